@@ -260,7 +260,7 @@ class Database(object):
         # return the Directory, init it with the absolute path
         return Directory(abs_dirpath, dir_p, self)
 
-    def add_message(self, filename):
+    def add_message(self, filename, tags=None):
         """Adds a new message to the database
 
         `filename` should be a path relative to the path of the open
@@ -268,6 +268,11 @@ class Database(object):
         filename with initial components that match the path of the
         database.
 
+        `tags` is an optional list of tags for the new message. They
+        are stored along with the message, which is much faster than
+        adding them afterwards with :meth:`Message.add_tag`. They are
+        not applied to a message that is already in the database.
+
         The file should be a single mail message (not a multi-message mbox)
         that is expected to remain at its current location, since the
         notmuch database will reference the filename, and will not copy the
@@ -299,15 +304,24 @@ class Database(object):
               STATUS.READ_ONLY_DATABASE
                       Database was opened in read-only mode so no message can
                       be added.
+              STATUS.TAG_TOO_LONG
+                      One of the `tags` is longer than the maximum length
+                      of a tag.
               STATUS.NOT_INITIALIZED
                       The database has not been initialized.
         """
         # Raise a NotmuchError if not initialized
         self._verify_initialized_db()
 
+        if tags is None:
+            tags = []
+        tags_p = (c_char_p * (len(tags) + 1))(*(list(tags) + [None]))
+
         msg_p = c_void_p()
-        status = nmlib.notmuch_database_add_message(self._db,
+        status = nmlib.notmuch_database_add_message_with_tags(self._db,
                                                   filename,
+                                                  None,
+                                                  tags_p,
                                                   byref(msg_p))
  
         if not status in [STATUS.SUCCESS,STATUS.DUPLICATE_MESSAGE_ID]:
@@ -479,6 +493,10 @@ class Query(object):
     _count_messages = nmlib.notmuch_query_count_messages
     _count_messages.restype = c_uint
 
+    """notmuch_query_count_threads"""
+    _count_threads = nmlib.notmuch_query_count_threads
+    _count_threads.restype = c_uint
+
     def __init__(self, db, querystr):
         """
         :param db: An open database which we derive the Query from.
@@ -608,6 +626,24 @@ class Query(object):
 
         return Query._count_messages(self._query)
 
+    def count_threads(self):
+        """Count the distinct threads with messages matching the query
+
+        This is the number of threads :meth:`search_threads` would
+        return, but it is much faster to compute since no thread
+        objects are constructed. Technically, it wraps the underlying
+        *notmuch_query_count_threads* function.
+
+        :returns: The number of matching threads
+        :exception: :exc:`NotmuchError`
+
+                      * STATUS.NOT_INITIALIZED if query is not inited
+        """
+        if self._query is None:
+            raise NotmuchError(STATUS.NOT_INITIALIZED)
+
+        return Query._count_threads(self._query)
+
     def __del__(self):
         """Close and free the Query"""
         if self._query is not None:
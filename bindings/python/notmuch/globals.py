@@ -66,6 +66,8 @@ STATUS = Status(['SUCCESS',
   'NULL_POINTER',
   'TAG_TOO_LONG',
   'UNBALANCED_FREEZE_THAW',
+  'ILLEGAL_ARGUMENT',
+  'UNBALANCED_ATOMIC',
   'NOT_INITIALIZED'])
 
 
@@ -32,25 +32,346 @@
 
 #include "notmuch-private.h"
 
+#include <glib.h> /* GHashTable */
+
 #include <xapian.h>
 
+/* How many parsed query strings each database keeps for reuse. */
+#define NOTMUCH_QUERY_CACHE_SIZE 16
+
+/* How many message IDs the thread ID cache of each database holds
+ * before it's emptied and started over. */
+#define NOTMUCH_THREAD_ID_CACHE_SIZE 65536
+
+typedef struct _notmuch_parsed_query {
+    char *query_string;
+    Xapian::Query *query;
+
+    /* The database generation at which the string was parsed. */
+    unsigned long generation;
+
+    /* For evicting the least-recently used entry. */
+    unsigned long last_used;
+} notmuch_parsed_query_t;
+
 struct _notmuch_database {
     notmuch_bool_t exception_reported;
 
     char *path;
 
     notmuch_bool_t needs_upgrade;
+
+    /* Whether the From, Subject, To and Date headers of every mail
+     * document are stored as values, (database version 3 and
+     * later). */
+    notmuch_bool_t headers_indexed;
+
+    /* Whether the summary of every thread is maintained, (database
+     * version 4 and later), and the IDs of threads whose summaries
+     * must be rebuilt, (see _notmuch_thread_summaries_refresh). */
+    notmuch_bool_t thread_summaries;
+    GHashTable *stale_thread_summaries;
+
+    /* The summaries changed within the current atomic operation, (by
+     * thread ID), to be written when it ends. NULL until first
+     * needed. */
+    GHashTable *changed_thread_summaries;
     notmuch_database_mode_t mode;
+    int atomic_nesting;
     Xapian::Database *xapian_db;
 
     uint64_t last_thread_id;
 
+    /* The thread IDs of message IDs, (of messages in the database or
+     * only referenced by them), looked up or generated since the
+     * database was opened, (see _resolve_message_id_to_thread_id).
+     * NULL until first needed. */
+    GHashTable *thread_id_cache;
+
+    /* Each thread merged into another, (mapped to the thread it was
+     * merged into). Within an atomic operation, the messages of a
+     * merged thread are only moved when it ends, (see
+     * _notmuch_database_move_merged_threads). NULL until first
+     * needed. */
+    GHashTable *merged_threads;
+
+    /* The document IDs of directories by path, and the paths of
+     * directories by document ID, (see
+     * _notmuch_database_find_directory_id). NULL until first
+     * needed. */
+    GHashTable *directory_ids;
+    GHashTable *directory_paths;
+
+    /* Metadata set within an atomic operation, (and so only written
+     * to the database when it ends), or NULL. */
+    GHashTable *pending_metadata;
+
+    /* The persistent "revision" metadata, (see
+     * _notmuch_database_modified), and whether it has been
+     * incremented since last written. */
+    uint64_t revision;
+    notmuch_bool_t revision_modified;
+
     Xapian::QueryParser *query_parser;
     Xapian::TermGenerator *term_gen;
+
+    /* For indexing by notmuch_database_add_message, (or NULL until
+     * first needed). */
+    notmuch_mime_parser_t *mime_parser;
+
     Xapian::ValueRangeProcessor *value_range_processor;
 
+    /* Incremented with every change to a mail document. Since the
+     * query parser expands wildcards against the terms present in
+     * the database, this invalidates all previously parsed queries.
+     */
+    unsigned long generation;
+
+    /* Recently parsed query strings, (see
+     * _notmuch_database_parse_query). */
+    notmuch_parsed_query_t query_cache[NOTMUCH_QUERY_CACHE_SIZE];
+    unsigned long query_cache_clock;
+};
+
+/* Record that a mail document has been added, changed or removed.
+ *
+ * This increments both the in-memory generation, (invalidating
+ * parsed queries), and the "revision" of the database, (invalidating
+ * cached search results). The revision is only written to the
+ * database metadata when an atomic operation ends or the database is
+ * closed, (see _notmuch_database_flush_revision).
+ */
+void
+_notmuch_database_modified (notmuch_database_t *notmuch);
+
+/* Write the revision to the database metadata if it has been
+ * incremented since last written.
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_database_flush_revision (notmuch_database_t *notmuch);
+
+/* Parse 'query_string' with the database's query parser, reusing the
+ * result of a recent parse of the same string where still valid.
+ *
+ * This function may throw a Xapian::Error.
+ */
+Xapian::Query
+_notmuch_database_parse_query (notmuch_database_t *notmuch,
+			       const char *query_string);
+
+/* Set the metadata 'key' to 'value', (or remove it if 'value' is
+ * empty). Within an atomic operation, this is deferred until the
+ * operation ends, (see _notmuch_database_flush_metadata), so that
+ * metadata changed with every message is only written once.
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_database_set_metadata (notmuch_database_t *notmuch,
+				const char *key,
+				const char *value);
+
+/* Get the metadata 'key', including any change not yet written.
+ *
+ * This function may throw a Xapian::Error.
+ */
+std::string
+_notmuch_database_get_metadata (notmuch_database_t *notmuch,
+				const char *key);
+
+/* Return the thread into which the thread 'thread_id' has been
+ * merged, (or 'thread_id' itself), whether or not its messages have
+ * been moved yet. The result is only valid until the next change to
+ * the database. */
+const char *
+_notmuch_database_canonical_thread_id (notmuch_database_t *notmuch,
+				       const char *thread_id);
+
+/* Move the messages of each thread merged into another within the
+ * atomic operation now ending, (so each is moved once however many
+ * merges follow).
+ *
+ * This function may throw a Xapian::Error.
+ */
+notmuch_status_t
+_notmuch_database_move_merged_threads (notmuch_database_t *notmuch);
+
+/* result-cache.cc */
+
+/* Whether search results are cached for 'notmuch', (only when the
+ * database is open read-only, since the changes made by a writer may
+ * never be committed). */
+notmuch_bool_t
+_notmuch_result_cache_enabled (notmuch_database_t *notmuch);
+
+/* Note a thread search for 'query_string' with 'sort', returning
+ * TRUE if it was seen recently, (so that its results are worth
+ * storing in the result cache).
+ */
+notmuch_bool_t
+_notmuch_result_cache_wanted (notmuch_database_t *notmuch,
+			      const char *query_string,
+			      notmuch_sort_t sort);
+
+/* The complete results of a thread search, as stored in the result
+ * cache. */
+typedef struct _notmuch_cached_results {
+    /* The ID of each thread matched, in sort order. */
+    unsigned int num_threads;
+    uint64_t *thread_ids;
+
+    /* The document ID of every message matched, grouped by thread,
+     * (thread_matches[i] of them for the i'th thread, in no
+     * particular order). */
+    unsigned int num_messages;
+    unsigned int *thread_matches;
+    unsigned int *doc_ids;
+} notmuch_cached_results_t;
+
+/* Look up cached results for 'query_string' with 'sort' that are
+ * valid for the current state of the database, returning NULL if
+ * there are none.
+ *
+ * The results are talloced from 'ctx'. If 'counts_only' is TRUE,
+ * only num_threads and num_messages are read, (the arrays being
+ * NULL).
+ *
+ * This function may throw a Xapian::Error.
+ */
+notmuch_cached_results_t *
+_notmuch_result_cache_load (void *ctx,
+			    notmuch_database_t *notmuch,
+			    const char *query_string,
+			    notmuch_sort_t sort,
+			    notmuch_bool_t counts_only);
+
+/* Store the complete results of 'query_string' with 'sort', (see
+ * _notmuch_result_cache_load). Failure to write the cache is
+ * silently ignored.
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_result_cache_store (notmuch_database_t *notmuch,
+			     const char *query_string,
+			     notmuch_sort_t sort,
+			     const notmuch_cached_results_t *results);
+
+/* thread-summary.cc */
+
+typedef struct _notmuch_thread_summary_tag {
+    char *name;
+    unsigned int count;
+} notmuch_thread_summary_tag_t;
+
+typedef struct _notmuch_thread_summary_author {
+    char *name;
+    unsigned int count;
+
+    /* The date and document ID of the author's earliest message. */
+    time_t date;
+    unsigned int doc_id;
+} notmuch_thread_summary_author_t;
+
+/* The parts of a thread that don't depend on which of its messages
+ * match a query. */
+struct _notmuch_thread_summary {
+    char *thread_id;
+
+    /* Whether the summary needs to be rebuilt. */
+    notmuch_bool_t stale;
+
+    unsigned int total_messages;
+
+    /* Every tag of any message of the thread. */
+    unsigned int num_tags;
+    notmuch_thread_summary_tag_t *tags;
+
+    /* Every author of the thread, in the order of their earliest
+     * messages. */
+    unsigned int num_authors;
+    notmuch_thread_summary_author_t *authors;
 };
 
+/* Return the summary of 'thread_id', talloced from 'ctx', or NULL if
+ * the database doesn't have an up-to-date summary of the thread.
+ *
+ * This function may throw a Xapian::Error.
+ */
+notmuch_thread_summary_t *
+_notmuch_thread_summary_get (void *ctx,
+			     notmuch_database_t *notmuch,
+			     const char *thread_id);
+
+/* Read what 'doc', (a mail document with ID 'doc_id'), contributes to
+ * the summary of its thread, talloced from 'ctx'. Returns NULL if the
+ * database doesn't maintain thread summaries, or if the document
+ * belongs to no thread.
+ *
+ * This function may throw a Xapian::Error.
+ */
+notmuch_thread_contribution_t *
+_notmuch_thread_contribution_create (void *ctx,
+				     notmuch_database_t *notmuch,
+				     Xapian::Document &doc,
+				     unsigned int doc_id);
+
+/* Update the summaries of the threads affected by replacing the mail
+ * document 'doc_id', (which contributed 'old_contribution', or
+ * nothing if NULL, such as for a new document), with 'new_doc', (or by
+ * deleting the document if 'new_doc' is NULL).
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_thread_summary_update (notmuch_database_t *notmuch,
+				unsigned int doc_id,
+				notmuch_thread_contribution_t *old_contribution,
+				Xapian::Document *new_doc);
+
+/* Rebuild every summary marked as stale since the database was
+ * opened, and write every summary changed within the atomic operation
+ * now ending.
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_thread_summaries_refresh (notmuch_database_t *notmuch);
+
+/* For building the summaries of many threads at once, (such as when
+ * upgrading the database), by adding each of their messages. */
+typedef struct _notmuch_thread_summary_builder notmuch_thread_summary_builder_t;
+
+notmuch_thread_summary_builder_t *
+_notmuch_thread_summary_builder_create (void *ctx,
+					notmuch_database_t *notmuch);
+
+/* This function may throw a Xapian::Error. */
+void
+_notmuch_thread_summary_builder_add (notmuch_thread_summary_builder_t *builder,
+				     unsigned int doc_id);
+
+/* Replace the stored summary of each thread with a message added to
+ * 'builder'.
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_thread_summary_builder_store (notmuch_thread_summary_builder_t *builder);
+
+/* message.cc */
+
+notmuch_message_t *
+_notmuch_message_create_detached (const void *talloc_owner,
+				  notmuch_database_t *notmuch,
+				  const char *message_id,
+				  Xapian::TermGenerator *term_gen);
+
+void
+_notmuch_message_attach (notmuch_message_t *message);
+
 /* Convert tags from Xapian internal format to notmuch format.
  *
  * The function gets a TermIterator as argument and uses that iterator to find
@@ -30,14 +30,12 @@
 
 using namespace std;
 
-#define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
-
 typedef struct {
     const char *name;
     const char *prefix;
 } prefix_t;
 
-#define NOTMUCH_DATABASE_VERSION 1
+#define NOTMUCH_DATABASE_VERSION 4
 
 #define STRINGIFY(s) _SUB_STRINGIFY(s)
 #define _SUB_STRINGIFY(s) #s
@@ -60,7 +58,8 @@ typedef struct {
  *	id:	Unique ID of mail, (from Message-ID header or generated
  *		as "notmuch-sha1-<sha1_sum_of_entire_file>.
  *
- *	thread:	The ID of the thread to which the mail belongs
+ *	thread:	The ID of the thread to which the mail belongs,
+ *		(which is also stored as the THREAD_ID value)
  *
  *	replyto: The ID from the In-Reply-To header of the mail (if any).
  *
@@ -77,13 +76,26 @@ typedef struct {
  *		        STRING is the name of a file within that
  *		        directory for this mail message.
  *
- *    A mail document also has two values:
+ *    A mail document also has the following values:
  *
  *	TIMESTAMP:	The time_t value corresponding to the message's
  *			Date header.
  *
  *	MESSAGE_ID:	The unique ID of the mail mess (see "id" above)
  *
+ *	THREAD_ID:	The ID of the thread to which the mail belongs
+ *			(see "thread" above). This allows search
+ *			results to be collapsed to one message per
+ *			thread. It was added in database version 2.
+ *
+ *	FROM, SUBJECT, TO, DATE:
+ *			The decoded contents of the corresponding
+ *			headers, (with no value for a header that is
+ *			missing or empty). These allow
+ *			notmuch_message_get_header to return these
+ *			headers without opening the message file. They
+ *			were added in database version 3.
+ *
  * In addition, terms from the content of the message are added with
  * "from", "to", "attachment", "subject" and "folder" prefixes for use
  * by the user in searching. But the database doesn't really care
@@ -143,6 +155,14 @@ typedef struct {
  *			generated is 1 and the value will be
  *			incremented for each thread ID.
  *
+ *	revision	A counter incremented with each change to a mail
+ *			document, (stored in the same form as
+ *			last_thread_id, once per atomic operation or
+ *			database object). It allows results computed
+ *			from the database, (such as the result-cache
+ *			files in .notmuch/result-cache), to be
+ *			recognized as stale.
+ *
  *	thread_id_*	A pre-allocated thread ID for a particular
  *			message. This is actually an arbitarily large
  *			family of metadata name. Any particular name
@@ -162,6 +182,18 @@ typedef struct {
  *			descendant messages that reference this common
  *			parent can be recognized as belonging to the
  *			same thread.
+ *
+ *	thread_summary_*
+ *			The summary of a thread: its total number of
+ *			messages, the number of its messages with
+ *			each tag and its authors. The name is formed
+ *			by concatenating "thread_summary_" with a
+ *			thread ID. The summary is updated with every
+ *			change to a message of the thread, (see
+ *			thread-summary.cc for its format), so that
+ *			searches need not read every message of each
+ *			thread. These were added in database version
+ *			4.
  */
 
 /* With these prefix values we follow the conventions published here:
@@ -267,6 +299,10 @@ notmuch_status_to_string (notmuch_status_t status)
 	return "Tag value is too long (exceeds NOTMUCH_TAG_MAX)";
     case NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW:
 	return "Unbalanced number of calls to notmuch_message_freeze/thaw";
+    case NOTMUCH_STATUS_ILLEGAL_ARGUMENT:
+	return "Illegal argument for function";
+    case NOTMUCH_STATUS_UNBALANCED_ATOMIC:
+	return "Unbalanced number of calls to notmuch_database_begin_atomic/end_atomic";
     default:
     case NOTMUCH_STATUS_LAST_STATUS:
 	return "Unknown error status value";
@@ -584,9 +620,24 @@ notmuch_database_open (const char *path,
 	notmuch->path[strlen (notmuch->path) - 1] = '\0';
 
     notmuch->needs_upgrade = FALSE;
+    notmuch->headers_indexed = FALSE;
+    notmuch->thread_summaries = FALSE;
+    notmuch->stale_thread_summaries = NULL;
+    notmuch->changed_thread_summaries = NULL;
     notmuch->mode = mode;
+    notmuch->atomic_nesting = 0;
+    notmuch->mime_parser = NULL;
+    notmuch->thread_id_cache = NULL;
+    notmuch->merged_threads = NULL;
+    notmuch->pending_metadata = NULL;
+    notmuch->directory_ids = NULL;
+    notmuch->directory_paths = NULL;
+    notmuch->generation = 0;
+    notmuch->revision_modified = FALSE;
+    memset (notmuch->query_cache, 0, sizeof (notmuch->query_cache));
+    notmuch->query_cache_clock = 0;
     try {
-	string last_thread_id;
+	string last_thread_id, revision;
 
 	if (mode == NOTMUCH_DATABASE_MODE_READ_WRITE) {
 	    notmuch->xapian_db = new Xapian::WritableDatabase (xapian_path,
@@ -623,6 +674,11 @@ notmuch_database_open (const char *path,
 	    }
 	}
 
+	if (version >= 3)
+	    notmuch->headers_indexed = TRUE;
+	if (version >= 4)
+	    notmuch->thread_summaries = TRUE;
+
 	last_thread_id = notmuch->xapian_db->get_metadata ("last_thread_id");
 	if (last_thread_id.empty ()) {
 	    notmuch->last_thread_id = 0;
@@ -636,6 +692,19 @@ notmuch_database_open (const char *path,
 		INTERNAL_ERROR ("Malformed database last_thread_id: %s", str);
 	}
 
+	revision = notmuch->xapian_db->get_metadata ("revision");
+	if (revision.empty ()) {
+	    notmuch->revision = 0;
+	} else {
+	    const char *str;
+	    char *end;
+
+	    str = revision.c_str ();
+	    notmuch->revision = strtoull (str, &end, 16);
+	    if (*end != '\0')
+		INTERNAL_ERROR ("Malformed database revision: %s", str);
+	}
+
 	notmuch->query_parser = new Xapian::QueryParser;
 	notmuch->term_gen = new Xapian::TermGenerator;
 	notmuch->term_gen->set_stemmer (Xapian::Stem ("english"));
@@ -675,9 +744,26 @@ notmuch_database_open (const char *path,
 void
 notmuch_database_close (notmuch_database_t *notmuch)
 {
+    unsigned int i;
+
     try {
-	if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE)
-	    (static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db))->flush ();
+	if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_WRITE) {
+	    Xapian::WritableDatabase *db;
+
+	    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+	    /* An unfinished atomic operation is abandoned, (along with
+	     * the summaries it changed). */
+	    if (notmuch->atomic_nesting) {
+		db->cancel_transaction ();
+		if (notmuch->changed_thread_summaries)
+		    g_hash_table_remove_all (notmuch->changed_thread_summaries);
+	    }
+
+	    _notmuch_thread_summaries_refresh (notmuch);
+	    _notmuch_database_flush_revision (notmuch);
+	    db->flush ();
+	}
     } catch (const Xapian::Error &error) {
 	if (! notmuch->exception_reported) {
 	    fprintf (stderr, "Error: A Xapian exception occurred flushing database: %s\n",
@@ -685,6 +771,24 @@ notmuch_database_close (notmuch_database_t *notmuch)
 	}
     }
 
+    if (notmuch->stale_thread_summaries)
+	g_hash_table_unref (notmuch->stale_thread_summaries);
+    if (notmuch->changed_thread_summaries)
+	g_hash_table_unref (notmuch->changed_thread_summaries);
+    if (notmuch->thread_id_cache)
+	g_hash_table_unref (notmuch->thread_id_cache);
+    if (notmuch->merged_threads)
+	g_hash_table_unref (notmuch->merged_threads);
+    if (notmuch->pending_metadata)
+	g_hash_table_unref (notmuch->pending_metadata);
+    if (notmuch->directory_ids)
+	g_hash_table_unref (notmuch->directory_ids);
+    if (notmuch->directory_paths)
+	g_hash_table_unref (notmuch->directory_paths);
+
+    for (i = 0; i < NOTMUCH_QUERY_CACHE_SIZE; i++)
+	delete notmuch->query_cache[i].query;
+
     delete notmuch->term_gen;
     delete notmuch->query_parser;
     delete notmuch->xapian_db;
@@ -692,6 +796,48 @@ notmuch_database_close (notmuch_database_t *notmuch)
     talloc_free (notmuch);
 }
 
+Xapian::Query
+_notmuch_database_parse_query (notmuch_database_t *notmuch,
+			       const char *query_string)
+{
+    notmuch_parsed_query_t *entry, *victim = NULL;
+    unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
+			  Xapian::QueryParser::FLAG_PHRASE |
+			  Xapian::QueryParser::FLAG_LOVEHATE |
+			  Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
+			  Xapian::QueryParser::FLAG_WILDCARD |
+			  Xapian::QueryParser::FLAG_PURE_NOT);
+    unsigned int i;
+
+    for (i = 0; i < NOTMUCH_QUERY_CACHE_SIZE; i++) {
+	entry = &notmuch->query_cache[i];
+
+	if (entry->query_string &&
+	    strcmp (entry->query_string, query_string) == 0 &&
+	    entry->generation == notmuch->generation)
+	{
+	    entry->last_used = ++notmuch->query_cache_clock;
+	    return *entry->query;
+	}
+
+	if (victim == NULL || entry->last_used < victim->last_used)
+	    victim = entry;
+    }
+
+    Xapian::Query query = notmuch->query_parser->parse_query (query_string,
+							      flags);
+
+    talloc_free (victim->query_string);
+    delete victim->query;
+
+    victim->query_string = talloc_strdup (notmuch, query_string);
+    victim->query = new Xapian::Query (query);
+    victim->generation = notmuch->generation;
+    victim->last_used = ++notmuch->query_cache_clock;
+
+    return query;
+}
+
 const char *
 notmuch_database_get_path (notmuch_database_t *notmuch)
 {
@@ -790,6 +936,17 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	timer_is_active = TRUE;
     }
 
+    /* Each version's pass over all messages below counts toward the
+     * progress. */
+    {
+	notmuch_query_t *query = notmuch_query_create (notmuch, "");
+
+	total = notmuch_query_count_messages (query);
+	total *= NOTMUCH_DATABASE_VERSION - version;
+
+	notmuch_query_destroy (query);
+    }
+
     /* Before version 1, each message document had its filename in the
      * data field. Copy that into the new format by calling
      * notmuch_message_add_filename.
@@ -801,8 +958,6 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	char *filename;
 	Xapian::TermIterator t, t_end;
 
-	total = notmuch_query_count_messages (query);
-
 	for (messages = notmuch_query_search_messages (query);
 	     notmuch_messages_valid (messages);
 	     notmuch_messages_move_to_next (messages))
@@ -868,9 +1023,110 @@ notmuch_database_upgrade (notmuch_database_t *notmuch,
 	}
     }
 
+    /* Before version 2, the thread ID of each message document was
+     * only stored as a term. Also store it as the THREAD_ID value.
+     */
+    if (version < 2) {
+	notmuch_query_t *query = notmuch_query_create (notmuch, "");
+	notmuch_messages_t *messages;
+	notmuch_message_t *message;
+
+	for (messages = notmuch_query_search_messages (query);
+	     notmuch_messages_valid (messages);
+	     notmuch_messages_move_to_next (messages))
+	{
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    message = notmuch_messages_get (messages);
+
+	    _notmuch_message_set_thread_id (message,
+					    notmuch_message_get_thread_id (message));
+	    _notmuch_message_sync (message);
+
+	    notmuch_message_destroy (message);
+
+	    count++;
+	}
+
+	notmuch_query_destroy (query);
+    }
+
+    /* Before version 3, the headers returned by
+     * notmuch_message_get_header were always read from the message
+     * file. Store the most commonly requested ones as values.
+     */
+    if (version < 3) {
+	notmuch_query_t *query = notmuch_query_create (notmuch, "");
+	notmuch_messages_t *messages;
+	notmuch_message_t *message;
+
+	for (messages = notmuch_query_search_messages (query);
+	     notmuch_messages_valid (messages);
+	     notmuch_messages_move_to_next (messages))
+	{
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    message = notmuch_messages_get (messages);
+
+	    _notmuch_message_set_header_values (
+		message,
+		notmuch_message_get_header (message, "from"),
+		notmuch_message_get_header (message, "subject"),
+		notmuch_message_get_header (message, "to"),
+		notmuch_message_get_header (message, "date"));
+	    _notmuch_message_sync (message);
+
+	    notmuch_message_destroy (message);
+
+	    count++;
+	}
+
+	notmuch_query_destroy (query);
+    }
+
+    /* Before version 4, there were no thread summaries. Build the
+     * summary of every thread from all of its messages, (replacing
+     * any partial summaries left by an interrupted upgrade).
+     */
+    if (version < 4) {
+	notmuch_thread_summary_builder_t *builder;
+	Xapian::PostingIterator p, p_end;
+	std::string term = std::string (_find_prefix ("type")) + "mail";
+
+	builder = _notmuch_thread_summary_builder_create (notmuch, notmuch);
+
+	p_end = notmuch->xapian_db->postlist_end (term);
+
+	for (p = notmuch->xapian_db->postlist_begin (term);
+	     p != p_end;
+	     p++)
+	{
+	    if (do_progress_notify) {
+		progress_notify (closure, (double) count / total);
+		do_progress_notify = 0;
+	    }
+
+	    _notmuch_thread_summary_builder_add (builder, *p);
+
+	    count++;
+	}
+
+	_notmuch_thread_summary_builder_store (builder);
+	talloc_free (builder);
+    }
+
     db->set_metadata ("version", STRINGIFY (NOTMUCH_DATABASE_VERSION));
     db->flush ();
 
+    notmuch->headers_indexed = TRUE;
+    notmuch->thread_summaries = TRUE;
+
     /* Now that the upgrade is complete we can remove the old data
      * and documents that are no longer needed. */
     if (version < 1) {
@@ -1047,6 +1303,16 @@ _notmuch_database_split_path (void *ctx,
     return NOTMUCH_STATUS_SUCCESS;
 }
 
+static void
+_my_talloc_free_for_g_hash (void *ptr)
+{
+    talloc_free (ptr);
+}
+
+/* Since directory documents are never removed, (only created), the
+ * document ID of a directory path and the path of a directory
+ * document ID are remembered for the lifetime of the database object,
+ * (or until an atomic operation that may have created them fails). */
 notmuch_status_t
 _notmuch_database_find_directory_id (notmuch_database_t *notmuch,
 				     const char *path,
@@ -1054,12 +1320,23 @@ _notmuch_database_find_directory_id (notmuch_database_t *notmuch,
 {
     notmuch_directory_t *directory;
     notmuch_status_t status;
+    gpointer id;
 
     if (path == NULL) {
 	*directory_id = 0;
 	return NOTMUCH_STATUS_SUCCESS;
     }
 
+    path = _notmuch_database_relative_path (notmuch, path);
+
+    if (notmuch->directory_ids &&
+	g_hash_table_lookup_extended (notmuch->directory_ids, path,
+				      NULL, &id))
+    {
+	*directory_id = GPOINTER_TO_UINT (id);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
     directory = _notmuch_directory_create (notmuch, path, &status);
     if (status) {
 	*directory_id = -1;
@@ -1070,6 +1347,15 @@ _notmuch_database_find_directory_id (notmuch_database_t *notmuch,
 
     notmuch_directory_destroy (directory);
 
+    if (notmuch->directory_ids == NULL) {
+	notmuch->directory_ids =
+	    g_hash_table_new_full (g_str_hash, g_str_equal,
+				   _my_talloc_free_for_g_hash, NULL);
+    }
+    g_hash_table_insert (notmuch->directory_ids,
+			 talloc_strdup (notmuch, path),
+			 GUINT_TO_POINTER (*directory_id));
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
@@ -1079,10 +1365,26 @@ _notmuch_database_get_directory_path (void *ctx,
 				      unsigned int doc_id)
 {
     Xapian::Document document;
+    const char *path;
+
+    if (notmuch->directory_paths) {
+	path = (const char *) g_hash_table_lookup (notmuch->directory_paths,
+						   GUINT_TO_POINTER (doc_id));
+	if (path)
+	    return talloc_strdup (ctx, path);
+    } else {
+	notmuch->directory_paths =
+	    g_hash_table_new_full (g_direct_hash, g_direct_equal,
+				   NULL, _my_talloc_free_for_g_hash);
+    }
 
     document = find_document_for_doc_id (notmuch, doc_id);
 
-    return talloc_strdup (ctx, document.get_data ().c_str ());
+    path = talloc_strdup (notmuch, document.get_data ().c_str ());
+    g_hash_table_insert (notmuch->directory_paths,
+			 GUINT_TO_POINTER (doc_id), (void *) path);
+
+    return talloc_strdup (ctx, path);
 }
 
 /* Given a legal 'filename' for the database, (either relative to
@@ -1154,174 +1456,599 @@ _notmuch_database_relative_path (notmuch_database_t *notmuch,
     return relative;
 }
 
-notmuch_directory_t *
-notmuch_database_get_directory (notmuch_database_t *notmuch,
-				const char *path)
+void
+_notmuch_database_set_metadata (notmuch_database_t *notmuch,
+				const char *key,
+				const char *value)
 {
-    notmuch_status_t status;
+    Xapian::WritableDatabase *db;
 
-    try {
-	return _notmuch_directory_create (notmuch, path, &status);
-    } catch (const Xapian::Error &error) {
-	fprintf (stderr, "A Xapian exception occurred getting directory: %s.\n",
-		 error.get_msg().c_str());
-	notmuch->exception_reported = TRUE;
-	return NULL;
+    if (notmuch->atomic_nesting) {
+	if (notmuch->pending_metadata == NULL) {
+	    notmuch->pending_metadata =
+		g_hash_table_new_full (g_str_hash, g_str_equal,
+				       _my_talloc_free_for_g_hash,
+				       _my_talloc_free_for_g_hash);
+	}
+	g_hash_table_replace (notmuch->pending_metadata,
+			      talloc_strdup (notmuch, key),
+			      talloc_strdup (notmuch, value));
+	return;
     }
-}
-
-static const char *
-_notmuch_database_generate_thread_id (notmuch_database_t *notmuch)
-{
-    /* 16 bytes (+ terminator) for hexadecimal representation of
-     * a 64-bit integer. */
-    static char thread_id[17];
-    Xapian::WritableDatabase *db;
 
     db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    db->set_metadata (key, value);
+}
 
-    notmuch->last_thread_id++;
-
-    sprintf (thread_id, "%016" PRIx64, notmuch->last_thread_id);
+string
+_notmuch_database_get_metadata (notmuch_database_t *notmuch,
+				const char *key)
+{
+    const char *value;
 
-    db->set_metadata ("last_thread_id", thread_id);
+    if (notmuch->pending_metadata) {
+	value = (const char *) g_hash_table_lookup (notmuch->pending_metadata,
+						    key);
+	if (value)
+	    return value;
+    }
 
-    return thread_id;
+    return notmuch->xapian_db->get_metadata (key);
 }
 
-static char *
-_get_metadata_thread_id_key (void *ctx, const char *message_id)
+static void
+_write_pending_metadata (void *key, void *value, void *closure)
 {
-    return talloc_asprintf (ctx, "thread_id_%s", message_id);
+    Xapian::WritableDatabase *db = (Xapian::WritableDatabase *) closure;
+
+    db->set_metadata ((const char *) key, (const char *) value);
 }
 
-/* Find the thread ID to which the message with 'message_id' belongs.
- *
- * Always returns a newly talloced string belonging to 'ctx'.
+/* Write the metadata set within the atomic operation now ending.
  *
- * Note: If there is no message in the database with the given
- * 'message_id' then a new thread_id will be allocated for this
- * message and stored in the database metadata, (where this same
- * thread ID can be looked up if the message is added to the database
- * later).
+ * This function may throw a Xapian::Error.
  */
-static const char *
-_resolve_message_id_to_thread_id (notmuch_database_t *notmuch,
-				  void *ctx,
-				  const char *message_id)
+static void
+_notmuch_database_flush_metadata (notmuch_database_t *notmuch)
 {
-    notmuch_message_t *message;
-    string thread_id_string;
-    const char *thread_id;
-    char *metadata_key;
     Xapian::WritableDatabase *db;
 
-    message = notmuch_database_find_message (notmuch, message_id);
+    if (notmuch->pending_metadata == NULL)
+	return;
 
-    if (message) {
-	thread_id = talloc_steal (ctx, notmuch_message_get_thread_id (message));
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
 
-	notmuch_message_destroy (message);
+    g_hash_table_foreach (notmuch->pending_metadata,
+			  _write_pending_metadata, db);
+    g_hash_table_remove_all (notmuch->pending_metadata);
+}
 
-	return thread_id;
-    }
+typedef struct _thread_id_cache_entry {
+    char *thread_id;
 
-    /* Message has not been seen yet.
-     *
-     * We may have seen a reference to it already, in which case, we
-     * can return the thread ID stored in the metadata. Otherwise, we
-     * generate a new thread ID and store it there.
-     */
-    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
-    metadata_key = _get_metadata_thread_id_key (ctx, message_id);
-    thread_id_string = notmuch->xapian_db->get_metadata (metadata_key);
+    /* Whether the message isn't in the database, (so 'thread_id' is
+     * the one stored in the metadata for when it's added). */
+    notmuch_bool_t ghost;
+} thread_id_cache_entry_t;
 
-    if (thread_id_string.empty()) {
-	thread_id = _notmuch_database_generate_thread_id (notmuch);
-	db->set_metadata (metadata_key, thread_id);
-    } else {
-	thread_id = thread_id_string.c_str();
-    }
+/* Empty the thread ID cache, (and forget the merges it depends on
+ * unless their messages are still to be moved). */
+static void
+_thread_id_cache_clear (notmuch_database_t *notmuch)
+{
+    if (notmuch->thread_id_cache)
+	g_hash_table_remove_all (notmuch->thread_id_cache);
+    if (notmuch->merged_threads && notmuch->atomic_nesting == 0)
+	g_hash_table_remove_all (notmuch->merged_threads);
+}
 
-    talloc_free (metadata_key);
+const char *
+_notmuch_database_canonical_thread_id (notmuch_database_t *notmuch,
+				       const char *thread_id)
+{
+    const char *merged;
+
+    if (notmuch->merged_threads == NULL)
+	return thread_id;
+
+    while ((merged = (const char *)
+	    g_hash_table_lookup (notmuch->merged_threads, thread_id)))
+    {
+	thread_id = merged;
+    }
 
     return thread_id;
 }
 
-static notmuch_status_t
-_merge_threads (notmuch_database_t *notmuch,
-		const char *winner_thread_id,
-		const char *loser_thread_id)
+/* Look up 'message_id' in the thread ID cache, (following the merges
+ * of its thread since it was cached), or return NULL if it's not
+ * there. */
+static thread_id_cache_entry_t *
+_thread_id_cache_lookup (notmuch_database_t *notmuch,
+			 const char *message_id)
 {
-    Xapian::PostingIterator loser, loser_end;
-    notmuch_message_t *message = NULL;
-    notmuch_private_status_t private_status;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+    thread_id_cache_entry_t *entry;
+    const char *thread_id;
 
-    find_doc_ids (notmuch, "thread", loser_thread_id, &loser, &loser_end);
+    if (notmuch->thread_id_cache == NULL)
+	return NULL;
 
-    for ( ; loser != loser_end; loser++) {
-	message = _notmuch_message_create (notmuch, notmuch,
-					   *loser, &private_status);
-	if (message == NULL) {
-	    ret = COERCE_STATUS (private_status,
-				 "Cannot find document for doc_id from query");
-	    goto DONE;
-	}
+    entry = (thread_id_cache_entry_t *)
+	g_hash_table_lookup (notmuch->thread_id_cache, message_id);
+    if (entry == NULL)
+	return NULL;
 
-	_notmuch_message_remove_term (message, "thread", loser_thread_id);
-	_notmuch_message_add_term (message, "thread", winner_thread_id);
-	_notmuch_message_sync (message);
+    thread_id = _notmuch_database_canonical_thread_id (notmuch,
+						       entry->thread_id);
+    if (thread_id != entry->thread_id) {
+	char *old_thread_id = entry->thread_id;
 
-	notmuch_message_destroy (message);
-	message = NULL;
+	entry->thread_id = talloc_strdup (entry, thread_id);
+	talloc_free (old_thread_id);
     }
 
-  DONE:
-    if (message)
-	notmuch_message_destroy (message);
-
-    return ret;
+    return entry;
 }
 
 static void
-_my_talloc_free_for_g_hash (void *ptr)
+_thread_id_cache_store (notmuch_database_t *notmuch,
+			const char *message_id,
+			const char *thread_id,
+			notmuch_bool_t ghost)
 {
-    talloc_free (ptr);
+    thread_id_cache_entry_t *entry;
+
+    if (notmuch->thread_id_cache == NULL) {
+	notmuch->thread_id_cache =
+	    g_hash_table_new_full (g_str_hash, g_str_equal,
+				   _my_talloc_free_for_g_hash,
+				   _my_talloc_free_for_g_hash);
+    } else if (g_hash_table_size (notmuch->thread_id_cache) >=
+	       NOTMUCH_THREAD_ID_CACHE_SIZE)
+    {
+	_thread_id_cache_clear (notmuch);
+    }
+
+    entry = talloc (notmuch, thread_id_cache_entry_t);
+    entry->thread_id = talloc_strdup (entry, thread_id);
+    entry->ghost = ghost;
+
+    g_hash_table_replace (notmuch->thread_id_cache,
+			  talloc_strdup (notmuch, message_id), entry);
 }
 
-static notmuch_status_t
-_notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
-					   notmuch_message_t *message,
-					   notmuch_message_file_t *message_file,
-					   const char **thread_id)
+static void
+_thread_id_cache_forget (notmuch_database_t *notmuch,
+			 const char *message_id)
 {
-    GHashTable *parents = NULL;
-    const char *refs, *in_reply_to, *in_reply_to_message_id;
-    GList *l, *keys = NULL;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+    if (notmuch->thread_id_cache)
+	g_hash_table_remove (notmuch->thread_id_cache, message_id);
+}
 
-    parents = g_hash_table_new_full (g_str_hash, g_str_equal,
-				     _my_talloc_free_for_g_hash, NULL);
+static void
+_thread_id_cache_entry_canonicalize (unused (void *key),
+				     void *value,
+				     void *closure)
+{
+    thread_id_cache_entry_t *entry = (thread_id_cache_entry_t *) value;
+    notmuch_database_t *notmuch = (notmuch_database_t *) closure;
+    const char *thread_id;
 
-    refs = notmuch_message_file_get_header (message_file, "references");
-    parse_references (message, notmuch_message_get_message_id (message),
-		      parents, refs);
+    thread_id = _notmuch_database_canonical_thread_id (notmuch,
+						       entry->thread_id);
+    if (thread_id != entry->thread_id) {
+	char *old_thread_id = entry->thread_id;
 
-    in_reply_to = notmuch_message_file_get_header (message_file, "in-reply-to");
-    parse_references (message, notmuch_message_get_message_id (message),
-		      parents, in_reply_to);
+	entry->thread_id = talloc_strdup (entry, thread_id);
+	talloc_free (old_thread_id);
+    }
+}
 
-    /* Carefully avoid adding any self-referential in-reply-to term. */
-    in_reply_to_message_id = _parse_message_id (message, in_reply_to, NULL);
-    if (in_reply_to_message_id &&
-	strcmp (in_reply_to_message_id,
-		notmuch_message_get_message_id (message)))
+/* Record that the thread 'loser_thread_id' has been merged into
+ * 'winner_thread_id', (see _merge_threads). */
+static void
+_notmuch_database_record_merge (notmuch_database_t *notmuch,
+				const char *winner_thread_id,
+				const char *loser_thread_id)
+{
+    /* Outside an atomic operation the messages are already moved, so
+     * the merge only matters to the thread ID cache. */
+    if (notmuch->thread_id_cache == NULL && notmuch->atomic_nesting == 0)
+	return;
+
+    if (notmuch->merged_threads == NULL) {
+	notmuch->merged_threads =
+	    g_hash_table_new_full (g_str_hash, g_str_equal,
+				   _my_talloc_free_for_g_hash,
+				   _my_talloc_free_for_g_hash);
+    }
+
+    winner_thread_id = _notmuch_database_canonical_thread_id (notmuch,
+							      winner_thread_id);
+    if (strcmp (winner_thread_id, loser_thread_id) == 0)
+	return;
+
+    g_hash_table_replace (notmuch->merged_threads,
+			  talloc_strdup (notmuch, loser_thread_id),
+			  talloc_strdup (notmuch, winner_thread_id));
+}
+
+/* Forget everything looked up or changed since the last commit, (when
+ * an atomic operation fails). */
+static void
+_notmuch_database_discard_pending (notmuch_database_t *notmuch)
+{
+    if (notmuch->pending_metadata)
+	g_hash_table_remove_all (notmuch->pending_metadata);
+    if (notmuch->changed_thread_summaries)
+	g_hash_table_remove_all (notmuch->changed_thread_summaries);
+    if (notmuch->thread_id_cache)
+	g_hash_table_remove_all (notmuch->thread_id_cache);
+    if (notmuch->merged_threads)
+	g_hash_table_remove_all (notmuch->merged_threads);
+    if (notmuch->directory_ids)
+	g_hash_table_remove_all (notmuch->directory_ids);
+    if (notmuch->directory_paths)
+	g_hash_table_remove_all (notmuch->directory_paths);
+}
+
+notmuch_status_t
+notmuch_database_begin_atomic (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    if (notmuch->atomic_nesting > 0)
+	goto DONE;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	db->begin_transaction (true);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred beginning transaction: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    notmuch->atomic_nesting++;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_status_t
+notmuch_database_end_atomic (notmuch_database_t *notmuch)
+{
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    if (notmuch->atomic_nesting == 0)
+	return NOTMUCH_STATUS_UNBALANCED_ATOMIC;
+
+    if (notmuch->atomic_nesting > 1)
+	goto DONE;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    try {
+	/* The summaries of the changed threads are committed along
+	 * with the changes, (rather than when the database is
+	 * closed). */
+	status = _notmuch_database_move_merged_threads (notmuch);
+	if (status) {
+	    db->cancel_transaction ();
+	    _notmuch_database_discard_pending (notmuch);
+	    notmuch->atomic_nesting = 0;
+	    return status;
+	}
+
+	_notmuch_thread_summaries_refresh (notmuch);
+
+	_notmuch_database_flush_revision (notmuch);
+	_notmuch_database_flush_metadata (notmuch);
+
+	/* Since the transaction is flushed, its changes are on disk
+	 * once this returns. */
+	db->commit_transaction ();
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred committing transaction: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	_notmuch_database_discard_pending (notmuch);
+	try {
+	    db->cancel_transaction ();
+	} catch (const Xapian::Error &cancel_error) {
+	    /* The transaction is abandoned either way. */
+	}
+	notmuch->atomic_nesting = 0;
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    notmuch->atomic_nesting--;
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_directory_t *
+notmuch_database_get_directory (notmuch_database_t *notmuch,
+				const char *path)
+{
+    notmuch_status_t status;
+
+    try {
+	return _notmuch_directory_create (notmuch, path, &status);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred getting directory: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+}
+
+static const char *
+_notmuch_database_generate_thread_id (notmuch_database_t *notmuch)
+{
+    /* 16 bytes (+ terminator) for hexadecimal representation of
+     * a 64-bit integer. */
+    static char thread_id[17];
+
+    notmuch->last_thread_id++;
+
+    sprintf (thread_id, "%016" PRIx64, notmuch->last_thread_id);
+
+    _notmuch_database_set_metadata (notmuch, "last_thread_id", thread_id);
+
+    return thread_id;
+}
+
+void
+_notmuch_database_modified (notmuch_database_t *notmuch)
+{
+    notmuch->generation++;
+    notmuch->revision++;
+    notmuch->revision_modified = TRUE;
+}
+
+void
+_notmuch_database_flush_revision (notmuch_database_t *notmuch)
+{
+    /* 16 bytes (+ terminator) for hexadecimal representation of
+     * a 64-bit integer. */
+    char revision[17];
+
+    if (! notmuch->revision_modified)
+	return;
+
+    sprintf (revision, "%016" PRIx64, notmuch->revision);
+
+    _notmuch_database_set_metadata (notmuch, "revision", revision);
+    notmuch->revision_modified = FALSE;
+}
+
+static char *
+_get_metadata_thread_id_key (void *ctx, const char *message_id)
+{
+    return talloc_asprintf (ctx, "thread_id_%s", message_id);
+}
+
+/* Find the thread ID to which the message with 'message_id' belongs.
+ *
+ * Always returns a newly talloced string belonging to 'ctx'.
+ *
+ * Note: If there is no message in the database with the given
+ * 'message_id' then a new thread_id will be allocated for this
+ * message and stored in the database metadata, (where this same
+ * thread ID can be looked up if the message is added to the database
+ * later).
+ *
+ * Since the same message IDs are referenced again and again, (by
+ * every later message of a thread), the result is cached for the
+ * lifetime of the database object.
+ */
+static const char *
+_resolve_message_id_to_thread_id (notmuch_database_t *notmuch,
+				  void *ctx,
+				  const char *message_id)
+{
+    thread_id_cache_entry_t *entry;
+    notmuch_message_t *message;
+    string thread_id_string;
+    const char *thread_id;
+    char *metadata_key;
+
+    entry = _thread_id_cache_lookup (notmuch, message_id);
+    if (entry)
+	return talloc_strdup (ctx, entry->thread_id);
+
+    message = notmuch_database_find_message (notmuch, message_id);
+
+    if (message) {
+	thread_id = talloc_steal (ctx, notmuch_message_get_thread_id (message));
+
+	notmuch_message_destroy (message);
+
+	_thread_id_cache_store (notmuch, message_id, thread_id, FALSE);
+
+	return thread_id;
+    }
+
+    /* Message has not been seen yet.
+     *
+     * We may have seen a reference to it already, in which case, we
+     * can return the thread ID stored in the metadata. Otherwise, we
+     * generate a new thread ID and store it there.
+     */
+    metadata_key = _get_metadata_thread_id_key (ctx, message_id);
+    thread_id_string = _notmuch_database_get_metadata (notmuch, metadata_key);
+
+    if (thread_id_string.empty()) {
+	thread_id = talloc_strdup (ctx,
+				   _notmuch_database_generate_thread_id (notmuch));
+	_notmuch_database_set_metadata (notmuch, metadata_key, thread_id);
+    } else {
+	thread_id = talloc_strdup (ctx,
+				   _notmuch_database_canonical_thread_id (notmuch,
+									  thread_id_string.c_str()));
+    }
+
+    talloc_free (metadata_key);
+
+    _thread_id_cache_store (notmuch, message_id, thread_id, TRUE);
+
+    return thread_id;
+}
+
+/* Move every message of the thread 'from_thread_id' to the thread
+ * 'to_thread_id'. */
+static notmuch_status_t
+_move_thread_messages (notmuch_database_t *notmuch,
+		       const char *from_thread_id,
+		       const char *to_thread_id)
+{
+    Xapian::PostingIterator from, from_end;
+    notmuch_message_t *message = NULL;
+    notmuch_private_status_t private_status;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+
+    find_doc_ids (notmuch, "thread", from_thread_id, &from, &from_end);
+
+    for ( ; from != from_end; from++) {
+	message = _notmuch_message_create (notmuch, notmuch,
+					   *from, &private_status);
+	if (message == NULL) {
+	    ret = COERCE_STATUS (private_status,
+				 "Cannot find document for doc_id from query");
+	    goto DONE;
+	}
+
+	/* The term is removed explicitly for the sake of documents
+	 * indexed before the THREAD_ID value existed. */
+	_notmuch_message_remove_term (message, "thread", from_thread_id);
+	_notmuch_message_set_thread_id (message, to_thread_id);
+	_notmuch_message_sync (message);
+
+	notmuch_message_destroy (message);
+	message = NULL;
+    }
+
+  DONE:
+    if (message)
+	notmuch_message_destroy (message);
+
+    return ret;
+}
+
+notmuch_status_t
+_notmuch_database_move_merged_threads (notmuch_database_t *notmuch)
+{
+    GList *l, *keys;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+
+    if (notmuch->merged_threads == NULL)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    keys = g_hash_table_get_keys (notmuch->merged_threads);
+    for (l = keys; l; l = l->next) {
+	const char *thread_id = (const char *) l->data;
+
+	ret = _move_thread_messages (notmuch, thread_id,
+				     _notmuch_database_canonical_thread_id (notmuch,
+									    thread_id));
+	if (ret)
+	    break;
+    }
+    g_list_free (keys);
+
+    if (ret)
+	return ret;
+
+    /* The merges are forgotten, so the cache mustn't depend on them. */
+    if (notmuch->thread_id_cache) {
+	g_hash_table_foreach (notmuch->thread_id_cache,
+			      _thread_id_cache_entry_canonicalize, notmuch);
+    }
+    g_hash_table_remove_all (notmuch->merged_threads);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+static unsigned int
+_thread_size (notmuch_database_t *notmuch, const char *thread_id)
+{
+    unsigned int size;
+    char *term;
+
+    term = talloc_asprintf (notmuch, "%s%s", _find_prefix ("thread"),
+			    thread_id);
+    size = notmuch->xapian_db->get_termfreq (term);
+    talloc_free (term);
+
+    return size;
+}
+
+/* Merge the thread '*thread_id' of 'message', (not yet in the
+ * database), and the thread 'other_thread_id', (both as returned by
+ * _notmuch_database_canonical_thread_id).
+ *
+ * The thread with fewer messages is merged into the other, (updating
+ * '*thread_id' and the thread of 'message' if that's the thread of
+ * 'message'), so a message moves between threads rarely however
+ * threads grow. Within an atomic operation, the messages of the
+ * merged thread are only moved when it ends.
+ */
+static notmuch_status_t
+_merge_threads (notmuch_database_t *notmuch,
+		notmuch_message_t *message,
+		const char **thread_id,
+		const char *other_thread_id)
+{
+    const char *winner_thread_id = *thread_id;
+    const char *loser_thread_id = other_thread_id;
+    notmuch_status_t ret;
+
+    if (_thread_size (notmuch, other_thread_id) >
+	_thread_size (notmuch, *thread_id))
     {
-	_notmuch_message_add_term (message, "replyto",
-			     _parse_message_id (message, in_reply_to, NULL));
+	loser_thread_id = *thread_id;
+	winner_thread_id = talloc_strdup (message, other_thread_id);
+	*thread_id = winner_thread_id;
+	_notmuch_message_set_thread_id (message, *thread_id);
+    }
+
+    if (notmuch->atomic_nesting) {
+	_notmuch_database_record_merge (notmuch, winner_thread_id,
+					loser_thread_id);
+	return NOTMUCH_STATUS_SUCCESS;
     }
 
+    ret = _move_thread_messages (notmuch, loser_thread_id, winner_thread_id);
+    if (ret)
+	_thread_id_cache_clear (notmuch);
+    else
+	_notmuch_database_record_merge (notmuch, winner_thread_id,
+					loser_thread_id);
+
+    return ret;
+}
+
+static notmuch_status_t
+_notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
+					   notmuch_message_t *message,
+					   GHashTable *parents,
+					   const char **thread_id)
+{
+    GList *l, *keys = NULL;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+
     keys = g_hash_table_get_keys (parents);
     for (l = keys; l; l = l->next) {
 	char *parent_message_id;
@@ -1329,18 +2056,16 @@ _notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
 
 	parent_message_id = (char *) l->data;
 
-	_notmuch_message_add_term (message, "reference",
-				   parent_message_id);
-
 	parent_thread_id = _resolve_message_id_to_thread_id (notmuch,
 							     message,
 							     parent_message_id);
 
 	if (*thread_id == NULL) {
 	    *thread_id = talloc_strdup (message, parent_thread_id);
-	    _notmuch_message_add_term (message, "thread", *thread_id);
+	    _notmuch_message_set_thread_id (message, *thread_id);
 	} else if (strcmp (*thread_id, parent_thread_id)) {
-	    ret = _merge_threads (notmuch, *thread_id, parent_thread_id);
+	    ret = _merge_threads (notmuch, message, thread_id,
+				  parent_thread_id);
 	    if (ret)
 		goto DONE;
 	}
@@ -1349,8 +2074,6 @@ _notmuch_database_link_message_to_parents (notmuch_database_t *notmuch,
   DONE:
     if (keys)
 	g_list_free (keys);
-    if (parents)
-	g_hash_table_unref (parents);
 
     return ret;
 }
@@ -1382,12 +2105,13 @@ _notmuch_database_link_message_to_children (notmuch_database_t *notmuch,
 	child_thread_id = notmuch_message_get_thread_id (child_message);
 	if (*thread_id == NULL) {
 	    *thread_id = talloc_strdup (message, child_thread_id);
-	    _notmuch_message_add_term (message, "thread", *thread_id);
+	    _notmuch_message_set_thread_id (message, *thread_id);
 	} else if (strcmp (*thread_id, child_thread_id)) {
 	    _notmuch_message_remove_term (child_message, "reference",
 					  message_id);
 	    _notmuch_message_sync (child_message);
-	    ret = _merge_threads (notmuch, *thread_id, child_thread_id);
+	    ret = _merge_threads (notmuch, message, thread_id,
+				  child_thread_id);
 	    if (ret)
 		goto DONE;
 	}
@@ -1403,16 +2127,17 @@ _notmuch_database_link_message_to_children (notmuch_database_t *notmuch,
     return ret;
 }
 
-/* Given a (mostly empty) 'message' and its corresponding
- * 'message_file' link it to existing threads in the database.
+/* Given a 'message' not yet in the database, (see
+ * _notmuch_message_create_detached), and the message IDs of its
+ * 'parents', (from its References and In-Reply-To headers), link it
+ * to existing threads in the database.
  *
  * The first check is in the metadata of the database to see if we
  * have pre-allocated a thread_id in advance for this message, (which
  * would have happened if a message was previously added that
  * referenced this one).
  *
- * Second, we look at 'message_file' and its link-relevant headers
- * (References and In-Reply-To) for message IDs.
+ * Second, we look up the thread of each of 'parents'.
  *
  * Finally, we look in the database for existing message that
  * reference 'message'.
@@ -1431,10 +2156,11 @@ _notmuch_database_link_message_to_children (notmuch_database_t *notmuch,
 static notmuch_status_t
 _notmuch_database_link_message (notmuch_database_t *notmuch,
 				notmuch_message_t *message,
-				notmuch_message_file_t *message_file)
+				GHashTable *parents)
 {
     notmuch_status_t status;
     const char *message_id, *thread_id = NULL;
+    thread_id_cache_entry_t *entry;
     char *metadata_key;
     string stored_id;
 
@@ -1444,23 +2170,30 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
     /* Check if we have already seen related messages to this one.
      * If we have then use the thread_id that we stored at that time.
      */
-    stored_id = notmuch->xapian_db->get_metadata (metadata_key);
-    if (! stored_id.empty()) {
-        Xapian::WritableDatabase *db;
-
-	db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+    entry = _thread_id_cache_lookup (notmuch, message_id);
+    if (entry && entry->ghost) {
+	thread_id = talloc_strdup (message, entry->thread_id);
+    } else {
+	stored_id = _notmuch_database_get_metadata (notmuch, metadata_key);
+	if (! stored_id.empty()) {
+	    thread_id = talloc_strdup (message,
+				       _notmuch_database_canonical_thread_id (notmuch,
+									      stored_id.c_str()));
+	}
+    }
 
+    if (thread_id) {
 	/* Clear the metadata for this message ID. We don't need it
 	 * anymore. */
-        db->set_metadata (metadata_key, "");
-        thread_id = stored_id.c_str();
+	_notmuch_database_set_metadata (notmuch, metadata_key, "");
+	_thread_id_cache_forget (notmuch, message_id);
 
-        _notmuch_message_add_term (message, "thread", thread_id);
+	_notmuch_message_set_thread_id (message, thread_id);
     }
     talloc_free (metadata_key);
 
     status = _notmuch_database_link_message_to_parents (notmuch, message,
-							message_file,
+							parents,
 							&thread_id);
     if (status)
 	return status;
@@ -1474,37 +2207,98 @@ _notmuch_database_link_message (notmuch_database_t *notmuch,
     if (thread_id == NULL) {
 	thread_id = _notmuch_database_generate_thread_id (notmuch);
 
-	_notmuch_message_add_term (message, "thread", thread_id);
+	_notmuch_message_set_thread_id (message, thread_id);
     }
 
     return NOTMUCH_STATUS_SUCCESS;
 }
 
-notmuch_status_t
-notmuch_database_add_message (notmuch_database_t *notmuch,
-			      const char *filename,
-			      const char *folder_name,
-			      notmuch_message_t **message_ret)
-{
+struct _notmuch_indexer {
+    notmuch_database_t *notmuch;
+    Xapian::TermGenerator *term_gen;
+    notmuch_mime_parser_t *mime_parser;
+};
+
+struct _notmuch_indexed_message {
+    notmuch_database_t *notmuch;
+    char *filename;
+    char *folder_name;
+    char *message_id;
+
+    /* The contents of the file, read only once for parsing its
+     * headers, hashing it and indexing it, and kept until the
+     * document is built, (see _indexed_message_build). */
     notmuch_message_file_t *message_file;
-    notmuch_message_t *message = NULL;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
-    notmuch_private_status_t private_status;
+    Xapian::TermGenerator *term_gen;
+    notmuch_mime_parser_t *mime_parser;
+
+    /* The document, not yet in the database, (or NULL until built). */
+    notmuch_message_t *message;
+
+    /* The message IDs referenced by the message, (see
+     * parse_references). */
+    GHashTable *parents;
+};
+
+static int
+_notmuch_indexed_message_destructor (notmuch_indexed_message_t *indexed)
+{
+    if (indexed->parents)
+	g_hash_table_unref (indexed->parents);
 
-    const char *date, *header;
-    const char *from, *to, *subject;
+    return 0;
+}
+
+/* Read the message in 'filename', (unless its contents are already
+ * in 'message_file', which is then stolen), and find its message ID,
+ * (without accessing the database, other than for its path).
+ *
+ * On success, *indexed_ret is set to a new object, talloced without
+ * a parent, whose document is later built with 'term_gen' and
+ * 'mime_parser'.
+ */
+static notmuch_status_t
+_indexed_message_open (notmuch_database_t *notmuch,
+		       Xapian::TermGenerator *term_gen,
+		       notmuch_mime_parser_t *mime_parser,
+		       const char *filename,
+		       const char *folder_name,
+		       notmuch_message_file_t *message_file,
+		       notmuch_indexed_message_t **indexed_ret)
+{
+    notmuch_indexed_message_t *indexed;
+    const char *from, *subject, *to, *header;
     char *message_id = NULL;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
 
-    if (message_ret)
-	*message_ret = NULL;
+    *indexed_ret = NULL;
 
-    ret = _notmuch_database_ensure_writable (notmuch);
-    if (ret)
-	return ret;
+    indexed = talloc_zero (NULL, notmuch_indexed_message_t);
+    if (unlikely (indexed == NULL)) {
+	if (message_file)
+	    notmuch_message_file_close (message_file);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
 
-    message_file = notmuch_message_file_open (filename);
-    if (message_file == NULL)
-	return NOTMUCH_STATUS_FILE_ERROR;
+    talloc_set_destructor (indexed, _notmuch_indexed_message_destructor);
+
+    indexed->notmuch = notmuch;
+    indexed->term_gen = term_gen;
+    indexed->mime_parser = mime_parser;
+    indexed->filename = talloc_strdup (indexed, filename);
+    if (folder_name)
+	indexed->folder_name = talloc_strdup (indexed, folder_name);
+
+    if (message_file)
+	talloc_steal (indexed, message_file);
+    else
+	message_file = _notmuch_message_file_read (indexed, filename);
+    if (message_file == NULL) {
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    indexed->message_file = message_file;
 
     notmuch_message_file_restrict_headers (message_file,
 					   "date",
@@ -1516,98 +2310,273 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 					   "to",
 					   (char *) NULL);
 
-    try {
-	/* Before we do any real work, (especially before doing a
-	 * potential SHA-1 computation on the entire file's contents),
-	 * let's make sure that what we're looking at looks like an
-	 * actual email message.
-	 */
-	from = notmuch_message_file_get_header (message_file, "from");
-	subject = notmuch_message_file_get_header (message_file, "subject");
-	to = notmuch_message_file_get_header (message_file, "to");
-
-	if ((from == NULL || *from == '\0') &&
-	    (subject == NULL || *subject == '\0') &&
-	    (to == NULL || *to == '\0'))
-	{
-	    ret = NOTMUCH_STATUS_FILE_NOT_EMAIL;
-	    goto DONE;
-	}
+    /* Before we do any real work, (especially before doing a
+     * potential SHA-1 computation on the entire file's contents),
+     * let's make sure that what we're looking at looks like an
+     * actual email message.
+     */
+    from = notmuch_message_file_get_header (message_file, "from");
+    subject = notmuch_message_file_get_header (message_file, "subject");
+    to = notmuch_message_file_get_header (message_file, "to");
+
+    if ((from == NULL || *from == '\0') &&
+	(subject == NULL || *subject == '\0') &&
+	(to == NULL || *to == '\0'))
+    {
+	ret = NOTMUCH_STATUS_FILE_NOT_EMAIL;
+	goto DONE;
+    }
 
-	/* Now that we're sure it's mail, the first order of business
-	 * is to find a message ID (or else create one ourselves). */
+    /* Now that we're sure it's mail, the first order of business
+     * is to find a message ID (or else create one ourselves). */
 
-	header = notmuch_message_file_get_header (message_file, "message-id");
-	if (header && *header != '\0') {
-	    message_id = _parse_message_id (message_file, header, NULL);
+    header = notmuch_message_file_get_header (message_file, "message-id");
+    if (header && *header != '\0') {
+	message_id = _parse_message_id (indexed, header, NULL);
 
-	    /* So the header value isn't RFC-compliant, but it's
-	     * better than no message-id at all. */
-	    if (message_id == NULL)
-		message_id = talloc_strdup (message_file, header);
+	/* So the header value isn't RFC-compliant, but it's
+	 * better than no message-id at all. */
+	if (message_id == NULL)
+	    message_id = talloc_strdup (indexed, header);
 
-	    /* Reject a Message ID that's too long. */
-	    if (message_id && strlen (message_id) + 1 > NOTMUCH_TERM_MAX) {
-		talloc_free (message_id);
-		message_id = NULL;
-	    }
+	/* Reject a Message ID that's too long. */
+	if (message_id && strlen (message_id) + 1 > NOTMUCH_TERM_MAX) {
+	    talloc_free (message_id);
+	    message_id = NULL;
 	}
+    }
 
-	if (message_id == NULL ) {
-	    /* No message-id at all, let's generate one by taking a
-	     * hash over the file's contents. */
-	    char *sha1 = notmuch_sha1_of_file (filename);
+    if (message_id == NULL ) {
+	/* No message-id at all, let's generate one by taking a
+	 * hash over the file's contents. */
+	GByteArray *data = _notmuch_message_file_get_data (message_file);
+	char *sha1 = notmuch_sha1_of_buffer (data->data, data->len);
 
-	    /* If that failed too, something is really wrong. Give up. */
-	    if (sha1 == NULL) {
-		ret = NOTMUCH_STATUS_FILE_ERROR;
-		goto DONE;
-	    }
+	message_id = talloc_asprintf (indexed, "notmuch-sha1-%s", sha1);
+	free (sha1);
+    }
 
-	    message_id = talloc_asprintf (message_file,
-					  "notmuch-sha1-%s", sha1);
-	    free (sha1);
-	}
+    indexed->message_id = message_id;
 
-	/* Now that we have a message ID, we get a message object,
-	 * (which may or may not reference an existing document in the
-	 * database). */
+  DONE:
+    if (ret)
+	talloc_free (indexed);
+    else
+	*indexed_ret = indexed;
 
-	message = _notmuch_message_create_for_message_id (notmuch,
-							  message_id,
-							  &private_status);
+    return ret;
+}
 
-	talloc_free (message_id);
+/* Build the complete document of 'indexed', (everything but its
+ * filename and thread), without accessing the database.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_status_t
+_indexed_message_build (notmuch_indexed_message_t *indexed)
+{
+    notmuch_message_file_t *message_file = indexed->message_file;
+    notmuch_message_t *message;
+    const char *date, *in_reply_to, *in_reply_to_message_id;
+    GList *l, *keys;
 
-	if (message == NULL) {
-	    ret = COERCE_STATUS (private_status,
-				 "Unexpected status value from _notmuch_message_create_for_message_id");
-	    goto DONE;
-	}
+    message = _notmuch_message_create_detached (indexed, indexed->notmuch,
+						indexed->message_id,
+						indexed->term_gen);
+    if (unlikely (message == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    _notmuch_message_add_term (message, "type", "mail");
+
+    indexed->parents = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      _my_talloc_free_for_g_hash,
+					      NULL);
+
+    /* The message IDs belong to 'indexed' rather than to 'message',
+     * which may be destroyed first. */
+    parse_references (indexed, indexed->message_id, indexed->parents,
+		      notmuch_message_file_get_header (message_file,
+						       "references"));
+
+    in_reply_to = notmuch_message_file_get_header (message_file, "in-reply-to");
+    parse_references (indexed, indexed->message_id, indexed->parents,
+		      in_reply_to);
+
+    /* Carefully avoid adding any self-referential in-reply-to term. */
+    in_reply_to_message_id = _parse_message_id (indexed, in_reply_to, NULL);
+    if (in_reply_to_message_id &&
+	strcmp (in_reply_to_message_id, indexed->message_id))
+    {
+	_notmuch_message_add_term (message, "replyto",
+				   in_reply_to_message_id);
+    }
+
+    keys = g_hash_table_get_keys (indexed->parents);
+    for (l = keys; l; l = l->next)
+	_notmuch_message_add_term (message, "reference", (char *) l->data);
+    g_list_free (keys);
+
+    date = notmuch_message_file_get_header (message_file, "date");
+    _notmuch_message_set_date (message, date);
+    _notmuch_message_set_header_values (message,
+					notmuch_message_file_get_header (message_file, "from"),
+					notmuch_message_file_get_header (message_file, "subject"),
+					notmuch_message_file_get_header (message_file, "to"),
+					date);
+
+    if (indexed->folder_name != NULL)
+	_notmuch_message_gen_terms (message, "folder", indexed->folder_name);
+
+    _notmuch_message_index_file (message, indexed->mime_parser, message_file);
+
+    notmuch_message_file_close (message_file);
+    indexed->message_file = NULL;
+
+    indexed->message = message;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_indexer_t *
+notmuch_indexer_create (notmuch_database_t *notmuch)
+{
+    notmuch_indexer_t *indexer;
+
+    indexer = talloc (NULL, notmuch_indexer_t);
+    if (unlikely (indexer == NULL))
+	return NULL;
+
+    /* The indexer may be used from any one thread of execution, so
+     * all shared initialization happens here. */
+    _notmuch_index_init ();
+
+    indexer->mime_parser = _notmuch_mime_parser_create (indexer);
+    if (unlikely (indexer->mime_parser == NULL)) {
+	talloc_free (indexer);
+	return NULL;
+    }
+
+    indexer->notmuch = notmuch;
+    indexer->term_gen = new Xapian::TermGenerator;
+    indexer->term_gen->set_stemmer (Xapian::Stem ("english"));
 
-	_notmuch_message_add_filename (message, filename);
+    return indexer;
+}
+
+notmuch_status_t
+notmuch_indexer_index_file (notmuch_indexer_t *indexer,
+			    const char *filename,
+			    const char *folder_name,
+			    notmuch_indexed_message_t **indexed_ret)
+{
+    notmuch_indexed_message_t *indexed;
+    notmuch_status_t ret;
+
+    ret = _indexed_message_open (indexer->notmuch, indexer->term_gen,
+				 indexer->mime_parser, filename, folder_name,
+				 NULL, indexed_ret);
+    if (ret)
+	return ret;
+
+    indexed = *indexed_ret;
+
+    try {
+	ret = _indexed_message_build (indexed);
+    } catch (const Xapian::Error &error) {
+	/* Not reported on the database, which belongs to another
+	 * thread of execution. */
+	fprintf (stderr, "A Xapian exception occurred indexing message: %s.\n",
+		 error.get_msg().c_str());
+	ret = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    if (ret) {
+	talloc_free (indexed);
+	*indexed_ret = NULL;
+    }
 
-	/* Is this a newly created message object? */
-	if (private_status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND) {
-	    _notmuch_message_add_term (message, "type", "mail");
+    return ret;
+}
+
+void
+notmuch_indexer_destroy (notmuch_indexer_t *indexer)
+{
+    delete indexer->term_gen;
+    talloc_free (indexer);
+}
+
+notmuch_status_t
+notmuch_database_add_indexed_message (notmuch_database_t *notmuch,
+				      notmuch_indexed_message_t *indexed,
+				      const char **tags,
+				      notmuch_message_t **message_ret)
+{
+    notmuch_message_t *message = NULL;
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+    const char **tag;
+
+    if (message_ret)
+	*message_ret = NULL;
 
-	    ret = _notmuch_database_link_message (notmuch, message,
-						  message_file);
+    if (indexed->notmuch != notmuch)
+	return NOTMUCH_STATUS_ILLEGAL_ARGUMENT;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	return ret;
+
+    /* Check the tags before changing anything. */
+    for (tag = tags; tag && *tag; tag++) {
+	if (strlen (*tag) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+    }
+
+    try {
+	message = notmuch_database_find_message (notmuch, indexed->message_id);
+	if (message) {
+	    _notmuch_message_add_filename (message, indexed->filename);
+	    _notmuch_message_sync (message);
+	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
+	    goto DONE;
+	}
+
+	/* Only now that the message is known to be new is its
+	 * document built, (unless that was done already, such as by
+	 * notmuch_indexer_index_file). */
+	if (indexed->message == NULL) {
+	    ret = _indexed_message_build (indexed);
 	    if (ret)
 		goto DONE;
+	}
+
+	message = talloc_steal (notmuch, indexed->message);
+	indexed->message = NULL;
 
-	    date = notmuch_message_file_get_header (message_file, "date");
-	    _notmuch_message_set_date (message, date);
+	ret = _notmuch_message_add_filename (message, indexed->filename);
+	if (ret)
+	    goto DONE;
 
-	    if (folder_name != NULL)
-		_notmuch_message_gen_terms (message, "folder", folder_name);
+	ret = _notmuch_database_link_message (notmuch, message,
+					      indexed->parents);
+	if (ret)
+	    goto DONE;
 
-	    _notmuch_message_index_file (message, filename);
-	} else {
-	    ret = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
+	/* The tags are in the document from the start, so it's only
+	 * written once. */
+	for (tag = tags; tag && *tag; tag++) {
+	    notmuch_private_status_t private_status;
+
+	    private_status = _notmuch_message_add_term (message, "tag", *tag);
+	    if (private_status) {
+		INTERNAL_ERROR ("_notmuch_message_add_term return unexpected value: %d\n",
+				private_status);
+	    }
 	}
 
-	_notmuch_message_sync (message);
+	_notmuch_message_attach (message);
+
+	_thread_id_cache_store (notmuch, indexed->message_id,
+				notmuch_message_get_thread_id (message), FALSE);
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred adding message: %s.\n",
 		 error.get_msg().c_str());
@@ -1624,12 +2593,192 @@ notmuch_database_add_message (notmuch_database_t *notmuch,
 	    notmuch_message_destroy (message);
     }
 
+    return ret;
+}
+
+void
+notmuch_indexed_message_destroy (notmuch_indexed_message_t *indexed)
+{
+    talloc_free (indexed);
+}
+
+notmuch_status_t
+notmuch_database_add_message (notmuch_database_t *notmuch,
+			      const char *filename,
+			      const char *folder_name,
+			      notmuch_message_t **message_ret)
+{
+    return notmuch_database_add_message_with_tags (notmuch, filename,
+						   folder_name, NULL,
+						   message_ret);
+}
+
+/* Add the message in 'filename', (whose contents are those of
+ * 'message_file' unless it's NULL), to the database, (see
+ * notmuch_database_add_message_with_tags). 'message_file' is always
+ * closed. */
+static notmuch_status_t
+_notmuch_database_add_message_file (notmuch_database_t *notmuch,
+				    const char *filename,
+				    const char *folder_name,
+				    notmuch_message_file_t *message_file,
+				    const char **tags,
+				    notmuch_message_t **message_ret)
+{
+    notmuch_indexed_message_t *indexed;
+    notmuch_status_t ret;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    ret = _notmuch_database_ensure_writable (notmuch);
+    if (ret)
+	goto FAIL;
+
+    if (notmuch->mime_parser == NULL) {
+	notmuch->mime_parser = _notmuch_mime_parser_create (notmuch);
+	if (unlikely (notmuch->mime_parser == NULL)) {
+	    ret = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto FAIL;
+	}
+    }
+
+    ret = _indexed_message_open (notmuch, notmuch->term_gen,
+				 notmuch->mime_parser, filename,
+				 folder_name, message_file, &indexed);
+    if (ret)
+	return ret;
+
+    ret = notmuch_database_add_indexed_message (notmuch, indexed, tags,
+						message_ret);
+
+    notmuch_indexed_message_destroy (indexed);
+
+    return ret;
+
+  FAIL:
     if (message_file)
 	notmuch_message_file_close (message_file);
 
     return ret;
 }
 
+notmuch_status_t
+notmuch_database_add_message_with_tags (notmuch_database_t *notmuch,
+					const char *filename,
+					const char *folder_name,
+					const char **tags,
+					notmuch_message_t **message_ret)
+{
+    return _notmuch_database_add_message_file (notmuch, filename,
+					       folder_name, NULL,
+					       tags, message_ret);
+}
+
+notmuch_status_t
+notmuch_database_add_message_from_buffer (notmuch_database_t *notmuch,
+					  const char *filename,
+					  const char *folder_name,
+					  const char *buffer,
+					  size_t length,
+					  const char **tags,
+					  notmuch_message_t **message_ret)
+{
+    notmuch_message_file_t *message_file;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    message_file = _notmuch_message_file_read_buffer (NULL, buffer, length);
+    if (unlikely (message_file == NULL))
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+
+    return _notmuch_database_add_message_file (notmuch, filename,
+					       folder_name, message_file,
+					       tags, message_ret);
+}
+
+notmuch_status_t
+notmuch_database_add_message_from_fd (notmuch_database_t *notmuch,
+				      const char *filename,
+				      const char *folder_name,
+				      int fd,
+				      const char **tags,
+				      notmuch_message_t **message_ret)
+{
+    notmuch_message_file_t *message_file;
+
+    if (message_ret)
+	*message_ret = NULL;
+
+    message_file = _notmuch_message_file_read_fd (NULL, fd);
+    if (message_file == NULL)
+	return NOTMUCH_STATUS_FILE_ERROR;
+
+    return _notmuch_database_add_message_file (notmuch, filename,
+					       folder_name, message_file,
+					       tags, message_ret);
+}
+
+notmuch_status_t
+notmuch_database_add_message_filename (notmuch_database_t *notmuch,
+				       const char *existing,
+				       const char *filename)
+{
+    void *local;
+    char *direntry, *term;
+    Xapian::PostingIterator i, end;
+    notmuch_message_t *message;
+    notmuch_status_t status;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    local = talloc_new (notmuch);
+
+    try {
+	status = _notmuch_database_filename_to_direntry (local, notmuch,
+							 existing, &direntry);
+	if (status)
+	    goto DONE;
+
+	term = talloc_asprintf (local, "%s%s",
+				_find_prefix ("file-direntry"), direntry);
+
+	find_doc_ids_for_term (notmuch, term, &i, &end);
+
+	if (i == end) {
+	    status = NOTMUCH_STATUS_FILE_ERROR;
+	    goto DONE;
+	}
+
+	message = _notmuch_message_create (local, notmuch, *i, NULL);
+	if (unlikely (message == NULL)) {
+	    status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    goto DONE;
+	}
+
+	/* Just as when notmuch_database_add_message finds the file to
+	 * be a duplicate, but without reading it to find that out. */
+	status = _notmuch_message_add_filename (message, filename);
+	if (status)
+	    goto DONE;
+
+	_notmuch_message_sync (message);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred adding message filename: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    talloc_free (local);
+
+    return status;
+}
+
 notmuch_status_t
 notmuch_database_remove_message (notmuch_database_t *notmuch,
 				 const char *filename)
@@ -1640,6 +2789,7 @@ notmuch_database_remove_message (notmuch_database_t *notmuch,
     char *direntry, *term;
     Xapian::PostingIterator i, end;
     Xapian::Document document;
+    notmuch_thread_contribution_t *contribution;
     notmuch_status_t status;
 
     status = _notmuch_database_ensure_writable (notmuch);
@@ -1675,12 +2825,29 @@ notmuch_database_remove_message (notmuch_database_t *notmuch,
 	    if (j == document.termlist_end () ||
 		strncmp ((*j).c_str (), prefix, strlen (prefix)))
 	    {
+		const char *id_prefix = _find_prefix ("id");
+
+		j = document.termlist_begin ();
+		j.skip_to (id_prefix);
+		if (j != document.termlist_end () &&
+		    strncmp ((*j).c_str (), id_prefix, strlen (id_prefix)) == 0)
+		{
+		    _thread_id_cache_forget (notmuch,
+					     (*j).c_str () + strlen (id_prefix));
+		}
+
+		contribution = _notmuch_thread_contribution_create (
+		    local, notmuch, document, *i);
+		_notmuch_thread_summary_update (notmuch, *i, contribution,
+						NULL);
+		talloc_free (contribution);
 		db->delete_document (document.get_docid ());
 		status = NOTMUCH_STATUS_SUCCESS;
 	    } else {
 		db->replace_document (document.get_docid (), document);
 		status = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
 	    }
+	    _notmuch_database_modified (notmuch);
 	}
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "Error: A Xapian exception occurred removing message: %s\n",
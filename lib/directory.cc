@@ -128,6 +128,239 @@ notmuch_filenames_destroy (notmuch_filenames_t *filenames)
     talloc_free (filenames);
 }
 
+typedef struct {
+    uint64_t name_hash;
+    uint64_t inode;
+    uint64_t size;
+} manifest_entry_t;
+
+/* The entries of a manifest are kept sorted by name hash, (only
+ * sorting entries added since the last lookup when needed). */
+struct _notmuch_manifest {
+    unsigned int count;
+    unsigned int size;
+    notmuch_bool_t sorted;
+    manifest_entry_t *entries;
+};
+
+/* The 64-bit FNV-1a hash of 'name'. */
+static uint64_t
+_manifest_hash_name (const char *name)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    const unsigned char *s;
+
+    for (s = (const unsigned char *) name; *s; s++) {
+	hash ^= *s;
+	hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+static int
+_manifest_entry_compare (const void *a, const void *b)
+{
+    const manifest_entry_t *entry_a = (const manifest_entry_t *) a;
+    const manifest_entry_t *entry_b = (const manifest_entry_t *) b;
+
+    if (entry_a->name_hash < entry_b->name_hash)
+	return -1;
+    return entry_a->name_hash > entry_b->name_hash;
+}
+
+static void
+_notmuch_manifest_sort (notmuch_manifest_t *manifest)
+{
+    if (manifest->sorted)
+	return;
+
+    qsort (manifest->entries, manifest->count, sizeof (manifest_entry_t),
+	   _manifest_entry_compare);
+    manifest->sorted = TRUE;
+}
+
+static notmuch_manifest_t *
+_notmuch_manifest_create (const void *ctx)
+{
+    notmuch_manifest_t *manifest;
+
+    manifest = talloc (ctx, notmuch_manifest_t);
+    if (unlikely (manifest == NULL))
+	return NULL;
+
+    manifest->count = 0;
+    manifest->size = 0;
+    manifest->sorted = TRUE;
+    manifest->entries = NULL;
+
+    return manifest;
+}
+
+static notmuch_bool_t
+_notmuch_manifest_append (notmuch_manifest_t *manifest,
+			  uint64_t name_hash,
+			  uint64_t inode,
+			  uint64_t size)
+{
+    manifest_entry_t *entry;
+
+    if (manifest->count == manifest->size) {
+	unsigned int new_size = manifest->size ? manifest->size * 2 : 64;
+	manifest_entry_t *entries;
+
+	entries = talloc_realloc (manifest, manifest->entries,
+				  manifest_entry_t, new_size);
+	if (unlikely (entries == NULL))
+	    return FALSE;
+
+	manifest->entries = entries;
+	manifest->size = new_size;
+    }
+
+    entry = &manifest->entries[manifest->count];
+    if (manifest->count &&
+	entry[-1].name_hash > name_hash)
+    {
+	manifest->sorted = FALSE;
+    }
+
+    entry->name_hash = name_hash;
+    entry->inode = inode;
+    entry->size = size;
+    manifest->count++;
+
+    return TRUE;
+}
+
+/* Serialise 'manifest' as a string talloced from 'ctx': the number of
+ * entries, then the name hash, inode number and size of each, (all in
+ * hexadecimal, since metadata is handled as strings). */
+static char *
+_notmuch_manifest_serialise (void *ctx, notmuch_manifest_t *manifest)
+{
+    /* Three numbers of up to 16 digits and their separators. */
+    const size_t entry_max = 3 * 17;
+    char *value, *s;
+    unsigned int i;
+
+    _notmuch_manifest_sort (manifest);
+
+    value = talloc_array (ctx, char, (manifest->count + 1) * entry_max);
+    if (unlikely (value == NULL))
+	return NULL;
+
+    s = value + sprintf (value, "%x\n", manifest->count);
+
+    for (i = 0; i < manifest->count; i++) {
+	manifest_entry_t *entry = &manifest->entries[i];
+
+	s += sprintf (s, "%llx %llx %llx\n",
+		      (unsigned long long) entry->name_hash,
+		      (unsigned long long) entry->inode,
+		      (unsigned long long) entry->size);
+    }
+
+    return value;
+}
+
+/* Add the entries of a manifest serialised by
+ * _notmuch_manifest_serialise to 'manifest', returning FALSE if
+ * 'value' is malformed. */
+static notmuch_bool_t
+_notmuch_manifest_parse (notmuch_manifest_t *manifest, const char *value)
+{
+    unsigned long count, i;
+    unsigned long long name_hash, inode, size;
+    char *end;
+
+    count = strtoul (value, &end, 16);
+    if (end == value || *end != '\n')
+	return FALSE;
+    value = end + 1;
+
+    for (i = 0; i < count; i++) {
+	name_hash = strtoull (value, &end, 16);
+	if (end == value || *end != ' ')
+	    return FALSE;
+	value = end + 1;
+
+	inode = strtoull (value, &end, 16);
+	if (end == value || *end != ' ')
+	    return FALSE;
+	value = end + 1;
+
+	size = strtoull (value, &end, 16);
+	if (end == value || *end != '\n')
+	    return FALSE;
+	value = end + 1;
+
+	if (! _notmuch_manifest_append (manifest, name_hash, inode, size))
+	    return FALSE;
+    }
+
+    return *value == '\0';
+}
+
+notmuch_manifest_t *
+notmuch_manifest_create (notmuch_database_t *notmuch)
+{
+    return _notmuch_manifest_create (notmuch);
+}
+
+notmuch_status_t
+notmuch_manifest_add (notmuch_manifest_t *manifest,
+		      const char *name,
+		      uint64_t inode,
+		      uint64_t size)
+{
+    if (! _notmuch_manifest_append (manifest, _manifest_hash_name (name),
+				    inode, size))
+    {
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_manifest_find (notmuch_manifest_t *manifest,
+		       const char *name,
+		       uint64_t *inode,
+		       uint64_t *size)
+{
+    manifest_entry_t key, *entry;
+
+    _notmuch_manifest_sort (manifest);
+
+    key.name_hash = _manifest_hash_name (name);
+    entry = (manifest_entry_t *) bsearch (&key, manifest->entries,
+					  manifest->count,
+					  sizeof (manifest_entry_t),
+					  _manifest_entry_compare);
+    if (entry == NULL)
+	return FALSE;
+
+    if (inode)
+	*inode = entry->inode;
+    if (size)
+	*size = entry->size;
+
+    return TRUE;
+}
+
+unsigned int
+notmuch_manifest_count (notmuch_manifest_t *manifest)
+{
+    return manifest->count;
+}
+
+void
+notmuch_manifest_destroy (notmuch_manifest_t *manifest)
+{
+    talloc_free (manifest);
+}
+
 struct _notmuch_directory {
     notmuch_database_t *notmuch;
     Xapian::docid document_id;
@@ -259,6 +492,14 @@ _notmuch_directory_get_document_id (notmuch_directory_t *directory)
     return directory->document_id;
 }
 
+/* The metadata key of the manifest of 'directory', talloced from
+ * 'ctx'. */
+static char *
+_manifest_key (void *ctx, notmuch_directory_t *directory)
+{
+    return talloc_asprintf (ctx, "manifest-%u", directory->document_id);
+}
+
 notmuch_status_t
 notmuch_directory_set_mtime (notmuch_directory_t *directory,
 			     time_t mtime)
@@ -266,6 +507,7 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
     notmuch_database_t *notmuch = directory->notmuch;
     Xapian::WritableDatabase *db;
     notmuch_status_t status;
+    char *key;
 
     status = _notmuch_database_ensure_writable (notmuch);
     if (status)
@@ -276,8 +518,13 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
     try {
 	directory->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 				   Xapian::sortable_serialise (mtime));
+	directory->doc.remove_value (NOTMUCH_VALUE_DIRECTORY_TIMES);
 
 	db->replace_document (directory->document_id, directory->doc);
+
+	key = _manifest_key (directory, directory);
+	_notmuch_database_set_metadata (notmuch, key, "");
+	talloc_free (key);
     } catch (const Xapian::Error &error) {
 	fprintf (stderr,
 		 "A Xapian exception occurred setting directory mtime: %s.\n",
@@ -286,6 +533,8 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
 	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
     }
 
+    directory->mtime = mtime;
+
     return NOTMUCH_STATUS_SUCCESS;
 }
 
@@ -295,6 +544,157 @@ notmuch_directory_get_mtime (notmuch_directory_t *directory)
     return directory->mtime;
 }
 
+notmuch_status_t
+notmuch_directory_set_times (notmuch_directory_t *directory,
+			     const struct timespec *mtime,
+			     const struct timespec *ctime)
+{
+    notmuch_database_t *notmuch = directory->notmuch;
+    Xapian::WritableDatabase *db;
+    notmuch_status_t status;
+    char *times;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    times = talloc_asprintf (directory, "%ld.%09ld %ld.%09ld",
+			     (long) mtime->tv_sec, (long) mtime->tv_nsec,
+			     (long) ctime->tv_sec, (long) ctime->tv_nsec);
+
+    try {
+	directory->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
+				   Xapian::sortable_serialise (mtime->tv_sec));
+	directory->doc.add_value (NOTMUCH_VALUE_DIRECTORY_TIMES, times);
+
+	db->replace_document (directory->document_id, directory->doc);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred setting directory times: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (times);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (times);
+
+    directory->mtime = mtime->tv_sec;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+notmuch_bool_t
+notmuch_directory_get_times (notmuch_directory_t *directory,
+			     struct timespec *mtime,
+			     struct timespec *ctime)
+{
+    std::string times;
+    long mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+
+    try {
+	times = directory->doc.get_value (NOTMUCH_VALUE_DIRECTORY_TIMES);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred getting directory times: %s.\n",
+		 error.get_msg().c_str());
+	directory->notmuch->exception_reported = TRUE;
+	return FALSE;
+    }
+
+    if (sscanf (times.c_str (), "%ld.%ld %ld.%ld",
+		&mtime_sec, &mtime_nsec, &ctime_sec, &ctime_nsec) != 4)
+    {
+	return FALSE;
+    }
+
+    /* A version of notmuch unaware of these times might have stored
+     * a later mtime without discarding them. */
+    if (mtime_sec != (long) directory->mtime)
+	return FALSE;
+
+    mtime->tv_sec = mtime_sec;
+    mtime->tv_nsec = mtime_nsec;
+    ctime->tv_sec = ctime_sec;
+    ctime->tv_nsec = ctime_nsec;
+
+    return TRUE;
+}
+
+notmuch_manifest_t *
+notmuch_directory_get_manifest (notmuch_directory_t *directory)
+{
+    notmuch_manifest_t *manifest;
+    std::string value;
+    char *key;
+
+    key = _manifest_key (directory, directory);
+
+    try {
+	value = _notmuch_database_get_metadata (directory->notmuch, key);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred getting directory manifest: %s.\n",
+		 error.get_msg().c_str());
+	directory->notmuch->exception_reported = TRUE;
+	talloc_free (key);
+	return NULL;
+    }
+
+    talloc_free (key);
+
+    if (value.empty ())
+	return NULL;
+
+    manifest = _notmuch_manifest_create (directory);
+    if (unlikely (manifest == NULL))
+	return NULL;
+
+    if (! _notmuch_manifest_parse (manifest, value.c_str ())) {
+	talloc_free (manifest);
+	return NULL;
+    }
+
+    return manifest;
+}
+
+notmuch_status_t
+notmuch_directory_set_manifest (notmuch_directory_t *directory,
+				notmuch_manifest_t *manifest)
+{
+    notmuch_database_t *notmuch = directory->notmuch;
+    notmuch_status_t status;
+    char *key, *value;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    key = _manifest_key (directory, directory);
+    value = _notmuch_manifest_serialise (key, manifest);
+    if (unlikely (value == NULL)) {
+	talloc_free (key);
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    try {
+	_notmuch_database_set_metadata (notmuch, key, value);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr,
+		 "A Xapian exception occurred setting directory manifest: %s.\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	talloc_free (key);
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+    talloc_free (key);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
 notmuch_filenames_t *
 notmuch_directory_get_child_files (notmuch_directory_t *directory)
 {
@@ -313,6 +713,29 @@ notmuch_directory_get_child_files (notmuch_directory_t *directory)
     return child_files;
 }
 
+notmuch_filenames_t *
+notmuch_directory_get_child_files_with_prefix (notmuch_directory_t *directory,
+					       const char *prefix)
+{
+    char *term;
+    notmuch_filenames_t *child_files;
+
+    term = talloc_asprintf (directory, "%s%u:%s",
+			    _find_prefix ("file-direntry"),
+			    directory->document_id, prefix);
+
+    child_files = _notmuch_filenames_create (directory,
+					     directory->notmuch, term);
+
+    talloc_free (term);
+
+    /* The filenames listed include 'prefix'. */
+    if (child_files)
+	child_files->prefix_len -= strlen (prefix);
+
+    return child_files;
+}
+
 notmuch_filenames_t *
 notmuch_directory_get_child_directories (notmuch_directory_t *directory)
 {
@@ -418,37 +418,78 @@ _index_mime_part (notmuch_message_t *message,
     }
 }
 
-notmuch_status_t
-_notmuch_message_index_file (notmuch_message_t *message,
-			     const char *filename)
+void
+_notmuch_index_init (void)
 {
-    GMimeStream *stream = NULL;
-    GMimeParser *parser = NULL;
-    GMimeMessage *mime_message = NULL;
-    InternetAddressList *addresses;
-    FILE *file = NULL;
-    const char *from, *subject;
-    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
     static int initialized = 0;
 
     if (! initialized) {
 	g_mime_init (0);
+
+	/* The filter's type is registered on its first use. */
+	g_object_unref (notmuch_filter_discard_uuencode_new ());
+
 	initialized = 1;
     }
+}
 
-    file = fopen (filename, "r");
-    if (! file) {
-	fprintf (stderr, "Error opening %s: %s\n", filename, strerror (errno));
-	ret = NOTMUCH_STATUS_FILE_ERROR;
-	goto DONE;
-    }
+struct _notmuch_mime_parser {
+    /* Set to the contents of each message in turn, without being
+     * copied or owned by the stream. */
+    GMimeStream *stream;
+    GMimeParser *parser;
+};
+
+static int
+_notmuch_mime_parser_destructor (notmuch_mime_parser_t *mime_parser)
+{
+    g_object_unref (mime_parser->parser);
+    g_object_unref (mime_parser->stream);
+
+    return 0;
+}
+
+notmuch_mime_parser_t *
+_notmuch_mime_parser_create (const void *ctx)
+{
+    notmuch_mime_parser_t *mime_parser;
 
-    /* Evil GMime steals my FILE* here so I won't fclose it. */
-    stream = g_mime_stream_file_new (file);
+    mime_parser = talloc (ctx, notmuch_mime_parser_t);
+    if (unlikely (mime_parser == NULL))
+	return NULL;
+
+    _notmuch_index_init ();
+
+    mime_parser->stream = g_mime_stream_mem_new ();
+    mime_parser->parser = g_mime_parser_new ();
+
+    talloc_set_destructor (mime_parser, _notmuch_mime_parser_destructor);
+
+    return mime_parser;
+}
+
+notmuch_status_t
+_notmuch_message_index_file (notmuch_message_t *message,
+			     notmuch_mime_parser_t *mime_parser,
+			     notmuch_message_file_t *message_file)
+{
+    GByteArray *data;
+    GMimeMessage *mime_message = NULL;
+    InternetAddressList *addresses;
+    const char *from, *subject;
+
+    data = _notmuch_message_file_get_data (message_file);
+    if (data == NULL)
+	INTERNAL_ERROR ("_notmuch_message_index_file called for a message file not read in full");
 
-    parser = g_mime_parser_new_with_stream (stream);
+    /* Since the stream is seekable, the parts of the message refer
+     * to its contents rather than copying them, so 'data' must
+     * outlive 'mime_message'. */
+    g_mime_stream_mem_set_byte_array (GMIME_STREAM_MEM (mime_parser->stream),
+				      data);
+    g_mime_parser_init_with_stream (mime_parser->parser, mime_parser->stream);
 
-    mime_message = g_mime_parser_construct_message (parser);
+    mime_message = g_mime_parser_construct_message (mime_parser->parser);
 
     from = g_mime_message_get_sender (mime_message);
     addresses = internet_address_list_parse_string (from);
@@ -464,15 +505,7 @@ _notmuch_message_index_file (notmuch_message_t *message,
 
     _index_mime_part (message, g_mime_message_get_mime_part (mime_message));
 
-  DONE:
-    if (mime_message)
-	g_object_unref (mime_message);
-
-    if (parser)
-	g_object_unref (parser);
-
-    if (stream)
-	g_object_unref (stream);
+    g_object_unref (mime_message);
 
-    return ret;
+    return NOTMUCH_STATUS_SUCCESS;
 }
@@ -26,27 +26,42 @@
 
 #include <glib.h> /* GHashTable */
 
+/* A header within the message's contents, (possibly folded over
+ * several lines). */
 typedef struct {
-    char *str;
-    size_t size;
-    size_t len;
-} header_value_closure_t;
+    const char *name;
+    size_t name_len;
+
+    /* From the first non-blank character after the colon to the end
+     * of the header's last line. */
+    const char *value;
+    size_t value_len;
+
+    int folded;
+} header_view_t;
 
 struct _notmuch_message_file {
-    /* File object */
-    FILE *file;
+    /* Complete contents of the file, either mapped into memory or
+     * read in full, (see _notmuch_message_file_read). */
+    const char *contents;
+    size_t length;
+    void *map;
+    GByteArray *data;
 
     /* Header storage */
     int restrict_headers;
     GHashTable *headers;
     int broken_headers;
     int good_headers;
-    size_t header_size; /* Length of full message header in bytes. */
 
-    /* Parsing state */
-    char *line;
-    size_t line_size;
-    header_value_closure_t value;
+    /* Parsing state: the offset within 'contents' of the next line
+     * of the header to be parsed, and buffers reused for the name and
+     * unfolded value of each header. */
+    size_t offset;
+    char *name;
+    size_t name_size;
+    char *value;
+    size_t value_size;
 
     int parsing_started;
     int parsing_finished;
@@ -76,25 +91,71 @@ strcase_hash (const void *ptr)
 static int
 _notmuch_message_file_destructor (notmuch_message_file_t *message)
 {
-    if (message->line)
-	free (message->line);
+    if (message->name)
+	free (message->name);
 
-    if (message->value.size)
-	free (message->value.str);
+    if (message->value)
+	free (message->value);
 
     if (message->headers)
 	g_hash_table_destroy (message->headers);
 
-    if (message->file)
-	fclose (message->file);
+    if (message->map)
+	munmap (message->map, message->length);
+
+    if (message->data)
+	g_byte_array_free (message->data, TRUE);
 
     return 0;
 }
 
-/* Create a new notmuch_message_file_t for 'filename' with 'ctx' as
- * the talloc owner. */
-notmuch_message_file_t *
-_notmuch_message_file_open_ctx (void *ctx, const char *filename)
+/* Read the entire contents of 'fd' into a new array, (or return NULL
+ * with errno set on failure). */
+static GByteArray *
+_read_contents (int fd, const struct stat *st)
+{
+    GByteArray *data;
+    size_t size, length = 0;
+    ssize_t bytes_read;
+    int saved_errno;
+
+    /* One byte more than the size of the file, so that its end is
+     * found without growing the array. */
+    size = st->st_size + 1;
+
+    data = g_byte_array_sized_new (size);
+    g_byte_array_set_size (data, size);
+
+    while (1) {
+	if (length == size) {
+	    size *= 2;
+	    g_byte_array_set_size (data, size);
+	}
+
+	bytes_read = read (fd, data->data + length, size - length);
+	if (bytes_read < 0) {
+	    if (errno == EINTR)
+		continue;
+	    saved_errno = errno;
+	    g_byte_array_free (data, TRUE);
+	    errno = saved_errno;
+	    return NULL;
+	}
+
+	if (bytes_read == 0)
+	    break;
+
+	length += bytes_read;
+    }
+
+    g_byte_array_set_size (data, length);
+
+    return data;
+}
+
+/* Create a message file without any contents yet. */
+static notmuch_message_file_t *
+_notmuch_message_file_alloc (void *ctx)
 {
     notmuch_message_file_t *message;
 
@@ -104,10 +165,6 @@ _notmuch_message_file_open_ctx (void *ctx, const char *filename)
 
     talloc_set_destructor (message, _notmuch_message_file_destructor);
 
-    message->file = fopen (filename, "r");
-    if (message->file == NULL)
-	goto FAIL;
-
     message->headers = g_hash_table_new_full (strcase_hash,
 					      strcase_equal,
 					      free,
@@ -116,15 +173,126 @@ _notmuch_message_file_open_ctx (void *ctx, const char *filename)
     message->parsing_started = 0;
     message->parsing_finished = 0;
 
+    return message;
+}
+
+/* Open 'filename' and either map its contents into memory or, (when
+ * 'read_contents' is true or the file can't be mapped), read them. */
+static notmuch_message_file_t *
+_notmuch_message_file_create (void *ctx, const char *filename,
+			      notmuch_bool_t read_contents)
+{
+    notmuch_message_file_t *message;
+    struct stat st;
+    int fd = -1, saved_errno;
+
+    message = _notmuch_message_file_alloc (ctx);
+    if (unlikely (message == NULL))
+	return NULL;
+
+    fd = open (filename, O_RDONLY);
+    if (fd < 0 || fstat (fd, &st))
+	goto FAIL;
+
+    if (! read_contents && S_ISREG (st.st_mode) && st.st_size > 0) {
+	message->map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (message->map == MAP_FAILED) {
+	    message->map = NULL;
+	} else {
+	    message->contents = (const char *) message->map;
+	    message->length = st.st_size;
+	}
+    }
+
+    if (message->map == NULL) {
+	message->data = _read_contents (fd, &st);
+	if (message->data == NULL)
+	    goto FAIL;
+	message->contents = (const char *) message->data->data;
+	message->length = message->data->len;
+    }
+
+    close (fd);
+
     return message;
 
   FAIL:
-    fprintf (stderr, "Error opening %s: %s\n", filename, strerror (errno));
+    saved_errno = errno;
+    fprintf (stderr, "Error opening %s: %s\n", filename, strerror (saved_errno));
+    if (fd >= 0)
+	close (fd);
     notmuch_message_file_close (message);
 
     return NULL;
 }
 
+/* Create a new notmuch_message_file_t for 'filename' with 'ctx' as
+ * the talloc owner. */
+notmuch_message_file_t *
+_notmuch_message_file_open_ctx (void *ctx, const char *filename)
+{
+    return _notmuch_message_file_create (ctx, filename, FALSE);
+}
+
+notmuch_message_file_t *
+_notmuch_message_file_read (void *ctx, const char *filename)
+{
+    return _notmuch_message_file_create (ctx, filename, TRUE);
+}
+
+notmuch_message_file_t *
+_notmuch_message_file_read_fd (void *ctx, int fd)
+{
+    notmuch_message_file_t *message;
+    struct stat st;
+
+    message = _notmuch_message_file_alloc (ctx);
+    if (unlikely (message == NULL))
+	return NULL;
+
+    /* The size of anything but a regular file is only a guess. */
+    if (fstat (fd, &st) || ! S_ISREG (st.st_mode))
+	st.st_size = 0;
+
+    message->data = _read_contents (fd, &st);
+    if (message->data == NULL) {
+	fprintf (stderr, "Error reading message: %s\n", strerror (errno));
+	notmuch_message_file_close (message);
+	return NULL;
+    }
+
+    message->contents = (const char *) message->data->data;
+    message->length = message->data->len;
+
+    return message;
+}
+
+notmuch_message_file_t *
+_notmuch_message_file_read_buffer (void *ctx,
+				   const char *buffer,
+				   size_t length)
+{
+    notmuch_message_file_t *message;
+
+    message = _notmuch_message_file_alloc (ctx);
+    if (unlikely (message == NULL))
+	return NULL;
+
+    message->data = g_byte_array_sized_new (length);
+    g_byte_array_append (message->data, (const guint8 *) buffer, length);
+
+    message->contents = (const char *) message->data->data;
+    message->length = message->data->len;
+
+    return message;
+}
+
+GByteArray *
+_notmuch_message_file_get_data (notmuch_message_file_t *message)
+{
+    return message->data;
+}
+
 notmuch_message_file_t *
 notmuch_message_file_open (const char *filename)
 {
@@ -167,44 +335,146 @@ notmuch_message_file_restrict_headers (notmuch_message_file_t *message, ...)
     notmuch_message_file_restrict_headersv (message, va_headers);
 }
 
-static void
-copy_header_unfolding (header_value_closure_t *value,
-		       const char *chunk)
+/* Return the end of the line starting at 'line', (just after its
+ * newline, or 'end' for a final line without one). */
+static inline const char *
+_line_end (const char *line, const char *end)
 {
-    char *last;
+    const char *newline;
 
-    if (chunk == NULL)
-	return;
+    newline = memchr (line, '\n', end - line);
 
-    while (*chunk == ' ' || *chunk == '\t')
-	chunk++;
+    return newline ? newline + 1 : end;
+}
 
-    if (value->len + 1 + strlen (chunk) + 1 > value->size) {
-	unsigned int new_size = value->size;
-	if (value->size == 0)
-	    new_size = strlen (chunk) + 1;
-	else
-	    while (value->len + 1 + strlen (chunk) + 1 > new_size)
-		new_size *= 2;
-	value->str = xrealloc (value->str, new_size);
-	value->size = new_size;
+/* Find the next header of 'message', skipping any broken lines.
+ *
+ * Returns 0 at the end of the message's header, (and sets
+ * message->parsing_finished).
+ */
+static int
+_notmuch_message_file_next_header (notmuch_message_file_t *message,
+				   header_view_t *header)
+{
+    const char *end = message->contents + message->length;
+    const char *line, *line_end, *colon, *s;
+
+    while (! message->parsing_finished) {
+	line = message->contents + message->offset;
+
+	if (line == end || *line == '\n') {
+	    message->parsing_finished = 1;
+	    break;
+	}
+
+	line_end = _line_end (line, end);
+
+	/* Any lines folded into this one belong to the same header. */
+	header->folded = 0;
+	s = line_end;
+	while (s < end && (*s == ' ' || *s == '\t')) {
+	    header->folded = 1;
+	    s = _line_end (s, end);
+	}
+	message->offset = s - message->contents;
+
+	/* A continuation of no header at all. */
+	if (*line == ' ' || *line == '\t')
+	    continue;
+
+	colon = memchr (line, ':', line_end - line);
+	if (colon == NULL) {
+	    message->broken_headers++;
+	    /* A simple heuristic for giving up on things that just
+	     * don't look like mail messages. */
+	    if (message->broken_headers >= 10 &&
+		message->good_headers < 5)
+	    {
+		message->parsing_finished = 1;
+		break;
+	    }
+	    continue;
+	}
+
+	message->good_headers++;
+
+	header->name = line;
+	header->name_len = colon - line;
+
+	s = colon + 1;
+	while (s < line_end && (*s == ' ' || *s == '\t'))
+	    s++;
+
+	header->value = s;
+	header->value_len = (message->contents + message->offset) - s;
+
+	return 1;
+    }
+
+    return 0;
+}
+
+/* Copy 'length' bytes of 'src' as a null-terminated string into
+ * '*buffer', growing it as needed. */
+static char *
+_copy_to_buffer (char **buffer, size_t *size, const char *src, size_t length)
+{
+    if (length + 1 > *size) {
+	*size = length + 1;
+	*buffer = xrealloc (*buffer, *size);
     }
 
-    last = value->str + value->len;
-    if (value->len) {
-	*last = ' ';
-	last++;
-	value->len++;
+    memcpy (*buffer, src, length);
+    (*buffer)[length] = '\0';
+
+    return *buffer;
+}
+
+/* Return the value of 'header' as a null-terminated string in
+ * message->value, joining any folded lines with single spaces. */
+static const char *
+_header_value_unfolded (notmuch_message_file_t *message,
+			const header_view_t *header)
+{
+    const char *s = header->value, *end = header->value + header->value_len;
+    const char *line_end;
+    size_t len = 0;
+    char *value;
+
+    if (! header->folded) {
+	if (end > s && end[-1] == '\n')
+	    end--;
+	return _copy_to_buffer (&message->value, &message->value_size,
+				s, end - s);
+    }
+
+    /* Unfolding never makes the value longer. */
+    if (header->value_len + 1 > message->value_size) {
+	message->value_size = header->value_len + 1;
+	message->value = xrealloc (message->value, message->value_size);
     }
+    value = message->value;
 
-    strcpy (last, chunk);
-    value->len += strlen (chunk);
+    while (s < end) {
+	line_end = _line_end (s, end);
 
-    last = value->str + value->len - 1;
-    if (*last == '\n') {
-	*last = '\0';
-	value->len--;
+	while (s < line_end && (*s == ' ' || *s == '\t'))
+	    s++;
+
+	if (len)
+	    value[len++] = ' ';
+
+	memcpy (value + len, s, line_end - s);
+	len += line_end - s;
+	if (len && value[len - 1] == '\n')
+	    len--;
+
+	s = line_end;
     }
+
+    value[len] = '\0';
+
+    return value;
 }
 
 /* As a special-case, a value of NULL for header_desired will force
@@ -221,11 +491,11 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
 {
     int contains;
     char *header, *decoded_value, *header_sofar, *combined_header;
-    const char *s, *colon;
+    header_view_t view;
     int match, newhdr, hdrsofar, is_received;
     static int initialized = 0;
 
-    is_received = (strcmp(header_desired,"received") == 0);
+    is_received = (header_desired && strcmp(header_desired,"received") == 0);
 
     if (! initialized) {
 	g_mime_init (0);
@@ -247,89 +517,31 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
     if (message->parsing_finished)
 	return "";
 
-#define NEXT_HEADER_LINE(closure)				\
-    while (1) {							\
-	ssize_t bytes_read = getline (&message->line,		\
-				      &message->line_size,	\
-				      message->file);		\
-	if (bytes_read == -1) {					\
-	    message->parsing_finished = 1;			\
-	    break;						\
-	}							\
-	if (*message->line == '\n') {				\
-	    message->parsing_finished = 1;			\
-	    break;						\
-	}							\
-	if (closure &&						\
-	    (*message->line == ' ' || *message->line == '\t'))	\
-	{							\
-	    copy_header_unfolding ((closure), message->line);	\
-	}							\
-	if (*message->line == ' ' || *message->line == '\t')	\
-	    message->header_size += strlen (message->line);	\
-	else							\
-	    break;						\
-    }
-
-    if (message->line == NULL)
-	NEXT_HEADER_LINE (NULL);
-
-    while (1) {
-
-	if (message->parsing_finished)
-	    break;
-
-	colon = strchr (message->line, ':');
-
-	if (colon == NULL) {
-	    message->broken_headers++;
-	    /* A simple heuristic for giving up on things that just
-	     * don't look like mail messages. */
-	    if (message->broken_headers >= 10 &&
-		message->good_headers < 5)
-	    {
-		message->parsing_finished = 1;
-		break;
-	    }
-	    NEXT_HEADER_LINE (NULL);
-	    continue;
-	}
-
-	message->header_size += strlen (message->line);
-
-	message->good_headers++;
+    while (_notmuch_message_file_next_header (message, &view)) {
 
-	header = xstrndup (message->line, colon - message->line);
+	/* Look the name up in place before deciding to keep a copy. */
+	_copy_to_buffer (&message->name, &message->name_size,
+			 view.name, view.name_len);
 
 	if (message->restrict_headers &&
 	    ! g_hash_table_lookup_extended (message->headers,
-					    header, NULL, NULL))
+					    message->name, NULL, NULL))
 	{
-	    free (header);
-	    NEXT_HEADER_LINE (NULL);
 	    continue;
 	}
 
-	s = colon + 1;
-	while (*s == ' ' || *s == '\t')
-	    s++;
-
-	message->value.len = 0;
-	copy_header_unfolding (&message->value, s);
-
-	NEXT_HEADER_LINE (&message->value);
-
 	if (header_desired == NULL)
 	    match = 0;
 	else
-	    match = (strcasecmp (header, header_desired) == 0);
+	    match = (strcasecmp (message->name, header_desired) == 0);
 
-	decoded_value = g_mime_utils_header_decode_text (message->value.str);
-	header_sofar = (char *)g_hash_table_lookup (message->headers, header);
+	decoded_value = g_mime_utils_header_decode_text (_header_value_unfolded (message, &view));
+	header_sofar = (char *)g_hash_table_lookup (message->headers, message->name);
 	/* we treat the Received: header special - we want to concat ALL of 
 	 * the Received: headers we encounter.
 	 * for everything else we return the first instance of a header */
 	if (is_received) {
+	    header = xstrdup (message->name);
 	    if (header_sofar == NULL) {
 		/* first Received: header we encountered; just add it */
 		g_hash_table_insert (message->headers, header, decoded_value);
@@ -341,12 +553,17 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
 		strncpy(combined_header,header_sofar,hdrsofar);
 		*(combined_header+hdrsofar) = ' ';
 		strncpy(combined_header+hdrsofar+1,decoded_value,newhdr+1);
+		free (decoded_value);
 		g_hash_table_insert (message->headers, header, combined_header);
 	    }
 	} else {
 	    if (header_sofar == NULL) {
 		/* Only insert if we don't have a value for this header, yet. */
+		header = xstrdup (message->name);
 		g_hash_table_insert (message->headers, header, decoded_value);
+	    } else {
+		free (decoded_value);
+		decoded_value = header_sofar;
 	    }
 	}
 	/* if we found a match we can bail - unless of course we are
@@ -355,20 +572,16 @@ notmuch_message_file_get_header (notmuch_message_file_t *message,
 	    return decoded_value;
     }
 
-    if (message->parsing_finished) {
-        fclose (message->file);
-        message->file = NULL;
+    if (message->name) {
+	free (message->name);
+	message->name = NULL;
+	message->name_size = 0;
     }
 
-    if (message->line)
-	free (message->line);
-    message->line = NULL;
-
-    if (message->value.size) {
-	free (message->value.str);
-	message->value.str = NULL;
-	message->value.size = 0;
-	message->value.len = 0;
+    if (message->value) {
+	free (message->value);
+	message->value = NULL;
+	message->value_size = 0;
     }
 
     /* For the Received: header we actually might end up here even
@@ -27,10 +27,33 @@
 
 #include <xapian.h>
 
+/* The headers which are stored as values of each mail document, (so
+ * that they can be returned without opening the message file). */
+static const struct {
+    const char *name;
+    notmuch_value_t slot;
+} INDEXED_HEADERS[] = {
+    { "from",		NOTMUCH_VALUE_FROM },
+    { "subject",	NOTMUCH_VALUE_SUBJECT },
+    { "to",		NOTMUCH_VALUE_TO },
+    { "date",		NOTMUCH_VALUE_DATE }
+};
+
 struct _notmuch_message {
     notmuch_database_t *notmuch;
     Xapian::docid doc_id;
     int frozen;
+
+    /* Whether 'doc' has been changed since it was last synchronized
+     * to the database, (so a thaw without a change costs nothing). */
+    notmuch_bool_t modified;
+
+    /* What 'doc' contributed to the summary of its thread when last
+     * synchronized, (NULL for a new document), remembered before its
+     * first change so that _notmuch_message_sync needn't read the
+     * stored document again. */
+    notmuch_thread_contribution_t *stored_contribution;
+
     char *message_id;
     char *thread_id;
     char *in_reply_to;
@@ -39,6 +62,10 @@ struct _notmuch_message {
     notmuch_message_file_t *message_file;
     notmuch_message_list_t *replies;
     unsigned long flags;
+    char *indexed_headers[ARRAY_SIZE (INDEXED_HEADERS)];
+
+    /* Used by _notmuch_message_gen_terms. */
+    Xapian::TermGenerator *term_gen;
 
     Xapian::Document doc;
 };
@@ -57,6 +84,72 @@ _notmuch_message_destructor (notmuch_message_t *message)
     return 0;
 }
 
+/* Allocate a new notmuch_message_t object, (with an empty document),
+ * for 'doc_id'. Returns NULL if out of memory. */
+static notmuch_message_t *
+_notmuch_message_alloc (const void *talloc_owner,
+			notmuch_database_t *notmuch,
+			unsigned int doc_id)
+{
+    notmuch_message_t *message;
+
+    message = talloc (talloc_owner, notmuch_message_t);
+    if (unlikely (message == NULL))
+	return NULL;
+
+    message->notmuch = notmuch;
+    message->doc_id = doc_id;
+    message->term_gen = notmuch->term_gen;
+
+    message->frozen = 0;
+    message->modified = FALSE;
+    message->stored_contribution = NULL;
+    message->flags = 0;
+
+    /* Each of these will be lazily created as needed. */
+    message->message_id = NULL;
+    message->thread_id = NULL;
+    message->in_reply_to = NULL;
+    message->filename = NULL;
+    message->message_file = NULL;
+    message->author = NULL;
+    memset (message->indexed_headers, 0, sizeof (message->indexed_headers));
+
+    message->replies = _notmuch_message_list_create (message);
+    if (unlikely (message->replies == NULL)) {
+	talloc_free (message);
+	return NULL;
+    }
+
+    /* This is C++'s creepy "placement new", which is really just an
+     * ugly way to call a constructor for a pre-allocated object. So
+     * it's really not an error to not be checking for OUT_OF_MEMORY
+     * here, since this "new" isn't actually allocating memory. This
+     * is language-design comedy of the wrong kind. */
+
+    new (&message->doc) Xapian::Document;
+
+    talloc_set_destructor (message, _notmuch_message_destructor);
+
+    return message;
+}
+
+/* Call before each change to 'message->doc', (see
+ * stored_contribution). */
+static void
+_notmuch_message_prepare_change (notmuch_message_t *message)
+{
+    if (message->modified || message->doc_id == 0 ||
+	message->notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
+    {
+	return;
+    }
+
+    message->stored_contribution =
+	_notmuch_thread_contribution_create (message, message->notmuch,
+					     message->doc, message->doc_id);
+}
+
 /* Create a new notmuch_message_t object for an existing document in
  * the database.
  *
@@ -92,44 +185,13 @@ _notmuch_message_create (const void *talloc_owner,
     if (status)
 	*status = NOTMUCH_PRIVATE_STATUS_SUCCESS;
 
-    message = talloc (talloc_owner, notmuch_message_t);
+    message = _notmuch_message_alloc (talloc_owner, notmuch, doc_id);
     if (unlikely (message == NULL)) {
 	if (status)
 	    *status = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
 	return NULL;
     }
 
-    message->notmuch = notmuch;
-    message->doc_id = doc_id;
-
-    message->frozen = 0;
-    message->flags = 0;
-
-    /* Each of these will be lazily created as needed. */
-    message->message_id = NULL;
-    message->thread_id = NULL;
-    message->in_reply_to = NULL;
-    message->filename = NULL;
-    message->message_file = NULL;
-    message->author = NULL;
-
-    message->replies = _notmuch_message_list_create (message);
-    if (unlikely (message->replies == NULL)) {
-	if (status)
-	    *status = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
-	return NULL;
-    }
-
-    /* This is C++'s creepy "placement new", which is really just an
-     * ugly way to call a constructor for a pre-allocated object. So
-     * it's really not an error to not be checking for OUT_OF_MEMORY
-     * here, since this "new" isn't actually allocating memory. This
-     * is language-design comedy of the wrong kind. */
-
-    new (&message->doc) Xapian::Document;
-
-    talloc_set_destructor (message, _notmuch_message_destructor);
-
     try {
 	message->doc = notmuch->xapian_db->get_document (doc_id);
     } catch (const Xapian::DocNotFoundError &error) {
@@ -142,74 +204,60 @@ _notmuch_message_create (const void *talloc_owner,
     return message;
 }
 
-/* Create a new notmuch_message_t object for a specific message ID,
- * (which may or may not already exist in the database).
+/* Create a new notmuch_message_t object for a new mail document with
+ * message ID 'message_id', which is not (yet) in the database. The
+ * document can be built without accessing the database, and is then
+ * added to the database with _notmuch_message_attach.
  *
- * The 'notmuch' database will be the talloc owner of the returned
- * message.
+ * Terms are generated with 'term_gen' rather than with the term
+ * generator of 'notmuch', so messages may be built in several
+ * threads of execution at once, each with its own term generator.
  *
- * If there is already a document with message ID 'message_id' in the
- * database, then the returned message can be used to query/modify the
- * document. Otherwise, a new document will be inserted into the
- * database before this function returns, (and *status will be set
- * to NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND).
+ * Returns NULL if out of memory.
  *
- * If an error occurs, this function will return NULL and *status
- * will be set as appropriate. (The status pointer argument must
- * not be NULL.)
+ * This function may throw a Xapian::Error.
  */
 notmuch_message_t *
-_notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
-					const char *message_id,
-					notmuch_private_status_t *status_ret)
+_notmuch_message_create_detached (const void *talloc_owner,
+				  notmuch_database_t *notmuch,
+				  const char *message_id,
+				  Xapian::TermGenerator *term_gen)
 {
     notmuch_message_t *message;
-    Xapian::Document doc;
-    Xapian::WritableDatabase *db;
-    unsigned int doc_id;
-    char *term;
-
-    *status_ret = NOTMUCH_PRIVATE_STATUS_SUCCESS;
 
-    message = notmuch_database_find_message (notmuch, message_id);
-    if (message)
-	return talloc_steal (notmuch, message);
-
-    term = talloc_asprintf (NULL, "%s%s",
-			    _find_prefix ("id"), message_id);
-    if (term == NULL) {
-	*status_ret = NOTMUCH_PRIVATE_STATUS_OUT_OF_MEMORY;
+    message = _notmuch_message_alloc (talloc_owner, notmuch, 0);
+    if (unlikely (message == NULL))
 	return NULL;
-    }
 
-    if (notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY)
-	INTERNAL_ERROR ("Failure to ensure database is writable.");
+    message->term_gen = term_gen;
 
-    db = static_cast<Xapian::WritableDatabase *> (notmuch->xapian_db);
-    try {
-	doc.add_term (term, 0);
-	talloc_free (term);
+    _notmuch_message_add_term (message, "id", message_id);
+    message->doc.add_value (NOTMUCH_VALUE_MESSAGE_ID, message_id);
 
-	doc.add_value (NOTMUCH_VALUE_MESSAGE_ID, message_id);
+    return message;
+}
 
-	doc_id = db->add_document (doc);
-    } catch (const Xapian::Error &error) {
-	fprintf (stderr, "A Xapian exception occurred creating message: %s\n",
-		 error.get_msg().c_str());
-	notmuch->exception_reported = TRUE;
-	*status_ret = NOTMUCH_PRIVATE_STATUS_XAPIAN_EXCEPTION;
-	return NULL;
-    }
+/* Add the document of a message from _notmuch_message_create_detached
+ * to the database, after which the message is like any other.
+ *
+ * This function may throw a Xapian::Error.
+ */
+void
+_notmuch_message_attach (notmuch_message_t *message)
+{
+    notmuch_database_t *notmuch = message->notmuch;
 
-    message = _notmuch_message_create (notmuch, notmuch,
-				       doc_id, status_ret);
+    if (message->doc_id)
+	INTERNAL_ERROR ("Message with document ID of %d is already attached.\n",
+			message->doc_id);
 
-    /* We want to inform the caller that we had to create a new
-     * document. */
-    if (*status_ret == NOTMUCH_PRIVATE_STATUS_SUCCESS)
-	*status_ret = NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND;
+    /* Replacing a document that doesn't exist yet adds it with the
+     * given ID, so the new document ID is known to
+     * _notmuch_message_sync before the document is added. */
+    message->doc_id = notmuch->xapian_db->get_lastdocid () + 1;
+    message->term_gen = notmuch->term_gen;
 
-    return message;
+    _notmuch_message_sync (message);
 }
 
 const char *
@@ -259,9 +307,54 @@ _notmuch_message_ensure_message_file (notmuch_message_t *message)
     message->message_file = _notmuch_message_file_open_ctx (message, filename);
 }
 
+/* Return the value of 'header' as stored in the document, or NULL if
+ * 'header' is not one of INDEXED_HEADERS or the database doesn't
+ * store header values yet. */
+static const char *
+_notmuch_message_get_indexed_header (notmuch_message_t *message,
+				     const char *header)
+{
+    unsigned int i;
+
+    if (! message->notmuch->headers_indexed)
+	return NULL;
+
+    for (i = 0; i < ARRAY_SIZE (INDEXED_HEADERS); i++) {
+	if (strcasecmp (header, INDEXED_HEADERS[i].name) == 0)
+	    break;
+    }
+
+    if (i == ARRAY_SIZE (INDEXED_HEADERS))
+	return NULL;
+
+    if (message->indexed_headers[i] == NULL) {
+	try {
+	    std::string value;
+
+	    value = message->doc.get_value (INDEXED_HEADERS[i].slot);
+	    message->indexed_headers[i] = talloc_strdup (message,
+							 value.c_str ());
+	} catch (const Xapian::Error &error) {
+	    fprintf (stderr, "A Xapian exception occurred reading a header value: %s\n",
+		     error.get_msg().c_str());
+	    message->notmuch->exception_reported = TRUE;
+	    return NULL;
+	}
+    }
+
+    return message->indexed_headers[i];
+}
+
 const char *
 notmuch_message_get_header (notmuch_message_t *message, const char *header)
 {
+    const char *value;
+
+    /* The most commonly requested headers don't require the file. */
+    value = _notmuch_message_get_indexed_header (message, header);
+    if (value)
+	return value;
+
     _notmuch_message_ensure_message_file (message);
     if (message->message_file == NULL)
 	return NULL;
@@ -337,6 +430,17 @@ notmuch_message_get_thread_id (notmuch_message_t *message)
     if (message->thread_id)
 	return message->thread_id;
 
+    /* The value is much cheaper to read than the term, but documents
+     * indexed before database version 2 only have the term. */
+    id = message->doc.get_value (NOTMUCH_VALUE_THREAD_ID);
+    if (! id.empty ()) {
+	message->thread_id =
+	    talloc_strdup (message,
+			   _notmuch_database_canonical_thread_id (message->notmuch,
+								  id.c_str ()));
+	return message->thread_id;
+    }
+
     i = message->doc.termlist_begin ();
     i.skip_to (prefix);
 
@@ -347,7 +451,10 @@ notmuch_message_get_thread_id (notmuch_message_t *message)
 	INTERNAL_ERROR ("Message with document ID of %d has no thread ID.\n",
 			message->doc_id);
 
-    message->thread_id = talloc_strdup (message, id.c_str () + 1);
+    message->thread_id =
+	talloc_strdup (message,
+		       _notmuch_database_canonical_thread_id (message->notmuch,
+							      id.c_str () + 1));
 
 #if DEBUG_DATABASE_SANITY
     i++;
@@ -420,7 +527,9 @@ _notmuch_message_talloc_copy_data (notmuch_message_t *message)
 void
 _notmuch_message_clear_data (notmuch_message_t *message)
 {
+    _notmuch_message_prepare_change (message);
     message->doc.set_data ("");
+    message->modified = TRUE;
 }
 
 const char *
@@ -564,8 +673,42 @@ _notmuch_message_set_date (notmuch_message_t *message,
     else
 	time_value = g_mime_utils_header_decode_date (date, NULL);
 
+    _notmuch_message_prepare_change (message);
     message->doc.add_value (NOTMUCH_VALUE_TIMESTAMP,
 			    Xapian::sortable_serialise (time_value));
+    message->modified = TRUE;
+}
+
+/* Store the (decoded) values of the From, Subject, To and Date
+ * headers of 'message' for notmuch_message_get_header. Any of these
+ * may be NULL for a missing header. */
+void
+_notmuch_message_set_header_values (notmuch_message_t *message,
+				    const char *from,
+				    const char *subject,
+				    const char *to,
+				    const char *date)
+{
+    const char *values[ARRAY_SIZE (INDEXED_HEADERS)];
+    unsigned int i;
+
+    values[0] = from;
+    values[1] = subject;
+    values[2] = to;
+    values[3] = date;
+
+    _notmuch_message_prepare_change (message);
+
+    for (i = 0; i < ARRAY_SIZE (INDEXED_HEADERS); i++) {
+	if (values[i] && *values[i])
+	    message->doc.add_value (INDEXED_HEADERS[i].slot, values[i]);
+	else
+	    message->doc.remove_value (INDEXED_HEADERS[i].slot);
+	message->modified = TRUE;
+
+	talloc_free (message->indexed_headers[i]);
+	message->indexed_headers[i] = NULL;
+    }
 }
 
 /* Synchronize changes made to message->doc out into the database. */
@@ -578,7 +721,19 @@ _notmuch_message_sync (notmuch_message_t *message)
 	return;
 
     db = static_cast <Xapian::WritableDatabase *> (message->notmuch->xapian_db);
+
+    /* An unchanged document contributes as it did. */
+    if (message->modified) {
+	_notmuch_thread_summary_update (message->notmuch, message->doc_id,
+					message->stored_contribution,
+					&message->doc);
+    }
     db->replace_document (message->doc_id, message->doc);
+    _notmuch_database_modified (message->notmuch);
+
+    talloc_free (message->stored_contribution);
+    message->stored_contribution = NULL;
+    message->modified = FALSE;
 }
 
 /* Ensure that 'message' is not holding any file object open. Future
@@ -618,13 +773,51 @@ _notmuch_message_add_term (notmuch_message_t *message,
     if (strlen (term) > NOTMUCH_TERM_MAX)
 	return NOTMUCH_PRIVATE_STATUS_TERM_TOO_LONG;
 
+    _notmuch_message_prepare_change (message);
     message->doc.add_term (term, 0);
+    message->modified = TRUE;
 
     talloc_free (term);
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
 
+/* Set the thread ID of 'message', (as both its "thread" term and its
+ * THREAD_ID value), in place of any thread ID previously set with
+ * this function.
+ *
+ * This change will not be reflected in the database until the next
+ * call to _notmuch_message_sync. */
+notmuch_private_status_t
+_notmuch_message_set_thread_id (notmuch_message_t *message,
+				const char *thread_id)
+{
+    notmuch_private_status_t status;
+    std::string old_thread_id;
+
+    if (thread_id == NULL)
+	return NOTMUCH_PRIVATE_STATUS_NULL_POINTER;
+
+    old_thread_id = message->doc.get_value (NOTMUCH_VALUE_THREAD_ID);
+    if (! old_thread_id.empty ())
+	_notmuch_message_remove_term (message, "thread",
+				      old_thread_id.c_str ());
+
+    status = _notmuch_message_add_term (message, "thread", thread_id);
+    if (status)
+	return status;
+
+    _notmuch_message_prepare_change (message);
+    message->doc.add_value (NOTMUCH_VALUE_THREAD_ID, thread_id);
+    message->modified = TRUE;
+
+    /* Any previous thread ID string is left in place, (rather than
+     * freed), since the caller may still be using it. */
+    message->thread_id = talloc_strdup (message, thread_id);
+
+    return NOTMUCH_PRIVATE_STATUS_SUCCESS;
+}
+
 /* Parse 'text' and add a term to 'message' for each parsed word. Each
  * term will be added both prefixed (if prefix_name is not NULL) and
  * also unprefixed). */
@@ -633,11 +826,12 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
 			    const char *text)
 {
-    Xapian::TermGenerator *term_gen = message->notmuch->term_gen;
+    Xapian::TermGenerator *term_gen = message->term_gen;
 
     if (text == NULL)
 	return NOTMUCH_PRIVATE_STATUS_NULL_POINTER;
 
+    _notmuch_message_prepare_change (message);
     term_gen->set_document (message->doc);
 
     if (prefix_name) {
@@ -647,6 +841,7 @@ _notmuch_message_gen_terms (notmuch_message_t *message,
     }
 
     term_gen->index_text (text);
+    message->modified = TRUE;
 
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
@@ -674,8 +869,11 @@ _notmuch_message_remove_term (notmuch_message_t *message,
     if (strlen (term) > NOTMUCH_TERM_MAX)
 	return NOTMUCH_PRIVATE_STATUS_TERM_TOO_LONG;
 
+    _notmuch_message_prepare_change (message);
+
     try {
 	message->doc.remove_term (term);
+	message->modified = TRUE;
     } catch (const Xapian::InvalidArgumentError) {
 	/* We'll let the philosopher's try to wrestle with the
 	 * question of whether failing to remove that which was not
@@ -688,6 +886,32 @@ _notmuch_message_remove_term (notmuch_message_t *message,
     return NOTMUCH_PRIVATE_STATUS_SUCCESS;
 }
 
+/* Whether 'message' has the name:value term, (encoded as by
+ * _notmuch_message_add_term).
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_bool_t
+_notmuch_message_has_term (notmuch_message_t *message,
+			   const char *prefix_name,
+			   const char *value)
+{
+    Xapian::TermIterator i;
+    notmuch_bool_t found;
+    char *term;
+
+    term = talloc_asprintf (message, "%s%s",
+			    _find_prefix (prefix_name), value);
+
+    i = message->doc.termlist_begin ();
+    i.skip_to (term);
+    found = (i != message->doc.termlist_end () && *i == term);
+
+    talloc_free (term);
+
+    return found;
+}
+
 notmuch_status_t
 notmuch_message_add_tag (notmuch_message_t *message, const char *tag)
 {
@@ -704,6 +928,11 @@ notmuch_message_add_tag (notmuch_message_t *message, const char *tag)
     if (strlen (tag) > NOTMUCH_TAG_MAX)
 	return NOTMUCH_STATUS_TAG_TOO_LONG;
 
+    /* Adding a tag the message already has changes nothing, so
+     * there's no document to rewrite. */
+    if (_notmuch_message_has_term (message, "tag", tag))
+	return NOTMUCH_STATUS_SUCCESS;
+
     private_status = _notmuch_message_add_term (message, "tag", tag);
     if (private_status) {
 	INTERNAL_ERROR ("_notmuch_message_add_term return unexpected value: %d\n",
@@ -732,6 +961,9 @@ notmuch_message_remove_tag (notmuch_message_t *message, const char *tag)
     if (strlen (tag) > NOTMUCH_TAG_MAX)
 	return NOTMUCH_STATUS_TAG_TOO_LONG;
 
+    if (! _notmuch_message_has_term (message, "tag", tag))
+	return NOTMUCH_STATUS_SUCCESS;
+
     private_status = _notmuch_message_remove_term (message, "tag", tag);
     if (private_status) {
 	INTERNAL_ERROR ("_notmuch_message_remove_term return unexpected value: %d\n",
@@ -769,7 +1001,7 @@ notmuch_message_remove_all_tags (notmuch_message_t *message)
 	}
     }
 
-    if (! message->frozen)
+    if (! message->frozen && message->modified)
 	_notmuch_message_sync (message);
 
     return NOTMUCH_STATUS_SUCCESS;
@@ -800,7 +1032,7 @@ notmuch_message_thaw (notmuch_message_t *message)
 
     if (message->frozen > 0) {
 	message->frozen--;
-	if (message->frozen == 0)
+	if (message->frozen == 0 && message->modified)
 	    _notmuch_message_sync (message);
 	return NOTMUCH_STATUS_SUCCESS;
     } else {
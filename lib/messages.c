@@ -137,6 +137,15 @@ notmuch_messages_move_to_next (notmuch_messages_t *messages)
     messages->iterator = messages->iterator->next;
 }
 
+const char *
+notmuch_messages_get_cursor (notmuch_messages_t *messages)
+{
+    if (messages == NULL || messages->is_of_list_type)
+	return NULL;
+
+    return _notmuch_mset_messages_get_cursor (messages);
+}
+
 void
 notmuch_messages_destroy (notmuch_messages_t *messages)
 {
@@ -46,6 +46,8 @@ NOTMUCH_BEGIN_DECLS
 
 #include <talloc.h>
 
+#include <glib.h> /* GByteArray */
+
 #include "xutil.h"
 
 #ifdef DEBUG
@@ -55,6 +57,8 @@ NOTMUCH_BEGIN_DECLS
 
 #define COMPILE_TIME_ASSERT(pred) ((void)sizeof(char[1 - 2*!(pred)]))
 
+#define ARRAY_SIZE(arr) (sizeof (arr) / sizeof (arr[0]))
+
 /* There's no point in continuing when we've detected that we've done
  * something wrong internally (as opposed to the user passing in a
  * bogus value).
@@ -100,7 +104,15 @@ _internal_error (const char *format, ...) PRINTF_ATTRIBUTE (1, 2);
 
 typedef enum {
     NOTMUCH_VALUE_TIMESTAMP = 0,
-    NOTMUCH_VALUE_MESSAGE_ID
+    NOTMUCH_VALUE_MESSAGE_ID,
+    NOTMUCH_VALUE_THREAD_ID,
+    NOTMUCH_VALUE_FROM,
+    NOTMUCH_VALUE_SUBJECT,
+    NOTMUCH_VALUE_TO,
+    NOTMUCH_VALUE_DATE,
+
+    /* Of directory documents, (see notmuch_directory_set_times). */
+    NOTMUCH_VALUE_DIRECTORY_TIMES
 } notmuch_value_t;
 
 /* Xapian (with flint backend) complains if we provide a term longer
@@ -199,15 +211,6 @@ _notmuch_directory_create (notmuch_database_t *notmuch,
 unsigned int
 _notmuch_directory_get_document_id (notmuch_directory_t *directory);
 
-/* thread.cc */
-
-notmuch_thread_t *
-_notmuch_thread_create (void *ctx,
-			notmuch_database_t *notmuch,
-			const char *thread_id,
-			const char *query_string,
-			notmuch_sort_t sort);
-
 /* message.cc */
 
 notmuch_message_t *
@@ -216,11 +219,6 @@ _notmuch_message_create (const void *talloc_owner,
 			 unsigned int doc_id,
 			 notmuch_private_status_t *status);
 
-notmuch_message_t *
-_notmuch_message_create_for_message_id (notmuch_database_t *notmuch,
-					const char *message_id,
-					notmuch_private_status_t *status);
-
 const char *
 _notmuch_message_get_in_reply_to (notmuch_message_t *message);
 
@@ -234,6 +232,10 @@ _notmuch_message_remove_term (notmuch_message_t *message,
 			      const char *prefix_name,
 			      const char *value);
 
+notmuch_private_status_t
+_notmuch_message_set_thread_id (notmuch_message_t *message,
+				const char *thread_id);
+
 notmuch_private_status_t
 _notmuch_message_gen_terms (notmuch_message_t *message,
 			    const char *prefix_name,
@@ -253,6 +255,13 @@ void
 _notmuch_message_set_date (notmuch_message_t *message,
 			   const char *date);
 
+void
+_notmuch_message_set_header_values (notmuch_message_t *message,
+				    const char *from,
+				    const char *subject,
+				    const char *to,
+				    const char *date);
+
 void
 _notmuch_message_sync (notmuch_message_t *message);
 
@@ -287,9 +296,27 @@ notmuch_message_get_author (notmuch_message_t *message);
 
 /* index.cc */
 
+/* Initialize GMime, and register the types used for indexing. This
+ * is done by _notmuch_mime_parser_create as needed, but must be done
+ * before indexing in more than one thread of execution at once. */
+void
+_notmuch_index_init (void);
+
+/* A GMime parser and stream, reused for indexing one message after
+ * another, (but only from one thread of execution at a time). */
+typedef struct _notmuch_mime_parser notmuch_mime_parser_t;
+
+notmuch_mime_parser_t *
+_notmuch_mime_parser_create (const void *ctx);
+
+typedef struct _notmuch_message_file notmuch_message_file_t;
+
+/* Index the body of 'message_file', (which must have been read with
+ * _notmuch_message_file_read), into 'message' using 'parser'. */
 notmuch_status_t
 _notmuch_message_index_file (notmuch_message_t *message,
-			     const char *filename);
+			     notmuch_mime_parser_t *parser,
+			     notmuch_message_file_t *message_file);
 
 /* message-file.c */
 
@@ -297,8 +324,6 @@ _notmuch_message_index_file (notmuch_message_t *message,
  * into the public interface in notmuch.h
  */
 
-typedef struct _notmuch_message_file notmuch_message_file_t;
-
 /* Open a file containing a single email message.
  *
  * The caller should call notmuch_message_close when done with this.
@@ -312,6 +337,35 @@ notmuch_message_file_open (const char *filename);
 notmuch_message_file_t *
 _notmuch_message_file_open_ctx (void *ctx, const char *filename);
 
+/* Like _notmuch_message_file_open_ctx, but reading the entire file
+ * into memory rather than mapping it, so that its contents can be
+ * handed to GMime for indexing, (see _notmuch_message_file_get_data). */
+notmuch_message_file_t *
+_notmuch_message_file_read (void *ctx, const char *filename);
+
+/* Like _notmuch_message_file_read, but reading the contents of the
+ * message from 'fd', (from its current offset to its end), rather
+ * than from a file. */
+notmuch_message_file_t *
+_notmuch_message_file_read_fd (void *ctx, int fd);
+
+/* Like _notmuch_message_file_read, but with a copy of the 'length'
+ * bytes at 'buffer' as the contents of the message. */
+notmuch_message_file_t *
+_notmuch_message_file_read_buffer (void *ctx,
+				   const char *buffer,
+				   size_t length);
+
+/* Return the complete contents of a message file read with
+ * _notmuch_message_file_read, (or NULL for a file whose contents
+ * were mapped into memory instead).
+ *
+ * The returned array is owned by 'message' and is valid only until
+ * the message is closed.
+ */
+GByteArray *
+_notmuch_message_file_get_data (notmuch_message_file_t *message);
+
 /* Close a notmuch message previously opened with notmuch_message_open. */
 void
 notmuch_message_file_close (notmuch_message_file_t *message);
@@ -404,6 +458,32 @@ _notmuch_mset_messages_get (notmuch_messages_t *messages);
 void
 _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages);
 
+const char *
+_notmuch_mset_messages_get_cursor (notmuch_messages_t *messages);
+
+/* thread.cc */
+
+typedef struct _notmuch_thread_summary notmuch_thread_summary_t;
+
+/* What a single mail document contributes to its thread's summary,
+ * (see thread-summary.cc). */
+typedef struct _notmuch_thread_contribution notmuch_thread_contribution_t;
+
+notmuch_thread_t *
+_notmuch_thread_create (void *ctx,
+			notmuch_database_t *notmuch,
+			const char *thread_id,
+			notmuch_message_list_t *members,
+			notmuch_thread_summary_t *summary,
+			const char *query_string,
+			notmuch_sort_t sort);
+
+/* Return the author of a message with the given From header, (as
+ * shown by notmuch_thread_get_authors), talloced from 'ctx', or NULL
+ * if no author can be found. */
+char *
+_notmuch_thread_author_from_header (void *ctx, const char *from);
+
 /* message.cc */
 
 void
@@ -415,6 +495,9 @@ _notmuch_message_add_reply (notmuch_message_t *message,
 char *
 notmuch_sha1_of_string (const char *str);
 
+char *
+notmuch_sha1_of_buffer (const void *data, size_t length);
+
 char *
 notmuch_sha1_of_file (const char *filename);
 
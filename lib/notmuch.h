@@ -32,6 +32,7 @@
 NOTMUCH_BEGIN_DECLS
 
 #include <time.h>
+#include <stdint.h>
 
 #ifndef FALSE
 #define FALSE 0
@@ -81,6 +82,14 @@ typedef int notmuch_bool_t;
  * NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW: The notmuch_message_thaw
  *	function has been called more times than notmuch_message_freeze.
  *
+ * NOTMUCH_STATUS_ILLEGAL_ARGUMENT: An argument passed to a notmuch
+ *	function was not of an acceptable form, (for example, a
+ *	malformed cursor string).
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The notmuch_database_end_atomic
+ *	function has been called more times than
+ *	notmuch_database_begin_atomic.
+ *
  * And finally:
  *
  * NOTMUCH_STATUS_LAST_STATUS: Not an actual status value. Just a way
@@ -97,6 +106,8 @@ typedef enum _notmuch_status {
     NOTMUCH_STATUS_NULL_POINTER,
     NOTMUCH_STATUS_TAG_TOO_LONG,
     NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW,
+    NOTMUCH_STATUS_ILLEGAL_ARGUMENT,
+    NOTMUCH_STATUS_UNBALANCED_ATOMIC,
 
     NOTMUCH_STATUS_LAST_STATUS
 } notmuch_status_t;
@@ -118,7 +129,10 @@ typedef struct _notmuch_messages notmuch_messages_t;
 typedef struct _notmuch_message notmuch_message_t;
 typedef struct _notmuch_tags notmuch_tags_t;
 typedef struct _notmuch_directory notmuch_directory_t;
+typedef struct _notmuch_manifest notmuch_manifest_t;
 typedef struct _notmuch_filenames notmuch_filenames_t;
+typedef struct _notmuch_indexer notmuch_indexer_t;
+typedef struct _notmuch_indexed_message notmuch_indexed_message_t;
 
 /* Create a new, empty notmuch database located at 'path'.
  *
@@ -214,6 +228,54 @@ notmuch_database_upgrade (notmuch_database_t *database,
 						   double progress),
 			  void *closure);
 
+/* Begin an atomic database operation.
+ *
+ * Any modifications performed between a successful begin and a
+ * notmuch_database_end_atomic will be applied to the database
+ * atomically, and written to disk when the outermost atomic
+ * operation ends. Neither begin nor end blocks readers of the
+ * database, which see none of the modifications until the end.
+ *
+ * Calls may be nested, in which case only the outermost pair takes
+ * effect. A database closed during an atomic operation discards the
+ * modifications made since it began, and notmuch_database_upgrade
+ * must not be called during one.
+ *
+ * When messages added during an atomic operation join two threads
+ * together, the messages of one of them are only moved to the other
+ * when the operation ends. Until then, notmuch_message_get_thread_id
+ * already returns the joined thread, but searches of this database
+ * object may still show the two threads separately.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Successfully entered atomic section.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	atomic section not entered.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database is read-only.
+ */
+notmuch_status_t
+notmuch_database_begin_atomic (notmuch_database_t *notmuch);
+
+/* Indicate the end of an atomic database operation.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Atomic section ended successfully.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred;
+ *	atomic section not ended, (and its modifications discarded).
+ *
+ * NOTMUCH_STATUS_UNBALANCED_ATOMIC: The database is not currently in
+ *	an atomic section.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database is read-only.
+ */
+notmuch_status_t
+notmuch_database_end_atomic (notmuch_database_t *notmuch);
+
 /* Retrieve a directory object from the database for 'path'.
  *
  * Here, 'path' should be a path relative to the path of 'database'
@@ -272,6 +334,178 @@ notmuch_database_add_message (notmuch_database_t *database,
 			      const char *folder_name,
 			      notmuch_message_t **message);
 
+/* Add a new message to the given notmuch database with the tags in
+ * 'tags', (a NULL-terminated array, or NULL for no tags).
+ *
+ * This is just like notmuch_database_add_message followed by
+ * notmuch_message_add_tag for each tag, except that the message is
+ * written to the database only once, already with all of its tags.
+ * The tags are only applied if the message is new, (not if
+ * NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID is returned).
+ *
+ * The return values are those of notmuch_database_add_message, and:
+ *
+ * NOTMUCH_STATUS_TAG_TOO_LONG: One of the tags is too long, (exceeds
+ *	NOTMUCH_TAG_MAX). Nothing added to the database.
+ */
+notmuch_status_t
+notmuch_database_add_message_with_tags (notmuch_database_t *database,
+					const char *filename,
+					const char *folder_name,
+					const char **tags,
+					notmuch_message_t **message);
+
+/* Add a new message to the given notmuch database, (just as
+ * notmuch_database_add_message_with_tags would), but with the
+ * 'length' bytes at 'buffer' as its contents rather than reading
+ * them from 'filename'.
+ *
+ * 'filename' must still name a file in the mail store with just
+ * those contents, (such as one just delivered from 'buffer'), since
+ * that's what the database refers to. The buffer is copied, and
+ * needn't outlive the call.
+ *
+ * The return values are those of
+ * notmuch_database_add_message_with_tags, (other than
+ * NOTMUCH_STATUS_FILE_ERROR, since no file is read).
+ */
+notmuch_status_t
+notmuch_database_add_message_from_buffer (notmuch_database_t *database,
+					  const char *filename,
+					  const char *folder_name,
+					  const char *buffer,
+					  size_t length,
+					  const char **tags,
+					  notmuch_message_t **message);
+
+/* Just like notmuch_database_add_message_from_buffer, but reading the
+ * contents of the message from 'fd', (from its current offset to its
+ * end, so it may be a pipe). 'fd' is left open.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR is returned if 'fd' can't be read.
+ */
+notmuch_status_t
+notmuch_database_add_message_from_fd (notmuch_database_t *database,
+				      const char *filename,
+				      const char *folder_name,
+				      int fd,
+				      const char **tags,
+				      notmuch_message_t **message);
+
+/* Create an indexer, for reading and indexing messages to be added to
+ * 'database' without otherwise accessing the database.
+ *
+ * Adding a message with notmuch_database_add_message amounts to
+ * indexing the message, (which is the bulk of the work), and then
+ * adding it to the database with
+ * notmuch_database_add_indexed_message. With an indexer for each of
+ * several threads of execution, many messages can be indexed at once
+ * while a single thread adds them to the database.
+ *
+ * An indexer must only be used by one thread of execution at a time,
+ * but need not be used by the thread which created it.
+ *
+ * The caller should call notmuch_indexer_destroy when finished with
+ * the indexer, (and before closing 'database').
+ *
+ * Returns NULL if out of memory.
+ */
+notmuch_indexer_t *
+notmuch_indexer_create (notmuch_database_t *database);
+
+/* Read and index the message in 'filename', (see
+ * notmuch_database_add_message for 'filename' and 'folder_name').
+ *
+ * On success, '*indexed' is set to an object which can be passed to
+ * notmuch_database_add_indexed_message, (in any thread of execution),
+ * and which the caller should then destroy with
+ * notmuch_indexed_message_destroy. On any failure '*indexed' is set
+ * to NULL.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Message successfully indexed.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: an error occurred trying to open the
+ *	file, (such as permission denied, or file not found, etc.).
+ *
+ * NOTMUCH_STATUS_FILE_NOT_EMAIL: the contents of filename don't look
+ *	like an email message.
+ */
+notmuch_status_t
+notmuch_indexer_index_file (notmuch_indexer_t *indexer,
+			    const char *filename,
+			    const char *folder_name,
+			    notmuch_indexed_message_t **indexed);
+
+/* Destroy an indexer, (see notmuch_indexer_create). */
+void
+notmuch_indexer_destroy (notmuch_indexer_t *indexer);
+
+/* Add a message indexed with notmuch_indexer_index_file to the given
+ * notmuch database, (which must be the database for which the
+ * indexer was created).
+ *
+ * Messages are linked into threads as they are added, so adding
+ * messages in the order in which they were indexed gives just the
+ * same results as notmuch_database_add_message_with_tags would, (with
+ * the same 'tags', which may be NULL).
+ *
+ * 'indexed' must still be destroyed by the caller afterwards.
+ *
+ * If 'message' is not NULL, it is set just as by
+ * notmuch_database_add_message_with_tags, as is the return value,
+ * (other than NOTMUCH_STATUS_FILE_ERROR and
+ * NOTMUCH_STATUS_FILE_NOT_EMAIL, which were already returned by
+ * notmuch_indexer_index_file).
+ *
+ * NOTMUCH_STATUS_ILLEGAL_ARGUMENT is returned if the indexer was
+ * created for another database.
+ */
+notmuch_status_t
+notmuch_database_add_indexed_message (notmuch_database_t *database,
+				      notmuch_indexed_message_t *indexed,
+				      const char **tags,
+				      notmuch_message_t **message);
+
+/* Destroy an indexed message, (see notmuch_indexer_index_file). */
+void
+notmuch_indexed_message_destroy (notmuch_indexed_message_t *indexed);
+
+/* Add 'filename' as another file of the message in the given
+ * notmuch database which already has the file 'existing', (both
+ * named as for notmuch_database_add_message), without reading
+ * either file.
+ *
+ * This is for a file known to have the same contents as 'existing',
+ * such as when 'existing' has just been renamed to 'filename', in
+ * which case 'existing' should then be removed with
+ * notmuch_database_remove_message. It's just like
+ * notmuch_database_add_message returning
+ * NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID, but much cheaper.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The filename was added to the message, (or
+ *	was already one of its files).
+ *
+ * NOTMUCH_STATUS_FILE_ERROR: No message in the database has the file
+ *	'existing'. Nothing changed.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so no filename can be added.
+ */
+notmuch_status_t
+notmuch_database_add_message_filename (notmuch_database_t *database,
+				       const char *existing,
+				       const char *filename);
+
 /* Remove a message from the given notmuch database.
  *
  * Note that only this particular filename association is removed from
@@ -366,6 +600,50 @@ typedef enum {
 void
 notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort);
 
+/* Skip the first 'offset' results of this query.
+ *
+ * For notmuch_query_search_messages the offset counts messages,
+ * while for notmuch_query_search_threads it counts threads. The
+ * offset does not affect notmuch_query_count_messages.
+ *
+ * The default offset is 0.
+ */
+void
+notmuch_query_set_offset (notmuch_query_t *query, unsigned int offset);
+
+/* Return no more than 'limit' results from this query, (counting
+ * messages or threads as described for notmuch_query_set_offset).
+ *
+ * With a limit, results are retrieved from the database only as far
+ * as needed, so asking for the first screenful of a large result set
+ * is much cheaper than asking for all of it.
+ *
+ * A limit of 0, (the default), means no limit.
+ */
+void
+notmuch_query_set_limit (notmuch_query_t *query, unsigned int limit);
+
+/* Make notmuch_query_search_messages resume after the position
+ * identified by 'cursor', (as previously returned by
+ * notmuch_messages_get_cursor for a query with the same sort).
+ *
+ * Unlike an offset, a cursor stays correct when messages are added
+ * to or removed from the database between successive pages, and it
+ * costs no more to resume deep into a result set than near its
+ * start. Any offset is applied after the cursor position.
+ *
+ * A cursor has no effect on queries sorted NOTMUCH_SORT_UNSORTED, nor
+ * on notmuch_query_search_threads. Passing NULL clears the cursor.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: The cursor was set.
+ *
+ * NOTMUCH_STATUS_ILLEGAL_ARGUMENT: 'cursor' is not a valid cursor.
+ */
+notmuch_status_t
+notmuch_query_set_cursor (notmuch_query_t *query, const char *cursor);
+
 /* Execute a query for threads, returning a notmuch_threads_t object
  * which can be used to iterate over the results. The returned threads
  * object is owned by the query and as such, will only be valid until
@@ -405,6 +683,42 @@ notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort);
 notmuch_threads_t *
 notmuch_query_search_threads (notmuch_query_t *query);
 
+/* Construct the thread with ID 'thread_id' exactly as it would appear
+ * in the results of notmuch_query_search_threads for 'query', (with
+ * the query determining which messages of the thread are matched).
+ *
+ * Together with notmuch_threads_get_thread_id, this allows threads to
+ * be constructed in parallel: Each thread of execution opens its own
+ * notmuch_database_t for the same database, (a database object and
+ * everything derived from it must only be used by one thread of
+ * execution at a time), and creates its own query from the same
+ * query string and sort.
+ *
+ * The returned thread belongs to 'query'. Returns NULL if no message
+ * of the thread matches the query, or if an out-of-memory situation
+ * or Xapian exception occurs.
+ */
+notmuch_thread_t *
+notmuch_query_get_thread (notmuch_query_t *query,
+			  const char *thread_id);
+
+/* Construct the threads with the 'count' (distinct) IDs 'thread_ids'
+ * as by notmuch_query_get_thread, storing each in the corresponding
+ * element of 'threads', (or NULL if no message of the thread matches
+ * the query, or on error).
+ *
+ * The matching messages of all of the threads are fetched with a
+ * single search, so this is much cheaper than calling
+ * notmuch_query_get_thread for each thread.
+ *
+ * The returned threads belong to 'query'.
+ */
+void
+notmuch_query_get_threads (notmuch_query_t *query,
+			   const char **thread_ids,
+			   unsigned int count,
+			   notmuch_thread_t **threads);
+
 /* Execute a query for messages, returning a notmuch_messages_t object
  * which can be used to iterate over the results. The returned
  * messages object is owned by the query and as such, will only be
@@ -483,6 +797,15 @@ notmuch_threads_valid (notmuch_threads_t *threads);
 notmuch_thread_t *
 notmuch_threads_get (notmuch_threads_t *threads);
 
+/* Get the ID of the current thread of 'threads', without constructing
+ * the thread, (which is much cheaper than notmuch_threads_get).
+ *
+ * The returned string belongs to 'threads'. Returns NULL when
+ * notmuch_threads_valid would return FALSE.
+ */
+const char *
+notmuch_threads_get_thread_id (notmuch_threads_t *threads);
+
 /* Move the 'threads' iterator to the next thread.
  *
  * If 'threads' is already pointing at the last thread then the
@@ -505,17 +828,84 @@ notmuch_threads_move_to_next (notmuch_threads_t *threads);
 void
 notmuch_threads_destroy (notmuch_threads_t *threads);
 
-/* Return an estimate of the number of messages matching a search
+/* Return the number of messages matching a search.
  *
- * This function performs a search and returns Xapian's best
- * guess as to number of matching messages.
+ * This function counts the matching messages without retrieving or
+ * sorting them. Queries consisting of a single term, (such as
+ * "tag:inbox"), or matching all messages are answered directly from
+ * statistics stored in the database.
  *
  * If a Xapian exception occurs, this function may return 0 (after
  * printing a message).
  */
 unsigned
 notmuch_query_count_messages (notmuch_query_t *query);
- 
+
+/* Return an estimate of the number of messages matching a search.
+ *
+ * This is like notmuch_query_count_messages, but for queries of more
+ * than a single term it returns Xapian's best guess from database
+ * statistics rather than counting each match. This is much faster
+ * for large result sets, (useful for displaying rough counts), but
+ * the result may be inexact.
+ *
+ * If a Xapian exception occurs, this function may return 0 (after
+ * printing a message).
+ */
+unsigned
+notmuch_query_count_messages_approximate (notmuch_query_t *query);
+
+/* Return the number of distinct threads with messages matching a
+ * search.
+ *
+ * This is the number of threads notmuch_query_search_threads would
+ * return, (ignoring any offset and limit), but is computed without
+ * constructing any thread objects.
+ *
+ * If a Xapian exception occurs, this function may return 0 (after
+ * printing a message).
+ */
+unsigned
+notmuch_query_count_threads (notmuch_query_t *query);
+
+/* Remove each tag of 'remove_tags' from, and then add each tag of
+ * 'add_tags' to, every message matching 'query', (either array may be
+ * NULL, and otherwise is terminated by a NULL tag).
+ *
+ * Only the messages these changes would actually change are visited:
+ * the query is restricted to messages lacking one of the tags to add
+ * or having one of the tags to remove, (but not to add). So applying
+ * the same changes a second time costs little more than a search.
+ *
+ * Each message is left with either all or none of the changes, and
+ * the changes are made in atomic operations, (see
+ * notmuch_database_begin_atomic), of a bounded number of messages
+ * each, so an interruption loses at most one batch of work.
+ *
+ * Unless 'changed' is NULL, the number of messages changed is stored
+ * in *changed, (even on failure).
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: All matching messages changed.
+ *
+ * NOTMUCH_STATUS_NULL_POINTER: 'query' is NULL.
+ *
+ * NOTMUCH_STATUS_TAG_TOO_LONG: A tag exceeds NOTMUCH_TAG_MAX, (and no
+ *	message was changed).
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so messages cannot be modified.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception occurred, (and
+ *	only some of the messages may have been changed).
+ */
+notmuch_status_t
+notmuch_query_change_tags (notmuch_query_t *query,
+			   const char **add_tags,
+			   const char **remove_tags,
+			   unsigned int *changed);
+
 /* Get the thread ID of 'thread'.
  *
  * The returned string belongs to 'thread' and as such, should not be
@@ -678,6 +1068,24 @@ notmuch_messages_get (notmuch_messages_t *messages);
 void
 notmuch_messages_move_to_next (notmuch_messages_t *messages);
 
+/* Get an opaque cursor identifying the position of the current
+ * message of 'messages' within its query's results.
+ *
+ * Passing this string to notmuch_query_set_cursor for a later query
+ * (with the same query string and sort) makes that query's results
+ * start just after this message. This allows for paging through a
+ * large result set one window at a time.
+ *
+ * The returned string belongs to 'messages' and will only be valid
+ * for as long as 'messages' is valid.
+ *
+ * Returns NULL if 'messages' is not pointing at a valid message, if
+ * its results are unsorted, or if 'messages' did not come from
+ * notmuch_query_search_messages.
+ */
+const char *
+notmuch_messages_get_cursor (notmuch_messages_t *messages);
+
 /* Destroy a notmuch_messages_t object.
  *
  * It's not strictly necessary to call this function. All memory from
@@ -842,6 +1250,8 @@ notmuch_message_get_tags (notmuch_message_t *message);
 #define NOTMUCH_TAG_MAX 200
 
 /* Add a tag to the given message.
+ *
+ * Adding a tag the message already has leaves the database untouched.
  *
  * Return value:
  *
@@ -859,6 +1269,9 @@ notmuch_status_t
 notmuch_message_add_tag (notmuch_message_t *message, const char *tag);
 
 /* Remove a tag from the given message.
+ *
+ * Removing a tag the message doesn't have leaves the database
+ * untouched.
  *
  * Return value:
  *
@@ -931,6 +1344,7 @@ notmuch_message_freeze (notmuch_message_t *message);
 
 /* Thaw the current 'message', synchronizing any changes that may have
  * occurred while 'message' was frozen into the notmuch database.
+ * (If nothing changed, the database is left untouched.)
  *
  * See notmuch_message_freeze for an example of how to use this
  * function to safely provide tag changes.
@@ -1034,6 +1448,10 @@ notmuch_tags_destroy (notmuch_tags_t *tags);
  * timestamp. So don't store a timestamp of 0 unless you are
  * comfortable with that.
  *
+ * This discards any times stored with notmuch_directory_set_times and
+ * any manifest stored with notmuch_directory_set_manifest, (which
+ * might no longer match the directory).
+ *
  * Return value:
  *
  * NOTMUCH_STATUS_SUCCESS: mtime successfully stored in database.
@@ -1056,6 +1474,77 @@ notmuch_directory_set_mtime (notmuch_directory_t *directory,
 time_t
 notmuch_directory_get_mtime (notmuch_directory_t *directory);
 
+/* Store the modification and status-change times of 'directory' with
+ * nanosecond precision, (as read from the st_mtim and st_ctim fields
+ * of its stat).
+ *
+ * This also stores the seconds of 'mtime' as the mtime returned by
+ * notmuch_directory_get_mtime. Comparing both times for equality,
+ * (rather than only comparing mtimes to the second), lets a client
+ * notice every change to a directory, even several within a second or
+ * one that sets the mtime back.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Times successfully stored in database.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception
+ *	occurred, times not stored.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so directory times cannot be modified.
+ */
+notmuch_status_t
+notmuch_directory_set_times (notmuch_directory_t *directory,
+			     const struct timespec *mtime,
+			     const struct timespec *ctime);
+
+/* Get the times of a directory, (as previously stored with
+ * notmuch_directory_set_times).
+ *
+ * Returns FALSE, (leaving 'mtime' and 'ctime' unchanged), if no times
+ * have been stored for this directory, or if its mtime has since been
+ * stored with notmuch_directory_set_mtime, (which discards them).
+ */
+notmuch_bool_t
+notmuch_directory_get_times (notmuch_directory_t *directory,
+			     struct timespec *mtime,
+			     struct timespec *ctime);
+
+/* Get the manifest of a directory, (as previously stored with
+ * notmuch_directory_set_manifest), or NULL if none has been stored.
+ *
+ * A manifest lists the entries of a directory, (each by a hash of its
+ * name, its inode number and its size), so that a client can tell
+ * which entries of a changed directory it has seen before without
+ * listing the directory's files in the database.
+ *
+ * The manifest belongs to 'directory', (and is destroyed with it).
+ */
+notmuch_manifest_t *
+notmuch_directory_get_manifest (notmuch_directory_t *directory);
+
+/* Store 'manifest' as the manifest of 'directory', replacing any
+ * previous manifest.
+ *
+ * The manifest of a directory is discarded whenever its mtime is
+ * stored with notmuch_directory_set_mtime, (by a client unaware of
+ * manifests).
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Manifest successfully stored in database.
+ *
+ * NOTMUCH_STATUS_XAPIAN_EXCEPTION: A Xapian exception
+ *	occurred, manifest not stored.
+ *
+ * NOTMUCH_STATUS_READ_ONLY_DATABASE: Database was opened in read-only
+ *	mode so the manifest cannot be modified.
+ */
+notmuch_status_t
+notmuch_directory_set_manifest (notmuch_directory_t *directory,
+				notmuch_manifest_t *manifest);
+
 /* Get a notmuch_filenames_t iterator listing all the filenames of
  * messages in the database within the given directory.
  *
@@ -1064,6 +1553,16 @@ notmuch_directory_get_mtime (notmuch_directory_t *directory);
 notmuch_filenames_t *
 notmuch_directory_get_child_files (notmuch_directory_t *directory);
 
+/* Get a notmuch_filenames_t iterator listing the filenames of
+ * messages in the database within the given directory which begin
+ * with 'prefix', (see notmuch_directory_get_child_files).
+ *
+ * This is much cheaper than listing every file of the directory to
+ * find those few. */
+notmuch_filenames_t *
+notmuch_directory_get_child_files_with_prefix (notmuch_directory_t *directory,
+					       const char *prefix);
+
 /* Get a notmuch_filenams_t iterator listing all the filenames of
  * sub-directories in the database within the given directory.
  *
@@ -1076,6 +1575,61 @@ notmuch_directory_get_child_directories (notmuch_directory_t *directory);
 void
 notmuch_directory_destroy (notmuch_directory_t *directory);
 
+/* Create a new, empty manifest, (to be stored with
+ * notmuch_directory_set_manifest).
+ *
+ * The manifest belongs to 'database' until destroyed with
+ * notmuch_manifest_destroy.
+ *
+ * Returns NULL if out of memory.
+ */
+notmuch_manifest_t *
+notmuch_manifest_create (notmuch_database_t *database);
+
+/* Add the directory entry 'name' to 'manifest'.
+ *
+ * Return value:
+ *
+ * NOTMUCH_STATUS_SUCCESS: Entry added.
+ *
+ * NOTMUCH_STATUS_OUT_OF_MEMORY: Out of memory, entry not added.
+ */
+notmuch_status_t
+notmuch_manifest_add (notmuch_manifest_t *manifest,
+		      const char *name,
+		      uint64_t inode,
+		      uint64_t size);
+
+/* Look up the directory entry 'name' in 'manifest'.
+ *
+ * If found, TRUE is returned and the inode number and size recorded
+ * for it are stored in *inode and *size, (either of which may be
+ * NULL).
+ *
+ * Entries are identified by a hash of their names, so another entry
+ * might be found in place of 'name', (though most unlikely). A client
+ * should check the inode number before assuming that 'name' has been
+ * seen before.
+ */
+notmuch_bool_t
+notmuch_manifest_find (notmuch_manifest_t *manifest,
+		       const char *name,
+		       uint64_t *inode,
+		       uint64_t *size);
+
+/* Return the number of entries in 'manifest'. */
+unsigned int
+notmuch_manifest_count (notmuch_manifest_t *manifest);
+
+/* Destroy a notmuch_manifest_t object.
+ *
+ * It's not necessary to destroy a manifest returned by
+ * notmuch_directory_get_manifest, (it's destroyed with its
+ * directory).
+ */
+void
+notmuch_manifest_destroy (notmuch_manifest_t *manifest);
+
 /* Is the given 'filenames' iterator pointing at a valid filename.
  *
  * When this function returns TRUE, notmuch_filenames_get will return
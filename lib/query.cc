@@ -25,28 +25,141 @@
 
 #include <xapian.h>
 
+#include <set>
+
 struct _notmuch_query {
     notmuch_database_t *notmuch;
     const char *query_string;
     notmuch_sort_t sort;
+    unsigned int offset;
+    unsigned int limit;
+
+    /* Keyset position to resume after, (see notmuch_query_set_cursor),
+     * as the hex-encoded sort value and the document ID. */
+    char *cursor_value;
+    unsigned int cursor_doc_id;
+
+    /* The parsed query string, (or NULL for a query matching all
+     * mail), and the final query over mail documents built from it,
+     * as of database generation 'generation'. These are built on
+     * first use and shared by all searches and counts of the query.
+     */
+    Xapian::Query *string_query;
+    Xapian::Query *final_query;
+    unsigned long generation;
 };
 
 typedef struct _notmuch_mset_messages {
     notmuch_messages_t base;
     notmuch_database_t *notmuch;
+    Xapian::Enquire *enquire;
+
+    /* The value slot results are sorted by, (or -1 if unsorted). */
+    int sort_slot;
+
+    /* Rank of the first result of the next window, the size of that
+     * window, (0 for all remaining results at once), and how many
+     * results may still be fetched if 'limited'. */
+    Xapian::doccount window_first;
+    Xapian::doccount window_size;
+    notmuch_bool_t limited;
+    Xapian::doccount remaining;
+    notmuch_bool_t exhausted;
+
     Xapian::MSetIterator iterator;
     Xapian::MSetIterator iterator_end;
 } notmuch_mset_messages_t;
 
+/* Thread members are fetched for this many threads at a time, (with a
+ * single search for all of their thread terms). */
+#define NOTMUCH_THREADS_FETCH_BATCH 100
+
+typedef struct _notmuch_thread_members {
+    const char *thread_id;
+
+    /* All messages of the thread, oldest-first, (or NULL if not yet
+     * fetched or already handed over to a notmuch_thread_t). When
+     * 'summary' is not NULL, only the messages matching the query
+     * are fetched. */
+    notmuch_message_list_t *messages;
+    notmuch_thread_summary_t *summary;
+
+    /* How many of the fetched messages match the query. */
+    unsigned int matched;
+
+    /* The position of the thread within the results. */
+    unsigned int index;
+
+    /* The document IDs of the messages matching the query, when the
+     * results were read from the result cache, (or else NULL). */
+    const unsigned int *cached_matches;
+    unsigned int num_cached_matches;
+
+    /* Whether the matching messages have been recorded for the
+     * result cache. */
+    notmuch_bool_t recorded;
+} notmuch_thread_members_t;
+
 struct _notmuch_threads {
     notmuch_query_t *query;
-    GHashTable *threads;
-    notmuch_messages_t *messages;
 
-    /* This thread ID is our iterator state. */
-    const char *thread_id;
+    /* The messages matching the query, collapsed to one per thread,
+     * from which threads are discovered as the iterator advances. */
+    notmuch_messages_t *messages;
+    notmuch_bool_t complete;
+
+    /* Threads that will be skipped to honor the query's offset. */
+    unsigned int skip;
+
+    /* Every thread with a message matching the query, in the order
+     * the query first matched each thread. */
+    notmuch_thread_members_t **threads;
+    unsigned int num_threads;
+    unsigned int size;
+
+    /* Thread ID -> notmuch_thread_members_t, for the above, (or NULL
+     * for threads skipped due to the offset). */
+    GHashTable *thread_hash;
+
+    /* Document IDs of the members of fetched threads that match the
+     * query, (see _notmuch_threads_fetch_members). */
+    GHashTable *matched;
+
+    /* Members have been fetched for threads [0, fetched). */
+    unsigned int fetched;
+
+    /* The document ID of every match, and the index of its thread,
+     * recorded while fetching the members of threads so that the
+     * complete results can be stored in the result cache once every
+     * thread is fetched, (or NULL if they won't be). The matches of
+     * 'record_threads' threads are recorded so far. */
+    unsigned int *record_doc_ids;
+    unsigned int *record_thread_indices;
+    unsigned int record_count;
+    unsigned int record_size;
+    unsigned int record_threads;
+
+    /* The results read from the result cache, (or NULL if the query
+     * is being run). */
+    notmuch_cached_results_t *cached;
+
+    /* This index into 'threads' is our iterator state. */
+    unsigned int current;
 };
 
+/* We end up having to call the destructors explicitly because we had
+ * to use "new" in order to keep C++ objects within a block that we
+ * allocated with talloc.
+ */
+static int
+_notmuch_query_destructor (notmuch_query_t *query)
+{
+    delete query->string_query;
+    delete query->final_query;
+
+    return 0;
+}
+
 notmuch_query_t *
 notmuch_query_create (notmuch_database_t *notmuch,
 		      const char *query_string)
@@ -67,6 +180,18 @@ notmuch_query_create (notmuch_database_t *notmuch,
 
     query->sort = NOTMUCH_SORT_NEWEST_FIRST;
 
+    query->offset = 0;
+    query->limit = 0;
+
+    query->cursor_value = NULL;
+    query->cursor_doc_id = 0;
+
+    query->string_query = NULL;
+    query->final_query = NULL;
+    query->generation = 0;
+
+    talloc_set_destructor (query, _notmuch_query_destructor);
+
     return query;
 }
 
@@ -76,6 +201,143 @@ notmuch_query_set_sort (notmuch_query_t *query, notmuch_sort_t sort)
     query->sort = sort;
 }
 
+void
+notmuch_query_set_offset (notmuch_query_t *query, unsigned int offset)
+{
+    query->offset = offset;
+}
+
+void
+notmuch_query_set_limit (notmuch_query_t *query, unsigned int limit)
+{
+    query->limit = limit;
+}
+
+notmuch_status_t
+notmuch_query_set_cursor (notmuch_query_t *query, const char *cursor)
+{
+    const char *colon, *s;
+    char *end;
+    unsigned long doc_id;
+
+    if (cursor == NULL) {
+	talloc_free (query->cursor_value);
+	query->cursor_value = NULL;
+	query->cursor_doc_id = 0;
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    colon = strchr (cursor, ':');
+    if (colon == NULL || (colon - cursor) % 2)
+	return NOTMUCH_STATUS_ILLEGAL_ARGUMENT;
+
+    for (s = cursor; s < colon; s++)
+	if (! isxdigit (*s))
+	    return NOTMUCH_STATUS_ILLEGAL_ARGUMENT;
+
+    doc_id = strtoul (colon + 1, &end, 10);
+    if (colon[1] == '\0' || *end != '\0' || doc_id == 0)
+	return NOTMUCH_STATUS_ILLEGAL_ARGUMENT;
+
+    talloc_free (query->cursor_value);
+    query->cursor_value = talloc_strndup (query, cursor, colon - cursor);
+    query->cursor_doc_id = doc_id;
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Build (or reuse) the Xapian query for all mail documents matching
+ * the query string of 'query'.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static void
+_notmuch_query_ensure_parsed (notmuch_query_t *query)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    const char *query_string = query->query_string;
+    Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
+					       _find_prefix ("type"),
+					       "mail"));
+
+    if (query->final_query && query->generation == notmuch->generation)
+	return;
+
+    delete query->string_query;
+    query->string_query = NULL;
+    delete query->final_query;
+    query->final_query = NULL;
+
+    if (strcmp (query_string, "") == 0 ||
+	strcmp (query_string, "*") == 0)
+    {
+	query->final_query = new Xapian::Query (mail_query);
+    } else {
+	query->string_query = new Xapian::Query (
+	    _notmuch_database_parse_query (notmuch, query_string));
+	query->final_query = new Xapian::Query (Xapian::Query::OP_AND,
+						mail_query,
+						*query->string_query);
+    }
+
+    query->generation = notmuch->generation;
+}
+
+static Xapian::Query
+_notmuch_query_get_xapian_query (notmuch_query_t *query)
+{
+    _notmuch_query_ensure_parsed (query);
+
+    return *query->final_query;
+}
+
+/* The value slot by which 'sort' orders results, or -1 for none. */
+static int
+_notmuch_sort_slot (notmuch_sort_t sort)
+{
+    switch (sort) {
+    case NOTMUCH_SORT_OLDEST_FIRST:
+    case NOTMUCH_SORT_NEWEST_FIRST:
+	return NOTMUCH_VALUE_TIMESTAMP;
+    case NOTMUCH_SORT_MESSAGE_ID:
+	return NOTMUCH_VALUE_MESSAGE_ID;
+    case NOTMUCH_SORT_UNSORTED:
+    default:
+	return -1;
+    }
+}
+
+static char *
+_hex_encode (void *ctx, const std::string &value)
+{
+    char *hex;
+    size_t i;
+
+    hex = talloc_array (ctx, char, value.size () * 2 + 1);
+    if (unlikely (hex == NULL))
+	return NULL;
+
+    for (i = 0; i < value.size (); i++)
+	sprintf (hex + i * 2, "%02x", (unsigned char) value[i]);
+    hex[value.size () * 2] = '\0';
+
+    return hex;
+}
+
+static std::string
+_hex_decode (const char *hex)
+{
+    std::string value;
+    unsigned int byte;
+
+    for (; hex[0] && hex[1]; hex += 2) {
+	sscanf (hex, "%2x", &byte);
+	value += (char) byte;
+    }
+
+    return value;
+}
+
 /* We end up having to call the destructors explicitly because we had
  * to use "placement new" in order to initialize C++ objects within a
  * block that we allocated with talloc. So C++ is making talloc
@@ -88,14 +350,69 @@ _notmuch_messages_destructor (notmuch_mset_messages_t *messages)
     messages->iterator.~MSetIterator ();
     messages->iterator_end.~MSetIterator ();
 
+    delete messages->enquire;
+
     return 0;
 }
 
-notmuch_messages_t *
-notmuch_query_search_messages (notmuch_query_t *query)
+/* Count the results at the front of 'final_query' (as sorted on
+ * 'sort_slot') that precede or are the query's cursor position.
+ *
+ * Results are in document ID order among equal sort values, so this
+ * is the number of results with exactly the cursor's sort value and
+ * a document ID no greater than the cursor's.
+ */
+static Xapian::doccount
+_notmuch_query_count_cursor_ties (notmuch_query_t *query,
+				  const Xapian::Query &final_query,
+				  int sort_slot)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    std::string value = _hex_decode (query->cursor_value);
+    Xapian::Enquire enquire (*notmuch->xapian_db);
+    Xapian::MSet mset;
+    Xapian::MSetIterator i;
+    Xapian::doccount count = 0;
+
+    enquire.set_weighting_scheme (Xapian::BoolWeight());
+    enquire.set_query (Xapian::Query (Xapian::Query::OP_FILTER, final_query,
+				      Xapian::Query (Xapian::Query::OP_VALUE_RANGE,
+						     sort_slot, value, value)));
+
+    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+    for (i = mset.begin (); i != mset.end (); i++)
+	if (*i <= query->cursor_doc_id)
+	    count++;
+
+    return count;
+}
+
+/* Execute 'query' returning a messages object that will fetch its
+ * results starting at rank 'first'.
+ *
+ * If 'window' is non-zero, then results are fetched from Xapian that
+ * many at a time, (doubling for each subsequent fetch), so that
+ * callers interested in only the first few results don't pay for
+ * sorting every match. Otherwise, all results are fetched at once.
+ *
+ * If 'limit' is non-zero, no more than 'limit' results are returned.
+ *
+ * If 'use_cursor' is TRUE, results begin after the query's cursor
+ * position, (if any).
+ *
+ * If 'collapse_threads' is TRUE, only the first result of each thread
+ * is returned, (along with every result lacking a THREAD_ID value).
+ */
+static notmuch_messages_t *
+_notmuch_query_search_messages (notmuch_query_t *query,
+				unsigned int first,
+				unsigned int window,
+				unsigned int limit,
+				notmuch_bool_t use_cursor,
+				notmuch_bool_t collapse_threads)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
     notmuch_mset_messages_t *messages;
 
     messages = talloc (query, notmuch_mset_messages_t);
@@ -107,61 +424,68 @@ notmuch_query_search_messages (notmuch_query_t *query)
 	messages->base.is_of_list_type = FALSE;
 	messages->base.iterator = NULL;
 	messages->notmuch = notmuch;
+	messages->enquire = NULL;
 	new (&messages->iterator) Xapian::MSetIterator ();
 	new (&messages->iterator_end) Xapian::MSetIterator ();
 
 	talloc_set_destructor (messages, _notmuch_messages_destructor);
 
-	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   "mail"));
-	Xapian::Query string_query, final_query;
-	Xapian::MSet mset;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
-
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
-	}
+	messages->enquire = new Xapian::Enquire (*notmuch->xapian_db);
 
-	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	Xapian::Enquire *enquire = messages->enquire;
+	Xapian::Query final_query;
+
+	final_query = _notmuch_query_get_xapian_query (query);
+
+	enquire->set_weighting_scheme (Xapian::BoolWeight());
 
 	switch (query->sort) {
 	case NOTMUCH_SORT_OLDEST_FIRST:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+	    enquire->set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
 	    break;
 	case NOTMUCH_SORT_NEWEST_FIRST:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, TRUE);
+	    enquire->set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, TRUE);
 	    break;
 	case NOTMUCH_SORT_MESSAGE_ID:
-	    enquire.set_sort_by_value (NOTMUCH_VALUE_MESSAGE_ID, FALSE);
+	    enquire->set_sort_by_value (NOTMUCH_VALUE_MESSAGE_ID, FALSE);
 	    break;
         case NOTMUCH_SORT_UNSORTED:
 	    break;
 	}
 
+	if (collapse_threads)
+	    enquire->set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+
+	messages->sort_slot = _notmuch_sort_slot (query->sort);
+
+	if (use_cursor && query->cursor_value && messages->sort_slot != -1) {
+	    std::string value = _hex_decode (query->cursor_value);
+	    Xapian::Query::op op = Xapian::Query::OP_VALUE_GE;
+
+	    if (query->sort == NOTMUCH_SORT_NEWEST_FIRST)
+		op = Xapian::Query::OP_VALUE_LE;
+
+	    first += _notmuch_query_count_cursor_ties (query, final_query,
+						       messages->sort_slot);
+
+	    final_query = Xapian::Query (Xapian::Query::OP_FILTER,
+					 final_query,
+					 Xapian::Query (op,
+							messages->sort_slot,
+							value));
+	}
+
 #if DEBUG_QUERY
 	fprintf (stderr, "Final query is:\n%s\n", final_query.get_description().c_str());
 #endif
 
-	enquire.set_query (final_query);
+	enquire->set_query (final_query);
 
-	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
-
-	messages->iterator = mset.begin ();
-	messages->iterator_end = mset.end ();
+	messages->window_first = first;
+	messages->window_size = window;
+	messages->limited = (limit != 0);
+	messages->remaining = limit;
+	messages->exhausted = FALSE;
 
 	return &messages->base;
 
@@ -175,6 +499,54 @@ notmuch_query_search_messages (notmuch_query_t *query)
     }
 }
 
+notmuch_messages_t *
+notmuch_query_search_messages (notmuch_query_t *query)
+{
+    return _notmuch_query_search_messages (query, query->offset,
+					   query->limit, query->limit,
+					   TRUE, FALSE);
+}
+
+/* Fetch the next window of results for 'messages' from Xapian. */
+static void
+_notmuch_mset_messages_fetch_window (notmuch_mset_messages_t *messages)
+{
+    notmuch_database_t *notmuch = messages->notmuch;
+    Xapian::doccount size;
+    Xapian::MSet mset;
+
+    size = messages->window_size;
+    if (size == 0)
+	size = notmuch->xapian_db->get_doccount ();
+    if (messages->limited && size > messages->remaining)
+	size = messages->remaining;
+
+    try {
+	mset = messages->enquire->get_mset (messages->window_first, size);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred performing query: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	messages->exhausted = TRUE;
+	return;
+    }
+
+    messages->iterator = mset.begin ();
+    messages->iterator_end = mset.end ();
+
+    messages->window_first += mset.size ();
+    if (messages->limited)
+	messages->remaining -= mset.size ();
+
+    if (mset.size () < size || messages->window_size == 0 ||
+	(messages->limited && messages->remaining == 0))
+    {
+	messages->exhausted = TRUE;
+    }
+
+    messages->window_size *= 2;
+}
+
 notmuch_bool_t
 _notmuch_mset_messages_valid (notmuch_messages_t *messages)
 {
@@ -182,7 +554,13 @@ _notmuch_mset_messages_valid (notmuch_messages_t *messages)
 
     mset_messages = (notmuch_mset_messages_t *) messages;
 
-    return (mset_messages->iterator != mset_messages->iterator_end);
+    while (mset_messages->iterator == mset_messages->iterator_end) {
+	if (mset_messages->exhausted)
+	    return FALSE;
+	_notmuch_mset_messages_fetch_window (mset_messages);
+    }
+
+    return TRUE;
 }
 
 notmuch_message_t *
@@ -223,6 +601,38 @@ _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages)
     mset_messages->iterator++;
 }
 
+const char *
+_notmuch_mset_messages_get_cursor (notmuch_messages_t *messages)
+{
+    notmuch_mset_messages_t *mset_messages;
+    std::string value;
+    char *hex;
+
+    mset_messages = (notmuch_mset_messages_t *) messages;
+
+    if (! _notmuch_mset_messages_valid (&mset_messages->base) ||
+	mset_messages->sort_slot == -1)
+    {
+	return NULL;
+    }
+
+    try {
+	value = mset_messages->iterator.get_document ().get_value (mset_messages->sort_slot);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading a sort value: %s\n",
+		 error.get_msg().c_str());
+	mset_messages->notmuch->exception_reported = TRUE;
+	return NULL;
+    }
+
+    hex = _hex_encode (mset_messages, value);
+    if (unlikely (hex == NULL))
+	return NULL;
+
+    return talloc_asprintf (mset_messages, "%s:%u",
+			    hex, *mset_messages->iterator);
+}
+
 /* Glib objects force use to use a talloc destructor as well, (but not
  * nearly as ugly as the for messages due to C++ objects). At
  * this point, I'd really like to have some talloc-friendly
@@ -230,13 +640,582 @@ _notmuch_mset_messages_move_to_next (notmuch_messages_t *messages)
 static int
 _notmuch_threads_destructor (notmuch_threads_t *threads)
 {
-    g_hash_table_unref (threads->threads);
+    g_hash_table_unref (threads->thread_hash);
+    g_hash_table_unref (threads->matched);
 
     return 0;
 }
 
-notmuch_threads_t *
-notmuch_query_search_threads (notmuch_query_t *query)
+/* Add the thread 'thread_id' to the results, (or skip it, for the
+ * query's offset), unless already seen. Returns TRUE if the thread
+ * had not been seen before. */
+static notmuch_bool_t
+_notmuch_threads_add_thread (notmuch_threads_t *threads,
+			     const char *thread_id)
+{
+    notmuch_thread_members_t *members;
+
+    if (g_hash_table_lookup_extended (threads->thread_hash,
+				      thread_id, NULL, NULL))
+    {
+	return FALSE;
+    }
+
+    if (threads->skip) {
+	threads->skip--;
+	g_hash_table_insert (threads->thread_hash,
+			     talloc_strdup (threads, thread_id),
+			     NULL);
+	return TRUE;
+    }
+
+    if (threads->num_threads == threads->size) {
+	threads->size = threads->size ? threads->size * 2 : 64;
+	threads->threads = talloc_realloc (threads, threads->threads,
+					   notmuch_thread_members_t *,
+					   threads->size);
+    }
+
+    members = talloc (threads, notmuch_thread_members_t);
+    members->thread_id = talloc_strdup (members, thread_id);
+    members->messages = NULL;
+    members->summary = NULL;
+    members->matched = 0;
+    members->index = threads->num_threads;
+    members->cached_matches = NULL;
+    members->num_cached_matches = 0;
+    members->recorded = FALSE;
+
+    threads->threads[threads->num_threads++] = members;
+    g_hash_table_insert (threads->thread_hash,
+			 (void *) members->thread_id, members);
+
+    return TRUE;
+}
+
+/* Parse a thread ID as generated by
+ * _notmuch_database_generate_thread_id, (16 hexadecimal digits),
+ * returning FALSE for any other form of ID. */
+static notmuch_bool_t
+_thread_id_to_integer (const char *thread_id, uint64_t *value)
+{
+    char *end;
+
+    if (strlen (thread_id) != 16 || ! isxdigit (thread_id[0]))
+	return FALSE;
+
+    *value = strtoull (thread_id, &end, 16);
+
+    return *end == '\0';
+}
+
+/* Build the results to be stored in the result cache from the
+ * document ID of each of 'num_messages' matches and the index of its
+ * thread, grouping the matches by thread.
+ *
+ * The thread_ids array is allocated, (for 'num_threads' threads), but
+ * left for the caller to fill.
+ */
+static notmuch_cached_results_t *
+_notmuch_cached_results_create (void *ctx,
+				unsigned int num_threads,
+				unsigned int num_messages,
+				const unsigned int *doc_ids,
+				const unsigned int *thread_indices)
+{
+    notmuch_cached_results_t *results;
+    unsigned int *next;
+    unsigned int i, first;
+
+    results = talloc (ctx, notmuch_cached_results_t);
+    if (results == NULL)
+	return NULL;
+
+    results->num_threads = num_threads;
+    results->num_messages = num_messages;
+    results->thread_ids = talloc_array (results, uint64_t, num_threads + 1);
+    results->thread_matches = talloc_zero_array (results, unsigned int,
+						 num_threads + 1);
+    results->doc_ids = talloc_array (results, unsigned int, num_messages + 1);
+    next = talloc_array (results, unsigned int, num_threads + 1);
+    if (results->thread_ids == NULL || results->thread_matches == NULL ||
+	results->doc_ids == NULL || next == NULL)
+    {
+	talloc_free (results);
+	return NULL;
+    }
+
+    for (i = 0; i < num_messages; i++)
+	results->thread_matches[thread_indices[i]]++;
+
+    first = 0;
+    for (i = 0; i < num_threads; i++) {
+	next[i] = first;
+	first += results->thread_matches[i];
+    }
+
+    for (i = 0; i < num_messages; i++)
+	results->doc_ids[next[thread_indices[i]]++] = doc_ids[i];
+
+    talloc_free (next);
+
+    return results;
+}
+
+/* Append a match of the thread of 'members' to the results being
+ * recorded for the result cache, (unless already recorded). */
+static void
+_notmuch_threads_record_match (notmuch_threads_t *threads,
+			       notmuch_thread_members_t *members,
+			       unsigned int doc_id)
+{
+    if (threads->record_doc_ids == NULL || members->recorded)
+	return;
+
+    if (threads->record_count == threads->record_size) {
+	threads->record_size *= 2;
+	threads->record_doc_ids = talloc_realloc (threads,
+						  threads->record_doc_ids,
+						  unsigned int,
+						  threads->record_size);
+	threads->record_thread_indices = talloc_realloc (threads,
+							 threads->record_thread_indices,
+							 unsigned int,
+							 threads->record_size);
+    }
+
+    threads->record_doc_ids[threads->record_count] = doc_id;
+    threads->record_thread_indices[threads->record_count] = members->index;
+    threads->record_count++;
+}
+
+/* Stop recording results for the result cache, (such as when they
+ * can't be complete). */
+static void
+_notmuch_threads_stop_recording (notmuch_threads_t *threads)
+{
+    talloc_free (threads->record_doc_ids);
+    talloc_free (threads->record_thread_indices);
+    threads->record_doc_ids = NULL;
+    threads->record_thread_indices = NULL;
+}
+
+/* Store the recorded results, (every message matching the query, by
+ * thread), in the result cache, unless a thread ID can't be stored. */
+static void
+_notmuch_threads_store_results (notmuch_threads_t *threads)
+{
+    notmuch_query_t *query = threads->query;
+    notmuch_cached_results_t *results;
+    notmuch_bool_t storable;
+    unsigned int i;
+
+    results = _notmuch_cached_results_create (threads,
+					      threads->num_threads,
+					      threads->record_count,
+					      threads->record_doc_ids,
+					      threads->record_thread_indices);
+
+    storable = (results != NULL);
+    for (i = 0; storable && i < threads->num_threads; i++)
+	storable = _thread_id_to_integer (threads->threads[i]->thread_id,
+					  &results->thread_ids[i]);
+
+    if (storable) {
+	try {
+	    _notmuch_result_cache_store (query->notmuch, query->query_string,
+					 query->sort, results);
+	} catch (const Xapian::Error &error) {
+	    fprintf (stderr, "A Xapian exception occurred caching results: %s\n",
+		     error.get_msg().c_str());
+	    query->notmuch->exception_reported = TRUE;
+	}
+    }
+
+    talloc_free (results);
+    _notmuch_threads_stop_recording (threads);
+}
+
+/* Mark the matches of the threads in [first, last) as recorded, (once
+ * their members are fetched), storing the results once those of every
+ * thread are. */
+static void
+_notmuch_threads_recorded (notmuch_threads_t *threads,
+			   unsigned int first,
+			   unsigned int last)
+{
+    unsigned int i;
+
+    if (threads->record_doc_ids == NULL)
+	return;
+
+    for (i = first; i < last; i++) {
+	if (! threads->threads[i]->recorded) {
+	    threads->threads[i]->recorded = TRUE;
+	    threads->record_threads++;
+	}
+    }
+
+    if (threads->complete && threads->record_threads == threads->num_threads)
+	_notmuch_threads_store_results (threads);
+}
+
+/* Discover the threads from results found in the result cache,
+ * without searching, (each thread keeping its cached matches for
+ * _notmuch_threads_fetch_members). */
+static void
+_notmuch_threads_discover_cached (notmuch_threads_t *threads,
+				  notmuch_cached_results_t *results)
+{
+    notmuch_query_t *query = threads->query;
+    notmuch_thread_members_t *members;
+    char thread_id[17];
+    unsigned int i, first = 0;
+
+    threads->cached = results;
+
+    for (i = 0; i < results->num_threads; i++) {
+	if (query->limit && threads->num_threads == query->limit)
+	    break;
+
+	sprintf (thread_id, "%016" PRIx64, results->thread_ids[i]);
+	_notmuch_threads_add_thread (threads, thread_id);
+
+	members = (notmuch_thread_members_t *)
+	    g_hash_table_lookup (threads->thread_hash, thread_id);
+	if (members) {
+	    members->cached_matches = results->doc_ids + first;
+	    members->num_cached_matches = results->thread_matches[i];
+	}
+
+	first += results->thread_matches[i];
+    }
+
+    threads->complete = TRUE;
+}
+
+/* Read matches of the query until 'count' threads are known, (or
+ * the matches are exhausted), recording the distinct thread IDs in
+ * result order.
+ *
+ * The matches are collapsed by the THREAD_ID value, so each thread
+ * is normally seen once, with its ID read from the collapse key and
+ * no document loaded. Only documents indexed before that value
+ * existed are loaded, (to read the thread term).
+ *
+ * The first query->offset threads are skipped, and no more than
+ * query->limit threads will be recorded, (if non-zero).
+ */
+static void
+_notmuch_threads_discover (notmuch_threads_t *threads, unsigned int count)
+{
+    notmuch_query_t *query = threads->query;
+    notmuch_mset_messages_t *mset_messages;
+    notmuch_message_t *message;
+    std::string thread_id;
+
+    if (threads->complete)
+	return;
+
+    if (query->limit && count > query->limit)
+	count = query->limit;
+
+    mset_messages = (notmuch_mset_messages_t *) threads->messages;
+
+    try {
+	while (threads->num_threads < count) {
+	    if (! notmuch_messages_valid (threads->messages)) {
+		threads->complete = TRUE;
+		_notmuch_threads_recorded (threads, 0, 0);
+		break;
+	    }
+
+	    thread_id = mset_messages->iterator.get_collapse_key ();
+
+	    if (thread_id.empty ()) {
+		message = notmuch_messages_get (threads->messages);
+		if (message) {
+		    thread_id = notmuch_message_get_thread_id (message);
+		    talloc_free (message);
+		}
+	    }
+
+	    notmuch_messages_move_to_next (threads->messages);
+
+	    if (thread_id.empty ())
+		continue;
+
+	    _notmuch_threads_add_thread (threads, thread_id.c_str ());
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred finding threads: %s\n",
+		 error.get_msg().c_str());
+	query->notmuch->exception_reported = TRUE;
+	threads->complete = TRUE;
+	_notmuch_threads_stop_recording (threads);
+    }
+}
+
+typedef struct _notmuch_cached_match {
+    time_t date;
+    unsigned int doc_id;
+    notmuch_message_t *message;
+} notmuch_cached_match_t;
+
+/* Order matches oldest-first, (as a search sorted by date would). */
+static int
+_cached_match_compare (const void *a, const void *b)
+{
+    const notmuch_cached_match_t *match_a = (const notmuch_cached_match_t *) a;
+    const notmuch_cached_match_t *match_b = (const notmuch_cached_match_t *) b;
+
+    if (match_a->date != match_b->date)
+	return match_a->date < match_b->date ? -1 : 1;
+
+    if (match_a->doc_id != match_b->doc_id)
+	return match_a->doc_id < match_b->doc_id ? -1 : 1;
+
+    return 0;
+}
+
+/* Add the messages matching the query to the list of 'members',
+ * oldest-first, from the document IDs found in the result cache.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static void
+_notmuch_threads_add_cached_matches (notmuch_threads_t *threads,
+				     notmuch_thread_members_t *members)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    notmuch_cached_match_t *matches;
+    notmuch_message_t *message;
+    notmuch_private_status_t status;
+    unsigned int i, count = 0;
+
+    matches = talloc_array (threads, notmuch_cached_match_t,
+			    members->num_cached_matches + 1);
+    if (matches == NULL)
+	return;
+
+    for (i = 0; i < members->num_cached_matches; i++) {
+	message = _notmuch_message_create (members->messages, notmuch,
+					   members->cached_matches[i],
+					   &status);
+	if (message == NULL) {
+	    if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+		INTERNAL_ERROR ("the result cache contains a non-existent document ID.\n");
+	    continue;
+	}
+
+	matches[count].date = notmuch_message_get_date (message);
+	matches[count].doc_id = members->cached_matches[i];
+	matches[count].message = message;
+	count++;
+    }
+
+    qsort (matches, count, sizeof (notmuch_cached_match_t),
+	   _cached_match_compare);
+
+    for (i = 0; i < count; i++) {
+	notmuch_message_set_flag (matches[i].message,
+				  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
+	members->matched++;
+
+	_notmuch_message_list_add_message (members->messages,
+					   matches[i].message);
+    }
+
+    talloc_free (matches);
+}
+
+/* Fetch the messages matching the query of the threads in [first,
+ * last) with a single search of the query restricted to their thread
+ * terms, distributing the results, (oldest-first), to each thread's
+ * list of members.
+ *
+ * That is all that's needed when every one of these threads has an
+ * up-to-date summary, (see thread-summary.cc). Otherwise all messages
+ * of the threads are fetched with one more search, for the union of
+ * their thread terms.
+ *
+ * When the results were read from the result cache, the matching
+ * messages are known without running the query at all.
+ */
+static void
+_notmuch_threads_fetch_members (notmuch_threads_t *threads,
+				unsigned int first,
+				unsigned int last)
+{
+    notmuch_database_t *notmuch = threads->query->notmuch;
+    notmuch_thread_members_t *members;
+    notmuch_message_t *message;
+    notmuch_private_status_t status;
+    std::vector<std::string> terms;
+    notmuch_bool_t summarized = TRUE;
+    unsigned int i;
+
+    for (i = first; i < last; i++) {
+	members = threads->threads[i];
+	if (members->messages)
+	    talloc_free (members->messages);
+	members->messages = _notmuch_message_list_create (members);
+	members->matched = 0;
+	terms.push_back (std::string (_find_prefix ("thread")) +
+			 members->thread_id);
+    }
+
+    try {
+	for (i = first; i < last; i++) {
+	    members = threads->threads[i];
+	    if (members->summary == NULL)
+		members->summary = _notmuch_thread_summary_get (members,
+								notmuch,
+								members->thread_id);
+	    if (members->summary == NULL)
+		summarized = FALSE;
+	}
+
+	if (! summarized) {
+	    for (i = first; i < last; i++) {
+		members = threads->threads[i];
+		talloc_free (members->summary);
+		members->summary = NULL;
+	    }
+	}
+
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query mail_query (talloc_asprintf (threads, "%s%s",
+						   _find_prefix ("type"),
+						   "mail"));
+	Xapian::Query thread_query (Xapian::Query::OP_OR,
+				    terms.begin (), terms.end ());
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+
+	if (summarized && threads->cached) {
+	    for (i = first; i < last; i++)
+		_notmuch_threads_add_cached_matches (threads,
+						     threads->threads[i]);
+
+	    return;
+	}
+
+	if (summarized) {
+	    enquire.set_weighting_scheme (Xapian::BoolWeight());
+	    enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+	    enquire.set_query (Xapian::Query (Xapian::Query::OP_FILTER,
+					      _notmuch_query_get_xapian_query (threads->query),
+					      thread_query));
+
+	    mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	    for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+		message = _notmuch_message_create (threads, notmuch,
+						   *iterator, &status);
+		if (message == NULL) {
+		    if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+			INTERNAL_ERROR ("a thread search returned a non-existent document ID.\n");
+		    continue;
+		}
+
+		members = (notmuch_thread_members_t *)
+		    g_hash_table_lookup (threads->thread_hash,
+					 notmuch_message_get_thread_id (message));
+		if (members == NULL || members->messages == NULL) {
+		    talloc_free (message);
+		    continue;
+		}
+
+		notmuch_message_set_flag (message,
+					  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
+		members->matched++;
+		_notmuch_threads_record_match (threads, members, *iterator);
+
+		_notmuch_message_list_add_message (members->messages,
+						   talloc_steal (members->messages,
+								 message));
+	    }
+
+	    return;
+	}
+
+	if (threads->cached) {
+	    for (i = first; i < last; i++) {
+		unsigned int j;
+
+		members = threads->threads[i];
+		for (j = 0; j < members->num_cached_matches; j++)
+		    g_hash_table_insert (threads->matched,
+					 GUINT_TO_POINTER (members->cached_matches[j]),
+					 NULL);
+	    }
+	} else {
+	    Xapian::Enquire matched_enquire (*notmuch->xapian_db);
+
+	    matched_enquire.set_weighting_scheme (Xapian::BoolWeight());
+	    matched_enquire.set_docid_order (Xapian::Enquire::DONT_CARE);
+	    matched_enquire.set_query (Xapian::Query (Xapian::Query::OP_FILTER,
+						      _notmuch_query_get_xapian_query (threads->query),
+						      thread_query));
+
+	    mset = matched_enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	    for (iterator = mset.begin (); iterator != mset.end (); iterator++)
+		g_hash_table_insert (threads->matched,
+				     GUINT_TO_POINTER (*iterator), NULL);
+	}
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_AND,
+					  mail_query, thread_query));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    message = _notmuch_message_create (threads, notmuch,
+					       *iterator, &status);
+	    if (message == NULL) {
+		if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+		    INTERNAL_ERROR ("a thread search returned a non-existent document ID.\n");
+		continue;
+	    }
+
+	    members = (notmuch_thread_members_t *)
+		g_hash_table_lookup (threads->thread_hash,
+				     notmuch_message_get_thread_id (message));
+	    if (members == NULL || members->messages == NULL) {
+		talloc_free (message);
+		continue;
+	    }
+
+	    if (g_hash_table_lookup_extended (threads->matched,
+					      GUINT_TO_POINTER (*iterator),
+					      NULL, NULL))
+	    {
+		notmuch_message_set_flag (message,
+					  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
+		members->matched++;
+		_notmuch_threads_record_match (threads, members, *iterator);
+	    }
+
+	    _notmuch_message_list_add_message (members->messages,
+					       talloc_steal (members->messages,
+							     message));
+	}
+
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred fetching threads: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+	_notmuch_threads_stop_recording (threads);
+    }
+}
+
+/* Create an empty set of thread results for 'query'. */
+static notmuch_threads_t *
+_notmuch_threads_create (notmuch_query_t *query)
 {
     notmuch_threads_t *threads;
 
@@ -245,18 +1224,145 @@ notmuch_query_search_threads (notmuch_query_t *query)
 	return NULL;
 
     threads->query = query;
-    threads->threads = g_hash_table_new_full (g_str_hash, g_str_equal,
-					      free, NULL);
+    threads->complete = FALSE;
+    threads->skip = query->offset;
+    threads->threads = NULL;
+    threads->num_threads = 0;
+    threads->size = 0;
+    threads->thread_hash = g_hash_table_new (g_str_hash, g_str_equal);
+    threads->matched = g_hash_table_new (NULL, NULL);
+    threads->fetched = 0;
+    threads->current = 0;
+    threads->record_doc_ids = NULL;
+    threads->record_thread_indices = NULL;
+    threads->record_count = 0;
+    threads->record_size = 0;
+    threads->record_threads = 0;
+    threads->cached = NULL;
+    threads->messages = NULL;
+
+    talloc_set_destructor (threads, _notmuch_threads_destructor);
 
-    threads->messages = notmuch_query_search_messages (query);
+    return threads;
+}
 
-    threads->thread_id = NULL;
+notmuch_threads_t *
+notmuch_query_search_threads (notmuch_query_t *query)
+{
+    notmuch_threads_t *threads;
+    notmuch_cached_results_t *results;
+    unsigned int window = 0;
 
-    talloc_set_destructor (threads, _notmuch_threads_destructor);
+    threads = _notmuch_threads_create (query);
+    if (threads == NULL)
+	return NULL;
+
+    try {
+	results = _notmuch_result_cache_load (threads, query->notmuch,
+					      query->query_string, query->sort,
+					      FALSE);
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading cached results: %s\n",
+		 error.get_msg().c_str());
+	query->notmuch->exception_reported = TRUE;
+	results = NULL;
+    }
+
+    if (results) {
+	_notmuch_threads_discover_cached (threads, results);
+	return threads;
+    }
+
+    /* Only the complete results of the query are cached, (and only
+     * for a query that has been run before, so that one-off queries
+     * don't push out those that are repeated). */
+    if (query->offset == 0 && query->limit == 0 &&
+	_notmuch_result_cache_enabled (query->notmuch) &&
+	_notmuch_result_cache_wanted (query->notmuch, query->query_string,
+				      query->sort))
+    {
+	threads->record_size = 64;
+	threads->record_doc_ids = talloc_array (threads, unsigned int,
+						threads->record_size);
+	threads->record_thread_indices = talloc_array (threads, unsigned int,
+						       threads->record_size);
+    }
+
+    /* With a limit, only as many messages as are needed to find the
+     * requested threads are retrieved, starting with one message per
+     * thread. */
+    if (query->limit)
+	window = query->offset + query->limit;
+
+    threads->messages = _notmuch_query_search_messages (query, 0, window,
+							 0, FALSE, TRUE);
+    if (threads->messages == NULL)
+	threads->complete = TRUE;
 
     return threads;
 }
 
+void
+notmuch_query_get_threads (notmuch_query_t *query,
+			   const char **thread_ids,
+			   unsigned int count,
+			   notmuch_thread_t **threads_out)
+{
+    notmuch_threads_t *threads;
+    notmuch_thread_members_t *members;
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+	threads_out[i] = NULL;
+
+    threads = _notmuch_threads_create (query);
+    if (threads == NULL)
+	return;
+
+    /* Every one of the given threads is wanted. */
+    threads->skip = 0;
+
+    for (i = 0; i < count; i++)
+	_notmuch_threads_add_thread (threads, thread_ids[i]);
+
+    _notmuch_threads_fetch_members (threads, 0, threads->num_threads);
+
+    for (i = 0; i < count; i++) {
+	members = (notmuch_thread_members_t *)
+	    g_hash_table_lookup (threads->thread_hash, thread_ids[i]);
+	if (members == NULL || members->matched == 0 ||
+	    members->messages == NULL)
+	{
+	    continue;
+	}
+
+	threads_out[i] = _notmuch_thread_create (query, query->notmuch,
+						 members->thread_id,
+						 members->messages,
+						 members->summary,
+						 query->query_string,
+						 query->sort);
+
+	/* The thread took the messages and summary. */
+	talloc_free (members->messages);
+	members->messages = NULL;
+	members->summary = NULL;
+    }
+
+    talloc_free (threads);
+}
+
+notmuch_thread_t *
+notmuch_query_get_thread (notmuch_query_t *query,
+			  const char *thread_id)
+{
+    notmuch_thread_t *thread;
+
+    notmuch_query_get_threads (query, &thread_id, 1, &thread);
+
+    return thread;
+}
+
 void
 notmuch_query_destroy (notmuch_query_t *query)
 {
@@ -266,51 +1372,71 @@ notmuch_query_destroy (notmuch_query_t *query)
 notmuch_bool_t
 notmuch_threads_valid (notmuch_threads_t *threads)
 {
-    notmuch_message_t *message;
-
-    if (threads->thread_id)
-	return TRUE;
+    if (threads->current >= threads->num_threads && ! threads->complete)
+	_notmuch_threads_discover (threads, threads->current + 1);
 
-    while (notmuch_messages_valid (threads->messages))
-    {
-	message = notmuch_messages_get (threads->messages);
+    return threads->current < threads->num_threads;
+}
 
-	threads->thread_id = notmuch_message_get_thread_id (message);
+notmuch_thread_t *
+notmuch_threads_get (notmuch_threads_t *threads)
+{
+    notmuch_thread_members_t *members;
+    notmuch_thread_t *thread;
+    unsigned int last;
 
-	if (! g_hash_table_lookup_extended (threads->threads,
-					    threads->thread_id,
-					    NULL, NULL))
-	{
-	    g_hash_table_insert (threads->threads,
-				 xstrdup (threads->thread_id), NULL);
-	    notmuch_messages_move_to_next (threads->messages);
-	    return TRUE;
-	}
+    if (! notmuch_threads_valid (threads))
+	return NULL;
 
-	notmuch_messages_move_to_next (threads->messages);
+    if (threads->current >= threads->fetched) {
+	last = threads->current + NOTMUCH_THREADS_FETCH_BATCH;
+	_notmuch_threads_discover (threads, last);
+	if (last > threads->num_threads)
+	    last = threads->num_threads;
+	_notmuch_threads_fetch_members (threads, threads->current, last);
+	threads->fetched = last;
+	_notmuch_threads_recorded (threads, threads->current, last);
     }
 
-    threads->thread_id = NULL;
-    return FALSE;
+    members = threads->threads[threads->current];
+
+    /* The messages were handed over to a previous thread object for
+     * this same position, so fetch them again. */
+    if (members->messages == NULL)
+	_notmuch_threads_fetch_members (threads, threads->current,
+					threads->current + 1);
+
+    thread = _notmuch_thread_create (threads->query,
+				     threads->query->notmuch,
+				     members->thread_id,
+				     members->messages,
+				     members->summary,
+				     threads->query->query_string,
+				     threads->query->sort);
+
+    talloc_free (members->messages);
+    members->messages = NULL;
+
+    /* The thread took the summary, (or it will be fetched again). */
+    members->summary = NULL;
+
+    return thread;
 }
 
-notmuch_thread_t *
-notmuch_threads_get (notmuch_threads_t *threads)
+const char *
+notmuch_threads_get_thread_id (notmuch_threads_t *threads)
 {
     if (! notmuch_threads_valid (threads))
 	return NULL;
 
-    return _notmuch_thread_create (threads->query,
-				   threads->query->notmuch,
-				   threads->thread_id,
-				   threads->query->query_string,
-				   threads->query->sort);
+    return threads->threads[threads->current]->thread_id;
 }
 
 void
 notmuch_threads_move_to_next (notmuch_threads_t *threads)
 {
-    threads->thread_id = NULL;
+    if (threads->current < threads->num_threads)
+	threads->current++;
 }
 
 void
@@ -319,56 +1445,395 @@ notmuch_threads_destroy (notmuch_threads_t *threads)
     talloc_free (threads);
 }
 
-unsigned
-notmuch_query_count_messages (notmuch_query_t *query)
+/* If the mail documents matching 'query' are exactly those carrying
+ * a single term, store that term in 'term' and return TRUE.
+ *
+ * This holds for a query matching all mail, and for a query
+ * consisting of one term, (other than the few kinds of term that
+ * documents other than mail also carry).
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_bool_t
+_notmuch_query_get_single_term (notmuch_query_t *query, std::string &term)
+{
+    const char *non_mail_prefixes[] = {
+	_find_prefix ("type"),
+	_find_prefix ("directory"),
+	_find_prefix ("directory-direntry")
+    };
+    Xapian::Query string_query;
+    Xapian::TermIterator i;
+    std::string description;
+    unsigned int j;
+
+    _notmuch_query_ensure_parsed (query);
+
+    if (query->string_query == NULL) {
+	term = std::string (_find_prefix ("type")) + "mail";
+	return TRUE;
+    }
+
+    string_query = *query->string_query;
+
+    i = string_query.get_terms_begin ();
+    if (i == string_query.get_terms_end ())
+	return FALSE;
+    term = *i;
+    if (++i != string_query.get_terms_end ())
+	return FALSE;
+
+    for (j = 0; j < ARRAY_SIZE (non_mail_prefixes); j++)
+	if (strncmp (term.c_str (), non_mail_prefixes[j],
+		     strlen (non_mail_prefixes[j])) == 0)
+	    return FALSE;
+
+    /* A query over one term may still not match exactly the documents
+     * with that term, (such as "NOT term"), so insist on the query
+     * being the plain term, (as a text or as a boolean term). */
+    description = string_query.get_description ();
+
+    return (description == Xapian::Query (term).get_description () ||
+	    description == Xapian::Query (term, 1, 1).get_description () ||
+	    description == Xapian::Query (Xapian::Query::OP_SCALE_WEIGHT,
+					  Xapian::Query (term),
+					  0).get_description ());
+}
+
+/* Look up the numbers of threads and messages matching 'query' in
+ * the result cache, (from results in the query's own sort order or
+ * else unsorted, as either serves for counting), returning NULL if
+ * there are none.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_cached_results_t *
+_notmuch_query_load_cached_counts (notmuch_query_t *query)
+{
+    notmuch_cached_results_t *results;
+
+    results = _notmuch_result_cache_load (query, query->notmuch,
+					  query->query_string, query->sort,
+					  TRUE);
+
+    if (results == NULL && query->sort != NOTMUCH_SORT_UNSORTED)
+	results = _notmuch_result_cache_load (query, query->notmuch,
+					      query->query_string,
+					      NOTMUCH_SORT_UNSORTED,
+					      TRUE);
+
+    return results;
+}
+
+static unsigned
+_notmuch_query_count_messages (notmuch_query_t *query,
+			       notmuch_bool_t approximate)
 {
     notmuch_database_t *notmuch = query->notmuch;
-    const char *query_string = query->query_string;
     Xapian::doccount count = 0;
 
     try {
 	Xapian::Enquire enquire (*notmuch->xapian_db);
-	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
-						   _find_prefix ("type"),
-						   "mail"));
-	Xapian::Query string_query, final_query;
 	Xapian::MSet mset;
-	unsigned int flags = (Xapian::QueryParser::FLAG_BOOLEAN |
-			      Xapian::QueryParser::FLAG_PHRASE |
-			      Xapian::QueryParser::FLAG_LOVEHATE |
-			      Xapian::QueryParser::FLAG_BOOLEAN_ANY_CASE |
-			      Xapian::QueryParser::FLAG_WILDCARD |
-			      Xapian::QueryParser::FLAG_PURE_NOT);
-
-	if (strcmp (query_string, "") == 0 ||
-	    strcmp (query_string, "*") == 0)
-	{
-	    final_query = mail_query;
-	} else {
-	    string_query = notmuch->query_parser->
-		parse_query (query_string, flags);
-	    final_query = Xapian::Query (Xapian::Query::OP_AND,
-					 mail_query, string_query);
+	notmuch_cached_results_t *results;
+	std::string term;
+
+	/* The number of documents carrying a term is stored in the
+	 * database, so is available without running any search. */
+	if (_notmuch_query_get_single_term (query, term))
+	    return notmuch->xapian_db->get_termfreq (term);
+
+	/* As is the exact count of a search run before, (when the
+	 * results were cached). */
+	results = _notmuch_query_load_cached_counts (query);
+	if (results) {
+	    count = results->num_messages;
+	    talloc_free (results);
+	    return count;
 	}
 
-	enquire.set_weighting_scheme(Xapian::BoolWeight());
-	enquire.set_docid_order(Xapian::Enquire::ASCENDING);
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_docid_order (Xapian::Enquire::DONT_CARE);
+	enquire.set_query (_notmuch_query_get_xapian_query (query));
 
-#if DEBUG_QUERY
-	fprintf (stderr, "Final query is:\n%s\n", final_query.get_description().c_str());
-#endif
+	/* Asking for no documents avoids collecting or sorting any
+	 * results, while 'checkatleast' forces every match to be
+	 * counted, (rather than estimated). */
+	if (approximate)
+	    mset = enquire.get_mset (0, 0);
+	else
+	    mset = enquire.get_mset (0, 0, notmuch->xapian_db->get_doccount ());
+
+	count = mset.get_matches_estimated ();
+
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
+    }
+
+    return count;
+}
+
+unsigned
+notmuch_query_count_messages (notmuch_query_t *query)
+{
+    return _notmuch_query_count_messages (query, FALSE);
+}
+
+unsigned
+notmuch_query_count_messages_approximate (notmuch_query_t *query)
+{
+    return _notmuch_query_count_messages (query, TRUE);
+}
+
+/* Return the thread ID of the document 'doc_id' as found in its
+ * thread term, (for documents indexed before the THREAD_ID value
+ * existed), or an empty string if it has none.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static std::string
+_notmuch_query_get_thread_term (notmuch_database_t *notmuch,
+				Xapian::docid doc_id)
+{
+    const char *prefix = _find_prefix ("thread");
+    Xapian::TermIterator i, end;
+    std::string term;
+
+    i = notmuch->xapian_db->termlist_begin (doc_id);
+    end = notmuch->xapian_db->termlist_end (doc_id);
+
+    i.skip_to (prefix);
+    if (i == end)
+	return "";
+
+    term = *i;
+    if (term[0] != *prefix)
+	return "";
+
+    return term.substr (1);
+}
+
+unsigned
+notmuch_query_count_threads (notmuch_query_t *query)
+{
+    notmuch_database_t *notmuch = query->notmuch;
+    Xapian::doccount count = 0;
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+	std::set<std::string> distinct_thread_ids;
+	notmuch_cached_results_t *results;
+	std::string thread_id;
+	notmuch_bool_t collapsed = TRUE;
+
+	results = _notmuch_query_load_cached_counts (query);
+	if (results) {
+	    count = results->num_threads;
+	    talloc_free (results);
+	    return count;
+	}
 
-	enquire.set_query (final_query);
+	/* Collapsing by THREAD_ID returns one document per thread. */
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_docid_order (Xapian::Enquire::DONT_CARE);
+	enquire.set_collapse_key (NOTMUCH_VALUE_THREAD_ID);
+	enquire.set_query (_notmuch_query_get_xapian_query (query));
 
 	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
 
-	count = mset.get_matches_estimated();
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    if (iterator.get_collapse_key ().empty ()) {
+		collapsed = FALSE;
+		break;
+	    }
+	}
+
+	if (collapsed) {
+	    count = mset.size ();
+	} else {
+	    /* Some documents lack the THREAD_ID value, (the database
+	     * not having been upgraded), so their thread terms must be
+	     * read and the threads counted by hand. */
+	    for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+		thread_id = iterator.get_collapse_key ();
+		if (thread_id.empty ())
+		    thread_id = _notmuch_query_get_thread_term (notmuch,
+								*iterator);
+		if (! thread_id.empty ())
+		    distinct_thread_ids.insert (thread_id);
+	    }
+
+	    count = distinct_thread_ids.size ();
+	}
 
     } catch (const Xapian::Error &error) {
 	fprintf (stderr, "A Xapian exception occurred: %s\n",
 		 error.get_msg().c_str());
 	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
     }
 
     return count;
 }
+
+/* Whether 'tag' is one of the NULL-terminated 'tags', (which may be
+ * NULL). */
+static notmuch_bool_t
+_tags_contain (const char **tags, const char *tag)
+{
+    if (tags == NULL)
+	return FALSE;
+
+    for (; *tags; tags++)
+	if (strcmp (*tags, tag) == 0)
+	    return TRUE;
+
+    return FALSE;
+}
+
+/* How many messages notmuch_query_change_tags changes in each atomic
+ * operation. */
+#define NOTMUCH_CHANGE_TAGS_BATCH 1000
+
+notmuch_status_t
+notmuch_query_change_tags (notmuch_query_t *query,
+			   const char **add_tags,
+			   const char **remove_tags,
+			   unsigned int *changed)
+{
+    notmuch_database_t *notmuch;
+    notmuch_message_t *message;
+    notmuch_private_status_t private_status;
+    notmuch_status_t status, end_status;
+    notmuch_bool_t in_atomic = FALSE;
+    const char **tag;
+    unsigned int i, done = 0;
+
+    if (changed)
+	*changed = 0;
+
+    if (query == NULL)
+	return NOTMUCH_STATUS_NULL_POINTER;
+
+    notmuch = query->notmuch;
+
+    status = _notmuch_database_ensure_writable (notmuch);
+    if (status)
+	return status;
+
+    for (tag = add_tags; tag && *tag; tag++)
+	if (strlen (*tag) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+    for (tag = remove_tags; tag && *tag; tag++)
+	if (strlen (*tag) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query mail_query (talloc_asprintf (query, "%s%s",
+						   _find_prefix ("type"),
+						   "mail"));
+	std::vector<Xapian::Query> changes;
+	std::vector<unsigned int> doc_ids;
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+	std::string term;
+
+	/* A message needs changing if it lacks a tag to add, or has a
+	 * tag to remove, (unless also added, since the additions are
+	 * made last). */
+	for (tag = add_tags; tag && *tag; tag++) {
+	    term = std::string (_find_prefix ("tag")) + *tag;
+	    changes.push_back (Xapian::Query (Xapian::Query::OP_AND_NOT,
+					      mail_query,
+					      Xapian::Query (term)));
+	}
+	for (tag = remove_tags; tag && *tag; tag++) {
+	    if (_tags_contain (add_tags, *tag))
+		continue;
+	    term = std::string (_find_prefix ("tag")) + *tag;
+	    changes.push_back (Xapian::Query (term));
+	}
+
+	if (changes.empty ())
+	    return NOTMUCH_STATUS_SUCCESS;
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_FILTER,
+					  _notmuch_query_get_xapian_query (query),
+					  Xapian::Query (Xapian::Query::OP_OR,
+							 changes.begin (),
+							 changes.end ())));
+
+	/* The matches are gathered before any is changed, (which
+	 * would invalidate the search), in document ID order. */
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+	doc_ids.reserve (mset.size ());
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++)
+	    doc_ids.push_back (*iterator);
+
+	for (i = 0; i < doc_ids.size (); i++) {
+	    if (! in_atomic) {
+		status = notmuch_database_begin_atomic (notmuch);
+		if (status)
+		    goto DONE;
+		in_atomic = TRUE;
+	    }
+
+	    message = _notmuch_message_create (query, notmuch, doc_ids[i],
+					       &private_status);
+	    if (message == NULL) {
+		status = COERCE_STATUS (private_status,
+					"Failed to find message to change tags");
+		goto DONE;
+	    }
+
+	    notmuch_message_freeze (message);
+
+	    for (tag = remove_tags; tag && *tag; tag++)
+		notmuch_message_remove_tag (message, *tag);
+
+	    for (tag = add_tags; tag && *tag; tag++)
+		notmuch_message_add_tag (message, *tag);
+
+	    notmuch_message_thaw (message);
+
+	    notmuch_message_destroy (message);
+
+	    done++;
+
+	    if (done % NOTMUCH_CHANGE_TAGS_BATCH == 0) {
+		in_atomic = FALSE;
+		status = notmuch_database_end_atomic (notmuch);
+		if (status)
+		    goto DONE;
+		if (changed)
+		    *changed = done;
+	    }
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred changing tags: %s\n",
+		 error.get_msg().c_str());
+	fprintf (stderr, "Query string was: %s\n", query->query_string);
+	notmuch->exception_reported = TRUE;
+	status = NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+    }
+
+  DONE:
+    /* Each message is changed whole, so the messages changed before
+     * any failure are kept. */
+    if (in_atomic) {
+	end_status = notmuch_database_end_atomic (notmuch);
+	if (status == NOTMUCH_STATUS_SUCCESS)
+	    status = end_status;
+	if (end_status == NOTMUCH_STATUS_SUCCESS && changed)
+	    *changed = done;
+    }
+
+    return status;
+}
@@ -0,0 +1,431 @@
+/* result-cache.cc - On-disk cache of the results of searches
+ *
+ * Copyright © 2026 The notmuch contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <dirent.h>
+#include <utime.h>
+
+#include <xapian.h>
+
+/* The results of a search are stored in a file within
+ * .notmuch/result-cache named by the SHA-1 of the query string and
+ * sort. Each file has the following layout, (in host byte order,
+ * since the cache is never shared between machines):
+ *
+ *	notmuch_result_cache_header_t
+ *	The query string, (header.query_length bytes, no terminator)
+ *	The ID of each thread of the results, in order,
+ *	(header.num_threads uint64_t)
+ *	The number of messages matched in each of those threads,
+ *	(header.num_threads uint32_t)
+ *	The document ID of each message matched, grouped by thread,
+ *	(header.num_messages uint32_t)
+ *
+ * A file is only valid for the database revision and last document
+ * ID recorded in its header. Any change to a mail document increments
+ * the revision, (see _notmuch_database_modified), so a stale file is
+ * recognized from its header alone.
+ *
+ * Results are only stored for a search that is repeated, (so that
+ * one-off searches don't push out the results of those that are
+ * not). The keys of recent searches are kept, one per line, most
+ * recent last, in the file .seen within the same directory.
+ */
+
+#define NOTMUCH_RESULT_CACHE_MAGIC "notmuchR"
+#define NOTMUCH_RESULT_CACHE_VERSION 3
+
+/* No more than this many results files are kept, (the least recently
+ * used being removed first). */
+#define NOTMUCH_RESULT_CACHE_MAX_FILES 64
+
+/* No more than this many recent searches are remembered in .seen. */
+#define NOTMUCH_RESULT_CACHE_MAX_SEEN 256
+
+/* The length of a key, (a SHA-1 in hex), in .seen. */
+#define NOTMUCH_RESULT_CACHE_KEY_LENGTH 40
+
+typedef struct _notmuch_result_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t sort;
+    uint64_t revision;
+    uint32_t last_doc_id;
+    uint32_t query_length;
+    uint32_t num_threads;
+    uint32_t num_messages;
+} notmuch_result_cache_header_t;
+
+static char *
+_result_cache_directory (void *ctx, notmuch_database_t *notmuch)
+{
+    return talloc_asprintf (ctx, "%s/.notmuch/result-cache", notmuch->path);
+}
+
+/* Return the query string with surrounding whitespace removed and
+ * each run of whitespace reduced to a single space, (which doesn't
+ * change the meaning of the query). */
+static char *
+_result_cache_normalize_query (void *ctx, const char *query_string)
+{
+    char *normalized, *out;
+    const char *s;
+
+    normalized = talloc_array (ctx, char, strlen (query_string) + 1);
+    out = normalized;
+
+    for (s = query_string; *s; s++) {
+	if (isspace (*s)) {
+	    if (out > normalized && out[-1] != ' ')
+		*out++ = ' ';
+	} else {
+	    *out++ = *s;
+	}
+    }
+
+    if (out > normalized && out[-1] == ' ')
+	out--;
+    *out = '\0';
+
+    return normalized;
+}
+
+/* Return the key of the (normalized) 'query_string' with 'sort',
+ * naming its results file. */
+static char *
+_result_cache_key (void *ctx, const char *query_string, notmuch_sort_t sort)
+{
+    char *key, *sha1, *ret;
+
+    key = talloc_asprintf (ctx, "%d:%s", sort, query_string);
+    sha1 = notmuch_sha1_of_string (key);
+
+    ret = talloc_strdup (ctx, sha1);
+
+    free (sha1);
+    talloc_free (key);
+
+    return ret;
+}
+
+static char *
+_result_cache_filename (void *ctx, notmuch_database_t *notmuch,
+			const char *query_string, notmuch_sort_t sort)
+{
+    return talloc_asprintf (ctx, "%s/%s",
+			    _result_cache_directory (ctx, notmuch),
+			    _result_cache_key (ctx, query_string, sort));
+}
+
+notmuch_bool_t
+_notmuch_result_cache_enabled (notmuch_database_t *notmuch)
+{
+    return notmuch->mode == NOTMUCH_DATABASE_MODE_READ_ONLY;
+}
+
+notmuch_bool_t
+_notmuch_result_cache_wanted (notmuch_database_t *notmuch,
+			      const char *query_string,
+			      notmuch_sort_t sort)
+{
+    void *local;
+    char *directory, *filename, *temp_filename, *key;
+    char line[NOTMUCH_RESULT_CACHE_KEY_LENGTH + 2];
+    char **seen;
+    unsigned int i, num_seen = 0;
+    notmuch_bool_t found = FALSE, written;
+    FILE *file;
+
+    if (! _notmuch_result_cache_enabled (notmuch))
+	return FALSE;
+
+    local = talloc_new (NULL);
+
+    directory = _result_cache_directory (local, notmuch);
+    filename = talloc_asprintf (local, "%s/.seen", directory);
+    temp_filename = talloc_asprintf (local, "%s.tmp.%d",
+				     filename, (int) getpid ());
+    key = _result_cache_key (local,
+			     _result_cache_normalize_query (local, query_string),
+			     sort);
+
+    /* One more than the limit, for this search's key. */
+    seen = talloc_array (local, char *, NOTMUCH_RESULT_CACHE_MAX_SEEN + 1);
+    if (seen == NULL)
+	goto DONE;
+
+    file = fopen (filename, "r");
+    if (file) {
+	while (num_seen < NOTMUCH_RESULT_CACHE_MAX_SEEN &&
+	       fgets (line, sizeof (line), file))
+	{
+	    line[strcspn (line, "\n")] = '\0';
+	    if (strlen (line) != NOTMUCH_RESULT_CACHE_KEY_LENGTH)
+		continue;
+
+	    if (strcmp (line, key) == 0) {
+		found = TRUE;
+		continue;
+	    }
+
+	    seen[num_seen++] = talloc_strdup (seen, line);
+	}
+	fclose (file);
+    }
+
+    /* Remember this search as the most recent, forgetting the
+     * oldest if there are too many. */
+    seen[num_seen++] = key;
+    i = 0;
+    if (num_seen > NOTMUCH_RESULT_CACHE_MAX_SEEN)
+	i = num_seen - NOTMUCH_RESULT_CACHE_MAX_SEEN;
+
+    /* As with the results, failing to write this is not an error. */
+    mkdir (directory, 0755);
+
+    file = fopen (temp_filename, "w");
+    if (file == NULL)
+	goto DONE;
+
+    for (; i < num_seen; i++)
+	fprintf (file, "%s\n", seen[i]);
+
+    written = ! ferror (file);
+
+    if (fclose (file) || ! written ||
+	rename (temp_filename, filename))
+    {
+	unlink (temp_filename);
+    }
+
+  DONE:
+    talloc_free (local);
+
+    return found;
+}
+
+notmuch_cached_results_t *
+_notmuch_result_cache_load (void *ctx,
+			    notmuch_database_t *notmuch,
+			    const char *query_string,
+			    notmuch_sort_t sort,
+			    notmuch_bool_t counts_only)
+{
+    void *local;
+    notmuch_result_cache_header_t header;
+    notmuch_cached_results_t *results;
+    char *normalized, *filename, *stored_query;
+    size_t query_length;
+    unsigned int i, num_messages;
+    notmuch_cached_results_t *ret = NULL;
+    FILE *file;
+
+    if (! _notmuch_result_cache_enabled (notmuch))
+	return NULL;
+
+    local = talloc_new (ctx);
+
+    normalized = _result_cache_normalize_query (local, query_string);
+    filename = _result_cache_filename (local, notmuch, normalized, sort);
+
+    file = fopen (filename, "r");
+    if (file == NULL)
+	goto DONE;
+
+    query_length = strlen (normalized);
+
+    if (fread (&header, sizeof (header), 1, file) != 1 ||
+	memcmp (header.magic, NOTMUCH_RESULT_CACHE_MAGIC, sizeof (header.magic)) ||
+	header.version != NOTMUCH_RESULT_CACHE_VERSION ||
+	header.sort != (uint32_t) sort ||
+	header.revision != notmuch->revision ||
+	header.last_doc_id != notmuch->xapian_db->get_lastdocid () ||
+	header.query_length != query_length)
+    {
+	goto DONE;
+    }
+
+    stored_query = talloc_array (local, char, query_length + 1);
+    if (stored_query == NULL ||
+	fread (stored_query, 1, query_length, file) != query_length ||
+	memcmp (stored_query, normalized, query_length))
+    {
+	goto DONE;
+    }
+
+    results = talloc (local, notmuch_cached_results_t);
+    if (results == NULL)
+	goto DONE;
+
+    results->num_threads = header.num_threads;
+    results->num_messages = header.num_messages;
+    results->thread_ids = NULL;
+    results->thread_matches = NULL;
+    results->doc_ids = NULL;
+
+    /* The caller may only want the counts. */
+    if (! counts_only) {
+	results->thread_ids = talloc_array (results, uint64_t,
+					    header.num_threads + 1);
+	results->thread_matches = talloc_array (results, unsigned int,
+						header.num_threads + 1);
+	results->doc_ids = talloc_array (results, unsigned int,
+					 header.num_messages + 1);
+	if (results->thread_ids == NULL ||
+	    results->thread_matches == NULL ||
+	    results->doc_ids == NULL ||
+	    fread (results->thread_ids, sizeof (uint64_t),
+		   header.num_threads, file) != header.num_threads ||
+	    fread (results->thread_matches, sizeof (uint32_t),
+		   header.num_threads, file) != header.num_threads ||
+	    fread (results->doc_ids, sizeof (uint32_t),
+		   header.num_messages, file) != header.num_messages)
+	{
+	    goto DONE;
+	}
+
+	/* Don't trust a file whose groups don't add up. */
+	num_messages = 0;
+	for (i = 0; i < header.num_threads; i++)
+	    num_messages += results->thread_matches[i];
+	if (num_messages != header.num_messages)
+	    goto DONE;
+    }
+
+    /* Keep recently used files from being removed. */
+    utime (filename, NULL);
+
+    ret = talloc_steal (ctx, results);
+
+  DONE:
+    if (file)
+	fclose (file);
+    talloc_free (local);
+
+    return ret;
+}
+
+/* Remove the least recently used results files while there are more
+ * than NOTMUCH_RESULT_CACHE_MAX_FILES. */
+static void
+_result_cache_expire (void *ctx, const char *directory)
+{
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char *path, *oldest = NULL;
+    time_t oldest_time = 0;
+    unsigned int files;
+
+    do {
+	dir = opendir (directory);
+	if (dir == NULL)
+	    return;
+
+	files = 0;
+	while ((entry = readdir (dir)) != NULL) {
+	    if (entry->d_name[0] == '.')
+		continue;
+
+	    path = talloc_asprintf (ctx, "%s/%s", directory, entry->d_name);
+	    if (stat (path, &st) == 0) {
+		files++;
+		if (oldest == NULL || st.st_mtime < oldest_time) {
+		    talloc_free (oldest);
+		    oldest = path;
+		    oldest_time = st.st_mtime;
+		    continue;
+		}
+	    }
+	    talloc_free (path);
+	}
+
+	closedir (dir);
+
+	if (files > NOTMUCH_RESULT_CACHE_MAX_FILES && oldest)
+	    unlink (oldest);
+
+	talloc_free (oldest);
+	oldest = NULL;
+    } while (files > NOTMUCH_RESULT_CACHE_MAX_FILES + 1);
+}
+
+void
+_notmuch_result_cache_store (notmuch_database_t *notmuch,
+			     const char *query_string,
+			     notmuch_sort_t sort,
+			     const notmuch_cached_results_t *results)
+{
+    void *local;
+    notmuch_result_cache_header_t header;
+    char *directory, *filename, *temp_filename;
+    FILE *file;
+    notmuch_bool_t written;
+
+    if (! _notmuch_result_cache_enabled (notmuch))
+	return;
+
+    local = talloc_new (NULL);
+
+    query_string = _result_cache_normalize_query (local, query_string);
+    directory = _result_cache_directory (local, notmuch);
+    filename = _result_cache_filename (local, notmuch, query_string, sort);
+    temp_filename = talloc_asprintf (local, "%s.tmp.%d",
+				     filename, (int) getpid ());
+
+    /* The cache is merely an optimization, so failing to create it,
+     * (such as for lack of permission), is not an error. */
+    mkdir (directory, 0755);
+
+    file = fopen (temp_filename, "w");
+    if (file == NULL)
+	goto DONE;
+
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, NOTMUCH_RESULT_CACHE_MAGIC, sizeof (header.magic));
+    header.version = NOTMUCH_RESULT_CACHE_VERSION;
+    header.sort = sort;
+    header.revision = notmuch->revision;
+    header.last_doc_id = notmuch->xapian_db->get_lastdocid ();
+    header.query_length = strlen (query_string);
+    header.num_threads = results->num_threads;
+    header.num_messages = results->num_messages;
+
+    written = (fwrite (&header, sizeof (header), 1, file) == 1 &&
+	       fwrite (query_string, 1, header.query_length, file) == header.query_length &&
+	       fwrite (results->thread_ids, sizeof (uint64_t),
+		       header.num_threads, file) == header.num_threads &&
+	       fwrite (results->thread_matches, sizeof (uint32_t),
+		       header.num_threads, file) == header.num_threads &&
+	       fwrite (results->doc_ids, sizeof (uint32_t),
+		       header.num_messages, file) == header.num_messages);
+
+    if (fclose (file) || ! written ||
+	rename (temp_filename, filename))
+    {
+	unlink (temp_filename);
+	goto DONE;
+    }
+
+    _result_cache_expire (local, directory);
+
+  DONE:
+    talloc_free (local);
+}
@@ -51,13 +51,26 @@ _hex_of_sha1_digest (const unsigned char digest[SHA1_DIGEST_SIZE])
  */
 char *
 notmuch_sha1_of_string (const char *str)
+{
+    return notmuch_sha1_of_buffer (str, strlen (str) + 1);
+}
+
+/* Create a hexadecimal string version of the SHA-1 digest of the
+ * 'length' bytes at 'data', (the same as notmuch_sha1_of_file for a
+ * file with those contents).
+ *
+ * This function returns a newly allocated string which the caller
+ * should free() when finished.
+ */
+char *
+notmuch_sha1_of_buffer (const void *data, size_t length)
 {
     sha1_ctx sha1;
     unsigned char digest[SHA1_DIGEST_SIZE];
 
     sha1_begin (&sha1);
 
-    sha1_hash ((unsigned char *) str, strlen (str) + 1, &sha1);
+    sha1_hash ((const unsigned char *) data, length, &sha1);
 
     sha1_end (digest, &sha1);
 
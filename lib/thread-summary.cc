@@ -0,0 +1,899 @@
+/* thread-summary.cc - Per-thread summaries maintained with each change
+ *
+ * Copyright © 2026 The notmuch contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-private.h"
+#include "database-private.h"
+
+#include <glib.h> /* GHashTable */
+
+#include <xapian.h>
+
+/* The summary of each thread is stored in the database metadata
+ * under the key "thread_summary_<thread_id>" as a sequence of
+ * NUL-terminated fields:
+ *
+ *	The format version, ("1")
+ *	Whether the summary is stale, ("0" or "1")
+ *	The total number of messages
+ *	The number of distinct tags, then for each tag:
+ *		The tag
+ *		The number of messages with the tag
+ *	The number of distinct authors, then for each author, in the
+ *	order in which they first appear in the thread:
+ *		The author, (as shown by notmuch_thread_get_authors)
+ *		The number of messages by the author
+ *		The date of the earliest of those messages
+ *		The document ID of that message
+ *
+ * All numbers are written in decimal.
+ *
+ * Removing an author's earliest message from a thread leaves the
+ * order of its authors unknown. Rather than rebuilding the summary
+ * from all of the thread's messages for each such removal, (which
+ * happens for every message moved when threads are merged), the
+ * summary is marked as stale and rebuilt when the database is closed,
+ * (see _notmuch_thread_summaries_refresh). Readers ignore stale
+ * summaries.
+ *
+ * Within an atomic operation, each changed summary is kept in memory,
+ * (in notmuch->changed_thread_summaries), and written once when the
+ * operation ends, rather than with every change to its messages.
+ */
+
+#define NOTMUCH_THREAD_SUMMARY_FORMAT "1"
+
+struct _notmuch_thread_contribution {
+    const char *thread_id;
+    unsigned int doc_id;
+    time_t date;
+    const char *from;
+    GPtrArray *tags;
+
+    /* The author, (parsed from 'from' only when needed). */
+    notmuch_bool_t author_parsed;
+    const char *author;
+};
+
+struct _notmuch_thread_summary_builder {
+    notmuch_database_t *notmuch;
+
+    /* Thread ID -> notmuch_thread_summary_t */
+    GHashTable *summaries;
+};
+
+static char *
+_thread_summary_key (void *ctx, const char *thread_id)
+{
+    return talloc_asprintf (ctx, "thread_summary_%s", thread_id);
+}
+
+static int
+_thread_contribution_destructor (notmuch_thread_contribution_t *contribution)
+{
+    g_ptr_array_free (contribution->tags, TRUE);
+
+    return 0;
+}
+
+/* Read the contribution of 'doc', (a mail document with ID 'doc_id'),
+ * to the summary of its thread. Returns NULL for a document that
+ * belongs to no thread.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_thread_contribution_t *
+_thread_contribution_create (void *ctx,
+			     Xapian::Document &doc,
+			     unsigned int doc_id)
+{
+    notmuch_thread_contribution_t *contribution;
+    const char *prefix = _find_prefix ("tag");
+    Xapian::TermIterator i, end;
+    std::string value, term;
+
+    value = doc.get_value (NOTMUCH_VALUE_THREAD_ID);
+    if (value.empty ())
+	return NULL;
+
+    contribution = talloc (ctx, notmuch_thread_contribution_t);
+    if (unlikely (contribution == NULL))
+	return NULL;
+
+    contribution->thread_id = talloc_strdup (contribution, value.c_str ());
+    contribution->doc_id = doc_id;
+    contribution->date = (time_t) Xapian::sortable_unserialise (
+	doc.get_value (NOTMUCH_VALUE_TIMESTAMP));
+
+    contribution->from = talloc_strdup (contribution,
+					doc.get_value (NOTMUCH_VALUE_FROM).c_str ());
+    contribution->author_parsed = FALSE;
+    contribution->author = NULL;
+
+    contribution->tags = g_ptr_array_new ();
+    talloc_set_destructor (contribution, _thread_contribution_destructor);
+
+    end = doc.termlist_end ();
+    for (i = doc.termlist_begin (), i.skip_to (prefix); i != end; i++) {
+	term = *i;
+	if (term.empty () || term[0] != *prefix)
+	    break;
+	g_ptr_array_add (contribution->tags,
+			 talloc_strdup (contribution, term.c_str () + 1));
+    }
+
+    return contribution;
+}
+
+static notmuch_bool_t
+_thread_contribution_has_tag (notmuch_thread_contribution_t *contribution,
+			      const char *tag)
+{
+    unsigned int i;
+
+    for (i = 0; i < contribution->tags->len; i++) {
+	if (strcmp ((char *) g_ptr_array_index (contribution->tags, i),
+		    tag) == 0)
+	{
+	    return TRUE;
+	}
+    }
+
+    return FALSE;
+}
+
+static const char *
+_thread_contribution_get_author (notmuch_thread_contribution_t *contribution)
+{
+    if (! contribution->author_parsed) {
+	contribution->author = _notmuch_thread_author_from_header (
+	    contribution, contribution->from);
+	contribution->author_parsed = TRUE;
+    }
+
+    return contribution->author;
+}
+
+static notmuch_thread_summary_t *
+_thread_summary_create (void *ctx, const char *thread_id)
+{
+    notmuch_thread_summary_t *summary;
+
+    summary = talloc (ctx, notmuch_thread_summary_t);
+    if (unlikely (summary == NULL))
+	return NULL;
+
+    summary->thread_id = talloc_strdup (summary, thread_id);
+    summary->stale = FALSE;
+    summary->total_messages = 0;
+    summary->num_tags = 0;
+    summary->tags = NULL;
+    summary->num_authors = 0;
+    summary->authors = NULL;
+
+    return summary;
+}
+
+/* Add 'delta', (1 or -1), to the number of messages in the thread
+ * with 'tag'. */
+static void
+_thread_summary_count_tag (notmuch_thread_summary_t *summary,
+			   const char *tag,
+			   int delta)
+{
+    unsigned int i;
+
+    for (i = 0; i < summary->num_tags; i++) {
+	if (strcmp (summary->tags[i].name, tag) == 0)
+	    break;
+    }
+
+    if (i == summary->num_tags) {
+	if (delta < 0)
+	    return;
+	summary->tags = talloc_realloc (summary, summary->tags,
+					notmuch_thread_summary_tag_t,
+					summary->num_tags + 1);
+	summary->tags[i].name = talloc_strdup (summary, tag);
+	summary->tags[i].count = 0;
+	summary->num_tags++;
+    }
+
+    if (delta < 0 && summary->tags[i].count <= 1) {
+	talloc_free (summary->tags[i].name);
+	summary->num_tags--;
+	memmove (&summary->tags[i], &summary->tags[i + 1],
+		 (summary->num_tags - i) * sizeof (summary->tags[0]));
+	return;
+    }
+
+    summary->tags[i].count += delta;
+}
+
+/* Whether an author's earliest message, (date, doc_id), precedes
+ * that of 'author'. Messages of the same date are ordered by document
+ * ID, (as a thread's messages are). */
+static notmuch_bool_t
+_thread_summary_author_precedes (time_t date, unsigned int doc_id,
+				 notmuch_thread_summary_author_t *author)
+{
+    if (date != author->date)
+	return date < author->date;
+
+    return doc_id < author->doc_id;
+}
+
+/* Move the author at index 'i' so that the authors remain ordered by
+ * their earliest messages. */
+static void
+_thread_summary_place_author (notmuch_thread_summary_t *summary,
+			      unsigned int i)
+{
+    notmuch_thread_summary_author_t author = summary->authors[i];
+
+    while (i > 0 &&
+	   _thread_summary_author_precedes (author.date, author.doc_id,
+					    &summary->authors[i - 1]))
+    {
+	summary->authors[i] = summary->authors[i - 1];
+	i--;
+    }
+
+    summary->authors[i] = author;
+}
+
+static void
+_thread_summary_add (notmuch_thread_summary_t *summary,
+		     notmuch_thread_contribution_t *contribution)
+{
+    notmuch_thread_summary_author_t *author;
+    const char *name;
+    unsigned int i;
+
+    summary->total_messages++;
+
+    for (i = 0; i < contribution->tags->len; i++)
+	_thread_summary_count_tag (summary,
+				   (char *) g_ptr_array_index (contribution->tags, i),
+				   1);
+
+    name = _thread_contribution_get_author (contribution);
+    if (name == NULL)
+	return;
+
+    for (i = 0; i < summary->num_authors; i++) {
+	if (strcmp (summary->authors[i].name, name) == 0)
+	    break;
+    }
+
+    if (i == summary->num_authors) {
+	summary->authors = talloc_realloc (summary, summary->authors,
+					   notmuch_thread_summary_author_t,
+					   summary->num_authors + 1);
+	author = &summary->authors[i];
+	author->name = talloc_strdup (summary, name);
+	author->count = 1;
+	author->date = contribution->date;
+	author->doc_id = contribution->doc_id;
+	summary->num_authors++;
+    } else {
+	author = &summary->authors[i];
+	author->count++;
+	if (! _thread_summary_author_precedes (contribution->date,
+					       contribution->doc_id,
+					       author))
+	{
+	    return;
+	}
+	author->date = contribution->date;
+	author->doc_id = contribution->doc_id;
+    }
+
+    _thread_summary_place_author (summary, i);
+}
+
+static void
+_thread_summary_remove (notmuch_thread_summary_t *summary,
+			notmuch_thread_contribution_t *contribution)
+{
+    notmuch_thread_summary_author_t *author;
+    const char *name;
+    unsigned int i;
+
+    if (summary->total_messages)
+	summary->total_messages--;
+
+    for (i = 0; i < contribution->tags->len; i++)
+	_thread_summary_count_tag (summary,
+				   (char *) g_ptr_array_index (contribution->tags, i),
+				   -1);
+
+    name = _thread_contribution_get_author (contribution);
+    if (name == NULL)
+	return;
+
+    for (i = 0; i < summary->num_authors; i++) {
+	if (strcmp (summary->authors[i].name, name) == 0)
+	    break;
+    }
+
+    if (i == summary->num_authors)
+	return;
+
+    author = &summary->authors[i];
+
+    if (author->count <= 1) {
+	talloc_free (author->name);
+	summary->num_authors--;
+	memmove (&summary->authors[i], &summary->authors[i + 1],
+		 (summary->num_authors - i) * sizeof (summary->authors[0]));
+	return;
+    }
+
+    author->count--;
+
+    if (author->doc_id == contribution->doc_id)
+	summary->stale = TRUE;
+}
+
+/* Parse the next NUL-terminated field from [*s, end). */
+static const char *
+_thread_summary_next_field (const char **s, const char *end)
+{
+    const char *field = *s;
+    const char *nul;
+
+    if (field >= end)
+	return NULL;
+
+    nul = (const char *) memchr (field, '\0', end - field);
+    if (nul == NULL)
+	return NULL;
+
+    *s = nul + 1;
+
+    return field;
+}
+
+static notmuch_bool_t
+_thread_summary_next_number (const char **s, const char *end,
+			     unsigned long long *number)
+{
+    const char *field;
+    char *field_end;
+
+    field = _thread_summary_next_field (s, end);
+    if (field == NULL || *field == '\0')
+	return FALSE;
+
+    *number = strtoull (field, &field_end, 10);
+
+    return *field_end == '\0';
+}
+
+static notmuch_thread_summary_t *
+_thread_summary_parse (void *ctx, const char *thread_id,
+		       const std::string &data)
+{
+    notmuch_thread_summary_t *summary;
+    const char *s = data.data ();
+    const char *end = s + data.size ();
+    const char *field;
+    unsigned long long number, count;
+    unsigned int i;
+
+    field = _thread_summary_next_field (&s, end);
+    if (field == NULL || strcmp (field, NOTMUCH_THREAD_SUMMARY_FORMAT))
+	return NULL;
+
+    summary = _thread_summary_create (ctx, thread_id);
+    if (unlikely (summary == NULL))
+	return NULL;
+
+    if (! _thread_summary_next_number (&s, end, &number))
+	goto FAIL;
+    summary->stale = (number != 0);
+
+    if (! _thread_summary_next_number (&s, end, &number))
+	goto FAIL;
+    summary->total_messages = number;
+
+    if (! _thread_summary_next_number (&s, end, &count) ||
+	count > data.size ())
+    {
+	goto FAIL;
+    }
+    summary->tags = talloc_array (summary, notmuch_thread_summary_tag_t,
+				  count);
+    for (i = 0; i < count; i++) {
+	field = _thread_summary_next_field (&s, end);
+	if (field == NULL || ! _thread_summary_next_number (&s, end, &number))
+	    goto FAIL;
+	summary->tags[i].name = talloc_strdup (summary, field);
+	summary->tags[i].count = number;
+    }
+    summary->num_tags = count;
+
+    if (! _thread_summary_next_number (&s, end, &count) ||
+	count > data.size ())
+    {
+	goto FAIL;
+    }
+    summary->authors = talloc_array (summary, notmuch_thread_summary_author_t,
+				     count);
+    for (i = 0; i < count; i++) {
+	field = _thread_summary_next_field (&s, end);
+	if (field == NULL || ! _thread_summary_next_number (&s, end, &number))
+	    goto FAIL;
+	summary->authors[i].name = talloc_strdup (summary, field);
+	summary->authors[i].count = number;
+	if (! _thread_summary_next_number (&s, end, &number))
+	    goto FAIL;
+	summary->authors[i].date = number;
+	if (! _thread_summary_next_number (&s, end, &number))
+	    goto FAIL;
+	summary->authors[i].doc_id = number;
+    }
+    summary->num_authors = count;
+
+    return summary;
+
+  FAIL:
+    talloc_free (summary);
+    return NULL;
+}
+
+static void
+_thread_summary_append_field (std::string &data, const char *field)
+{
+    data.append (field);
+    data.push_back ('\0');
+}
+
+static void
+_thread_summary_append_number (std::string &data, unsigned long long number)
+{
+    char buf[32];
+
+    snprintf (buf, sizeof (buf), "%llu", number);
+    _thread_summary_append_field (data, buf);
+}
+
+static std::string
+_thread_summary_serialize (notmuch_thread_summary_t *summary)
+{
+    std::string data;
+    unsigned int i;
+
+    _thread_summary_append_field (data, NOTMUCH_THREAD_SUMMARY_FORMAT);
+    _thread_summary_append_number (data, summary->stale ? 1 : 0);
+    _thread_summary_append_number (data, summary->total_messages);
+
+    _thread_summary_append_number (data, summary->num_tags);
+    for (i = 0; i < summary->num_tags; i++) {
+	_thread_summary_append_field (data, summary->tags[i].name);
+	_thread_summary_append_number (data, summary->tags[i].count);
+    }
+
+    _thread_summary_append_number (data, summary->num_authors);
+    for (i = 0; i < summary->num_authors; i++) {
+	_thread_summary_append_field (data, summary->authors[i].name);
+	_thread_summary_append_number (data, summary->authors[i].count);
+	_thread_summary_append_number (data, summary->authors[i].date);
+	_thread_summary_append_number (data, summary->authors[i].doc_id);
+    }
+
+    return data;
+}
+
+/* Load the summary of 'thread_id', (stale or not), or create an empty
+ * one if there is none. A summary changed within the current atomic
+ * operation is returned as it is, (rather than talloced from 'ctx').
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_thread_summary_t *
+_thread_summary_load (void *ctx, notmuch_database_t *notmuch,
+		      const char *thread_id)
+{
+    notmuch_thread_summary_t *summary;
+    char *key;
+    std::string data;
+
+    if (notmuch->changed_thread_summaries) {
+	summary = (notmuch_thread_summary_t *)
+	    g_hash_table_lookup (notmuch->changed_thread_summaries, thread_id);
+	if (summary)
+	    return summary;
+    }
+
+    key = _thread_summary_key (ctx, thread_id);
+    data = notmuch->xapian_db->get_metadata (key);
+    talloc_free (key);
+
+    summary = NULL;
+    if (! data.empty ())
+	summary = _thread_summary_parse (ctx, thread_id, data);
+
+    /* A summary that can't be parsed is rebuilt from scratch. */
+    if (summary == NULL && ! data.empty ()) {
+	summary = _thread_summary_create (ctx, thread_id);
+	if (summary)
+	    summary->stale = TRUE;
+    }
+
+    if (summary == NULL)
+	summary = _thread_summary_create (ctx, thread_id);
+
+    return summary;
+}
+
+/* Write 'summary' to the database, (removing it for a thread with no
+ * messages).
+ *
+ * This function may throw a Xapian::Error.
+ */
+static void
+_thread_summary_write (notmuch_database_t *notmuch,
+		       notmuch_thread_summary_t *summary)
+{
+    Xapian::WritableDatabase *db;
+    char *key;
+
+    db = static_cast <Xapian::WritableDatabase *> (notmuch->xapian_db);
+
+    key = _thread_summary_key (summary, summary->thread_id);
+
+    if (summary->total_messages == 0 && ! summary->stale)
+	db->set_metadata (key, "");
+    else
+	db->set_metadata (key, _thread_summary_serialize (summary));
+
+    talloc_free (key);
+}
+
+static void
+_thread_summary_free_for_g_hash (void *ptr)
+{
+    talloc_free (ptr);
+}
+
+/* Store the changed 'summary', and remember stale summaries for
+ * rebuilding. Within an atomic operation, the summary is stolen by
+ * 'notmuch' and written when the operation ends, (see
+ * _notmuch_thread_summaries_refresh). Otherwise it's written now.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static void
+_thread_summary_store (notmuch_database_t *notmuch,
+		       notmuch_thread_summary_t *summary)
+{
+    GHashTable *changed;
+
+    if (notmuch->atomic_nesting) {
+	if (notmuch->changed_thread_summaries == NULL) {
+	    notmuch->changed_thread_summaries =
+		g_hash_table_new_full (g_str_hash, g_str_equal,
+				       NULL, _thread_summary_free_for_g_hash);
+	}
+	changed = notmuch->changed_thread_summaries;
+
+	/* Replacing a summary frees it, (along with its key). */
+	if (g_hash_table_lookup (changed, summary->thread_id) != summary) {
+	    talloc_steal (notmuch, summary);
+	    g_hash_table_replace (changed, summary->thread_id, summary);
+	}
+    } else {
+	_thread_summary_write (notmuch, summary);
+    }
+
+    if (summary->stale) {
+	if (notmuch->stale_thread_summaries == NULL)
+	    notmuch->stale_thread_summaries = g_hash_table_new (g_str_hash,
+								g_str_equal);
+	if (! g_hash_table_lookup_extended (notmuch->stale_thread_summaries,
+					    summary->thread_id, NULL, NULL))
+	{
+	    g_hash_table_insert (notmuch->stale_thread_summaries,
+				 talloc_strdup (notmuch, summary->thread_id),
+				 NULL);
+	}
+    }
+}
+
+/* Build the summary of 'thread_id' from all of its messages.
+ *
+ * This function may throw a Xapian::Error.
+ */
+static notmuch_thread_summary_t *
+_thread_summary_rebuild (void *ctx, notmuch_database_t *notmuch,
+			 const char *thread_id)
+{
+    notmuch_thread_summary_t *summary;
+    notmuch_thread_contribution_t *contribution;
+    Xapian::PostingIterator i, end;
+    Xapian::Document doc;
+    char *term;
+
+    summary = _thread_summary_create (ctx, thread_id);
+    if (unlikely (summary == NULL))
+	return NULL;
+
+    term = talloc_asprintf (summary, "%s%s", _find_prefix ("thread"),
+			    thread_id);
+
+    end = notmuch->xapian_db->postlist_end (term);
+    for (i = notmuch->xapian_db->postlist_begin (term); i != end; i++) {
+	doc = notmuch->xapian_db->get_document (*i);
+	contribution = _thread_contribution_create (summary, doc, *i);
+	if (contribution == NULL)
+	    continue;
+	_thread_summary_add (summary, contribution);
+	talloc_free (contribution);
+    }
+
+    talloc_free (term);
+
+    return summary;
+}
+
+notmuch_thread_contribution_t *
+_notmuch_thread_contribution_create (void *ctx,
+				     notmuch_database_t *notmuch,
+				     Xapian::Document &doc,
+				     unsigned int doc_id)
+{
+    if (! notmuch->thread_summaries)
+	return NULL;
+
+    return _thread_contribution_create (ctx, doc, doc_id);
+}
+
+notmuch_thread_summary_t *
+_notmuch_thread_summary_get (void *ctx,
+			     notmuch_database_t *notmuch,
+			     const char *thread_id)
+{
+    notmuch_thread_summary_t *summary;
+    char *key;
+    std::string data;
+
+    if (! notmuch->thread_summaries)
+	return NULL;
+
+    summary = NULL;
+    if (notmuch->changed_thread_summaries) {
+	summary = (notmuch_thread_summary_t *)
+	    g_hash_table_lookup (notmuch->changed_thread_summaries, thread_id);
+    }
+
+    if (summary) {
+	data = _thread_summary_serialize (summary);
+    } else {
+	key = _thread_summary_key (ctx, thread_id);
+	data = notmuch->xapian_db->get_metadata (key);
+	talloc_free (key);
+    }
+
+    if (data.empty ())
+	return NULL;
+
+    summary = _thread_summary_parse (ctx, thread_id, data);
+    if (summary && summary->stale) {
+	talloc_free (summary);
+	return NULL;
+    }
+
+    return summary;
+}
+
+void
+_notmuch_thread_summary_update (notmuch_database_t *notmuch,
+				unsigned int doc_id,
+				notmuch_thread_contribution_t *old_contribution,
+				Xapian::Document *new_doc)
+{
+    void *local;
+    notmuch_thread_contribution_t *new_contribution;
+    notmuch_thread_summary_t *summary;
+    unsigned int i;
+    const char *tag;
+    notmuch_bool_t changed;
+
+    if (! notmuch->thread_summaries)
+	return;
+
+    local = talloc_new (notmuch);
+
+    new_contribution = NULL;
+    if (new_doc)
+	new_contribution = _thread_contribution_create (local, *new_doc,
+							doc_id);
+
+    /* The common case of a change in tags only is applied to the
+     * counts of those tags. */
+    if (old_contribution && new_contribution &&
+	strcmp (old_contribution->thread_id,
+		new_contribution->thread_id) == 0 &&
+	old_contribution->date == new_contribution->date &&
+	strcmp (old_contribution->from, new_contribution->from) == 0)
+    {
+	summary = _thread_summary_load (local, notmuch,
+					new_contribution->thread_id);
+	changed = FALSE;
+
+	for (i = 0; i < new_contribution->tags->len; i++) {
+	    tag = (char *) g_ptr_array_index (new_contribution->tags, i);
+	    if (! _thread_contribution_has_tag (old_contribution, tag)) {
+		_thread_summary_count_tag (summary, tag, 1);
+		changed = TRUE;
+	    }
+	}
+
+	for (i = 0; i < old_contribution->tags->len; i++) {
+	    tag = (char *) g_ptr_array_index (old_contribution->tags, i);
+	    if (! _thread_contribution_has_tag (new_contribution, tag)) {
+		_thread_summary_count_tag (summary, tag, -1);
+		changed = TRUE;
+	    }
+	}
+
+	if (changed)
+	    _thread_summary_store (notmuch, summary);
+
+	goto DONE;
+    }
+
+    if (old_contribution) {
+	summary = _thread_summary_load (local, notmuch,
+					old_contribution->thread_id);
+	_thread_summary_remove (summary, old_contribution);
+	_thread_summary_store (notmuch, summary);
+    }
+
+    if (new_contribution) {
+	summary = _thread_summary_load (local, notmuch,
+					new_contribution->thread_id);
+	_thread_summary_add (summary, new_contribution);
+	_thread_summary_store (notmuch, summary);
+    }
+
+  DONE:
+    talloc_free (local);
+}
+
+static void
+_thread_summary_write_one (unused (gpointer key),
+			   gpointer value,
+			   gpointer closure)
+{
+    _thread_summary_write ((notmuch_database_t *) closure,
+			   (notmuch_thread_summary_t *) value);
+}
+
+void
+_notmuch_thread_summaries_refresh (notmuch_database_t *notmuch)
+{
+    GHashTable *stale = notmuch->stale_thread_summaries;
+    notmuch_thread_summary_t *summary;
+    GList *keys, *l;
+    void *local;
+
+    if (stale) {
+	/* Storing a rebuilt summary, (which is never stale), won't
+	 * add to the table while it's being walked. */
+	keys = g_hash_table_get_keys (stale);
+
+	for (l = keys; l; l = l->next) {
+	    local = talloc_new (notmuch);
+	    summary = _thread_summary_rebuild (local, notmuch,
+					       (char *) l->data);
+	    if (summary)
+		_thread_summary_store (notmuch, summary);
+	    talloc_free (local);
+	    talloc_free (l->data);
+	}
+
+	g_list_free (keys);
+
+	g_hash_table_unref (stale);
+	notmuch->stale_thread_summaries = NULL;
+    }
+
+    if (notmuch->changed_thread_summaries) {
+	g_hash_table_foreach (notmuch->changed_thread_summaries,
+			      _thread_summary_write_one, notmuch);
+	g_hash_table_remove_all (notmuch->changed_thread_summaries);
+    }
+}
+
+static int
+_thread_summary_builder_destructor (notmuch_thread_summary_builder_t *builder)
+{
+    g_hash_table_unref (builder->summaries);
+
+    return 0;
+}
+
+notmuch_thread_summary_builder_t *
+_notmuch_thread_summary_builder_create (void *ctx,
+					notmuch_database_t *notmuch)
+{
+    notmuch_thread_summary_builder_t *builder;
+
+    builder = talloc (ctx, notmuch_thread_summary_builder_t);
+    if (unlikely (builder == NULL))
+	return NULL;
+
+    builder->notmuch = notmuch;
+    builder->summaries = g_hash_table_new (g_str_hash, g_str_equal);
+
+    talloc_set_destructor (builder, _thread_summary_builder_destructor);
+
+    return builder;
+}
+
+void
+_notmuch_thread_summary_builder_add (notmuch_thread_summary_builder_t *builder,
+				     unsigned int doc_id)
+{
+    notmuch_thread_contribution_t *contribution;
+    notmuch_thread_summary_t *summary;
+    Xapian::Document doc;
+
+    doc = builder->notmuch->xapian_db->get_document (doc_id);
+
+    contribution = _thread_contribution_create (builder, doc, doc_id);
+    if (contribution == NULL)
+	return;
+
+    summary = (notmuch_thread_summary_t *)
+	g_hash_table_lookup (builder->summaries, contribution->thread_id);
+
+    if (summary == NULL) {
+	summary = _thread_summary_create (builder, contribution->thread_id);
+	if (unlikely (summary == NULL))
+	    goto DONE;
+	g_hash_table_insert (builder->summaries, summary->thread_id, summary);
+    }
+
+    _thread_summary_add (summary, contribution);
+
+  DONE:
+    talloc_free (contribution);
+}
+
+static void
+_thread_summary_builder_store_one (unused (gpointer key),
+				   gpointer value,
+				   gpointer closure)
+{
+    notmuch_thread_summary_builder_t *builder;
+
+    builder = (notmuch_thread_summary_builder_t *) closure;
+
+    _thread_summary_store (builder->notmuch,
+			   (notmuch_thread_summary_t *) value);
+}
+
+void
+_notmuch_thread_summary_builder_store (notmuch_thread_summary_builder_t *builder)
+{
+    g_hash_table_foreach (builder->summaries,
+			  _thread_summary_builder_store_one, builder);
+}
@@ -39,6 +39,12 @@ struct _notmuch_thread {
 
     notmuch_message_list_t *message_list;
     GHashTable *message_hash;
+
+    /* Whether the thread was created from a summary, (so that only
+     * its matched messages have been read and message_list is still
+     * empty until notmuch_thread_get_toplevel_messages). */
+    notmuch_bool_t messages_pending;
+
     int total_messages;
     int matched_messages;
     time_t oldest;
@@ -147,8 +153,8 @@ _complete_thread_authors (notmuch_thread_t *thread)
  * "Last, First" <first.last@company.com>
  * "Last, First MI" <first.mi.last@company.com>
  */
-char *
-_thread_cleanup_author (notmuch_thread_t *thread,
+static char *
+_thread_cleanup_author (void *ctx,
 			const char *author, const char *from)
 {
     char *clean_author,*test_author;
@@ -158,7 +164,7 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 
     if (author == NULL)
 	return NULL;
-    clean_author = talloc_strdup(thread, author);
+    clean_author = talloc_strdup(ctx, author);
     if (clean_author == NULL)
 	return NULL;
     /* check if there's a comma in the name and that there's a
@@ -177,7 +183,7 @@ _thread_cleanup_author (notmuch_thread_t *thread,
 	strncpy(clean_author + fname + 1, author, lname);
 	*(clean_author+fname+1+lname) = '\0';
 	/* make a temporary copy and see if it matches the email */
-	test_author = talloc_strdup(thread,clean_author);
+	test_author = talloc_strdup(ctx,clean_author);
 
 	blank=strchr(test_author,' ');
 	while (blank != NULL) {
@@ -192,6 +198,50 @@ _thread_cleanup_author (notmuch_thread_t *thread,
     return clean_author;
 }
 
+char *
+_notmuch_thread_author_from_header (void *ctx, const char *from)
+{
+    InternetAddressList *list = NULL;
+    InternetAddress *address;
+    const char *author;
+    char *clean_author = NULL;
+
+    if (from && *from)
+	list = internet_address_list_parse_string (from);
+
+    if (list) {
+	address = internet_address_list_get_address (list, 0);
+	if (address) {
+	    author = internet_address_get_name (address);
+	    if (author == NULL) {
+		InternetAddressMailbox *mailbox;
+		mailbox = INTERNET_ADDRESS_MAILBOX (address);
+		author = internet_address_mailbox_get_addr (mailbox);
+	    }
+	    clean_author = _thread_cleanup_author (ctx, author, from);
+	}
+	g_object_unref (G_OBJECT (list));
+    }
+
+    return clean_author;
+}
+
+/* Set the author of 'message', (belonging to 'thread'), from its From
+ * header, and return it. */
+static char *
+_thread_set_message_author (notmuch_thread_t *thread,
+			    notmuch_message_t *message)
+{
+    char *author;
+
+    author = _notmuch_thread_author_from_header (
+	thread, notmuch_message_get_header (message, "from"));
+    if (author)
+	notmuch_message_set_author (message, author);
+
+    return author;
+}
+
 /* Add 'message' as a message that belongs to 'thread'.
  *
  * The 'thread' will talloc_steal the 'message' and hold onto a
@@ -203,10 +253,6 @@ _thread_add_message (notmuch_thread_t *thread,
 {
     notmuch_tags_t *tags;
     const char *tag;
-    InternetAddressList *list = NULL;
-    InternetAddress *address;
-    const char *from, *author;
-    char *clean_author;
 
     _notmuch_message_list_add_message (thread->message_list,
 				       talloc_steal (thread, message));
@@ -216,25 +262,7 @@ _thread_add_message (notmuch_thread_t *thread,
 			 xstrdup (notmuch_message_get_message_id (message)),
 			 message);
 
-    from = notmuch_message_get_header (message, "from");
-    if (from)
-	list = internet_address_list_parse_string (from);
-
-    if (list) {
-	address = internet_address_list_get_address (list, 0);
-	if (address) {
-	    author = internet_address_get_name (address);
-	    if (author == NULL) {
-		InternetAddressMailbox *mailbox;
-		mailbox = INTERNET_ADDRESS_MAILBOX (address);
-		author = internet_address_mailbox_get_addr (mailbox);
-	    }
-	    clean_author = _thread_cleanup_author (thread, author, from);
-	    _thread_add_author (thread, clean_author);
-	    notmuch_message_set_author (message, clean_author);
-	}
-	g_object_unref (G_OBJECT (list));
-    }
+    _thread_add_author (thread, _thread_set_message_author (thread, message));
 
     if (! thread->subject) {
 	const char *subject;
@@ -286,7 +314,6 @@ _thread_add_matched_message (notmuch_thread_t *thread,
 			     notmuch_sort_t sort)
 {
     time_t date;
-    notmuch_message_t *hashed_message;
 
     date = notmuch_message_get_date (message);
 
@@ -298,14 +325,7 @@ _thread_add_matched_message (notmuch_thread_t *thread,
 
     thread->matched_messages++;
 
-    if (g_hash_table_lookup_extended (thread->message_hash,
-			    notmuch_message_get_message_id (message), NULL,
-			    (void **) &hashed_message)) {
-	notmuch_message_set_flag (hashed_message,
-				  NOTMUCH_MESSAGE_FLAG_MATCH, 1);
-    }
-
-    _thread_add_matched_author (thread, notmuch_message_get_author (hashed_message));
+    _thread_add_matched_author (thread, notmuch_message_get_author (message));
 
     if ((sort == NOTMUCH_SORT_OLDEST_FIRST && date <= thread->newest) ||
 	(sort != NOTMUCH_SORT_OLDEST_FIRST && date == thread->newest))
@@ -352,16 +372,123 @@ _resolve_thread_relationships (unused (notmuch_thread_t *thread))
      */
 }
 
-/* Create a new notmuch_thread_t object for the given thread ID,
- * treating any messages matching 'query_string' as "matched".
+/* Take the total number of messages, the tags and the authors of
+ * 'thread' from 'summary' rather than from each of its messages. */
+static void
+_thread_add_summary (notmuch_thread_t *thread,
+		     notmuch_thread_summary_t *summary)
+{
+    unsigned int i;
+
+    thread->total_messages = summary->total_messages;
+
+    for (i = 0; i < summary->num_tags; i++)
+	g_hash_table_insert (thread->tags, xstrdup (summary->tags[i].name),
+			     NULL);
+
+    for (i = 0; i < summary->num_authors; i++)
+	_thread_add_author (thread, summary->authors[i].name);
+}
+
+/* Add 'message', (a matched message of a thread created from a
+ * summary), to the messages that are reused when all messages of
+ * 'thread' are read, (see _thread_read_messages). */
+static void
+_thread_add_summarized_message (notmuch_thread_t *thread,
+				notmuch_message_t *message)
+{
+    talloc_steal (thread, message);
+
+    g_hash_table_insert (thread->message_hash,
+			 xstrdup (notmuch_message_get_message_id (message)),
+			 message);
+
+    _thread_set_message_author (thread, message);
+}
+
+/* Read all messages of a thread created from a summary, in
+ * oldest-first order, and arrange them by their replies. */
+static void
+_thread_read_messages (notmuch_thread_t *thread)
+{
+    notmuch_database_t *notmuch = thread->notmuch;
+    notmuch_message_t *message, *matched;
+    notmuch_private_status_t status;
+
+    thread->messages_pending = FALSE;
+
+    try {
+	Xapian::Enquire enquire (*notmuch->xapian_db);
+	Xapian::Query mail_query (talloc_asprintf (thread, "%s%s",
+						   _find_prefix ("type"),
+						   "mail"));
+	Xapian::Query thread_query (talloc_asprintf (thread, "%s%s",
+						     _find_prefix ("thread"),
+						     thread->thread_id));
+	Xapian::MSet mset;
+	Xapian::MSetIterator iterator;
+
+	enquire.set_weighting_scheme (Xapian::BoolWeight());
+	enquire.set_sort_by_value (NOTMUCH_VALUE_TIMESTAMP, FALSE);
+	enquire.set_query (Xapian::Query (Xapian::Query::OP_AND,
+					  mail_query, thread_query));
+
+	mset = enquire.get_mset (0, notmuch->xapian_db->get_doccount ());
+
+	for (iterator = mset.begin (); iterator != mset.end (); iterator++) {
+	    message = _notmuch_message_create (thread, notmuch,
+					       *iterator, &status);
+	    if (message == NULL) {
+		if (status == NOTMUCH_PRIVATE_STATUS_NO_DOCUMENT_FOUND)
+		    INTERNAL_ERROR ("a thread search returned a non-existent document ID.\n");
+		continue;
+	    }
+
+	    /* Use the matched message already read, (which has its
+	     * flag set). */
+	    if (g_hash_table_lookup_extended (thread->message_hash,
+					      notmuch_message_get_message_id (message),
+					      NULL, (void **) &matched))
+	    {
+		talloc_free (message);
+		message = matched;
+	    } else {
+		g_hash_table_insert (thread->message_hash,
+				     xstrdup (notmuch_message_get_message_id (message)),
+				     message);
+		_thread_set_message_author (thread, message);
+	    }
+
+	    _notmuch_message_list_add_message (thread->message_list, message);
+	    _notmuch_message_close (message);
+	}
+    } catch (const Xapian::Error &error) {
+	fprintf (stderr, "A Xapian exception occurred reading a thread: %s\n",
+		 error.get_msg().c_str());
+	notmuch->exception_reported = TRUE;
+    }
+
+    _resolve_thread_relationships (thread);
+}
+
+/* Create a new notmuch_thread_t object for the given thread ID from
+ * 'members', a list of all messages belonging to the thread in
+ * oldest-first order. Any of these messages that have
+ * NOTMUCH_MESSAGE_FLAG_MATCH set are treated as "matched" by
+ * 'query_string'.
+ *
+ * Alternately, if 'summary' is not NULL, 'members' need only hold the
+ * matched messages, (in the same order), with the rest of the thread
+ * described by 'summary'. All of the thread's messages are then only
+ * read if notmuch_thread_get_toplevel_messages is called.
  *
- * Creating the thread will trigger two database searches. The first
- * is for all messages belonging to the thread, (to get the first
- * subject line, the total count of messages, and all authors). The
- * second search is for all messages that are in the thread and that
- * also match the given query_string. This is to allow for a separate
- * count of matched messages, and to allow a viewer to display these
- * messages differently.
+ * The caller is expected to have gathered the members (and which of
+ * them matched) with searches covering many threads at once, (see
+ * notmuch_query_search_threads), so creating the thread itself
+ * triggers no further database searches.
+ *
+ * The thread will talloc_steal each message from 'members', (leaving
+ * the list itself for the caller to free), and 'summary'.
  *
  * Here, 'ctx' is talloc context for the resulting thread object.
  *
@@ -371,43 +498,38 @@ notmuch_thread_t *
 _notmuch_thread_create (void *ctx,
 			notmuch_database_t *notmuch,
 			const char *thread_id,
+			notmuch_message_list_t *members,
+			notmuch_thread_summary_t *summary,
 			const char *query_string,
 			notmuch_sort_t sort)
 {
     notmuch_thread_t *thread;
     const char *thread_id_query_string;
-    notmuch_query_t *thread_id_query;
-
-    notmuch_messages_t *messages;
+    notmuch_message_node_t *node;
     notmuch_message_t *message;
+    notmuch_message_t **matched;
+    unsigned int num_members, num_matched, i, j, run_end;
+    time_t date;
     notmuch_bool_t matched_is_subset_of_thread;
 
     thread_id_query_string = talloc_asprintf (ctx, "thread:%s", thread_id);
     if (unlikely (query_string == NULL))
 	return NULL;
 
-    /* Under normal circumstances we need to do two database
-     * queries. One is for the thread itself (thread_id_query_string)
-     * and the second is to determine which messages in that thread
-     * match the original query (matched_query_string).
+    /* The matched messages are visited in the order that separate
+     * searches used to return them, since the choice of thread
+     * subject depends on it.
      *
-     * But under two circumstances, we use only the
-     * thread_id_query_string:
+     * Under normal circumstances that is newest-first, (the default
+     * sort of a "thread:<id> AND (<query_string>)" search). But under
+     * two circumstances all messages of the thread match and we visit
+     * them oldest-first, along with the thread itself:
      *
      *	1. If the original query_string *is* just the thread
      *	   specification.
      *
      *  2. If the original query_string matches all messages ("" or
      *     "*").
-     *
-     * In either of these cases, we can be more efficient by running
-     * just the thread_id query (since we know all messages in the
-     * thread will match the query_string).
-     *
-     * Beyond the performance advantage, in the second case, it's
-     * important to not try to create a concatenated query because our
-     * parser handles "" and "*" as special cases and will not do the
-     * right thing with a query string of "* and thread:<foo>".
      **/
     matched_is_subset_of_thread = 1;
     if (strcmp (query_string, thread_id_query_string) == 0 ||
@@ -417,10 +539,6 @@ _notmuch_thread_create (void *ctx,
 	matched_is_subset_of_thread = 0;
     }
 
-    thread_id_query = notmuch_query_create (notmuch, thread_id_query_string);
-    if (unlikely (thread_id_query == NULL))
-	return NULL;
-
     thread = talloc (ctx, notmuch_thread_t);
     if (unlikely (thread == NULL))
 	return NULL;
@@ -448,59 +566,72 @@ _notmuch_thread_create (void *ctx,
     thread->message_hash = g_hash_table_new_full (g_str_hash, g_str_equal,
 						  free, NULL);
 
+    thread->messages_pending = FALSE;
+
     thread->total_messages = 0;
     thread->matched_messages = 0;
     thread->oldest = 0;
     thread->newest = 0;
 
-    notmuch_query_set_sort (thread_id_query, NOTMUCH_SORT_OLDEST_FIRST);
+    if (summary) {
+	talloc_steal (thread, summary);
+	_thread_add_summary (thread, summary);
+	thread->messages_pending = TRUE;
+    }
 
-    for (messages = notmuch_query_search_messages (thread_id_query);
-	 notmuch_messages_valid (messages);
-	 notmuch_messages_move_to_next (messages))
-    {
-	message = notmuch_messages_get (messages);
+    num_members = 0;
+    for (node = members->head; node; node = node->next)
+	num_members++;
+
+    matched = talloc_array (ctx, notmuch_message_t *, num_members);
+    if (unlikely (matched == NULL && num_members))
+	return NULL;
+
+    num_matched = 0;
+    for (node = members->head; node; node = node->next) {
+	message = node->message;
 
-	_thread_add_message (thread, message);
+	if (summary)
+	    _thread_add_summarized_message (thread, message);
+	else
+	    _thread_add_message (thread, message);
 
-	if (! matched_is_subset_of_thread)
-	    _thread_add_matched_message (thread, message, sort);
+	if (notmuch_message_get_flag (message, NOTMUCH_MESSAGE_FLAG_MATCH))
+	    matched[num_matched++] = message;
 
 	_notmuch_message_close (message);
     }
 
-    notmuch_query_destroy (thread_id_query);
-
-    if (matched_is_subset_of_thread)
-    {
-	const char *matched_query_string;
-	notmuch_query_t *matched_query;
-
-	matched_query_string = talloc_asprintf (ctx, "%s AND (%s)",
-						thread_id_query_string,
-						query_string);
-	if (unlikely (matched_query_string == NULL))
-	    return NULL;
-
-	matched_query = notmuch_query_create (notmuch, matched_query_string);
-	if (unlikely (matched_query == NULL))
-	    return NULL;
-
-	for (messages = notmuch_query_search_messages (matched_query);
-	     notmuch_messages_valid (messages);
-	     notmuch_messages_move_to_next (messages))
-	{
-	    message = notmuch_messages_get (messages);
-	    _thread_add_matched_message (thread, message, sort);
-	    _notmuch_message_close (message);
+    if (! matched_is_subset_of_thread) {
+	for (i = 0; i < num_matched; i++) {
+	    _thread_add_matched_message (thread, matched[i], sort);
+	    _notmuch_message_close (matched[i]);
+	}
+    } else {
+	/* Walk backwards through runs of equal date, keeping the
+	 * messages within each run in document order. */
+	i = num_matched;
+	while (i > 0) {
+	    run_end = i;
+	    date = notmuch_message_get_date (matched[i - 1]);
+	    while (i > 0 && notmuch_message_get_date (matched[i - 1]) == date)
+		i--;
+	    for (j = i; j < run_end; j++) {
+		_thread_add_matched_message (thread, matched[j], sort);
+		_notmuch_message_close (matched[j]);
+	    }
 	}
-
-	notmuch_query_destroy (matched_query);
     }
 
+    talloc_free (matched);
+
     _complete_thread_authors (thread);
 
-    _resolve_thread_relationships (thread);
+    if (! summary)
+	_resolve_thread_relationships (thread);
+
+    if (! thread->subject)
+	thread->subject = talloc_strdup (thread, "");
 
     return thread;
 }
@@ -508,6 +639,9 @@ _notmuch_thread_create (void *ctx,
 notmuch_messages_t *
 notmuch_thread_get_toplevel_messages (notmuch_thread_t *thread)
 {
+    if (thread->messages_pending)
+	_thread_read_messages (thread);
+
     return _notmuch_messages_create (thread->message_list);
 }
 
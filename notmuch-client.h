@@ -89,6 +89,9 @@ notmuch_dump_command (void *ctx, int argc, char *argv[]);
 int
 notmuch_new_command (void *ctx, int argc, char *argv[]);
 
+int
+notmuch_insert_command (void *ctx, int argc, char *argv[]);
+
 int
 notmuch_reply_command (void *ctx, int argc, char *argv[]);
 
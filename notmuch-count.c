@@ -28,6 +28,9 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
     notmuch_database_t *notmuch;
     notmuch_query_t *query;
     char *query_str;
+    notmuch_bool_t approximate = FALSE;
+    notmuch_bool_t output_threads = FALSE;
+    char *opt_output;
     int i;
 #if 0
     char *opt, *end;
@@ -40,6 +43,19 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	    i++;
 	    break;
 	}
+	if (strcmp (argv[i], "--approximate") == 0) {
+	    approximate = TRUE;
+	} else if (STRNCMP_LITERAL (argv[i], "--output=") == 0) {
+	    opt_output = argv[i] + sizeof ("--output=") - 1;
+	    if (strcmp (opt_output, "threads") == 0) {
+		output_threads = TRUE;
+	    } else if (strcmp (opt_output, "messages") == 0) {
+		output_threads = FALSE;
+	    } else {
+		fprintf (stderr, "Invalid value for --output: %s\n", opt_output);
+		return 1;
+	    }
+	} else
 #if 0
 	if (STRNCMP_LITERAL (argv[i], "--first=") == 0) {
 	    opt = argv[i] + sizeof ("--first=") - 1;
@@ -73,6 +89,11 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	}
     }
 
+    if (approximate && output_threads) {
+	fprintf (stderr, "Error: --approximate is not supported with --output=threads.\n");
+	return 1;
+    }
+
     argc -= i;
     argv += i;
 
@@ -101,7 +122,12 @@ notmuch_count_command (void *ctx, int argc, char *argv[])
 	return 1;
     }
 
-    printf ("%u\n", notmuch_query_count_messages(query));
+    if (output_threads)
+	printf ("%u\n", notmuch_query_count_threads (query));
+    else if (approximate)
+	printf ("%u\n", notmuch_query_count_messages_approximate (query));
+    else
+	printf ("%u\n", notmuch_query_count_messages (query));
 
     notmuch_query_destroy (query);
     notmuch_database_close (notmuch);
@@ -0,0 +1,432 @@
+/* notmuch - Not much of an email program, (just index and search)
+ *
+ * Copyright © 2026 The notmuch contributors
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see http://www.gnu.org/licenses/ .
+ */
+
+#include "notmuch-client.h"
+
+#include <fcntl.h>
+
+/* Read all of 'fd' into a buffer talloced from 'ctx', storing its
+ * length in *length. Returns NULL on failure. */
+static char *
+read_all (void *ctx, int fd, size_t *length)
+{
+    char *buffer;
+    size_t size = 16384;
+    ssize_t bytes_read;
+
+    *length = 0;
+
+    buffer = talloc_size (ctx, size);
+    if (buffer == NULL) {
+	fprintf (stderr, "Out of memory.\n");
+	return NULL;
+    }
+
+    while (1) {
+	if (*length == size) {
+	    size *= 2;
+	    buffer = talloc_realloc (ctx, buffer, char, size);
+	    if (buffer == NULL) {
+		fprintf (stderr, "Out of memory.\n");
+		return NULL;
+	    }
+	}
+
+	bytes_read = read (fd, buffer + *length, size - *length);
+	if (bytes_read < 0) {
+	    if (errno == EINTR)
+		continue;
+	    fprintf (stderr, "Error reading message: %s\n", strerror (errno));
+	    talloc_free (buffer);
+	    return NULL;
+	}
+
+	if (bytes_read == 0)
+	    break;
+
+	*length += bytes_read;
+    }
+
+    return buffer;
+}
+
+/* Write all 'length' bytes of 'buffer' to 'fd'. */
+static int
+write_all (int fd, const char *buffer, size_t length)
+{
+    ssize_t written;
+
+    while (length) {
+	written = write (fd, buffer, length);
+	if (written < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	buffer += written;
+	length -= written;
+    }
+
+    return 0;
+}
+
+/* Make the directory 'path', (and any missing parents). */
+static int
+make_directory (void *ctx, const char *path)
+{
+    char *parent, *slash;
+    struct stat st;
+
+    if (stat (path, &st) == 0) {
+	if (S_ISDIR (st.st_mode))
+	    return 0;
+	errno = ENOTDIR;
+	return -1;
+    }
+
+    parent = talloc_strdup (ctx, path);
+    slash = strrchr (parent, '/');
+    if (slash && slash != parent) {
+	*slash = '\0';
+	if (make_directory (ctx, parent)) {
+	    talloc_free (parent);
+	    return -1;
+	}
+    }
+    talloc_free (parent);
+
+    if (mkdir (path, 0700) && errno != EEXIST)
+	return -1;
+
+    return 0;
+}
+
+/* Make 'maildir' a Maildir, (if it isn't already). */
+static int
+make_maildir (void *ctx, const char *maildir)
+{
+    const char *subdirs[] = { "cur", "new", "tmp" };
+    char *path;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE (subdirs); i++) {
+	path = talloc_asprintf (ctx, "%s/%s", maildir, subdirs[i]);
+	if (make_directory (ctx, path)) {
+	    fprintf (stderr, "Error creating %s: %s\n", path, strerror (errno));
+	    return -1;
+	}
+	talloc_free (path);
+    }
+
+    return 0;
+}
+
+/* Return a name for a new file in a Maildir, unique as described in
+ * the Maildir specification, (time, process and host), as well as by
+ * 'attempt', (in case of a collision nonetheless). */
+static char *
+maildir_unique_name (void *ctx, unsigned int attempt)
+{
+    struct timeval tv;
+    char hostname[256];
+    char *s;
+
+    gettimeofday (&tv, NULL);
+
+    if (gethostname (hostname, sizeof (hostname)))
+	strcpy (hostname, "localhost");
+    hostname[sizeof (hostname) - 1] = '\0';
+
+    /* These would be taken for a directory or for Maildir flags. */
+    for (s = hostname; *s; s++) {
+	if (*s == '/')
+	    *s = '_';
+	else if (*s == ':')
+	    *s = '.';
+    }
+
+    return talloc_asprintf (ctx, "%ld.M%ldP%dQ%u.%s",
+			    (long) tv.tv_sec, (long) tv.tv_usec,
+			    (int) getpid (), attempt, hostname);
+}
+
+/* Flush the entries of the directory 'name' of 'maildir' to disk. */
+static int
+sync_directory (void *ctx, const char *maildir, const char *name)
+{
+    char *path;
+    int fd;
+
+    path = talloc_asprintf (ctx, "%s/%s", maildir, name);
+
+    fd = open (path, O_RDONLY);
+    if (fd < 0 || fsync (fd)) {
+	fprintf (stderr, "Error syncing %s: %s\n", path, strerror (errno));
+	if (fd >= 0)
+	    close (fd);
+	talloc_free (path);
+	return -1;
+    }
+
+    close (fd);
+    talloc_free (path);
+
+    return 0;
+}
+
+/* Deliver the 'length' bytes of 'buffer' to the Maildir 'maildir',
+ * (written to tmp and then moved to new once safely on disk), and
+ * return the path of the file delivered, (or NULL on failure). */
+static char *
+maildir_deliver (void *ctx, const char *maildir,
+		 const char *buffer, size_t length)
+{
+    char *name, *tmp_path = NULL, *new_path;
+    unsigned int attempt;
+    int fd = -1;
+
+    for (attempt = 0; attempt < 10; attempt++) {
+	name = maildir_unique_name (ctx, attempt);
+	tmp_path = talloc_asprintf (ctx, "%s/tmp/%s", maildir, name);
+
+	fd = open (tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (fd >= 0 || errno != EEXIST)
+	    break;
+
+	talloc_free (tmp_path);
+	tmp_path = NULL;
+    }
+
+    if (fd < 0) {
+	fprintf (stderr, "Error creating a file in %s/tmp: %s\n",
+		 maildir, strerror (errno));
+	return NULL;
+    }
+
+    if (write_all (fd, buffer, length) || fsync (fd)) {
+	fprintf (stderr, "Error writing %s: %s\n", tmp_path, strerror (errno));
+	close (fd);
+	unlink (tmp_path);
+	return NULL;
+    }
+
+    if (close (fd)) {
+	fprintf (stderr, "Error writing %s: %s\n", tmp_path, strerror (errno));
+	unlink (tmp_path);
+	return NULL;
+    }
+
+    new_path = talloc_asprintf (ctx, "%s/new/%s", maildir, name);
+    if (rename (tmp_path, new_path)) {
+	fprintf (stderr, "Error moving %s to %s: %s\n",
+		 tmp_path, new_path, strerror (errno));
+	unlink (tmp_path);
+	return NULL;
+    }
+
+    /* The rename itself must be on disk before the message is
+     * reported as delivered. */
+    if (sync_directory (ctx, maildir, "new")) {
+	unlink (new_path);
+	return NULL;
+    }
+
+    return new_path;
+}
+
+/* Record the file 'filename', (just delivered to the Maildir
+ * 'maildir'), in the manifest of its directory, if the directory has
+ * one, so that "notmuch new" doesn't read it again, (see
+ * notmuch_directory_get_manifest). Failure only costs that. */
+static void
+manifest_add_delivered (notmuch_database_t *notmuch,
+			const char *maildir, const char *filename)
+{
+    notmuch_directory_t *directory;
+    notmuch_manifest_t *manifest;
+    struct stat st;
+    char *path;
+
+    if (stat (filename, &st))
+	return;
+
+    path = talloc_asprintf (notmuch, "%s/new", maildir);
+    directory = notmuch_database_get_directory (notmuch, path);
+    talloc_free (path);
+    if (directory == NULL)
+	return;
+
+    manifest = notmuch_directory_get_manifest (directory);
+    if (manifest &&
+	notmuch_manifest_add (manifest, strrchr (filename, '/') + 1,
+			      st.st_ino, st.st_size) == NOTMUCH_STATUS_SUCCESS)
+    {
+	notmuch_directory_set_manifest (directory, manifest);
+    }
+
+    notmuch_directory_destroy (directory);
+}
+
+int
+notmuch_insert_command (void *ctx, int argc, char *argv[])
+{
+    notmuch_config_t *config;
+    notmuch_database_t *notmuch;
+    notmuch_status_t status;
+    const char *db_path, *folder = NULL;
+    notmuch_bool_t create_folder = FALSE;
+    const char **new_tags, **tags;
+    size_t new_tags_length;
+    char *maildir, *folder_name, *filename, *buffer;
+    size_t length;
+    struct stat st;
+    int i, j, num_tags = 0;
+
+    for (i = 0; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++) {
+	if (strcmp (argv[i], "--") == 0) {
+	    i++;
+	    break;
+	}
+	if (STRNCMP_LITERAL (argv[i], "--folder=") == 0) {
+	    folder = argv[i] + sizeof ("--folder=") - 1;
+	} else if (strcmp (argv[i], "--create-folder") == 0) {
+	    create_folder = TRUE;
+	} else {
+	    fprintf (stderr, "Unrecognized option: %s\n", argv[i]);
+	    return 1;
+	}
+    }
+
+    argc -= i;
+    argv += i;
+
+    for (i = 0; i < argc; i++) {
+	if ((argv[i][0] != '+' && argv[i][0] != '-') || argv[i][1] == '\0') {
+	    fprintf (stderr, "Error: '%s' is not a tag to add (+<tag>) or remove (-<tag>).\n",
+		     argv[i]);
+	    return 1;
+	}
+    }
+
+    /* The folder must lie within the mail store. */
+    if (folder &&
+	(*folder == '/' || strcmp (folder, "..") == 0 ||
+	 STRNCMP_LITERAL (folder, "../") == 0 ||
+	 strstr (folder, "/../") ||
+	 (strlen (folder) >= 3 &&
+	  strcmp (folder + strlen (folder) - 3, "/..") == 0)))
+    {
+	fprintf (stderr, "Error: the folder \"%s\" is not within the mail store.\n",
+		 folder);
+	return 1;
+    }
+
+    config = notmuch_config_open (ctx, NULL, NULL);
+    if (config == NULL)
+	return 1;
+
+    db_path = notmuch_config_get_database_path (config);
+
+    if (folder && *folder)
+	maildir = talloc_asprintf (ctx, "%s/%s", db_path, folder);
+    else
+	maildir = talloc_strdup (ctx, db_path);
+
+    if (create_folder) {
+	if (make_maildir (ctx, maildir))
+	    return 1;
+    } else if (stat (talloc_asprintf (ctx, "%s/tmp", maildir), &st) ||
+	       stat (talloc_asprintf (ctx, "%s/new", maildir), &st))
+    {
+	fprintf (stderr, "Error: %s is not a Maildir, (see --create-folder).\n",
+		 maildir);
+	return 1;
+    }
+
+    /* The tags of a message found in new by "notmuch new", (where
+     * it has no Maildir flags, so is also unread), as changed by
+     * those given. */
+    new_tags = notmuch_config_get_new_tags (config, &new_tags_length);
+    tags = talloc_array (ctx, const char *, new_tags_length + argc + 2);
+    for (i = 0; i < (int) new_tags_length; i++)
+	tags[num_tags++] = new_tags[i];
+    tags[num_tags++] = "unread";
+
+    for (i = 0; i < argc; i++) {
+	const char *tag = argv[i] + 1;
+
+	for (j = 0; j < num_tags; j++) {
+	    if (strcmp (tags[j], tag) == 0) {
+		tags[j--] = tags[--num_tags];
+	    }
+	}
+	if (argv[i][0] == '+')
+	    tags[num_tags++] = tag;
+    }
+    tags[num_tags] = NULL;
+
+    buffer = read_all (ctx, STDIN_FILENO, &length);
+    if (buffer == NULL)
+	return 1;
+
+    /* Open the database before delivering, so the message isn't left
+     * unindexed just because the database can't be opened. */
+    notmuch = notmuch_database_open (db_path,
+				     NOTMUCH_DATABASE_MODE_READ_WRITE);
+    if (notmuch == NULL)
+	return 1;
+
+    filename = maildir_deliver (ctx, maildir, buffer, length);
+    if (filename == NULL) {
+	notmuch_database_close (notmuch);
+	return 1;
+    }
+
+    /* Just as "notmuch new" names the folder of a message. */
+    folder_name = g_path_get_basename (maildir);
+
+    /* The message is indexed from memory rather than read back. */
+    status = notmuch_database_add_message_from_buffer (notmuch, filename,
+						       strcmp (folder_name, ".") ?
+						       folder_name : NULL,
+						       buffer, length,
+						       tags, NULL);
+    g_free (folder_name);
+
+    switch (status) {
+    case NOTMUCH_STATUS_SUCCESS:
+    case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
+	manifest_add_delivered (notmuch, maildir, filename);
+	break;
+    case NOTMUCH_STATUS_FILE_NOT_EMAIL:
+	fprintf (stderr, "Note: Delivered %s, which is not an email message.\n",
+		 filename);
+	break;
+    default:
+	fprintf (stderr, "Error: Delivered %s but failed to add it to the database: %s\n"
+		 "(\"notmuch new\" will add it later.)\n",
+		 filename, notmuch_status_to_string (status));
+	break;
+    }
+
+    notmuch_database_close (notmuch);
+
+    return status != NOTMUCH_STATUS_SUCCESS &&
+	status != NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID &&
+	status != NOTMUCH_STATUS_FILE_NOT_EMAIL;
+}
@@ -21,7 +21,43 @@
 #include "notmuch-client.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <glib.h>
+#include <pthread.h>
+
+#if HAVE_INOTIFY
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
+
+/* No more than this many jobs index new files by default. */
+#define NEW_MAX_JOBS 16
+
+/* How far (in files) the jobs may index ahead of the files added to
+ * the database. */
+#define NEW_JOBS_WINDOW 256
+
+/* How many files are added to the database between commits by
+ * default. */
+#define NEW_BATCH_SIZE 1000
+
+/* Where the directories completed by an interrupted run are
+ * recorded, (relative to the ".notmuch" directory). */
+#define NEW_CHECKPOINT_FILE "new-checkpoint"
+
+/* How many directories the scanner may examine ahead of those
+ * processed by add_files_recursive. */
+#define NEW_SCAN_WINDOW 4096
+
+/* While watching, how long (in milliseconds) the mail store must be
+ * left alone before the directories changed are examined, and how
+ * long at most that may be put off by a continuing burst of changes. */
+#define NEW_WATCH_QUIET 500
+#define NEW_WATCH_MAX_DELAY 5000
+
+/* While watching, how long (in seconds) to wait before trying again
+ * to open the database, (most likely held by another writer). */
+#define NEW_WATCH_RETRY 5
 
 typedef struct _filename_node {
     char *filename;
@@ -33,11 +69,206 @@ typedef struct _filename_list {
     _filename_node_t **tail;
 } _filename_list_t;
 
+/* A file found removed from a directory, which might turn up again
+ * elsewhere, (see find_moved_file). */
+typedef struct _removed_file {
+    char *filename;
+    uint64_t size;
+
+    /* The mtime of the directory when last recorded, (when the file
+     * was still there). */
+    struct timespec dir_mtime;
+} _removed_file_t;
+
+/* The times of a directory completed by an interrupted run, (as
+ * recorded in the database), for telling whether it has changed
+ * since. */
+typedef struct {
+    struct timespec mtime;
+    struct timespec ctime;
+} _checkpoint_times_t;
+
+/* A directory whose times, (and manifest), are to be recorded only
+ * once the files removed from it have been removed from the
+ * database. */
+typedef struct _deferred_mtime {
+    char *path;
+    struct timespec mtime;
+    struct timespec ctime;
+    notmuch_manifest_t *manifest;
+    struct _deferred_mtime *next;
+} _deferred_mtime_t;
+
+/* A new file, submitted to be indexed by one of the jobs of
+ * add_files_jobs_t. */
+typedef struct {
+    char *filename;
+    char *folder_name;
+
+    /* The final component of filename. */
+    const char *name;
+    notmuch_bool_t tag_maildir;
+
+    /* Set by the job which indexes the file. */
+    notmuch_status_t status;
+    notmuch_indexed_message_t *indexed;
+    notmuch_bool_t ready;
+} new_file_t;
+
+/* An entry of a directory, as found by the scanner. */
+typedef struct {
+    char *name;
+    ino_t inode;
+    unsigned char type;
+
+    /* For an entry of type DT_LNK or DT_UNKNOWN, the mode of the file,
+     * (following symlinks), or, if it couldn't be stat'ed, 0 and the
+     * errno in 'error'. */
+    mode_t mode;
+    int error;
+} scan_entry_t;
+
+typedef enum {
+    SCAN_QUEUED,
+    SCAN_RUNNING,
+    SCAN_DONE,
+    SCAN_TAKEN
+} scan_state_t;
+
+/* A directory of the mail store, as examined by the scanner. */
+typedef struct {
+    char *path;
+    scan_state_t state;
+
+    /* The errno of the stat of 'path', (or 0), and, for a directory,
+     * of opening it. */
+    int stat_error;
+    int open_error;
+
+    notmuch_bool_t is_directory;
+    struct timespec mtime;
+    struct timespec ctime;
+    notmuch_bool_t is_maildir;
+
+    /* Whether the directory changed so shortly before it was read
+     * that a later change might leave its times unchanged, (given
+     * the coarse clock of most filesystems). */
+    notmuch_bool_t racy;
+
+    /* Sorted by name, talloced from 'entries_ctx', (which belongs to
+     * the directory's taker, see scanner_take). */
+    void *entries_ctx;
+    scan_entry_t *entries;
+    int num_entries;
+    int num_files;
+} scan_dir_t;
+
+/* Directories queued to be scanned by one thread, which takes them
+ * from the tail, (so the thread goes depth first), while the other
+ * threads steal them from the head, (the largest subtrees). */
+typedef struct {
+    scan_dir_t **dirs;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int size;
+} scan_deque_t;
+
+typedef struct _scanner scanner_t;
+
+typedef struct {
+    pthread_t thread;
+    scanner_t *scanner;
+    unsigned int index;
+} scan_thread_t;
+
+/* The scanner walks the mail store with several threads, (reading each
+ * directory and stat'ing those of its entries whose type is unknown),
+ * so that add_files_recursive, (in the main thread), finds most
+ * directories already read. All fields following 'mutex' are
+ * protected by it. */
+struct _scanner {
+    unsigned int num_threads;
+    scan_thread_t *threads;
+
+    /* Directories completed by an interrupted run, (or NULL), which
+     * aren't scanned. */
+    GHashTable *checkpoint;
+
+    /* How many directories may be scanned and not yet taken, (or 0
+     * for no limit). */
+    unsigned int window;
+
+    pthread_mutex_t mutex;
+
+    /* Signalled whenever a directory is queued, scanned or taken. */
+    pthread_cond_t cond;
+
+    /* One for each thread, and a last one for the main thread. */
+    scan_deque_t *deques;
+
+    /* Every directory queued, by path. */
+    GHashTable *dirs;
+
+    /* How many directories are queued or being scanned, and how many
+     * have been scanned and not yet taken. */
+    unsigned int pending;
+    unsigned int unconsumed;
+
+    /* How many regular files have been found. */
+    int files;
+
+    notmuch_bool_t stop;
+};
+
+typedef struct _add_files_job add_files_job_t;
+
+/* The state shared by the jobs which index new files, (each with its
+ * own notmuch_indexer_t), while the main thread adds the indexed
+ * files to the database in the order in which they were found. All
+ * fields following 'mutex' are protected by it. */
+typedef struct {
+    unsigned int num_jobs;
+    add_files_job_t *job;
+
+    /* Once a fatal error has been reported, (this being its status),
+     * files are discarded rather than added. */
+    notmuch_status_t halted;
+
+    pthread_mutex_t mutex;
+
+    /* Signalled whenever a file is submitted, indexed or added. */
+    pthread_cond_t cond;
+
+    /* File i is files[i % NEW_JOBS_WINDOW]. */
+    new_file_t files[NEW_JOBS_WINDOW];
+
+    /* Files [added, submitted) are pending, and the files [next,
+     * submitted) are yet to be indexed. */
+    unsigned int submitted;
+    unsigned int next;
+    unsigned int added;
+
+    /* Set once no more files will be submitted. */
+    notmuch_bool_t done;
+} add_files_jobs_t;
+
+struct _add_files_job {
+    pthread_t thread;
+    notmuch_indexer_t *indexer;
+    add_files_jobs_t *jobs;
+};
+
 typedef struct {
     int output_is_a_tty;
     int verbose;
     const char **new_tags;
     size_t new_tags_length;
+    unsigned int num_jobs;
+
+    /* NULL when files are indexed one at a time. */
+    add_files_jobs_t *jobs;
+
+    scanner_t *scanner;
 
     int total_files;
     int processed_files;
@@ -47,6 +278,39 @@ typedef struct {
 
     _filename_list_t *removed_files;
     _filename_list_t *removed_directories;
+    _deferred_mtime_t *deferred_mtimes;
+
+    /* The files found removed, (by their inode numbers as text), for
+     * finding them again if they were only moved, (see
+     * find_moved_file). */
+    GHashTable *removed_inodes;
+
+    /* Changes to the database are committed atomically in batches,
+     * (see add_files_commit), each ended after this many files. */
+    unsigned int batch_size;
+    unsigned int batch_files;
+    notmuch_bool_t batch_open;
+
+    /* Each directory is completed once it and all its subdirectories
+     * have been examined and their files added. The directories
+     * completed by an interrupted run, (or NULL), mapped to their
+     * times then, (_checkpoint_times_t), aren't examined again unless
+     * changed since. The directories completed by this run are
+     * recorded in the checkpoint file, (with their times), as the
+     * batches completing them are committed. */
+    GHashTable *checkpoint;
+    char *checkpoint_path;
+    _filename_list_t *completed_directories;
+    _filename_node_t **uncommitted_directories;
+
+    /* Whether the last directory examined by add_files_recursive was
+     * completed. */
+    notmuch_bool_t subtree_complete;
+
+    /* While watching, the directories watched, (or NULL). These are
+     * only examined when changed themselves, not along with their
+     * parents. */
+    GHashTable *watched;
 } add_files_state_t;
 
 static volatile sig_atomic_t do_add_files_print_progress = 0;
@@ -97,6 +361,190 @@ _filename_list_add (_filename_list_t *list,
     list->tail = &node->next;
 }
 
+/* Read the directories completed by an interrupted run, (and their
+ * times), from the checkpoint file at 'path', returning NULL if there
+ * is none.
+ *
+ * The file is then removed, so that its entries are only ever used by
+ * the run following the one that wrote them. */
+static GHashTable *
+checkpoint_read (const char *path)
+{
+    GHashTable *checkpoint;
+    _checkpoint_times_t *times;
+    FILE *file;
+    char *line = NULL;
+    size_t line_size = 0;
+    ssize_t line_len;
+    long mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;
+    int offset;
+
+    file = fopen (path, "r");
+    if (file == NULL)
+	return NULL;
+
+    checkpoint = g_hash_table_new_full (g_str_hash, g_str_equal,
+					g_free, free);
+
+    while ((line_len = getline (&line, &line_size, file)) != -1) {
+	/* A line cut short by a crash names a directory that wasn't
+	 * completed, (or names none at all). */
+	if (line_len < 2 || line[line_len - 1] != '\n')
+	    continue;
+	line[line_len - 1] = '\0';
+
+	offset = 0;
+	if (sscanf (line, "%ld.%ld %ld.%ld %n", &mtime_sec, &mtime_nsec,
+		    &ctime_sec, &ctime_nsec, &offset) != 4 ||
+	    offset == 0 || line[offset] == '\0')
+	{
+	    continue;
+	}
+
+	times = malloc (sizeof (_checkpoint_times_t));
+	if (times == NULL)
+	    continue;
+	times->mtime.tv_sec = mtime_sec;
+	times->mtime.tv_nsec = mtime_nsec;
+	times->ctime.tv_sec = ctime_sec;
+	times->ctime.tv_nsec = ctime_nsec;
+	g_hash_table_insert (checkpoint, g_strdup (line + offset), times);
+    }
+
+    free (line);
+    fclose (file);
+
+    unlink (path);
+
+    return checkpoint;
+}
+
+/* Add 'path', (with the times just recorded for it), to the
+ * directories completed by this run. */
+static void
+checkpoint_add (add_files_state_t *state,
+		const char *path,
+		const struct timespec *mtime,
+		const struct timespec *ctime)
+{
+    char *entry;
+
+    entry = talloc_asprintf (state->completed_directories,
+			     "%ld.%09ld %ld.%09ld %s",
+			     (long) mtime->tv_sec, (long) mtime->tv_nsec,
+			     (long) ctime->tv_sec, (long) ctime->tv_nsec,
+			     path);
+    _filename_list_add (state->completed_directories, entry);
+    talloc_free (entry);
+}
+
+/* Return the times of 'path' if it was completed by an interrupted
+ * run and hasn't changed since, (or NULL otherwise). */
+static const _checkpoint_times_t *
+checkpoint_lookup (add_files_state_t *state, const char *path)
+{
+    gpointer value;
+    _checkpoint_times_t *times;
+    struct stat st;
+
+    if (state->checkpoint == NULL ||
+	! g_hash_table_lookup_extended (state->checkpoint, path, NULL, &value))
+    {
+	return NULL;
+    }
+
+    times = value;
+
+    if (stat (path, &st) ||
+	st.st_mtim.tv_sec != times->mtime.tv_sec ||
+	st.st_mtim.tv_nsec != times->mtime.tv_nsec ||
+	st.st_ctim.tv_sec != times->ctime.tv_sec ||
+	st.st_ctim.tv_nsec != times->ctime.tv_nsec)
+    {
+	return NULL;
+    }
+
+    return times;
+}
+
+/* Append the directories completed since the last call to the
+ * checkpoint file, (once the batch completing them has been
+ * committed). Failure is not fatal, since the directories are then
+ * merely examined again by the next run. */
+static void
+checkpoint_write (add_files_state_t *state)
+{
+    _filename_node_t *node = *state->uncommitted_directories;
+    FILE *file;
+
+    if (node == NULL)
+	return;
+
+    file = fopen (state->checkpoint_path, "a");
+    if (file == NULL)
+	goto FAIL;
+
+    for (; node; node = node->next)
+	fprintf (file, "%s\n", node->filename);
+
+    if (fflush (file) || fsync (fileno (file))) {
+	fclose (file);
+	goto FAIL;
+    }
+
+    if (fclose (file))
+	goto FAIL;
+
+    state->uncommitted_directories = state->completed_directories->tail;
+    return;
+
+  FAIL:
+    fprintf (stderr, "Warning: failed to write %s: %s\n",
+	     state->checkpoint_path, strerror (errno));
+}
+
+/* Whether a run ending with 'status' is to be resumed by the next,
+ * (from the directories it completed). Only an interruption, or a
+ * failure of the database, is. Failing to read some directory isn't,
+ * since its parents then aren't completed, and every run would
+ * otherwise skip the rest of the mail store. */
+static notmuch_bool_t
+new_is_resumable (notmuch_status_t status)
+{
+    return interrupted ||
+	(status != NOTMUCH_STATUS_SUCCESS &&
+	 status != NOTMUCH_STATUS_FILE_ERROR);
+}
+
+/* Commit the current batch of changes to the database, (recording the
+ * directories it completed), and begin the next batch. */
+static notmuch_status_t
+add_files_commit (notmuch_database_t *notmuch,
+		  add_files_state_t *state)
+{
+    notmuch_status_t status;
+
+    state->batch_files = 0;
+
+    state->batch_open = FALSE;
+    status = notmuch_database_end_atomic (notmuch);
+    if (status == NOTMUCH_STATUS_SUCCESS) {
+	checkpoint_write (state);
+	status = notmuch_database_begin_atomic (notmuch);
+	state->batch_open = (status == NOTMUCH_STATUS_SUCCESS);
+    } else {
+	/* The directories completed by the batch weren't after all. */
+	state->uncommitted_directories = state->completed_directories->tail;
+    }
+
+    if (status) {
+	fprintf (stderr, "Error: %s. Halting processing.\n",
+		 notmuch_status_to_string (status));
+    }
+
+    return status;
+}
+
 static void
 add_files_print_progress (add_files_state_t *state)
 {
@@ -125,16 +573,25 @@ add_files_print_progress (add_files_state_t *state)
     fflush (stdout);
 }
 
+/* Entries with equal inodes, (hard links), are ordered by name. */
 static int
-dirent_sort_inode (const struct dirent **a, const struct dirent **b)
+scan_entry_sort_inode (const void *a, const void *b)
 {
-    return ((*a)->d_ino < (*b)->d_ino) ? -1 : 1;
+    const scan_entry_t *entry_a = a, *entry_b = b;
+
+    if (entry_a->inode < entry_b->inode)
+	return -1;
+    if (entry_a->inode > entry_b->inode)
+	return 1;
+
+    return strcmp (entry_a->name, entry_b->name);
 }
 
 static int
-dirent_sort_strcmp_name (const struct dirent **a, const struct dirent **b)
+scan_entry_sort_strcmp_name (const void *a, const void *b)
 {
-    return strcmp ((*a)->d_name, (*b)->d_name);
+    return strcmp (((const scan_entry_t *) a)->name,
+		   ((const scan_entry_t *) b)->name);
 }
 
 /* Test if the directory looks like a Maildir directory.
@@ -145,17 +602,17 @@ dirent_sort_strcmp_name (const struct dirent **a, const struct dirent **b)
  * Return 1 if the directory looks like a Maildir and 0 otherwise.
  */
 static int
-_entries_resemble_maildir (struct dirent **entries, int count)
+_entries_resemble_maildir (scan_entry_t *entries, int count)
 {
     int i, found = 0;
 
     for (i = 0; i < count; i++) {
-	if (entries[i]->d_type != DT_DIR && entries[i]->d_type != DT_UNKNOWN)
+	if (entries[i].type != DT_DIR && entries[i].type != DT_UNKNOWN)
 	    continue;
 
-	if (strcmp(entries[i]->d_name, "new") == 0 ||
-	    strcmp(entries[i]->d_name, "cur") == 0 ||
-	    strcmp(entries[i]->d_name, "tmp") == 0)
+	if (strcmp(entries[i].name, "new") == 0 ||
+	    strcmp(entries[i].name, "cur") == 0 ||
+	    strcmp(entries[i].name, "tmp") == 0)
 	{
 	    found++;
 	    if (found == 3)
@@ -166,668 +623,2357 @@ _entries_resemble_maildir (struct dirent **entries, int count)
     return 0;
 }
 
-static char*
-_get_folder_base_name(const char *path)
+/* Whether add_files_recursive ignores the subdirectory 'entry' of
+ * 'dir', (to avoid infinite recursion, and since a "tmp" directory
+ * within a maildir holds messages still being delivered). */
+static notmuch_bool_t
+scan_entry_is_ignored (scan_dir_t *dir, scan_entry_t *entry)
 {
-  gchar *full_folder_name = NULL;
-  gchar *folder_base_name = NULL;
+    /* XXX: Eventually we'll want more sophistication to let the
+     * user specify files to be ignored. */
+    return (strcmp (entry->name, ".") == 0 ||
+	    strcmp (entry->name, "..") == 0 ||
+	    (dir->is_maildir && strcmp (entry->name, "tmp") == 0) ||
+	    strcmp (entry->name, ".notmuch") == 0);
+}
 
-  /* Find name of "folder" containing the email. */
-  full_folder_name = g_strdup(path);
-  while (1) {
-    folder_base_name = g_path_get_basename(full_folder_name);
+/* Whether 'entry' is a directory, (or a symlink to one). */
+static notmuch_bool_t
+scan_entry_is_directory (scan_entry_t *entry)
+{
+    if (entry->type == DT_LNK || entry->type == DT_UNKNOWN)
+	return S_ISDIR (entry->mode);
 
-    if (strcmp(folder_base_name, "cur") == 0
-	|| strcmp(folder_base_name, "new") == 0) {
-      gchar *parent_name = g_path_get_dirname(full_folder_name);
-      g_free(full_folder_name);
-      full_folder_name = parent_name;
-    } else
-      break;
-  }
+    return entry->type == DT_DIR;
+}
 
-  g_free(full_folder_name);
+/* Whether 'entry' is a regular file, (or a symlink to one). */
+static notmuch_bool_t
+scan_entry_is_regular (scan_entry_t *entry)
+{
+    if (entry->type == DT_LNK || entry->type == DT_UNKNOWN)
+	return S_ISREG (entry->mode);
 
-  if (strcmp(folder_base_name, ".") == 0) {
-    g_free(folder_base_name);
-    folder_base_name = NULL;
-  }
-  return folder_base_name;
+    return entry->type == DT_REG;
 }
 
-/* Tag new mail according to its Maildir attribute flags.
- *
- * Test if the mail file's filename contains any of the
- * standard Maildir attributes, and translate these to
- * the corresponding standard notmuch tags.
- *
- * If the message is not marked as 'seen', or if no
- * flags are present, tag as 'inbox, unread'.
- */
 static void
-derive_tags_from_maildir_flags (notmuch_message_t *message,
-                           const char * path)
+scan_deque_push (const void *ctx, scan_deque_t *deque, scan_dir_t *dir)
 {
-    int seen = FALSE;
-    int end_of_flags = FALSE;
-    size_t l = strlen(path);
+    if (deque->tail == deque->size) {
+	if (deque->head) {
+	    memmove (deque->dirs, deque->dirs + deque->head,
+		     (deque->tail - deque->head) * sizeof (scan_dir_t *));
+	    deque->tail -= deque->head;
+	    deque->head = 0;
+	} else {
+	    deque->size = deque->size ? deque->size * 2 : 64;
+	    deque->dirs = talloc_realloc (ctx, deque->dirs, scan_dir_t *,
+					  deque->size);
+	}
+    }
 
-    /* Non-experimental message flags start with this */
-    char * i = strstr(path, ":2,");
-    i = (i) ? i : strstr(path, "!2,"); /* This format is used on VFAT */
-    if (i != NULL) {
-   i += 3;
-   for (; i < (path + l) && !end_of_flags; i++) {
-       switch (*i) {
-       case 'F' :
-           notmuch_message_add_tag (message, "maildir::flagged");
-           break;
-       case 'R': /* replied */
-           notmuch_message_add_tag (message, "maildir::replied");
-           break;
-       case 'D':
-           notmuch_message_add_tag (message, "maildir::draft");
-           break;
-       case 'S': /* seen */
-           seen = TRUE;
-           break;
-       case 'T': /* trashed */
-           notmuch_message_add_tag (message, "maildir::trashed");
-           break;
-       case 'P': /* passed */
-           notmuch_message_add_tag (message, "maildir::forwarded");
-           break;
-       default:
-           end_of_flags = TRUE;
-           break;
-       }
-   }
+    deque->dirs[deque->tail++] = dir;
+}
+
+/* Take the next directory to be scanned by thread 'index', (the main
+ * thread being scanner->num_threads), or return NULL if there is
+ * none. The caller must hold scanner->mutex. */
+static scan_dir_t *
+scanner_next (scanner_t *scanner, unsigned int index)
+{
+    unsigned int num_deques = scanner->num_threads + 1;
+    scan_deque_t *deque;
+    scan_dir_t *dir = NULL;
+    unsigned int i;
+
+    deque = &scanner->deques[index];
+    if (deque->tail > deque->head) {
+	dir = deque->dirs[--deque->tail];
+	goto DONE;
     }
 
-    if (i == NULL || !seen) {
-        notmuch_message_add_tag (message, "unread");
+    for (i = 1; i < num_deques; i++) {
+	deque = &scanner->deques[(index + i) % num_deques];
+	if (deque->tail > deque->head) {
+	    dir = deque->dirs[deque->head++];
+	    goto DONE;
+	}
     }
+
+  DONE:
+    if (deque->head == deque->tail)
+	deque->head = deque->tail = 0;
+
+    return dir;
 }
 
-/* Examine 'path' recursively as follows:
- *
- *   o Ask the filesystem for the mtime of 'path' (fs_mtime)
- *   o Ask the database for its timestamp of 'path' (db_mtime)
- *
- *   o Ask the filesystem for files and directories within 'path'
- *     (via scandir and stored in fs_entries)
- *   o Ask the database for files and directories within 'path'
- *     (db_files and db_subdirs)
- *
- *   o Pass 1: For each directory in fs_entries, recursively call into
- *     this same function.
- *
- *   o Pass 2: If 'fs_mtime' > 'db_mtime', then walk fs_entries
- *     simultaneously with db_files and db_subdirs. Look for one of
- *     three interesting cases:
- *
- *	   1. Regular file in fs_entries and not in db_files
- *            This is a new file to add_message into the database.
- *
- *         2. Filename in db_files not in fs_entries.
- *            This is a file that has been removed from the mail store.
- *
- *         3. Directory in db_subdirs not in fs_entries
- *            This is a directory that has been removed from the mail store.
- *
- *     Note that the addition of a directory is not interesting here,
- *     since that will have been taken care of in pass 1. Also, we
- *     don't immediately act on file/directory removal since we must
- *     ensure that in the case of a rename that the new filename is
- *     added before the old filename is removed, (so that no
- *     information is lost from the database).
- *
- *   o Tell the database to update its time of 'path' to 'fs_mtime'
- */
-static notmuch_status_t
-add_files_recursive (notmuch_database_t *notmuch,
-		     const char *path,
-		     add_files_state_t *state)
+/* Queue 'path', (unless queued already), to be scanned by thread
+ * 'index'. The caller must hold scanner->mutex. */
+static scan_dir_t *
+scanner_queue (scanner_t *scanner, unsigned int index, const char *path)
+{
+    scan_dir_t *dir;
+
+    dir = g_hash_table_lookup (scanner->dirs, path);
+    if (dir)
+	return dir;
+
+    dir = talloc_zero (scanner, scan_dir_t);
+    dir->path = talloc_strdup (dir, path);
+    dir->state = SCAN_QUEUED;
+
+    g_hash_table_insert (scanner->dirs, dir->path, dir);
+    scan_deque_push (scanner, &scanner->deques[index], dir);
+    scanner->pending++;
+
+    pthread_cond_broadcast (&scanner->cond);
+
+    return dir;
+}
+
+/* Read the directory 'dir', (which the calling thread, 'index', has
+ * taken from the queue), and queue its subdirectories. This is done
+ * without holding scanner->mutex. */
+static void
+scan_directory (scanner_t *scanner, scan_dir_t *dir, unsigned int index)
 {
-    DIR *dir = NULL;
-    struct dirent *entry = NULL;
-    char *next = NULL;
-    time_t fs_mtime, db_mtime;
-    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
-    notmuch_message_t *message = NULL;
-    struct dirent **fs_entries = NULL;
-    int i, num_fs_entries;
-    notmuch_directory_t *directory;
-    notmuch_filenames_t *db_files = NULL;
-    notmuch_filenames_t *db_subdirs = NULL;
     struct stat st;
-    notmuch_bool_t is_maildir, new_directory;
-    const char **tag;
-    char *folder_base_name = NULL;
+    struct timeval now;
+    struct dirent *ent;
+    scan_entry_t *entry;
+    DIR *dirp;
+    char *child;
+    int fd, i, size = 0;
 
-    if (stat (path, &st)) {
-	fprintf (stderr, "Error reading directory %s: %s\n",
-		 path, strerror (errno));
-	return NOTMUCH_STATUS_FILE_ERROR;
+    dir->entries_ctx = talloc_new (NULL);
+
+    gettimeofday (&now, NULL);
+
+    if (stat (dir->path, &st)) {
+	dir->stat_error = errno;
+	return;
     }
 
     /* This is not an error since we may have recursed based on a
      * symlink to a regular file, not a directory, and we don't know
      * that until this stat. */
     if (! S_ISDIR (st.st_mode))
-	return NOTMUCH_STATUS_SUCCESS;
+	return;
+
+    dir->is_directory = TRUE;
+    dir->mtime = st.st_mtim;
+    dir->ctime = st.st_ctim;
+    dir->racy = (st.st_ctim.tv_sec + 1 >= now.tv_sec);
+
+    fd = open (dir->path, O_RDONLY | O_DIRECTORY);
+    dirp = (fd == -1) ? NULL : fdopendir (fd);
+    if (dirp == NULL) {
+	dir->open_error = errno;
+	if (fd != -1)
+	    close (fd);
+	return;
+    }
 
-    fs_mtime = st.st_mtime;
+    while ((ent = readdir (dirp)) != NULL) {
+	if (strcmp (ent->d_name, ".") == 0 || strcmp (ent->d_name, "..") == 0)
+	    continue;
 
-    directory = notmuch_database_get_directory (notmuch, path);
-    db_mtime = notmuch_directory_get_mtime (directory);
+	if (dir->num_entries == size) {
+	    size = size ? size * 2 : 64;
+	    dir->entries = talloc_realloc (dir->entries_ctx, dir->entries,
+					   scan_entry_t, size);
+	}
 
-    if (db_mtime == 0) {
-	new_directory = TRUE;
-	db_files = NULL;
-	db_subdirs = NULL;
-    } else {
-	new_directory = FALSE;
-	db_files = notmuch_directory_get_child_files (directory);
-	db_subdirs = notmuch_directory_get_child_directories (directory);
+	entry = &dir->entries[dir->num_entries++];
+	entry->name = talloc_strdup (dir->entries_ctx, ent->d_name);
+	entry->inode = ent->d_ino;
+	entry->type = ent->d_type;
+	entry->mode = 0;
+	entry->error = 0;
+
+	/* If we're looking at a symlink, we need to know what it links
+	 * to, (a regular file, or a directory, say). Similarly, if the
+	 * file is of unknown type (due to filesytem limitations), then
+	 * we also need to look closer. In either case, a stat does the
+	 * trick. */
+	if (entry->type == DT_LNK || entry->type == DT_UNKNOWN) {
+	    if (fstatat (dirfd (dirp), ent->d_name, &st, 0))
+		entry->error = errno;
+	    else
+		entry->mode = st.st_mode;
+	}
     }
 
-    /* If the database knows about this directory, then we sort based
-     * on strcmp to match the database sorting. Otherwise, we can do
-     * inode-based sorting for faster filesystem operation. */
-    num_fs_entries = scandir (path, &fs_entries, 0,
-			      new_directory ?
-			      dirent_sort_inode : dirent_sort_strcmp_name);
+    closedir (dirp);
 
-    if (num_fs_entries == -1) {
-	fprintf (stderr, "Error opening directory %s: %s\n",
-		 path, strerror (errno));
-	ret = NOTMUCH_STATUS_FILE_ERROR;
-	goto DONE;
-    }
+    /* The database sorts by name too. */
+    qsort (dir->entries, dir->num_entries, sizeof (scan_entry_t),
+	   scan_entry_sort_strcmp_name);
 
-    /* Pass 1: Recurse into all sub-directories. */
-    is_maildir = _entries_resemble_maildir (fs_entries, num_fs_entries);
+    dir->is_maildir = _entries_resemble_maildir (dir->entries,
+						 dir->num_entries);
 
-    for (i = 0; i < num_fs_entries; i++) {
-	if (interrupted)
-	    break;
+    /* Queued in reverse, so this thread takes them in order. */
+    pthread_mutex_lock (&scanner->mutex);
+    for (i = dir->num_entries - 1; i >= 0; i--) {
+	entry = &dir->entries[i];
 
-	entry = fs_entries[i];
+	if (scan_entry_is_regular (entry)) {
+	    dir->num_files++;
+	    continue;
+	}
 
-	/* We only want to descend into directories.
-	 * But symlinks can be to directories too, of course.
-	 *
-	 * And if the filesystem doesn't tell us the file type in the
-	 * scandir results, then it might be a directory (and if not,
-	 * then we'll stat and return immediately in the next level of
-	 * recursion). */
-	if (entry->d_type != DT_DIR &&
-	    entry->d_type != DT_LNK &&
-	    entry->d_type != DT_UNKNOWN)
+	if (! scan_entry_is_directory (entry) ||
+	    scan_entry_is_ignored (dir, entry))
 	{
 	    continue;
 	}
 
-	/* Ignore special directories to avoid infinite recursion.
-	 * Also ignore the .notmuch directory and any "tmp" directory
-	 * that appears within a maildir.
-	 */
-	/* XXX: Eventually we'll want more sophistication to let the
-	 * user specify files to be ignored. */
-	if (strcmp (entry->d_name, ".") == 0 ||
-	    strcmp (entry->d_name, "..") == 0 ||
-	    (is_maildir && strcmp (entry->d_name, "tmp") == 0) ||
-	    strcmp (entry->d_name, ".notmuch") ==0)
+	child = talloc_asprintf (dir->entries_ctx, "%s/%s",
+				 dir->path, entry->name);
+	if (! (scanner->checkpoint &&
+	       g_hash_table_lookup_extended (scanner->checkpoint, child,
+					     NULL, NULL)))
+	{
+	    scanner_queue (scanner, index, child);
+	}
+	talloc_free (child);
+    }
+    pthread_mutex_unlock (&scanner->mutex);
+}
+
+/* Scan 'dir', which the calling thread, 'index', has taken from the
+ * queue. The caller must hold scanner->mutex. */
+static void
+scanner_run_one (scanner_t *scanner, scan_dir_t *dir, unsigned int index)
+{
+    dir->state = SCAN_RUNNING;
+    pthread_mutex_unlock (&scanner->mutex);
+
+    scan_directory (scanner, dir, index);
+
+    pthread_mutex_lock (&scanner->mutex);
+    dir->state = SCAN_DONE;
+    scanner->pending--;
+    scanner->unconsumed++;
+    scanner->files += dir->num_files;
+    pthread_cond_broadcast (&scanner->cond);
+}
+
+static void *
+scan_thread_run (void *closure)
+{
+    scan_thread_t *thread = closure;
+    scanner_t *scanner = thread->scanner;
+    scan_dir_t *dir;
+
+    pthread_mutex_lock (&scanner->mutex);
+
+    while (! scanner->stop) {
+	dir = NULL;
+	if (! interrupted &&
+	    ! (scanner->window && scanner->unconsumed >= scanner->window))
 	{
+	    dir = scanner_next (scanner, thread->index);
+	}
+
+	if (dir == NULL) {
+	    pthread_cond_wait (&scanner->cond, &scanner->mutex);
 	    continue;
-	} else {
-	    state->tag_maildir = TRUE;
 	}
 
-	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
-	status = add_files_recursive (notmuch, next, state);
-	if (status && ret == NOTMUCH_STATUS_SUCCESS)
-	    ret = status;
-	talloc_free (next);
-	next = NULL;
+	/* Scanned already by the main thread. */
+	if (dir->state != SCAN_QUEUED)
+	    continue;
+
+	scanner_run_one (scanner, dir, thread->index);
     }
 
-    /* If this directory hasn't been modified since the last
-     * "notmuch new", then we can skip the second pass entirely. */
-    if (fs_mtime <= db_mtime)
-	goto DONE;
+    pthread_mutex_unlock (&scanner->mutex);
 
-    /* Pass 2: Scan for new files, removed files, and removed directories. */
-    for (i = 0; i < num_fs_entries; i++)
-    {
-	if (interrupted)
-	    break;
+    return NULL;
+}
 
-        entry = fs_entries[i];
+/* Wait on scanner->cond, (for at most a second, so that an interrupt
+ * isn't missed). The caller must hold scanner->mutex. */
+static void
+scanner_wait (scanner_t *scanner)
+{
+    struct timeval now;
+    struct timespec timeout;
 
-	/* Check if we've walked past any names in db_files or
-	 * db_subdirs. If so, these have been deleted. */
-	while (notmuch_filenames_valid (db_files) &&
-	       strcmp (notmuch_filenames_get (db_files), entry->d_name) < 0)
-	{
-	    char *absolute = talloc_asprintf (state->removed_files,
-					      "%s/%s", path,
-					      notmuch_filenames_get (db_files));
+    gettimeofday (&now, NULL);
+    timeout.tv_sec = now.tv_sec + 1;
+    timeout.tv_nsec = now.tv_usec * 1000;
 
-	    _filename_list_add (state->removed_files, absolute);
+    pthread_cond_timedwait (&scanner->cond, &scanner->mutex, &timeout);
+}
 
-	    notmuch_filenames_move_to_next (db_files);
+/* Start scanning the directory 'path' with 'num_threads' threads,
+ * (none meaning that each directory is only read when taken). */
+static scanner_t *
+scanner_start (const void *ctx,
+	       const char *path,
+	       unsigned int num_threads,
+	       GHashTable *checkpoint,
+	       unsigned int window)
+{
+    scanner_t *scanner;
+    unsigned int i;
+
+    scanner = talloc_zero (ctx, scanner_t);
+    scanner->num_threads = num_threads;
+    scanner->threads = talloc_zero_array (scanner, scan_thread_t,
+					  num_threads);
+    scanner->checkpoint = checkpoint;
+    scanner->window = window;
+
+    pthread_mutex_init (&scanner->mutex, NULL);
+    pthread_cond_init (&scanner->cond, NULL);
+
+    scanner->deques = talloc_zero_array (scanner, scan_deque_t,
+					 num_threads + 1);
+    scanner->dirs = g_hash_table_new (g_str_hash, g_str_equal);
+
+    pthread_mutex_lock (&scanner->mutex);
+
+    for (i = 0; i < num_threads; i++) {
+	scanner->threads[i].scanner = scanner;
+	scanner->threads[i].index = i;
+	if (pthread_create (&scanner->threads[i].thread, NULL,
+			    scan_thread_run, &scanner->threads[i]))
+	{
+	    /* The remaining directories are read as they're taken. */
+	    scanner->num_threads = i;
+	    break;
 	}
+    }
 
-	while (notmuch_filenames_valid (db_subdirs) &&
-	       strcmp (notmuch_filenames_get (db_subdirs), entry->d_name) <= 0)
-	{
-	    const char *filename = notmuch_filenames_get (db_subdirs);
+    scanner_queue (scanner, scanner->num_threads, path);
 
-	    if (strcmp (filename, entry->d_name) < 0)
-	    {
-		char *absolute = talloc_asprintf (state->removed_directories,
-						  "%s/%s", path, filename);
+    pthread_mutex_unlock (&scanner->mutex);
 
-		_filename_list_add (state->removed_directories, absolute);
-	    }
+    return scanner;
+}
 
-	    notmuch_filenames_move_to_next (db_subdirs);
+/* Scan the whole of the mail store, (with the main thread helping),
+ * and return the number of regular files found. */
+static int
+scanner_run (scanner_t *scanner)
+{
+    unsigned int index = scanner->num_threads;
+    int reported = 0, files;
+    scan_dir_t *dir;
+
+    pthread_mutex_lock (&scanner->mutex);
+
+    while (scanner->pending && ! interrupted) {
+	dir = scanner_next (scanner, index);
+	if (dir == NULL)
+	    scanner_wait (scanner);
+	else if (dir->state == SCAN_QUEUED)
+	    scanner_run_one (scanner, dir, index);
+
+	if (scanner->files / 1000 > reported / 1000) {
+	    reported = scanner->files;
+	    printf ("Found %d files so far.\r", reported);
+	    fflush (stdout);
 	}
+    }
 
-	/* If we're looking at a symlink, we only want to add it if it
-	 * links to a regular file, (and not to a directory, say).
-	 *
-	 * Similarly, if the file is of unknown type (due to filesytem
-	 * limitations), then we also need to look closer.
-	 *
-	 * In either case, a stat does the trick.
-	 */
-	if (entry->d_type == DT_LNK || entry->d_type == DT_UNKNOWN) {
-	    int err;
-
-	    next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
-	    err = stat (next, &st);
-	    talloc_free (next);
-	    next = NULL;
+    files = scanner->files;
 
-	    /* Don't emit an error for a link pointing nowhere, since
-	     * the directory-traversal pass will have already done
-	     * that. */
-	    if (err)
-		continue;
+    pthread_mutex_unlock (&scanner->mutex);
 
-	    if (! S_ISREG (st.st_mode))
-		continue;
-	} else if (entry->d_type != DT_REG) {
-	    continue;
-	}
+    return files;
+}
 
-	/* Don't add a file that we've added before. */
-	if (notmuch_filenames_valid (db_files) &&
-	    strcmp (notmuch_filenames_get (db_files), entry->d_name) == 0)
-	{
-	    notmuch_filenames_move_to_next (db_files);
+/* Return the scanned directory 'path', (waiting for it to be scanned,
+ * or scanning it now if no thread has started to). The caller must
+ * release it with scan_dir_release. */
+static scan_dir_t *
+scanner_take (scanner_t *scanner, const char *path)
+{
+    unsigned int index = scanner->num_threads;
+    scan_dir_t *dir;
+
+    pthread_mutex_lock (&scanner->mutex);
+
+    dir = scanner_queue (scanner, index, path);
+
+    while (dir->state == SCAN_RUNNING)
+	pthread_cond_wait (&scanner->cond, &scanner->mutex);
+
+    if (dir->state == SCAN_QUEUED)
+	scanner_run_one (scanner, dir, index);
+
+    if (dir->state == SCAN_DONE)
+	scanner->unconsumed--;
+    dir->state = SCAN_TAKEN;
+    pthread_cond_broadcast (&scanner->cond);
+
+    pthread_mutex_unlock (&scanner->mutex);
+
+    return dir;
+}
+
+static void
+scan_dir_release (scan_dir_t *dir)
+{
+    talloc_free (dir->entries_ctx);
+    dir->entries_ctx = NULL;
+    dir->entries = NULL;
+    dir->num_entries = 0;
+}
+
+static void
+_scan_dir_free_entries (unused (gpointer key),
+			gpointer value,
+			unused (gpointer user_data))
+{
+    scan_dir_t *dir = (scan_dir_t *) value;
+
+    if (dir->entries_ctx)
+	talloc_free (dir->entries_ctx);
+}
+
+static void
+scanner_stop (scanner_t *scanner)
+{
+    unsigned int i;
+
+    pthread_mutex_lock (&scanner->mutex);
+    scanner->stop = TRUE;
+    pthread_cond_broadcast (&scanner->cond);
+    pthread_mutex_unlock (&scanner->mutex);
+
+    for (i = 0; i < scanner->num_threads; i++)
+	pthread_join (scanner->threads[i].thread, NULL);
+
+    g_hash_table_foreach (scanner->dirs, _scan_dir_free_entries, NULL);
+    g_hash_table_unref (scanner->dirs);
+
+    pthread_cond_destroy (&scanner->cond);
+    pthread_mutex_destroy (&scanner->mutex);
+
+    talloc_free (scanner);
+}
+
+static char*
+_get_folder_base_name(const char *path)
+{
+  gchar *full_folder_name = NULL;
+  gchar *folder_base_name = NULL;
+
+  /* Find name of "folder" containing the email. */
+  full_folder_name = g_strdup(path);
+  while (1) {
+    folder_base_name = g_path_get_basename(full_folder_name);
+
+    if (strcmp(folder_base_name, "cur") == 0
+	|| strcmp(folder_base_name, "new") == 0) {
+      gchar *parent_name = g_path_get_dirname(full_folder_name);
+      g_free(full_folder_name);
+      full_folder_name = parent_name;
+    } else
+      break;
+  }
+
+  g_free(full_folder_name);
+
+  if (strcmp(folder_base_name, ".") == 0) {
+    g_free(folder_base_name);
+    folder_base_name = NULL;
+  }
+  return folder_base_name;
+}
+
+/* How many tags derive_tags_from_maildir_flags may add. */
+#define MAILDIR_TAGS_MAX 6
+
+/* Tag new mail according to its Maildir attribute flags.
+ *
+ * Test if the mail file's filename contains any of the
+ * standard Maildir attributes, and translate these to
+ * the corresponding standard notmuch tags, (appended to
+ * 'tags', of which there are '*count').
+ *
+ * If the message is not marked as 'seen', or if no
+ * flags are present, tag as 'inbox, unread'.
+ */
+static void
+derive_tags_from_maildir_flags (const char **tags, size_t *count,
+                           const char * path)
+{
+    int seen = FALSE, flagged = FALSE, replied = FALSE;
+    int draft = FALSE, trashed = FALSE, passed = FALSE;
+    int end_of_flags = FALSE;
+    size_t l = strlen(path);
+
+    /* Non-experimental message flags start with this */
+    char * i = strstr(path, ":2,");
+    i = (i) ? i : strstr(path, "!2,"); /* This format is used on VFAT */
+    if (i != NULL) {
+   i += 3;
+   for (; i < (path + l) && !end_of_flags; i++) {
+       switch (*i) {
+       case 'F' :
+           flagged = TRUE;
+           break;
+       case 'R': /* replied */
+           replied = TRUE;
+           break;
+       case 'D':
+           draft = TRUE;
+           break;
+       case 'S': /* seen */
+           seen = TRUE;
+           break;
+       case 'T': /* trashed */
+           trashed = TRUE;
+           break;
+       case 'P': /* passed */
+           passed = TRUE;
+           break;
+       default:
+           end_of_flags = TRUE;
+           break;
+       }
+   }
+    }
+
+    /* Each tag is added at most once, however often its flag is
+     * repeated. */
+    if (flagged)
+	tags[(*count)++] = "maildir::flagged";
+    if (replied)
+	tags[(*count)++] = "maildir::replied";
+    if (draft)
+	tags[(*count)++] = "maildir::draft";
+    if (trashed)
+	tags[(*count)++] = "maildir::trashed";
+    if (passed)
+	tags[(*count)++] = "maildir::forwarded";
+
+    if (i == NULL || !seen) {
+        tags[(*count)++] = "unread";
+    }
+}
+
+/* Return the tags of a new message in the file 'name', (the new_tags
+ * of the configuration and, if 'tag_maildir', those derived from its
+ * Maildir flags), as a NULL-terminated array talloced from 'ctx'. */
+static const char **
+new_message_tags (const void *ctx,
+		  add_files_state_t *state,
+		  const char *name,
+		  notmuch_bool_t tag_maildir)
+{
+    const char **tags;
+    size_t count = 0;
+    const char **tag;
+
+    tags = talloc_array (ctx, const char *,
+			 state->new_tags_length + MAILDIR_TAGS_MAX + 1);
+    if (tags == NULL)
+	return NULL;
+
+    for (tag=state->new_tags; *tag != NULL; tag++)
+	tags[count++] = *tag;
+
+    if (tag_maildir)
+	derive_tags_from_maildir_flags (tags, &count, name);
+
+    tags[count] = NULL;
+
+    return tags;
+}
+
+/* Report the result of adding 'filename' to the database. The current
+ * batch of changes is committed once full.
+ *
+ * Returns NOTMUCH_STATUS_SUCCESS unless processing must halt.
+ */
+static notmuch_status_t
+add_file_finish (notmuch_database_t *notmuch,
+		 add_files_state_t *state,
+		 const char *filename,
+		 notmuch_status_t status)
+{
+    notmuch_status_t ret = NOTMUCH_STATUS_SUCCESS;
+
+    switch (status) {
+    /* success */
+    case NOTMUCH_STATUS_SUCCESS:
+	state->added_messages++;
+	break;
+    /* Non-fatal issues (go on to next file) */
+    case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
+	/* Stay silent on this one. */
+	break;
+    case NOTMUCH_STATUS_FILE_NOT_EMAIL:
+	fprintf (stderr, "Note: Ignoring non-mail file: %s\n",
+		 filename);
+	break;
+    /* Fatal issues. Don't process anymore. */
+    case NOTMUCH_STATUS_READ_ONLY_DATABASE:
+    case NOTMUCH_STATUS_XAPIAN_EXCEPTION:
+    case NOTMUCH_STATUS_OUT_OF_MEMORY:
+    case NOTMUCH_STATUS_TAG_TOO_LONG:
+	fprintf (stderr, "Error: %s. Halting processing.\n",
+		 notmuch_status_to_string (status));
+	ret = status;
+	break;
+    default:
+    case NOTMUCH_STATUS_FILE_ERROR:
+    case NOTMUCH_STATUS_NULL_POINTER:
+    case NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW:
+    case NOTMUCH_STATUS_UNBALANCED_ATOMIC:
+    case NOTMUCH_STATUS_LAST_STATUS:
+	INTERNAL_ERROR ("add_message returned unexpected value: %d",  status);
+	break;
+    }
+
+    if (ret == NOTMUCH_STATUS_SUCCESS &&
+	++state->batch_files >= state->batch_size)
+    {
+	ret = add_files_commit (notmuch, state);
+    }
+
+    return ret;
+}
+
+static void *
+add_files_job_run (void *closure)
+{
+    add_files_job_t *job = closure;
+    add_files_jobs_t *jobs = job->jobs;
+    new_file_t *file;
+
+    pthread_mutex_lock (&jobs->mutex);
+
+    while (1) {
+	if (jobs->next == jobs->submitted) {
+	    if (jobs->done)
+		break;
+	    pthread_cond_wait (&jobs->cond, &jobs->mutex);
 	    continue;
 	}
 
-	/* We're now looking at a regular file that doesn't yet exist
-	 * in the database, so add it. */
-	next = talloc_asprintf (notmuch, "%s/%s", path, entry->d_name);
+	file = &jobs->files[jobs->next++ % NEW_JOBS_WINDOW];
 
-	state->processed_files++;
+	pthread_mutex_unlock (&jobs->mutex);
 
-	if (state->verbose) {
-	    if (state->output_is_a_tty)
-		printf("\r\033[K");
+	file->status = notmuch_indexer_index_file (job->indexer,
+						   file->filename,
+						   file->folder_name,
+						   &file->indexed);
 
-	    printf ("%i/%i: %s",
-		    state->processed_files,
-		    state->total_files,
-		    next);
+	pthread_mutex_lock (&jobs->mutex);
 
-	    putchar((state->output_is_a_tty) ? '\r' : '\n');
-	    fflush (stdout);
-	}
+	file->ready = TRUE;
+	pthread_cond_broadcast (&jobs->cond);
+    }
 
-	folder_base_name = _get_folder_base_name(path);
-	status = notmuch_database_add_message (notmuch, next,
-					       folder_base_name,
-					       &message);
-	switch (status) {
-	/* success */
-	case NOTMUCH_STATUS_SUCCESS:
-	    state->added_messages++;
-	    for (tag=state->new_tags; *tag != NULL; tag++)
-	        notmuch_message_add_tag (message, *tag);
-	    if (state->tag_maildir) {
-	      derive_tags_from_maildir_flags (message,
-					      entry->d_name);
-	    }
-	    break;
-	/* Non-fatal issues (go on to next file) */
-	case NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID:
-	    /* Stay silent on this one. */
+    pthread_mutex_unlock (&jobs->mutex);
+
+    return NULL;
+}
+
+/* Stop the jobs, (once they have indexed every submitted file). */
+static void
+add_files_jobs_stop (add_files_jobs_t *jobs)
+{
+    unsigned int i;
+
+    pthread_mutex_lock (&jobs->mutex);
+    jobs->done = TRUE;
+    pthread_cond_broadcast (&jobs->cond);
+    pthread_mutex_unlock (&jobs->mutex);
+
+    for (i = 0; i < jobs->num_jobs; i++) {
+	pthread_join (jobs->job[i].thread, NULL);
+	notmuch_indexer_destroy (jobs->job[i].indexer);
+    }
+
+    pthread_cond_destroy (&jobs->cond);
+    pthread_mutex_destroy (&jobs->mutex);
+
+    talloc_free (jobs);
+}
+
+/* Start up to 'num_jobs' jobs to index the new files of 'notmuch',
+ * returning NULL if fewer than two could be started. */
+static add_files_jobs_t *
+add_files_jobs_start (notmuch_database_t *notmuch,
+		      unsigned int num_jobs)
+{
+    add_files_jobs_t *jobs;
+    add_files_job_t *job;
+    unsigned int started;
+
+    jobs = talloc_zero (NULL, add_files_jobs_t);
+    if (jobs == NULL)
+	return NULL;
+
+    jobs->job = job = talloc_zero_array (jobs, add_files_job_t, num_jobs);
+    if (job == NULL) {
+	talloc_free (jobs);
+	return NULL;
+    }
+
+    pthread_mutex_init (&jobs->mutex, NULL);
+    pthread_cond_init (&jobs->cond, NULL);
+
+    for (started = 0; started < num_jobs; started++) {
+	job[started].jobs = jobs;
+	job[started].indexer = notmuch_indexer_create (notmuch);
+	if (job[started].indexer == NULL)
 	    break;
-	case NOTMUCH_STATUS_FILE_NOT_EMAIL:
-	    fprintf (stderr, "Note: Ignoring non-mail file: %s\n",
-		     next);
+
+	if (pthread_create (&job[started].thread, NULL,
+			    add_files_job_run, &job[started]))
+	{
+	    notmuch_indexer_destroy (job[started].indexer);
 	    break;
-	/* Fatal issues. Don't process anymore. */
-	case NOTMUCH_STATUS_READ_ONLY_DATABASE:
-	case NOTMUCH_STATUS_XAPIAN_EXCEPTION:
-	case NOTMUCH_STATUS_OUT_OF_MEMORY:
-	    fprintf (stderr, "Error: %s. Halting processing.\n",
-		     notmuch_status_to_string (status));
-	    ret = status;
-	    goto DONE;
-	default:
-	case NOTMUCH_STATUS_FILE_ERROR:
-	case NOTMUCH_STATUS_NULL_POINTER:
-	case NOTMUCH_STATUS_TAG_TOO_LONG:
-	case NOTMUCH_STATUS_UNBALANCED_FREEZE_THAW:
-	case NOTMUCH_STATUS_LAST_STATUS:
-	    INTERNAL_ERROR ("add_message returned unexpected value: %d",  status);
-	    goto DONE;
 	}
+    }
 
-	if (message) {
-	    notmuch_message_destroy (message);
-	    message = NULL;
-	}
+    jobs->num_jobs = started;
 
-	if (do_add_files_print_progress) {
-	    do_add_files_print_progress = 0;
-	    add_files_print_progress (state);
-	}
+    /* A single job would only add overhead to indexing in turn. */
+    if (started < 2) {
+	add_files_jobs_stop (jobs);
+	return NULL;
+    }
 
-	talloc_free (next);
-	next = NULL;
+    return jobs;
+}
+
+/* Wait for the oldest pending file to be indexed, then add it to the
+ * database, (see add_file_finish). */
+static notmuch_status_t
+add_files_jobs_add_next (notmuch_database_t *notmuch,
+			 add_files_state_t *state)
+{
+    add_files_jobs_t *jobs = state->jobs;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    const char **tags;
+    new_file_t *file;
+
+    pthread_mutex_lock (&jobs->mutex);
+    file = &jobs->files[jobs->added % NEW_JOBS_WINDOW];
+    while (! file->ready)
+	pthread_cond_wait (&jobs->cond, &jobs->mutex);
+    pthread_mutex_unlock (&jobs->mutex);
+
+    if (jobs->halted) {
+	ret = jobs->halted;
+    } else {
+	status = file->status;
+	if (status == NOTMUCH_STATUS_SUCCESS) {
+	    tags = new_message_tags (jobs, state, file->name,
+				     file->tag_maildir);
+	    if (tags == NULL)
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    else
+		status = notmuch_database_add_indexed_message (notmuch,
+							       file->indexed,
+							       tags, NULL);
+	    talloc_free (tags);
+	}
+
+	ret = add_file_finish (notmuch, state, file->filename, status);
+	jobs->halted = ret;
+    }
+
+    if (file->indexed)
+	notmuch_indexed_message_destroy (file->indexed);
+    talloc_free (file->filename);
+    talloc_free (file->folder_name);
+
+    pthread_mutex_lock (&jobs->mutex);
+    memset (file, 0, sizeof (new_file_t));
+    jobs->added++;
+    pthread_cond_broadcast (&jobs->cond);
+    pthread_mutex_unlock (&jobs->mutex);
+
+    return ret;
+}
+
+/* Submit 'filename' to be indexed by the jobs, and later added to the
+ * database by add_files_jobs_add_next, (which is called here as
+ * needed to make room for the new file). */
+static notmuch_status_t
+add_files_jobs_submit (notmuch_database_t *notmuch,
+		       add_files_state_t *state,
+		       const char *filename,
+		       const char *folder_name)
+{
+    add_files_jobs_t *jobs = state->jobs;
+    notmuch_status_t status;
+    new_file_t *file;
+
+    if (jobs->submitted - jobs->added == NEW_JOBS_WINDOW) {
+	status = add_files_jobs_add_next (notmuch, state);
+	if (status)
+	    return status;
+    }
+
+    pthread_mutex_lock (&jobs->mutex);
+
+    file = &jobs->files[jobs->submitted % NEW_JOBS_WINDOW];
+    file->filename = talloc_strdup (jobs, filename);
+    file->folder_name = folder_name ? talloc_strdup (jobs, folder_name) : NULL;
+    file->name = strrchr (file->filename, '/') + 1;
+    file->tag_maildir = state->tag_maildir;
+
+    jobs->submitted++;
+    pthread_cond_broadcast (&jobs->cond);
+
+    pthread_mutex_unlock (&jobs->mutex);
+
+    return NOTMUCH_STATUS_SUCCESS;
+}
+
+/* Add every pending file to the database. Once processing has halted,
+ * the remaining files are discarded, (and the status which halted
+ * processing is returned). */
+static notmuch_status_t
+add_files_jobs_flush (notmuch_database_t *notmuch,
+		      add_files_state_t *state)
+{
+    add_files_jobs_t *jobs = state->jobs;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+
+    while (jobs->added < jobs->submitted) {
+	status = add_files_jobs_add_next (notmuch, state);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+    }
+
+    return ret;
+}
+
+/* Whether 'entry' of 'dir' is listed in the manifest of the
+ * directory, (as are the regular files and the subdirectories of
+ * which the database knows). */
+static notmuch_bool_t
+scan_entry_is_manifested (scan_dir_t *dir, scan_entry_t *entry)
+{
+    return scan_entry_is_regular (entry) ||
+	(scan_entry_is_directory (entry) &&
+	 ! scan_entry_is_ignored (dir, entry));
+}
+
+/* Whether every entry of 'manifest' is still found in 'dir', (with
+ * the same inode number). If so, nothing has been removed from the
+ * directory and its entries missing from 'manifest' are new. */
+static notmuch_bool_t
+scan_dir_covers_manifest (scan_dir_t *dir, notmuch_manifest_t *manifest)
+{
+    scan_entry_t *entry;
+    uint64_t inode;
+    unsigned int found = 0;
+    int i;
+
+    for (i = 0; i < dir->num_entries; i++) {
+	entry = &dir->entries[i];
+
+	if (! scan_entry_is_manifested (dir, entry))
+	    continue;
+
+	if (notmuch_manifest_find (manifest, entry->name, &inode, NULL)) {
+	    if (inode != entry->inode)
+		return FALSE;
+	    found++;
+	}
+    }
+
+    return found == notmuch_manifest_count (manifest);
+}
+
+/* Add 'entry' of the directory 'path' to 'manifest', taking its size
+ * from 'db_manifest', (the previous manifest, or NULL), where it's
+ * recorded there and otherwise from a stat. */
+static notmuch_status_t
+manifest_add_entry (notmuch_database_t *notmuch,
+		    notmuch_manifest_t *manifest,
+		    notmuch_manifest_t *db_manifest,
+		    const char *path,
+		    scan_entry_t *entry)
+{
+    uint64_t inode, size = 0;
+    struct stat st;
+    char *filename;
+
+    /* The sizes of directories aren't of interest. */
+    if (! scan_entry_is_regular (entry))
+	return notmuch_manifest_add (manifest, entry->name, entry->inode, 0);
+
+    if (! (db_manifest &&
+	   notmuch_manifest_find (db_manifest, entry->name, &inode, &size) &&
+	   inode == entry->inode))
+    {
+	filename = talloc_asprintf (notmuch, "%s/%s", path, entry->name);
+	size = stat (filename, &st) ? 0 : st.st_size;
+	talloc_free (filename);
+    }
+
+    return notmuch_manifest_add (manifest, entry->name, entry->inode, size);
+}
+
+/* Add the file 'name' of the directory 'path' to the files to be
+ * removed from the database. If its inode number and size were
+ * recorded in 'db_manifest', (when the directory's mtime was
+ * 'db_mtime'), it can be found again if it was moved within the mail
+ * store, (see find_moved_file). */
+static void
+note_removed_file (add_files_state_t *state,
+		   const char *path,
+		   const char *name,
+		   notmuch_manifest_t *db_manifest,
+		   const struct timespec *db_mtime)
+{
+    _removed_file_t *removed;
+    char *absolute;
+    uint64_t inode, size;
+
+    absolute = talloc_asprintf (state->removed_files, "%s/%s", path, name);
+
+    _filename_list_add (state->removed_files, absolute);
+
+    if (db_manifest == NULL || db_mtime == NULL ||
+	! notmuch_manifest_find (db_manifest, name, &inode, &size))
+    {
+	return;
+    }
+
+    removed = talloc (state->removed_files, _removed_file_t);
+    removed->filename = absolute;
+    removed->size = size;
+    removed->dir_mtime = *db_mtime;
+
+    g_hash_table_insert (state->removed_inodes,
+			 talloc_asprintf (removed, "%llu",
+					  (unsigned long long) inode),
+			 removed);
+}
+
+/* The length of the Maildir unique name at the start of the file
+ * 'name', (before any ":2," info, or "!2," on VFAT). */
+static size_t
+maildir_unique_length (const char *name)
+{
+    const char *info;
+
+    info = strchr (name, ':');
+    if (info == NULL)
+	info = strstr (name, "!2,");
+
+    return info ? (size_t) (info - name) : strlen (name);
+}
+
+/* Find the file in the database, (other than 'name'), in 'directory',
+ * (the directory 'path'), with the Maildir unique name of which 'name'
+ * begins with the first 'length' characters. */
+static char *
+find_maildir_file (void *ctx,
+		   notmuch_directory_t *directory,
+		   const char *path,
+		   const char *name,
+		   size_t length)
+{
+    notmuch_filenames_t *files;
+    const char *file;
+    char *unique, *found = NULL;
+
+    unique = talloc_strndup (ctx, name, length);
+
+    for (files = notmuch_directory_get_child_files_with_prefix (directory,
+								 unique);
+	 notmuch_filenames_valid (files) && found == NULL;
+	 notmuch_filenames_move_to_next (files))
+    {
+	file = notmuch_filenames_get (files);
+
+	if (maildir_unique_length (file) == length && strcmp (file, name))
+	    found = talloc_asprintf (ctx, "%s/%s", path, file);
+    }
+
+    notmuch_filenames_destroy (files);
+    talloc_free (unique);
+
+    return found;
+}
+
+/* Find the file already in the database of which the new file 'name'
+ * in 'directory', (the directory 'path'), is the same file renamed,
+ * (or a copy), so that it needn't be read. That is either:
+ *
+ *   o A file of the same Maildir unique name, (the part of the name
+ *     that stays the same as its flags change), in the same "cur" or
+ *     "new" directory, or in the other one of the same Maildir.
+ *
+ *   o A file found removed, (see note_removed_file), of the same
+ *     inode number and size, which must already have been in its
+ *     directory when last recorded, (rather than delivered since,
+ *     reusing the inode of a file deleted). This only finds files
+ *     moved from directories examined before 'path'.
+ *
+ * Returns the path of the file, talloced from 'ctx', or NULL.
+ */
+static char *
+find_moved_file (void *ctx,
+		 notmuch_database_t *notmuch,
+		 add_files_state_t *state,
+		 notmuch_directory_t *directory,
+		 const char *path,
+		 scan_entry_t *entry)
+{
+    const char *base, *other;
+    char *key, *sibling, *filename, *found = NULL;
+    notmuch_directory_t *sibling_directory;
+    _removed_file_t *removed;
+    struct stat st;
+    size_t length;
+
+    base = strrchr (path, '/');
+    base = base ? base + 1 : path;
+
+    if (strcmp (base, "cur") == 0)
+	other = "new";
+    else if (strcmp (base, "new") == 0)
+	other = "cur";
+    else
+	other = NULL;
+
+    /* Files are only matched by name within a Maildir, (of which
+     * "tmp" and the other directory must exist too). */
+    if (other) {
+	sibling = talloc_asprintf (ctx, "%.*stmp", (int) (base - path), path);
+	if (stat (sibling, &st) || ! S_ISDIR (st.st_mode))
+	    other = NULL;
+	talloc_free (sibling);
+    }
+
+    if (other) {
+	sibling = talloc_asprintf (ctx, "%.*s%s",
+				   (int) (base - path), path, other);
+	if (stat (sibling, &st) || ! S_ISDIR (st.st_mode))
+	    other = NULL;
+    }
+
+    if (other) {
+	length = maildir_unique_length (entry->name);
+
+	found = find_maildir_file (ctx, directory, path, entry->name, length);
+
+	if (found == NULL) {
+	    sibling_directory = notmuch_database_get_directory (notmuch,
+								sibling);
+	    if (sibling_directory) {
+		found = find_maildir_file (ctx, sibling_directory, sibling,
+					   entry->name, length);
+		notmuch_directory_destroy (sibling_directory);
+	    }
+	}
+
+	talloc_free (sibling);
+	if (found)
+	    return found;
+    }
+
+    key = talloc_asprintf (ctx, "%llu",
+			   (unsigned long long) entry->inode);
+    removed = g_hash_table_lookup (state->removed_inodes, key);
+    if (removed) {
+	filename = talloc_asprintf (ctx, "%s/%s", path, entry->name);
+	if (stat (filename, &st) == 0 &&
+	    (uint64_t) st.st_size == removed->size &&
+	    (st.st_mtim.tv_sec < removed->dir_mtime.tv_sec ||
+	     (st.st_mtim.tv_sec == removed->dir_mtime.tv_sec &&
+	      st.st_mtim.tv_nsec < removed->dir_mtime.tv_nsec)))
+	{
+	    found = talloc_strdup (ctx, removed->filename);
+
+	    /* Each removed file is only found once. */
+	    g_hash_table_remove (state->removed_inodes, key);
+	}
+	talloc_free (filename);
+    }
+    talloc_free (key);
+
+    return found;
+}
+
+/* Record the times, (and the manifest), of 'directory', so the next
+ * run skips it unless changed. */
+static notmuch_status_t
+record_directory (notmuch_directory_t *directory,
+		  const struct timespec *mtime,
+		  const struct timespec *ctime,
+		  notmuch_manifest_t *manifest)
+{
+    notmuch_status_t status;
+
+    /* The manifest must never be newer than the times. */
+    status = notmuch_directory_set_manifest (directory, manifest);
+    if (status)
+	return status;
+
+    return notmuch_directory_set_times (directory, mtime, ctime);
+}
+
+static notmuch_status_t
+add_files_recursive (notmuch_database_t *notmuch,
+		     const char *path,
+		     add_files_state_t *state);
+
+/* Examine the subdirectories of 'path', (as listed in the database),
+ * but not 'path' itself, which was completed by an interrupted run
+ * with the times 'times' and hasn't changed since. A subdirectory
+ * changed since, (as found by add_files_recursive), is examined as
+ * usual, since that doesn't change the times of 'path'. */
+static notmuch_status_t
+add_files_checkpointed (notmuch_database_t *notmuch,
+			const char *path,
+			const _checkpoint_times_t *times,
+			add_files_state_t *state)
+{
+    notmuch_directory_t *directory;
+    notmuch_filenames_t *subdirs;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    notmuch_bool_t subdirs_complete = TRUE;
+    char *next;
+
+    state->subtree_complete = FALSE;
+
+    directory = notmuch_database_get_directory (notmuch, path);
+    if (directory == NULL)
+	return NOTMUCH_STATUS_XAPIAN_EXCEPTION;
+
+    for (subdirs = notmuch_directory_get_child_directories (directory);
+	 notmuch_filenames_valid (subdirs) && ! interrupted;
+	 notmuch_filenames_move_to_next (subdirs))
+    {
+	next = talloc_asprintf (notmuch, "%s/%s", path,
+				notmuch_filenames_get (subdirs));
+
+	if (state->watched &&
+	    g_hash_table_lookup_extended (state->watched, next, NULL, NULL))
+	{
+	    subdirs_complete = FALSE;
+	    talloc_free (next);
+	    continue;
+	}
+
+	status = add_files_recursive (notmuch, next, state);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+	if (! state->subtree_complete)
+	    subdirs_complete = FALSE;
+
+	talloc_free (next);
+    }
+
+    if (subdirs)
+	notmuch_filenames_destroy (subdirs);
+    notmuch_directory_destroy (directory);
+
+    /* Still complete, (should this run be interrupted in turn). */
+    if (subdirs_complete && ! interrupted && ret == NOTMUCH_STATUS_SUCCESS) {
+	checkpoint_add (state, path, &times->mtime, &times->ctime);
+	state->subtree_complete = TRUE;
+    } else {
+	state->subtree_complete = FALSE;
+    }
+
+    return ret;
+}
+
+/* Examine 'path' recursively as follows:
+ *
+ *   o Take the mtime and ctime of 'path' and the files and
+ *     directories within it (fs_entries) from the scanner, (which
+ *     reads directories ahead of this function, see scanner_take)
+ *   o Ask the database for its times of 'path'
+ *
+ *   o Pass 1: For each directory in fs_entries, recursively call into
+ *     this same function.
+ *
+ *   o Pass 2: If the times of 'path' differ from the database's, ask
+ *     the database for its manifest of 'path' (db_manifest). If every
+ *     entry listed there is still in fs_entries, the regular files in
+ *     fs_entries and not in db_manifest are new files to add_message
+ *     into the database. Otherwise, ask the database for the files
+ *     and directories within 'path' (db_files and db_subdirs) and walk
+ *     fs_entries simultaneously with them. Look for one of three
+ *     interesting cases:
+ *
+ *	   1. Regular file in fs_entries and not in db_files
+ *            This is a new file to add_message into the database,
+ *            (unless it's a file moved within the mail store, which
+ *            is only recorded under its new name, see
+ *            find_moved_file).
+ *
+ *         2. Filename in db_files not in fs_entries.
+ *            This is a file that has been removed from the mail store.
+ *
+ *         3. Directory in db_subdirs not in fs_entries
+ *            This is a directory that has been removed from the mail store.
+ *
+ *     Note that the addition of a directory is not interesting here,
+ *     since that will have been taken care of in pass 1. Also, we
+ *     don't immediately act on file/directory removal since we must
+ *     ensure that in the case of a rename that the new filename is
+ *     added before the old filename is removed, (so that no
+ *     information is lost from the database).
+ *
+ *   o Tell the database to update its times and manifest of 'path',
+ *     (or, if anything was removed, have notmuch_new_command do so
+ *     once the removals are done)
+ *
+ * A directory completed by an interrupted run, and unchanged since,
+ * is skipped, (see add_files_checkpointed), and
+ * state->subtree_complete is set to whether 'path' was completed.
+ */
+static notmuch_status_t
+add_files_recursive (notmuch_database_t *notmuch,
+		     const char *path,
+		     add_files_state_t *state)
+{
+    const _checkpoint_times_t *checkpoint_times;
+    scan_dir_t *scan = NULL;
+    scan_entry_t *entry;
+    char *next = NULL;
+    struct timespec fs_ctime, db_mtim, db_ctim;
+    time_t db_mtime;
+    notmuch_bool_t unchanged, have_times;
+    notmuch_manifest_t *db_manifest = NULL, *manifest = NULL;
+    char *moved_from;
+    uint64_t inode;
+    notmuch_status_t status, ret = NOTMUCH_STATUS_SUCCESS;
+    scan_entry_t *fs_entries;
+    int i, num_fs_entries;
+    notmuch_directory_t *directory = NULL;
+    notmuch_filenames_t *db_files = NULL;
+    notmuch_filenames_t *db_subdirs = NULL;
+    notmuch_bool_t new_directory;
+    notmuch_bool_t mtime_recorded = FALSE, subdirs_complete = TRUE;
+    notmuch_bool_t has_removals = FALSE;
+    char *folder_base_name = NULL;
+
+    checkpoint_times = checkpoint_lookup (state, path);
+    if (checkpoint_times)
+	return add_files_checkpointed (notmuch, path, checkpoint_times, state);
+
+    state->subtree_complete = FALSE;
+
+    /* The scanner has most likely read the directory already. */
+    scan = scanner_take (state->scanner, path);
+
+    if (scan->stat_error) {
+	fprintf (stderr, "Error reading directory %s: %s\n",
+		 path, strerror (scan->stat_error));
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    if (! scan->is_directory) {
+	state->subtree_complete = TRUE;
+	goto DONE;
+    }
+
+    directory = notmuch_database_get_directory (notmuch, path);
+    db_mtime = notmuch_directory_get_mtime (directory);
+
+    new_directory = (db_mtime == 0);
+
+    /* Directories last recorded by an earlier version of notmuch
+     * have only the mtime, to the second. */
+    have_times = notmuch_directory_get_times (directory, &db_mtim, &db_ctim);
+    if (have_times) {
+	unchanged = (scan->mtime.tv_sec == db_mtim.tv_sec &&
+		     scan->mtime.tv_nsec == db_mtim.tv_nsec &&
+		     scan->ctime.tv_sec == db_ctim.tv_sec &&
+		     scan->ctime.tv_nsec == db_ctim.tv_nsec);
+    } else {
+	unchanged = (scan->mtime.tv_sec <= db_mtime);
+    }
+
+    /* A racy directory is recorded with a ctime no directory has, so
+     * the next run looks at it again. */
+    fs_ctime = scan->ctime;
+    if (scan->racy)
+	fs_ctime.tv_sec = fs_ctime.tv_nsec = 0;
+
+    if (scan->open_error) {
+	fprintf (stderr, "Error opening directory %s: %s\n",
+		 path, strerror (scan->open_error));
+	ret = NOTMUCH_STATUS_FILE_ERROR;
+	goto DONE;
+    }
+
+    /* If the database knows about this directory, then the entries
+     * are sorted based on strcmp to match the database sorting.
+     * Otherwise, we can do inode-based sorting for faster filesystem
+     * operation. */
+    fs_entries = scan->entries;
+    num_fs_entries = scan->num_entries;
+    if (new_directory) {
+	/* Unless messages were added to the directory before it was
+	 * ever examined, (by "notmuch insert"), in which case they're
+	 * listed, (in name order), as for any known directory. */
+	db_files = notmuch_directory_get_child_files (directory);
+	if (! notmuch_filenames_valid (db_files)) {
+	    if (db_files)
+		notmuch_filenames_destroy (db_files);
+	    db_files = NULL;
+	    qsort (fs_entries, num_fs_entries, sizeof (scan_entry_t),
+		   scan_entry_sort_inode);
+	}
+    }
+
+    /* Pass 1: Recurse into all sub-directories. */
+    for (i = 0; i < num_fs_entries; i++) {
+	if (interrupted)
+	    break;
+
+	entry = &fs_entries[i];
+
+	/* We only want to descend into directories.
+	 * But symlinks can be to directories too, of course. */
+	if (entry->type != DT_DIR &&
+	    entry->type != DT_LNK &&
+	    entry->type != DT_UNKNOWN)
+	{
+	    continue;
+	}
+
+	if (scan_entry_is_ignored (scan, entry))
+	    continue;
+	else
+	    state->tag_maildir = TRUE;
+
+	/* A symlink that can't be followed is still descended into,
+	 * (to report the error). */
+	if (entry->type != DT_DIR && entry->error == 0 &&
+	    ! S_ISDIR (entry->mode))
+	{
+	    continue;
+	}
+
+	next = talloc_asprintf (notmuch, "%s/%s", path, entry->name);
+
+	if (state->watched &&
+	    g_hash_table_lookup_extended (state->watched, next, NULL, NULL))
+	{
+	    subdirs_complete = FALSE;
+	    talloc_free (next);
+	    next = NULL;
+	    continue;
+	}
+	status = add_files_recursive (notmuch, next, state);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+	if (! state->subtree_complete)
+	    subdirs_complete = FALSE;
+	talloc_free (next);
+	next = NULL;
+    }
+
+    /* If this directory hasn't been modified since the last
+     * "notmuch new", then we can skip the second pass entirely, (and
+     * needn't list its files and subdirectories in the database). */
+    if (unchanged) {
+	mtime_recorded = TRUE;
+	goto DONE;
+    }
+
+    /* Unless something listed in the manifest has been removed, the
+     * files to add are those missing from it, (and listing the files
+     * and subdirectories in the database is unnecessary). Otherwise,
+     * the manifest still tells the inode numbers of the files
+     * removed, (see note_removed_file). */
+    if (! new_directory) {
+	db_manifest = notmuch_directory_get_manifest (directory);
+	if (db_manifest == NULL ||
+	    ! scan_dir_covers_manifest (scan, db_manifest))
+	{
+	    db_files = notmuch_directory_get_child_files (directory);
+	    db_subdirs = notmuch_directory_get_child_directories (directory);
+	}
+    }
+
+    manifest = notmuch_manifest_create (notmuch);
+    if (manifest == NULL) {
+	ret = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	goto DONE;
+    }
+
+    /* Pass 2: Scan for new files, removed files, and removed directories. */
+    for (i = 0; i < num_fs_entries; i++)
+    {
+	if (interrupted)
+	    break;
+
+        entry = &fs_entries[i];
+
+	/* Check if we've walked past any names in db_files or
+	 * db_subdirs. If so, these have been deleted. */
+	while (notmuch_filenames_valid (db_files) &&
+	       strcmp (notmuch_filenames_get (db_files), entry->name) < 0)
+	{
+	    note_removed_file (state, path, notmuch_filenames_get (db_files),
+			       db_manifest, have_times ? &db_mtim : NULL);
+	    has_removals = TRUE;
+
+	    notmuch_filenames_move_to_next (db_files);
+	}
+
+	while (notmuch_filenames_valid (db_subdirs) &&
+	       strcmp (notmuch_filenames_get (db_subdirs), entry->name) <= 0)
+	{
+	    const char *filename = notmuch_filenames_get (db_subdirs);
+
+	    if (strcmp (filename, entry->name) < 0)
+	    {
+		char *absolute = talloc_asprintf (state->removed_directories,
+						  "%s/%s", path, filename);
+
+		_filename_list_add (state->removed_directories, absolute);
+		has_removals = TRUE;
+	    }
+
+	    notmuch_filenames_move_to_next (db_subdirs);
+	}
+
+	if (! scan_entry_is_manifested (scan, entry))
+	    continue;
+
+	status = manifest_add_entry (notmuch, manifest, db_manifest,
+				     path, entry);
+	if (status) {
+	    ret = status;
+	    goto DONE;
+	}
+
+	/* If we're looking at a symlink, we only want to add it if it
+	 * links to a regular file, (and not to a directory, say), as
+	 * the scanner found. Don't emit an error for a link pointing
+	 * nowhere, since the directory-traversal pass will have
+	 * already done that. */
+	if (! scan_entry_is_regular (entry))
+	    continue;
+
+	/* Don't add a file that we've added before. */
+	if (notmuch_filenames_valid (db_files) &&
+	    strcmp (notmuch_filenames_get (db_files), entry->name) == 0)
+	{
+	    notmuch_filenames_move_to_next (db_files);
+	    continue;
+	}
+
+	if (db_manifest &&
+	    notmuch_manifest_find (db_manifest, entry->name, &inode, NULL) &&
+	    inode == entry->inode)
+	{
+	    continue;
+	}
+
+	/* We're now looking at a regular file that doesn't yet exist
+	 * in the database, so add it. */
+	next = talloc_asprintf (notmuch, "%s/%s", path, entry->name);
+
+	/* Unless it's just a file already in the database moved, (or
+	 * renamed as its Maildir flags changed), which is recorded
+	 * under its new name without being read. The old name is
+	 * removed along with the other files removed. */
+	moved_from = find_moved_file (next, notmuch, state, directory,
+				      path, entry);
+	if (moved_from) {
+	    status = notmuch_database_add_message_filename (notmuch,
+							    moved_from,
+							    next);
+	    if (status != NOTMUCH_STATUS_FILE_ERROR) {
+		if (status == NOTMUCH_STATUS_SUCCESS)
+		    status = NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID;
+		status = add_file_finish (notmuch, state, next, status);
+		if (status) {
+		    ret = status;
+		    goto DONE;
+		}
+
+		talloc_free (next);
+		next = NULL;
+		continue;
+	    }
+	}
+
+	state->processed_files++;
+
+	if (state->verbose) {
+	    if (state->output_is_a_tty)
+		printf("\r\033[K");
+
+	    printf ("%i/%i: %s",
+		    state->processed_files,
+		    state->total_files,
+		    next);
+
+	    putchar((state->output_is_a_tty) ? '\r' : '\n');
+	    fflush (stdout);
+	}
+
+	if (folder_base_name == NULL)
+	    folder_base_name = _get_folder_base_name(path);
+
+	if (state->jobs) {
+	    status = add_files_jobs_submit (notmuch, state, next,
+					    folder_base_name);
+	} else {
+	    const char **tags = new_message_tags (next, state, entry->name,
+						  state->tag_maildir);
+
+	    if (tags == NULL)
+		status = NOTMUCH_STATUS_OUT_OF_MEMORY;
+	    else
+		status = notmuch_database_add_message_with_tags (notmuch, next,
+								 folder_base_name,
+								 tags, NULL);
+	    status = add_file_finish (notmuch, state, next, status);
+	}
+	if (status) {
+	    ret = status;
+	    goto DONE;
+	}
+
+	if (do_add_files_print_progress) {
+	    do_add_files_print_progress = 0;
+	    add_files_print_progress (state);
+	}
+
+	talloc_free (next);
+	next = NULL;
+    }
+
+    if (interrupted)
+	goto DONE;
+
+    /* Now that we've walked the whole filesystem list, anything left
+     * over in the database lists has been deleted. */
+    while (notmuch_filenames_valid (db_files))
+    {
+	note_removed_file (state, path, notmuch_filenames_get (db_files),
+			   db_manifest, have_times ? &db_mtim : NULL);
+	has_removals = TRUE;
+
+	notmuch_filenames_move_to_next (db_files);
+    }
+
+    while (notmuch_filenames_valid (db_subdirs))
+    {
+	char *absolute = talloc_asprintf (state->removed_directories,
+					  "%s/%s", path,
+					  notmuch_filenames_get (db_subdirs));
+
+	_filename_list_add (state->removed_directories, absolute);
+	has_removals = TRUE;
+
+	notmuch_filenames_move_to_next (db_subdirs);
+    }
+
+    /* The files of this directory must be in the database before its
+     * mtime is. */
+    if (state->jobs) {
+	status = add_files_jobs_flush (notmuch, state);
+	if (status) {
+	    ret = status;
+	    goto DONE;
+	}
+    }
+
+    if (interrupted)
+	goto DONE;
+
+    /* Were the mtime recorded now, a crash before the removals could
+     * leave them undetected by the next run. */
+    if (has_removals) {
+	_deferred_mtime_t *deferred = talloc (state->removed_files,
+					      _deferred_mtime_t);
+
+	deferred->path = talloc_strdup (deferred, path);
+	deferred->mtime = scan->mtime;
+	deferred->ctime = fs_ctime;
+	deferred->manifest = manifest;
+	deferred->next = state->deferred_mtimes;
+	state->deferred_mtimes = deferred;
+	manifest = NULL;
+    } else {
+	status = record_directory (directory, &scan->mtime, &fs_ctime,
+				   manifest);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+	mtime_recorded = (status == NOTMUCH_STATUS_SUCCESS);
+    }
+
+  DONE:
+    /* Directory names with newlines can't be recorded, (and must be
+     * rather rare). */
+    if (mtime_recorded && subdirs_complete && ! interrupted &&
+	ret == NOTMUCH_STATUS_SUCCESS && strchr (path, '\n') == NULL)
+    {
+	checkpoint_add (state, path, &scan->mtime, &fs_ctime);
+	state->subtree_complete = TRUE;
+    }
+
+    if (next)
+	talloc_free (next);
+    if (scan)
+	scan_dir_release (scan);
+    if (manifest)
+	notmuch_manifest_destroy (manifest);
+    if (db_manifest)
+	notmuch_manifest_destroy (db_manifest);
+    if (db_subdirs)
+	notmuch_filenames_destroy (db_subdirs);
+    if (db_files)
+	notmuch_filenames_destroy (db_files);
+    if (directory)
+	notmuch_directory_destroy (directory);
+    if (folder_base_name)
+	g_free(folder_base_name);
+    return ret;
+}
+
+/* This is the top-level entry point for add_files. It sets up the
+ * progress-printing timer, does a couple of error checks and then
+ * calls into the recursive function for each of 'paths'. */
+static notmuch_status_t
+add_files (notmuch_database_t *notmuch,
+	   const char **paths,
+	   unsigned int num_paths,
+	   add_files_state_t *state)
+{
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS, ret;
+    struct sigaction action;
+    struct itimerval timerval;
+    notmuch_bool_t timer_is_active = FALSE;
+    struct stat st;
+    unsigned int i;
+
+    if (state->output_is_a_tty && ! debugger_is_active () && ! state->verbose) {
+	/* Setup our handler for SIGALRM */
+	memset (&action, 0, sizeof (struct sigaction));
+	action.sa_handler = handle_sigalrm;
+	sigemptyset (&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction (SIGALRM, &action, NULL);
+
+	/* Then start a timer to send SIGALRM once per second. */
+	timerval.it_interval.tv_sec = 1;
+	timerval.it_interval.tv_usec = 0;
+	timerval.it_value.tv_sec = 1;
+	timerval.it_value.tv_usec = 0;
+	setitimer (ITIMER_REAL, &timerval, NULL);
+
+	timer_is_active = TRUE;
+    }
+
+    /* The directories are read ahead of indexing by the scanner
+     * threads, (unless they were already read to count the files, or
+     * only the directories changed are examined while watching). */
+    if (state->scanner == NULL) {
+	state->scanner = scanner_start (notmuch, paths[0],
+					state->num_jobs > 1 &&
+					state->watched == NULL ?
+					state->num_jobs : 0,
+					state->checkpoint, NEW_SCAN_WINDOW);
+    }
+
+    state->jobs = NULL;
+    if (state->num_jobs > 1)
+	state->jobs = add_files_jobs_start (notmuch, state->num_jobs);
+
+    for (i = 0; i < num_paths && ! interrupted; i++) {
+	if (stat (paths[i], &st)) {
+	    fprintf (stderr, "Error reading directory %s: %s\n",
+		     paths[i], strerror (errno));
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+	} else if (! S_ISDIR (st.st_mode)) {
+	    fprintf (stderr, "Error: %s is not a directory.\n", paths[i]);
+	    ret = NOTMUCH_STATUS_FILE_ERROR;
+	} else {
+	    ret = add_files_recursive (notmuch, paths[i], state);
+	}
+
+	if (ret && status == NOTMUCH_STATUS_SUCCESS)
+	    status = ret;
+
+	/* Processing halts on anything worse than an unreadable
+	 * directory. */
+	if (ret && ret != NOTMUCH_STATUS_FILE_ERROR)
+	    break;
+    }
+
+    if (state->jobs) {
+	/* Files remain pending if processing was interrupted. */
+	ret = add_files_jobs_flush (notmuch, state);
+	if (ret && status == NOTMUCH_STATUS_SUCCESS)
+	    status = ret;
+
+	add_files_jobs_stop (state->jobs);
+	state->jobs = NULL;
+    }
+
+    if (timer_is_active) {
+	/* Now stop the timer. */
+	timerval.it_interval.tv_sec = 0;
+	timerval.it_interval.tv_usec = 0;
+	timerval.it_value.tv_sec = 0;
+	timerval.it_value.tv_usec = 0;
+	setitimer (ITIMER_REAL, &timerval, NULL);
+
+	/* And disable the signal handler. */
+	action.sa_handler = SIG_IGN;
+	sigaction (SIGALRM, &action, NULL);
+    }
+
+    return status;
+}
+
+static void
+upgrade_print_progress (void *closure,
+			double progress)
+{
+    add_files_state_t *state = closure;
+
+    printf ("Upgrading database: %.2f%% complete", progress * 100.0);
+
+    if (progress > 0) {
+	struct timeval tv_now;
+	double elapsed, time_remaining;
+
+	gettimeofday (&tv_now, NULL);
+
+	elapsed = notmuch_time_elapsed (state->tv_start, tv_now);
+	time_remaining = (elapsed / progress) * (1.0 - progress);
+	printf (" (");
+	notmuch_time_print_formatted_seconds (time_remaining);
+	printf (" remaining)");
+    }
+
+    printf (".      \r");
+
+    fflush (stdout);
+}
+
+/* Recursively remove all filenames from the database referring to
+ * 'path' (or to any of its children). */
+static void
+_remove_directory (void *ctx,
+		   notmuch_database_t *notmuch,
+		   const char *path,
+		   int *renamed_files,
+		   int *removed_files)
+{
+    notmuch_directory_t *directory;
+    notmuch_filenames_t *files, *subdirs;
+    notmuch_status_t status;
+    char *absolute;
+
+    directory = notmuch_database_get_directory (notmuch, path);
+
+    for (files = notmuch_directory_get_child_files (directory);
+	 notmuch_filenames_valid (files);
+	 notmuch_filenames_move_to_next (files))
+    {
+	absolute = talloc_asprintf (ctx, "%s/%s", path,
+				    notmuch_filenames_get (files));
+	status = notmuch_database_remove_message (notmuch, absolute);
+	if (status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID)
+	    *renamed_files = *renamed_files + 1;
+	else
+	    *removed_files = *removed_files + 1;
+	talloc_free (absolute);
+    }
+
+    for (subdirs = notmuch_directory_get_child_directories (directory);
+	 notmuch_filenames_valid (subdirs);
+	 notmuch_filenames_move_to_next (subdirs))
+    {
+	absolute = talloc_asprintf (ctx, "%s/%s", path,
+				    notmuch_filenames_get (subdirs));
+	_remove_directory (ctx, notmuch, absolute, renamed_files, removed_files);
+	talloc_free (absolute);
+    }
+
+    notmuch_directory_destroy (directory);
+}
+
+/* Examine each of 'paths', (see add_files), then remove the files
+ * and directories found to have been removed from the mail store and
+ * record the times of the directories they were removed from, all
+ * committed atomically in batches. The numbers of files removed and
+ * renamed are stored in *removed_files and *renamed_files. */
+static notmuch_status_t
+new_update (void *ctx,
+	    notmuch_database_t *notmuch,
+	    const char **paths,
+	    unsigned int num_paths,
+	    add_files_state_t *state,
+	    int *renamed_files,
+	    int *removed_files)
+{
+    _filename_node_t *f;
+    _deferred_mtime_t *d;
+    notmuch_directory_t *directory;
+    notmuch_status_t status, ret;
+
+    *renamed_files = 0;
+    *removed_files = 0;
+
+    state->completed_directories = _filename_list_create (ctx);
+    state->uncommitted_directories = &state->completed_directories->head;
+
+    state->processed_files = 0;
+    state->added_messages = 0;
+    gettimeofday (&state->tv_start, NULL);
+
+    state->removed_files = _filename_list_create (ctx);
+    state->removed_directories = _filename_list_create (ctx);
+    state->deferred_mtimes = NULL;
+    state->removed_inodes = g_hash_table_new (g_str_hash, g_str_equal);
+
+    state->batch_files = 0;
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status) {
+	fprintf (stderr, "Error: %s.\n", notmuch_status_to_string (status));
+	talloc_free (state->completed_directories);
+	talloc_free (state->removed_files);
+	talloc_free (state->removed_directories);
+	g_hash_table_unref (state->removed_inodes);
+	return status;
+    }
+    state->batch_open = TRUE;
+
+    ret = add_files (notmuch, paths, num_paths, state);
+
+    if (state->scanner) {
+	scanner_stop (state->scanner);
+	state->scanner = NULL;
+    }
+
+    for (f = state->removed_files->head; f; f = f->next) {
+	status = notmuch_database_remove_message (notmuch, f->filename);
+	if (status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID)
+	    (*renamed_files)++;
+	else
+	    (*removed_files)++;
+    }
+
+    for (f = state->removed_directories->head; f; f = f->next) {
+	_remove_directory (ctx, notmuch, f->filename,
+			   renamed_files, removed_files);
+    }
+
+    for (d = state->deferred_mtimes; d; d = d->next) {
+	directory = notmuch_database_get_directory (notmuch, d->path);
+	if (directory) {
+	    record_directory (directory, &d->mtime, &d->ctime, d->manifest);
+	    notmuch_directory_destroy (directory);
+	}
+	notmuch_manifest_destroy (d->manifest);
+    }
+
+    g_hash_table_unref (state->removed_inodes);
+    talloc_free (state->removed_files);
+    talloc_free (state->removed_directories);
+
+    if (state->batch_open) {
+	status = notmuch_database_end_atomic (notmuch);
+	if (status && ret == NOTMUCH_STATUS_SUCCESS)
+	    ret = status;
+	else if (status == NOTMUCH_STATUS_SUCCESS && new_is_resumable (ret))
+	    checkpoint_write (state);
+    }
+
+    if (! new_is_resumable (ret))
+	unlink (state->checkpoint_path);
+
+    talloc_free (state->completed_directories);
+    state->completed_directories = NULL;
+
+    return ret;
+}
+
+/* Print what new_update did. */
+static void
+new_report (add_files_state_t *state,
+	    int renamed_files,
+	    int removed_files,
+	    notmuch_status_t ret)
+{
+    struct timeval tv_now;
+    double elapsed;
+
+    gettimeofday (&tv_now, NULL);
+    elapsed = notmuch_time_elapsed (state->tv_start, tv_now);
+
+    if (state->processed_files) {
+	printf ("Processed %d %s in ", state->processed_files,
+		state->processed_files == 1 ?
+		"file" : "total files");
+	notmuch_time_print_formatted_seconds (elapsed);
+	if (elapsed > 1) {
+	    printf (" (%d files/sec.).                 \n",
+		    (int) (state->processed_files / elapsed));
+	} else {
+	    printf (".                    \n");
+	}
+    }
+
+    if (state->added_messages) {
+	printf ("Added %d new %s to the database.",
+		state->added_messages,
+		state->added_messages == 1 ?
+		"message" : "messages");
+    } else {
+	printf ("No new mail.");
+    }
+
+    if (removed_files) {
+	printf (" Removed %d %s.",
+		removed_files,
+		removed_files == 1 ? "message" : "messages");
+    }
+
+    if (renamed_files) {
+	printf (" Detected %d file %s.",
+		renamed_files,
+		renamed_files == 1 ? "rename" : "renames");
+    }
+
+    printf ("\n");
+
+    if (ret) {
+	printf ("\nNote: At least one error was encountered: %s\n",
+		notmuch_status_to_string (ret));
     }
 
-    if (interrupted)
-	goto DONE;
-
-    /* Now that we've walked the whole filesystem list, anything left
-     * over in the database lists has been deleted. */
-    while (notmuch_filenames_valid (db_files))
-    {
-	char *absolute = talloc_asprintf (state->removed_files,
-					  "%s/%s", path,
-					  notmuch_filenames_get (db_files));
+    fflush (stdout);
+}
 
-	_filename_list_add (state->removed_files, absolute);
+#if HAVE_INOTIFY
 
-	notmuch_filenames_move_to_next (db_files);
-    }
+/* The directories of the mail store watched by "notmuch new --watch"
+ * for files created, moved or deleted, (see watch_mail_store). */
+typedef struct {
+    int fd;
 
-    while (notmuch_filenames_valid (db_subdirs))
-    {
-	char *absolute = talloc_asprintf (state->removed_directories,
-					  "%s/%s", path,
-					  notmuch_filenames_get (db_subdirs));
+    /* The path of each watch, by watch descriptor, and the watch
+     * descriptor of each path. */
+    GHashTable *paths;
+    GHashTable *wds;
 
-	_filename_list_add (state->removed_directories, absolute);
+    /* The directories changed since last examined. */
+    GHashTable *changed;
 
-	notmuch_filenames_move_to_next (db_subdirs);
-    }
+    /* Whether changes were lost, (more having been made than the
+     * kernel could queue), so that the whole mail store must be
+     * examined. */
+    notmuch_bool_t overflowed;
 
-    if (! interrupted) {
-	status = notmuch_directory_set_mtime (directory, fs_mtime);
-	if (status && ret == NOTMUCH_STATUS_SUCCESS)
-	    ret = status;
-    }
+    /* Whether a directory first watched is marked as changed, (since
+     * it might have changed before being watched). */
+    notmuch_bool_t mark_new;
 
-  DONE:
-    if (next)
-	talloc_free (next);
-    if (entry)
-	free (entry);
-    if (dir)
-	closedir (dir);
-    if (fs_entries)
-	free (fs_entries);
-    if (db_subdirs)
-	notmuch_filenames_destroy (db_subdirs);
-    if (db_files)
-	notmuch_filenames_destroy (db_files);
-    if (directory)
-	notmuch_directory_destroy (directory);
-    if (folder_base_name)
-	g_free(folder_base_name);
-    return ret;
-}
+    /* Whether the limit on the number of watches has been reported. */
+    notmuch_bool_t limit_reported;
+} watcher_t;
 
-/* This is the top-level entry point for add_files. It does a couple
- * of error checks, sets up the progress-printing timer and then calls
- * into the recursive function. */
-static notmuch_status_t
-add_files (notmuch_database_t *notmuch,
-	   const char *path,
-	   add_files_state_t *state)
+static watcher_t *
+watcher_create (void *ctx)
 {
-    notmuch_status_t status;
-    struct sigaction action;
-    struct itimerval timerval;
-    notmuch_bool_t timer_is_active = FALSE;
-    struct stat st;
-
-    if (state->output_is_a_tty && ! debugger_is_active () && ! state->verbose) {
-	/* Setup our handler for SIGALRM */
-	memset (&action, 0, sizeof (struct sigaction));
-	action.sa_handler = handle_sigalrm;
-	sigemptyset (&action.sa_mask);
-	action.sa_flags = SA_RESTART;
-	sigaction (SIGALRM, &action, NULL);
+    watcher_t *watcher;
 
-	/* Then start a timer to send SIGALRM once per second. */
-	timerval.it_interval.tv_sec = 1;
-	timerval.it_interval.tv_usec = 0;
-	timerval.it_value.tv_sec = 1;
-	timerval.it_value.tv_usec = 0;
-	setitimer (ITIMER_REAL, &timerval, NULL);
+    watcher = talloc_zero (ctx, watcher_t);
 
-	timer_is_active = TRUE;
+    watcher->fd = inotify_init ();
+    if (watcher->fd == -1) {
+	fprintf (stderr, "Error: failed to watch the mail store: %s\n",
+		 strerror (errno));
+	talloc_free (watcher);
+	return NULL;
     }
 
-    if (stat (path, &st)) {
-	fprintf (stderr, "Error reading directory %s: %s\n",
-		 path, strerror (errno));
-	return NOTMUCH_STATUS_FILE_ERROR;
-    }
+    watcher->paths = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					    NULL, g_free);
+    watcher->wds = g_hash_table_new_full (g_str_hash, g_str_equal,
+					  g_free, NULL);
+    watcher->changed = g_hash_table_new_full (g_str_hash, g_str_equal,
+					      g_free, NULL);
 
-    if (! S_ISDIR (st.st_mode)) {
-	fprintf (stderr, "Error: %s is not a directory.\n", path);
-	return NOTMUCH_STATUS_FILE_ERROR;
-    }
+    return watcher;
+}
 
-    status = add_files_recursive (notmuch, path, state);
+static void
+watcher_destroy (watcher_t *watcher)
+{
+    close (watcher->fd);
 
-    if (timer_is_active) {
-	/* Now stop the timer. */
-	timerval.it_interval.tv_sec = 0;
-	timerval.it_interval.tv_usec = 0;
-	timerval.it_value.tv_sec = 0;
-	timerval.it_value.tv_usec = 0;
-	setitimer (ITIMER_REAL, &timerval, NULL);
+    g_hash_table_unref (watcher->paths);
+    g_hash_table_unref (watcher->wds);
+    g_hash_table_unref (watcher->changed);
 
-	/* And disable the signal handler. */
-	action.sa_handler = SIG_IGN;
-	sigaction (SIGALRM, &action, NULL);
+    talloc_free (watcher);
+}
+
+/* Watch the directory 'path', returning FALSE if it can't be. */
+static notmuch_bool_t
+watcher_add (watcher_t *watcher, const char *path)
+{
+    const char *old_path;
+    int wd;
+
+    wd = inotify_add_watch (watcher->fd, path,
+			    IN_CREATE | IN_CLOSE_WRITE | IN_DELETE |
+			    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd == -1) {
+	/* A directory listed in the database might have been removed
+	 * since, (which its parent's watch reports). */
+	if (errno == ENOENT || errno == ENOTDIR)
+	    return FALSE;
+
+	if (errno != ENOSPC) {
+	    fprintf (stderr, "Warning: failed to watch %s: %s\n",
+		     path, strerror (errno));
+	} else if (! watcher->limit_reported) {
+	    fprintf (stderr, "Warning: too many directories to watch them all, (see\n"
+		     "/proc/sys/fs/inotify/max_user_watches). Those not watched are examined\n"
+		     "whenever their parent directory changes.\n");
+	    watcher->limit_reported = TRUE;
+	}
+	return FALSE;
     }
 
-    return status;
+    /* A directory that was moved keeps its watch. */
+    old_path = g_hash_table_lookup (watcher->paths, GINT_TO_POINTER (wd));
+    if (old_path)
+	g_hash_table_remove (watcher->wds, old_path);
+
+    g_hash_table_insert (watcher->paths, GINT_TO_POINTER (wd),
+			 g_strdup (path));
+    g_hash_table_insert (watcher->wds, g_strdup (path), GINT_TO_POINTER (wd));
+
+    return TRUE;
 }
 
-/* XXX: This should be merged with the add_files function since it
- * shares a lot of logic with it. */
-/* Recursively count all regular files in path and all sub-directories
- * of path.  The result is added to *count (which should be
- * initialized to zero by the top-level caller before calling
- * count_files). */
+/* Watch 'path' and its subdirectories known to the database,
+ * descending only into those not yet watched unless 'all'. */
 static void
-count_files (const char *path, int *count)
+watcher_add_tree (watcher_t *watcher,
+		  notmuch_database_t *notmuch,
+		  const char *path,
+		  notmuch_bool_t all)
 {
-    struct dirent *entry = NULL;
-    char *next;
-    struct stat st;
-    struct dirent **fs_entries = NULL;
-    int num_fs_entries = scandir (path, &fs_entries, 0, dirent_sort_inode);
-    int i = 0;
+    notmuch_directory_t *directory;
+    notmuch_filenames_t *subdirs;
+    char *subdir;
 
-    if (num_fs_entries == -1) {
-	fprintf (stderr, "Warning: failed to open directory %s: %s\n",
-		 path, strerror (errno));
-	goto DONE;
+    if (! g_hash_table_lookup_extended (watcher->wds, path, NULL, NULL) &&
+	watcher_add (watcher, path) &&
+	watcher->mark_new)
+    {
+	g_hash_table_insert (watcher->changed, g_strdup (path), NULL);
     }
 
-    while (!interrupted) {
-        if (i == num_fs_entries)
-	    break;
-
-        entry = fs_entries[i++];
+    directory = notmuch_database_get_directory (notmuch, path);
+    if (directory == NULL)
+	return;
 
-	/* Ignore special directories to avoid infinite recursion.
-	 * Also ignore the .notmuch directory.
-	 */
-	/* XXX: Eventually we'll want more sophistication to let the
-	 * user specify files to be ignored. */
-	if (strcmp (entry->d_name, ".") == 0 ||
-	    strcmp (entry->d_name, "..") == 0 ||
-	    strcmp (entry->d_name, ".notmuch") == 0)
+    for (subdirs = notmuch_directory_get_child_directories (directory);
+	 notmuch_filenames_valid (subdirs);
+	 notmuch_filenames_move_to_next (subdirs))
+    {
+	subdir = talloc_asprintf (watcher, "%s/%s", path,
+				  notmuch_filenames_get (subdirs));
+	if (all ||
+	    ! g_hash_table_lookup_extended (watcher->wds, subdir, NULL, NULL))
 	{
-	    continue;
+	    watcher_add_tree (watcher, notmuch, subdir, all);
 	}
+	talloc_free (subdir);
+    }
 
-	if (asprintf (&next, "%s/%s", path, entry->d_name) == -1) {
-	    next = NULL;
-	    fprintf (stderr, "Error descending from %s to %s: Out of memory\n",
-		     path, entry->d_name);
+    notmuch_directory_destroy (directory);
+}
+
+/* Read the events reported by the watches, (waiting at most 'timeout'
+ * milliseconds for them, or indefinitely if negative), and mark the
+ * directories they concern as changed. Returns the number of events
+ * read. */
+static int
+watcher_read (watcher_t *watcher, int timeout)
+{
+    char buf[4096]
+	__attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    const struct inotify_event *event;
+    struct pollfd pollfd;
+    const char *path;
+    gpointer wd;
+    ssize_t len;
+    char *p;
+    int count = 0;
+
+    pollfd.fd = watcher->fd;
+    pollfd.events = POLLIN;
+
+    /* Interrupted by a signal, (such as SIGINT), most likely. */
+    if (poll (&pollfd, 1, timeout) <= 0)
+	return 0;
+
+    len = read (watcher->fd, buf, sizeof (buf));
+    if (len <= 0)
+	return 0;
+
+    for (p = buf; p < buf + len; p += sizeof (struct inotify_event) + event->len) {
+	event = (const struct inotify_event *) p;
+	count++;
+
+	if (event->mask & IN_Q_OVERFLOW) {
+	    watcher->overflowed = TRUE;
 	    continue;
 	}
 
-	stat (next, &st);
+	path = g_hash_table_lookup (watcher->paths,
+				    GINT_TO_POINTER (event->wd));
+	if (path == NULL)
+	    continue;
 
-	if (S_ISREG (st.st_mode)) {
-	    *count = *count + 1;
-	    if (*count % 1000 == 0) {
-		printf ("Found %d files so far.\r", *count);
-		fflush (stdout);
+	/* The watch of a removed directory is removed with it, (and
+	 * its path might be watched anew by then). */
+	if (event->mask & IN_IGNORED) {
+	    if (g_hash_table_lookup_extended (watcher->wds, path, NULL, &wd) &&
+		GPOINTER_TO_INT (wd) == event->wd)
+	    {
+		g_hash_table_remove (watcher->wds, path);
 	    }
-	} else if (S_ISDIR (st.st_mode)) {
-	    count_files (next, count);
+	    g_hash_table_remove (watcher->paths, GINT_TO_POINTER (event->wd));
+	    continue;
 	}
 
-	free (next);
+	g_hash_table_insert (watcher->changed, g_strdup (path), NULL);
     }
 
-  DONE:
-    if (entry)
-	free (entry);
-    if (fs_entries)
-        free (fs_entries);
+    return count;
 }
 
 static void
-upgrade_print_progress (void *closure,
-			double progress)
+_add_changed_path (gpointer key,
+		   unused (gpointer value),
+		   gpointer user_data)
 {
-    add_files_state_t *state = closure;
+    GPtrArray *paths = user_data;
 
-    printf ("Upgrading database: %.2f%% complete", progress * 100.0);
+    g_ptr_array_add (paths, key);
+}
 
-    if (progress > 0) {
-	struct timeval tv_now;
-	double elapsed, time_remaining;
+static int
+_compare_paths (const void *a, const void *b)
+{
+    return strcmp (*(const char * const *) a, *(const char * const *) b);
+}
 
-	gettimeofday (&tv_now, NULL);
+/* Examine the directories changed since last examined, (or the whole
+ * mail store if changes were lost), and watch the subdirectories
+ * found. */
+static notmuch_status_t
+watch_update (void *ctx,
+	      notmuch_database_t *notmuch,
+	      const char *db_path,
+	      watcher_t *watcher,
+	      add_files_state_t *state)
+{
+    void *local = talloc_new (ctx);
+    GPtrArray *changed;
+    const char **paths;
+    unsigned int num_paths = 0, i;
+    notmuch_bool_t all = watcher->overflowed;
+    int renamed_files, removed_files;
+    notmuch_status_t ret;
+    struct stat st;
 
-	elapsed = notmuch_time_elapsed (state->tv_start, tv_now);
-	time_remaining = (elapsed / progress) * (1.0 - progress);
-	printf (" (");
-	notmuch_time_print_formatted_seconds (time_remaining);
-	printf (" remaining)");
+    changed = g_ptr_array_new ();
+    g_hash_table_foreach (watcher->changed, _add_changed_path, changed);
+
+    paths = talloc_array (local, const char *, changed->len + 1);
+
+    if (all) {
+	fprintf (stderr, "Warning: changes to the mail store were missed, (too many at once).\n"
+		 "Examining all of it.\n");
+	paths[num_paths++] = db_path;
+	watcher->overflowed = FALSE;
+    } else {
+	for (i = 0; i < changed->len; i++) {
+	    const char *path = g_ptr_array_index (changed, i);
+
+	    /* A directory removed since, (which its parent's watch
+	     * reports). */
+	    if (stat (path, &st) && errno == ENOENT)
+		continue;
+
+	    paths[num_paths++] = talloc_strdup (local, path);
+	}
+	qsort (paths, num_paths, sizeof (const char *), _compare_paths);
     }
 
-    printf (".      \r");
+    g_ptr_array_free (changed, TRUE);
+    g_hash_table_remove_all (watcher->changed);
 
-    fflush (stdout);
+    if (num_paths == 0) {
+	talloc_free (local);
+	return NOTMUCH_STATUS_SUCCESS;
+    }
+
+    state->watched = all ? NULL : watcher->wds;
+    ret = new_update (local, notmuch, paths, num_paths, state,
+		      &renamed_files, &removed_files);
+    state->watched = NULL;
+
+    if (state->processed_files || renamed_files || removed_files || ret)
+	new_report (state, renamed_files, removed_files, ret);
+
+    for (i = 0; i < num_paths && ! interrupted; i++)
+	watcher_add_tree (watcher, notmuch, paths[i], all);
+
+    talloc_free (local);
+
+    return ret;
 }
 
-/* Recursively remove all filenames from the database referring to
- * 'path' (or to any of its children). */
-static void
-_remove_directory (void *ctx,
-		   notmuch_database_t *notmuch,
-		   const char *path,
-		   int *renamed_files,
-		   int *removed_files)
+/* Examine the directories of the mail store as they change, (in
+ * batches, once each burst of changes is over), until interrupted.
+ * The database is only open while changes are being examined. */
+static notmuch_status_t
+watch_mail_store (void *ctx,
+		  const char *db_path,
+		  watcher_t *watcher,
+		  add_files_state_t *state)
 {
-    notmuch_directory_t *directory;
-    notmuch_filenames_t *files, *subdirs;
+    notmuch_database_t *notmuch;
     notmuch_status_t status;
-    char *absolute;
+    struct timeval tv_first, tv_now;
 
-    directory = notmuch_database_get_directory (notmuch, path);
+    while (! interrupted) {
+	if (g_hash_table_size (watcher->changed) == 0 &&
+	    ! watcher->overflowed)
+	{
+	    watcher_read (watcher, -1);
+	    continue;
+	}
 
-    for (files = notmuch_directory_get_child_files (directory);
-	 notmuch_filenames_valid (files);
-	 notmuch_filenames_move_to_next (files))
-    {
-	absolute = talloc_asprintf (ctx, "%s/%s", path,
-				    notmuch_filenames_get (files));
-	status = notmuch_database_remove_message (notmuch, absolute);
-	if (status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID)
-	    *renamed_files = *renamed_files + 1;
-	else
-	    *removed_files = *removed_files + 1;
-	talloc_free (absolute);
-    }
+	gettimeofday (&tv_first, NULL);
+	while (! interrupted && watcher_read (watcher, NEW_WATCH_QUIET)) {
+	    gettimeofday (&tv_now, NULL);
+	    if (notmuch_time_elapsed (tv_first, tv_now) * 1000 >=
+		NEW_WATCH_MAX_DELAY)
+	    {
+		break;
+	    }
+	}
 
-    for (subdirs = notmuch_directory_get_child_directories (directory);
-	 notmuch_filenames_valid (subdirs);
-	 notmuch_filenames_move_to_next (subdirs))
-    {
-	absolute = talloc_asprintf (ctx, "%s/%s", path,
-				    notmuch_filenames_get (subdirs));
-	_remove_directory (ctx, notmuch, absolute, renamed_files, removed_files);
-	talloc_free (absolute);
+	if (interrupted)
+	    break;
+
+	notmuch = notmuch_database_open (db_path,
+					 NOTMUCH_DATABASE_MODE_READ_WRITE);
+	if (notmuch == NULL) {
+	    sleep (NEW_WATCH_RETRY);
+	    continue;
+	}
+
+	status = watch_update (ctx, notmuch, db_path, watcher, state);
+
+	notmuch_database_close (notmuch);
+
+	/* Processing halts on anything worse than an unreadable
+	 * directory. */
+	if (status && status != NOTMUCH_STATUS_FILE_ERROR)
+	    return status;
     }
 
-    notmuch_directory_destroy (directory);
+    return NOTMUCH_STATUS_SUCCESS;
 }
 
+#endif /* HAVE_INOTIFY */
+
 int
 notmuch_new_command (void *ctx, int argc, char *argv[])
 {
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
     add_files_state_t add_files_state;
-    double elapsed;
-    struct timeval tv_now;
     int ret = 0;
     struct stat st;
     const char *db_path;
     char *dot_notmuch_path;
     struct sigaction action;
-    _filename_node_t *f;
     int renamed_files, removed_files;
-    notmuch_status_t status;
+    notmuch_bool_t watch = FALSE;
+#if HAVE_INOTIFY
+    watcher_t *watcher = NULL;
+#endif
+    char *opt, *end;
+    long online;
     int i;
 
     add_files_state.verbose = 0;
+    add_files_state.num_jobs = 0;
+    add_files_state.scanner = NULL;
+    add_files_state.watched = NULL;
+    add_files_state.batch_size = NEW_BATCH_SIZE;
     add_files_state.output_is_a_tty = isatty (fileno (stdout));
 
     for (i = 0; i < argc && argv[i][0] == '-'; i++) {
 	if (STRNCMP_LITERAL (argv[i], "--verbose") == 0) {
 	    add_files_state.verbose = 1;
+	} else if (STRNCMP_LITERAL (argv[i], "--jobs=") == 0) {
+	    opt = argv[i] + sizeof ("--jobs=") - 1;
+	    add_files_state.num_jobs = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *end != '\0' || add_files_state.num_jobs == 0) {
+		fprintf (stderr, "Invalid value for --jobs: %s\n", opt);
+		return 1;
+	    }
+	} else if (STRNCMP_LITERAL (argv[i], "--watch") == 0) {
+#if HAVE_INOTIFY
+	    watch = TRUE;
+#else
+	    fprintf (stderr, "Error: --watch is not supported on this system.\n");
+	    return 1;
+#endif
+	} else if (STRNCMP_LITERAL (argv[i], "--batch-size=") == 0) {
+	    opt = argv[i] + sizeof ("--batch-size=") - 1;
+	    add_files_state.batch_size = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *end != '\0' || add_files_state.batch_size == 0) {
+		fprintf (stderr, "Invalid value for --batch-size: %s\n", opt);
+		return 1;
+	    }
 	} else {
 	    fprintf (stderr, "Unrecognized option: %s\n", argv[i]);
 	    return 1;
 	}
     }
 
+    if (add_files_state.num_jobs == 0) {
+	online = sysconf (_SC_NPROCESSORS_ONLN);
+	add_files_state.num_jobs = online > 0 ? online : 1;
+	if (add_files_state.num_jobs > NEW_MAX_JOBS)
+	    add_files_state.num_jobs = NEW_MAX_JOBS;
+    }
+
     config = notmuch_config_open (ctx, NULL, NULL);
     if (config == NULL)
 	return 1;
@@ -840,10 +2986,16 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     if (stat (dot_notmuch_path, &st)) {
 	int count;
 
-	count = 0;
-	count_files (db_path, &count);
-	if (interrupted)
+	/* The directories read while counting are kept for indexing. */
+	add_files_state.scanner = scanner_start (ctx, db_path,
+						 add_files_state.num_jobs > 1 ?
+						 add_files_state.num_jobs : 0,
+						 NULL, 0);
+	count = scanner_run (add_files_state.scanner);
+	if (interrupted) {
+	    scanner_stop (add_files_state.scanner);
 	    return 1;
+	}
 
 	printf ("Found %d total files (that's not much mail).\n", count);
 	notmuch = notmuch_database_create (db_path);
@@ -878,82 +3030,63 @@ notmuch_new_command (void *ctx, int argc, char *argv[])
     action.sa_flags = SA_RESTART;
     sigaction (SIGINT, &action, NULL);
 
+    add_files_state.checkpoint_path = talloc_asprintf (ctx, "%s/%s",
+						       dot_notmuch_path,
+						       NEW_CHECKPOINT_FILE);
+    add_files_state.checkpoint = checkpoint_read (add_files_state.checkpoint_path);
+    if (add_files_state.checkpoint)
+	printf ("Resuming an interrupted run.\n");
+
     talloc_free (dot_notmuch_path);
     dot_notmuch_path = NULL;
 
-    add_files_state.processed_files = 0;
-    add_files_state.added_messages = 0;
-    gettimeofday (&add_files_state.tv_start, NULL);
-
-    add_files_state.removed_files = _filename_list_create (ctx);
-    add_files_state.removed_directories = _filename_list_create (ctx);
-
-    ret = add_files (notmuch, db_path, &add_files_state);
-
-    removed_files = 0;
-    renamed_files = 0;
-    for (f = add_files_state.removed_files->head; f; f = f->next) {
-	status = notmuch_database_remove_message (notmuch, f->filename);
-	if (status == NOTMUCH_STATUS_DUPLICATE_MESSAGE_ID)
-	    renamed_files++;
-	else
-	    removed_files++;
-    }
-
-    for (f = add_files_state.removed_directories->head; f; f = f->next) {
-	_remove_directory (ctx, notmuch, f->filename,
-			   &renamed_files, &removed_files);
+#if HAVE_INOTIFY
+    /* The directories already known are watched before they're
+     * examined, so that no change to them is missed. */
+    if (watch) {
+	watcher = watcher_create (ctx);
+	if (watcher == NULL) {
+	    notmuch_database_close (notmuch);
+	    return 1;
+	}
+	watcher_add_tree (watcher, notmuch, db_path, TRUE);
     }
+#endif
 
-    talloc_free (add_files_state.removed_files);
-    talloc_free (add_files_state.removed_directories);
-
-    gettimeofday (&tv_now, NULL);
-    elapsed = notmuch_time_elapsed (add_files_state.tv_start,
-				    tv_now);
+    ret = new_update (ctx, notmuch, &db_path, 1, &add_files_state,
+		      &renamed_files, &removed_files);
 
-    if (add_files_state.processed_files) {
-	printf ("Processed %d %s in ", add_files_state.processed_files,
-		add_files_state.processed_files == 1 ?
-		"file" : "total files");
-	notmuch_time_print_formatted_seconds (elapsed);
-	if (elapsed > 1) {
-	    printf (" (%d files/sec.).                 \n",
-		    (int) (add_files_state.processed_files / elapsed));
-	} else {
-	    printf (".                    \n");
-	}
+    if (add_files_state.checkpoint) {
+	g_hash_table_unref (add_files_state.checkpoint);
+	add_files_state.checkpoint = NULL;
     }
 
-    if (add_files_state.added_messages) {
-	printf ("Added %d new %s to the database.",
-		add_files_state.added_messages,
-		add_files_state.added_messages == 1 ?
-		"message" : "messages");
-    } else {
-	printf ("No new mail.");
-    }
+    new_report (&add_files_state, renamed_files, removed_files, ret);
 
-    if (removed_files) {
-	printf (" Removed %d %s.",
-		removed_files,
-		removed_files == 1 ? "message" : "messages");
-    }
+#if HAVE_INOTIFY
+    if (watch) {
+	if (ret == NOTMUCH_STATUS_SUCCESS && ! interrupted) {
+	    /* Those directories first found just now might have changed
+	     * since, (before being watched). */
+	    watcher->mark_new = TRUE;
+	    watcher_add_tree (watcher, notmuch, db_path, TRUE);
 
-    if (renamed_files) {
-	printf (" Detected %d file %s.",
-		renamed_files,
-		renamed_files == 1 ? "rename" : "renames");
-    }
+	    /* Other processes may write to the database in between. */
+	    notmuch_database_close (notmuch);
+	    notmuch = NULL;
 
-    printf ("\n");
+	    printf ("Watching for new mail.\n");
+	    fflush (stdout);
 
-    if (ret) {
-	printf ("\nNote: At least one error was encountered: %s\n",
-		notmuch_status_to_string (ret));
+	    ret = watch_mail_store (ctx, db_path, watcher, &add_files_state);
+	}
+
+	watcher_destroy (watcher);
     }
+#endif
 
-    notmuch_database_close (notmuch);
+    if (notmuch)
+	notmuch_database_close (notmuch);
 
     return ret || interrupted;
 }
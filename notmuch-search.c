@@ -20,10 +20,27 @@
 
 #include "notmuch-client.h"
 
+#include <pthread.h>
+
+/* A search for at least this many threads per available job is
+ * worth constructing threads in parallel, (see
+ * do_search_threads_parallel). */
+#define SEARCH_THREADS_PER_JOB 32
+
+/* No more than this many jobs are run by default. */
+#define SEARCH_MAX_JOBS 16
+
+/* How far (in threads) the jobs may run ahead of the output. */
+#define SEARCH_JOBS_WINDOW 1024
+
+/* A job constructs up to this many threads at a time, (with a single
+ * search, see notmuch_query_get_threads). */
+#define SEARCH_JOB_BATCH 100
+
 typedef struct search_format {
     const char *results_start;
     const char *thread_start;
-    void (*thread) (const void *ctx,
+    char * (*thread) (const void *ctx,
 		    const char *thread_id,
 		    const time_t date,
 		    const int matched,
@@ -39,7 +56,7 @@ typedef struct search_format {
     const char *results_end;
 } search_format_t;
 
-static void
+static char *
 format_thread_text (const void *ctx,
 		    const char *thread_id,
 		    const time_t date,
@@ -58,7 +75,7 @@ static const search_format_t format_text = {
     "",
 };
 
-static void
+static char *
 format_thread_json (const void *ctx,
 		    const char *thread_id,
 		    const time_t date,
@@ -77,7 +94,7 @@ static const search_format_t format_json = {
     "]\n",
 };
 
-static void
+static char *
 format_thread_text (const void *ctx,
 		    const char *thread_id,
 		    const time_t date,
@@ -86,16 +103,16 @@ format_thread_text (const void *ctx,
 		    const char *authors,
 		    const char *subject)
 {
-    printf ("thread:%s %12s [%d/%d] %s; %s",
-	    thread_id,
-	    notmuch_time_relative_date (ctx, date),
-	    matched,
-	    total,
-	    authors,
-	    subject);
+    return talloc_asprintf (ctx, "thread:%s %12s [%d/%d] %s; %s",
+			    thread_id,
+			    notmuch_time_relative_date (ctx, date),
+			    matched,
+			    total,
+			    authors,
+			    subject);
 }
 
-static void
+static char *
 format_thread_json (const void *ctx,
 		    const char *thread_id,
 		    const time_t date,
@@ -105,21 +122,72 @@ format_thread_json (const void *ctx,
 		    const char *subject)
 {
     void *ctx_quote = talloc_new (ctx);
-
-    printf ("\"thread\": %s,\n"
-	    "\"timestamp\": %ld,\n"
-	    "\"matched\": %d,\n"
-	    "\"total\": %d,\n"
-	    "\"authors\": %s,\n"
-	    "\"subject\": %s,\n",
-	    json_quote_str (ctx_quote, thread_id),
-	    date,
-	    matched,
-	    total,
-	    json_quote_str (ctx_quote, authors),
-	    json_quote_str (ctx_quote, subject));
+    char *result;
+
+    result = talloc_asprintf (ctx,
+			      "\"thread\": %s,\n"
+			      "\"timestamp\": %ld,\n"
+			      "\"matched\": %d,\n"
+			      "\"total\": %d,\n"
+			      "\"authors\": %s,\n"
+			      "\"subject\": %s,\n",
+			      json_quote_str (ctx_quote, thread_id),
+			      date,
+			      matched,
+			      total,
+			      json_quote_str (ctx_quote, authors),
+			      json_quote_str (ctx_quote, subject));
 
     talloc_free (ctx_quote);
+
+    return result;
+}
+
+/* Format 'thread' as one result, (without any separator from the
+ * previous result), returning a string talloced from 'ctx'. */
+static char *
+format_thread (const void *ctx,
+	       const search_format_t *format,
+	       notmuch_thread_t *thread,
+	       notmuch_sort_t sort)
+{
+    notmuch_tags_t *tags;
+    char *summary, *result;
+    time_t date;
+    int first_tag = 1;
+
+    if (sort == NOTMUCH_SORT_OLDEST_FIRST)
+	date = notmuch_thread_get_oldest_date (thread);
+    else
+	date = notmuch_thread_get_newest_date (thread);
+
+    summary = format->thread (ctx,
+			      notmuch_thread_get_thread_id (thread),
+			      date,
+			      notmuch_thread_get_matched_messages (thread),
+			      notmuch_thread_get_total_messages (thread),
+			      notmuch_thread_get_authors (thread),
+			      notmuch_thread_get_subject (thread));
+
+    result = talloc_asprintf (ctx, "%s%s%s", format->thread_start,
+			      summary, format->tag_start);
+    talloc_free (summary);
+
+    for (tags = notmuch_thread_get_tags (thread);
+	 notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+    {
+	if (! first_tag)
+	    result = talloc_strdup_append (result, format->tag_sep);
+	result = talloc_asprintf_append (result, format->tag,
+					 notmuch_tags_get (tags));
+	first_tag = 0;
+    }
+
+    result = talloc_strdup_append (result, format->tag_end);
+    result = talloc_strdup_append (result, format->thread_end);
+
+    return result;
 }
 
 static void
@@ -130,8 +198,7 @@ do_search_threads (const void *ctx,
 {
     notmuch_thread_t *thread;
     notmuch_threads_t *threads;
-    notmuch_tags_t *tags;
-    time_t date;
+    char *result;
     int first_thread = 1;
 
     fputs (format->results_start, stdout);
@@ -140,49 +207,253 @@ do_search_threads (const void *ctx,
 	 notmuch_threads_valid (threads);
 	 notmuch_threads_move_to_next (threads))
     {
-	int first_tag = 1;
-
 	if (! first_thread)
 	    fputs (format->thread_sep, stdout);
 
 	thread = notmuch_threads_get (threads);
 
-	if (sort == NOTMUCH_SORT_OLDEST_FIRST)
-	    date = notmuch_thread_get_oldest_date (thread);
-	else
-	    date = notmuch_thread_get_newest_date (thread);
+	result = format_thread (ctx, format, thread, sort);
+	fputs (result, stdout);
+	talloc_free (result);
+
+	first_thread = 0;
+
+	notmuch_thread_destroy (thread);
+    }
+
+    fputs (format->results_end, stdout);
+}
+
+/* The state shared by the jobs of do_search_threads_parallel.
+ *
+ * Each job constructs runs of threads with its own database and
+ * query, (see notmuch_query_get_threads), while the main thread
+ * outputs the results in order. All fields following 'mutex' are
+ * protected by it. */
+typedef struct search_jobs {
+    const search_format_t *format;
+    notmuch_sort_t sort;
+    const char **thread_ids;
+    unsigned int num_threads;
+    unsigned int num_jobs;
+
+    pthread_mutex_t mutex;
+
+    /* Signalled whenever a result is ready or output advances. */
+    pthread_cond_t cond;
+
+    /* The formatted result for each thread, (talloced without a
+     * parent, or NULL if the thread no longer matches). */
+    char **results;
+    notmuch_bool_t *ready;
+
+    /* The next thread for a job to construct. */
+    unsigned int next;
+
+    /* Threads [0, output) have been output. */
+    unsigned int output;
+} search_jobs_t;
+
+typedef struct search_job {
+    pthread_t thread;
+    notmuch_database_t *notmuch;
+    notmuch_query_t *query;
+    search_jobs_t *jobs;
+} search_job_t;
+
+static void *
+search_job_run (void *closure)
+{
+    search_job_t *job = closure;
+    search_jobs_t *jobs = job->jobs;
+    notmuch_thread_t *threads[SEARCH_JOB_BATCH];
+    char *results[SEARCH_JOB_BATCH];
+    unsigned int i, first, count;
+
+    pthread_mutex_lock (&jobs->mutex);
+
+    while (jobs->next < jobs->num_threads) {
+	/* Don't run too far ahead of the output. */
+	if (jobs->next >= jobs->output + SEARCH_JOBS_WINDOW) {
+	    pthread_cond_wait (&jobs->cond, &jobs->mutex);
+	    continue;
+	}
+
+	/* Take a run of threads, (but no more than a fair share of
+	 * those left, so that every job has some). */
+	first = jobs->next;
+	count = (jobs->num_threads - first) / jobs->num_jobs;
+	if (count > SEARCH_JOB_BATCH)
+	    count = SEARCH_JOB_BATCH;
+	if (count == 0)
+	    count = 1;
+	jobs->next += count;
+
+	pthread_mutex_unlock (&jobs->mutex);
+
+	notmuch_query_get_threads (job->query, jobs->thread_ids + first,
+				   count, threads);
+
+	for (i = 0; i < count; i++) {
+	    results[i] = NULL;
+	    if (threads[i]) {
+		results[i] = format_thread (NULL, jobs->format,
+					    threads[i], jobs->sort);
+		notmuch_thread_destroy (threads[i]);
+	    }
+	}
+
+	pthread_mutex_lock (&jobs->mutex);
+
+	for (i = 0; i < count; i++) {
+	    jobs->results[first + i] = results[i];
+	    jobs->ready[first + i] = TRUE;
+	}
+	pthread_cond_broadcast (&jobs->cond);
+    }
+
+    pthread_mutex_unlock (&jobs->mutex);
 
-	fputs (format->thread_start, stdout);
+    return NULL;
+}
 
-	format->thread (ctx,
-			notmuch_thread_get_thread_id (thread),
-			date,
-			notmuch_thread_get_matched_messages (thread),
-			notmuch_thread_get_total_messages (thread),
-			notmuch_thread_get_authors (thread),
-			notmuch_thread_get_subject (thread));
+/* As do_search_threads, but constructing the threads with up to
+ * 'num_jobs' threads of execution, each with its own handle for the
+ * database at 'database_path'.
+ *
+ * The thread IDs of the results are found first, (which is cheap),
+ * so that the output is still in the order of the query.
+ */
+static void
+do_search_threads_parallel (const void *ctx,
+			    const search_format_t *format,
+			    notmuch_query_t *query,
+			    notmuch_sort_t sort,
+			    const char *database_path,
+			    const char *query_str,
+			    unsigned int num_jobs)
+{
+    notmuch_threads_t *threads;
+    search_jobs_t jobs;
+    search_job_t *job;
+    const char *thread_id;
+    char *result;
+    unsigned int i, size = 0, started = 0;
+    int first_thread = 1;
 
-	fputs (format->tag_start, stdout);
+    memset (&jobs, 0, sizeof (jobs));
+    jobs.format = format;
+    jobs.sort = sort;
 
-	for (tags = notmuch_thread_get_tags (thread);
-	     notmuch_tags_valid (tags);
-	     notmuch_tags_move_to_next (tags))
+    for (threads = notmuch_query_search_threads (query);
+	 (thread_id = notmuch_threads_get_thread_id (threads)) != NULL;
+	 notmuch_threads_move_to_next (threads))
+    {
+	if (jobs.num_threads == size) {
+	    size = size ? size * 2 : 256;
+	    jobs.thread_ids = talloc_realloc (ctx, jobs.thread_ids,
+					      const char *, size);
+	}
+	jobs.thread_ids[jobs.num_threads++] = thread_id;
+    }
+
+    /* Starting a job costs opening the database once more, so small
+     * searches are better served by fewer jobs, (or none, in which
+     * case the threads are constructed as by do_search_threads, with
+     * their members fetched in batches). */
+    if (num_jobs > jobs.num_threads / SEARCH_THREADS_PER_JOB)
+	num_jobs = jobs.num_threads / SEARCH_THREADS_PER_JOB;
+    if (num_jobs < 2) {
+	talloc_free (jobs.thread_ids);
+	notmuch_threads_destroy (threads);
+	do_search_threads (ctx, format, query, sort);
+	return;
+    }
+
+    jobs.results = talloc_zero_array (ctx, char *, jobs.num_threads + 1);
+    jobs.ready = talloc_zero_array (ctx, notmuch_bool_t, jobs.num_threads + 1);
+
+    job = talloc_zero_array (ctx, search_job_t, num_jobs + 1);
+    jobs.num_jobs = num_jobs;
+
+    pthread_mutex_init (&jobs.mutex, NULL);
+    pthread_cond_init (&jobs.cond, NULL);
+
+    for (started = 0; started < num_jobs; started++) {
+	job[started].jobs = &jobs;
+	job[started].notmuch = notmuch_database_open (database_path,
+						      NOTMUCH_DATABASE_MODE_READ_ONLY);
+	if (job[started].notmuch == NULL)
+	    break;
+
+	job[started].query = notmuch_query_create (job[started].notmuch,
+						   query_str);
+	if (job[started].query == NULL) {
+	    notmuch_database_close (job[started].notmuch);
+	    break;
+	}
+	notmuch_query_set_sort (job[started].query, sort);
+
+	if (pthread_create (&job[started].thread, NULL,
+			    search_job_run, &job[started]))
 	{
-	    if (! first_tag)
-		fputs (format->tag_sep, stdout);
-	    printf (format->tag, notmuch_tags_get (tags));
-	    first_tag = 0;
+	    notmuch_query_destroy (job[started].query);
+	    notmuch_database_close (job[started].notmuch);
+	    break;
 	}
+    }
 
-	fputs (format->tag_end, stdout);
-	fputs (format->thread_end, stdout);
+    if (started == 0) {
+	/* No job could be started, so nothing has been output yet. */
+	pthread_cond_destroy (&jobs.cond);
+	pthread_mutex_destroy (&jobs.mutex);
+	talloc_free (job);
+	talloc_free (jobs.ready);
+	talloc_free (jobs.results);
+	talloc_free (jobs.thread_ids);
+	notmuch_threads_destroy (threads);
+	do_search_threads (ctx, format, query, sort);
+	return;
+    }
+
+    fputs (format->results_start, stdout);
 
+    for (i = 0; i < jobs.num_threads; i++) {
+	pthread_mutex_lock (&jobs.mutex);
+	while (! jobs.ready[i])
+	    pthread_cond_wait (&jobs.cond, &jobs.mutex);
+	result = jobs.results[i];
+	jobs.output = i + 1;
+	pthread_cond_broadcast (&jobs.cond);
+	pthread_mutex_unlock (&jobs.mutex);
+
+	if (result == NULL)
+	    continue;
+
+	if (! first_thread)
+	    fputs (format->thread_sep, stdout);
+	fputs (result, stdout);
 	first_thread = 0;
 
-	notmuch_thread_destroy (thread);
+	talloc_free (result);
     }
 
     fputs (format->results_end, stdout);
+
+    for (i = 0; i < started; i++) {
+	pthread_join (job[i].thread, NULL);
+	notmuch_query_destroy (job[i].query);
+	notmuch_database_close (job[i].notmuch);
+    }
+
+    pthread_cond_destroy (&jobs.cond);
+    pthread_mutex_destroy (&jobs.mutex);
+
+    talloc_free (job);
+    talloc_free (jobs.ready);
+    talloc_free (jobs.results);
+    talloc_free (jobs.thread_ids);
+    notmuch_threads_destroy (threads);
 }
 
 int
@@ -192,9 +463,12 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
     notmuch_database_t *notmuch;
     notmuch_query_t *query;
     char *query_str;
-    char *opt;
+    char *opt, *end;
     notmuch_sort_t sort = NOTMUCH_SORT_NEWEST_FIRST;
     const search_format_t *format = &format_text;
+    unsigned int offset = 0, limit = 0;
+    unsigned int jobs = 0;
+    long online;
     int i;
 
     for (i = 0; i < argc && argv[i][0] == '-'; i++) {
@@ -222,6 +496,27 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
 		fprintf (stderr, "Invalid value for --format: %s\n", opt);
 		return 1;
 	    }
+	} else if (STRNCMP_LITERAL (argv[i], "--offset=") == 0) {
+	    opt = argv[i] + sizeof ("--offset=") - 1;
+	    offset = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *end != '\0') {
+		fprintf (stderr, "Invalid value for --offset: %s\n", opt);
+		return 1;
+	    }
+	} else if (STRNCMP_LITERAL (argv[i], "--limit=") == 0) {
+	    opt = argv[i] + sizeof ("--limit=") - 1;
+	    limit = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *end != '\0') {
+		fprintf (stderr, "Invalid value for --limit: %s\n", opt);
+		return 1;
+	    }
+	} else if (STRNCMP_LITERAL (argv[i], "--jobs=") == 0) {
+	    opt = argv[i] + sizeof ("--jobs=") - 1;
+	    jobs = strtoul (opt, &end, 10);
+	    if (*opt == '\0' || *end != '\0' || jobs == 0) {
+		fprintf (stderr, "Invalid value for --jobs: %s\n", opt);
+		return 1;
+	    }
 	} else {
 	    fprintf (stderr, "Unrecognized option: %s\n", argv[i]);
 	    return 1;
@@ -257,8 +552,22 @@ notmuch_search_command (void *ctx, int argc, char *argv[])
     }
 
     notmuch_query_set_sort (query, sort);
+    notmuch_query_set_offset (query, offset);
+    notmuch_query_set_limit (query, limit);
+
+    if (jobs == 0) {
+	online = sysconf (_SC_NPROCESSORS_ONLN);
+	jobs = online > 0 ? online : 1;
+	if (jobs > SEARCH_MAX_JOBS)
+	    jobs = SEARCH_MAX_JOBS;
+    }
 
-    do_search_threads (ctx, format, query, sort);
+    if (jobs > 1)
+	do_search_threads_parallel (ctx, format, query, sort,
+				    notmuch_config_get_database_path (config),
+				    query_str, jobs);
+    else
+	do_search_threads (ctx, format, query, sort);
 
     notmuch_query_destroy (query);
     notmuch_database_close (notmuch);
@@ -20,76 +20,350 @@
 
 #include "notmuch-client.h"
 
-static volatile sig_atomic_t interrupted;
+/* Whether 'message' has 'tag'. */
+static notmuch_bool_t
+message_has_tag (notmuch_message_t *message, const char *tag)
+{
+    notmuch_tags_t *tags;
+
+    for (tags = notmuch_message_get_tags (message);
+	 notmuch_tags_valid (tags);
+	 notmuch_tags_move_to_next (tags))
+    {
+	if (strcmp (notmuch_tags_get (tags), tag) == 0)
+	    return TRUE;
+    }
+
+    return FALSE;
+}
+
+/* Whether 'tag' is one of the NULL-terminated 'tags'. */
+static notmuch_bool_t
+tags_contain (const char **tags, const char *tag)
+{
+    for (; *tags; tags++)
+	if (strcmp (*tags, tag) == 0)
+	    return TRUE;
+
+    return FALSE;
+}
+
+/* Change the tags of the message with 'message_id', (if any), as
+ * notmuch_query_change_tags would, but without parsing a query. */
+static notmuch_status_t
+tag_message_id (notmuch_database_t *notmuch, const char *message_id,
+		const char **add_tags, const char **remove_tags,
+		unsigned int *changed)
+{
+    notmuch_message_t *message;
+    notmuch_status_t status = NOTMUCH_STATUS_SUCCESS;
+    notmuch_bool_t needed = FALSE;
+    const char **tag;
+
+    *changed = 0;
+
+    /* Checked first, so that a message is changed wholly or not at
+     * all. */
+    for (tag = add_tags; *tag; tag++)
+	if (strlen (*tag) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+    for (tag = remove_tags; *tag; tag++)
+	if (strlen (*tag) > NOTMUCH_TAG_MAX)
+	    return NOTMUCH_STATUS_TAG_TOO_LONG;
+
+    message = notmuch_database_find_message (notmuch, message_id);
+    if (message == NULL)
+	return NOTMUCH_STATUS_SUCCESS;
+
+    /* As for notmuch_query_change_tags, the message needs changing if
+     * it lacks a tag to add, or has a tag to remove that isn't also
+     * added, (since the additions are made last). */
+    for (tag = add_tags; *tag && ! needed; tag++)
+	if (! message_has_tag (message, *tag))
+	    needed = TRUE;
+    for (tag = remove_tags; *tag && ! needed; tag++)
+	if (! tags_contain (add_tags, *tag) && message_has_tag (message, *tag))
+	    needed = TRUE;
+
+    if (! needed)
+	goto DONE;
+
+    notmuch_message_freeze (message);
+
+    for (tag = remove_tags; *tag && ! status; tag++)
+	status = notmuch_message_remove_tag (message, *tag);
+
+    for (tag = add_tags; *tag && ! status; tag++)
+	status = notmuch_message_add_tag (message, *tag);
+
+    notmuch_message_thaw (message);
+
+    if (status == NOTMUCH_STATUS_SUCCESS)
+	*changed = 1;
+
+  DONE:
+    notmuch_message_destroy (message);
+
+    return status;
+}
+
+/* Remove 'remove_tags' from and add 'add_tags' to the messages
+ * matching 'query_string', storing the number of messages changed in
+ * *changed. */
+static notmuch_status_t
+tag_query (notmuch_database_t *notmuch, const char *query_string,
+	   const char **add_tags, const char **remove_tags,
+	   unsigned int *changed)
+{
+    notmuch_query_t *query;
+    notmuch_status_t status;
+    const char *message_id;
+
+    /* A query for a single message ID, (as from a filtering script
+     * tagging each new message), is just looked up. */
+    if (STRNCMP_LITERAL (query_string, "id:") == 0) {
+	message_id = query_string + strlen ("id:");
+	if (*message_id && strpbrk (message_id, " \t\"()") == NULL)
+	    return tag_message_id (notmuch, message_id,
+				   add_tags, remove_tags, changed);
+    }
+
+    query = notmuch_query_create (notmuch, query_string);
+    if (query == NULL) {
+	*changed = 0;
+	return NOTMUCH_STATUS_OUT_OF_MEMORY;
+    }
+
+    /* Only the messages not already tagged as requested are visited,
+     * and the changes are committed in batches, (so an interrupted
+     * run loses little, and running it again costs little). */
+    status = notmuch_query_change_tags (query, add_tags, remove_tags,
+					changed);
+
+    notmuch_query_destroy (query);
+
+    return status;
+}
+
+/* Split a line of "notmuch tag --batch" input, (of the same form as
+ * the arguments of "notmuch tag"), into its tags, (in the arrays
+ * 'add_tags' and 'remove_tags', each with room for a tag per two
+ * characters of 'line'), and its search terms. The tags are
+ * terminated within 'line' itself.
+ *
+ * Returns the search terms, or NULL if the line has no tags. */
+static char *
+parse_tag_line (char *line, const char **add_tags, const char **remove_tags)
+{
+    int add_tags_count = 0, remove_tags_count = 0;
+    char *end;
+
+    while (1) {
+	line += strspn (line, " \t");
+	if (*line != '+' && *line != '-')
+	    break;
+
+	end = line + strcspn (line, " \t");
+
+	if (end - line == 2 && strncmp (line, "--", 2) == 0) {
+	    line = end + strspn (end, " \t");
+	    break;
+	}
+
+	if (*end)
+	    *end++ = '\0';
+
+	if (*line == '+')
+	    add_tags[add_tags_count++] = line + 1;
+	else
+	    remove_tags[remove_tags_count++] = line + 1;
+
+	line = end;
+    }
+
+    add_tags[add_tags_count] = NULL;
+    remove_tags[remove_tags_count] = NULL;
+
+    if (add_tags_count == 0 && remove_tags_count == 0)
+	return NULL;
+
+    return line;
+}
 
-static void
-handle_sigint (unused (int sig))
+/* Apply each line of tag changes read from 'input', (all within a
+ * single atomic operation), reporting any line in error. Returns
+ * non-zero if any line failed. */
+static int
+tag_batch (void *ctx, notmuch_database_t *notmuch, FILE *input,
+	   notmuch_bool_t verbose)
 {
-    ssize_t ignored;
+    char *line = NULL, *query_string;
+    size_t line_size;
+    ssize_t line_len;
+    const char **add_tags, **remove_tags;
+    notmuch_status_t status;
+    unsigned int line_number = 0, changed, total = 0;
+    int ret = 0;
+
+    status = notmuch_database_begin_atomic (notmuch);
+    if (status) {
+	fprintf (stderr, "Error changing tags: %s\n",
+		 notmuch_status_to_string (status));
+	return 1;
+    }
+
+    while ((line_len = getline (&line, &line_size, input)) != -1) {
+	line_number++;
+
+	chomp_newline (line);
+
+	query_string = line + strspn (line, " \t");
+	if (*query_string == '\0' || *query_string == '#')
+	    continue;
+
+	add_tags = talloc_array (ctx, const char *, line_len / 2 + 2);
+	remove_tags = talloc_array (ctx, const char *, line_len / 2 + 2);
+	if (add_tags == NULL || remove_tags == NULL) {
+	    fprintf (stderr, "Out of memory.\n");
+	    ret = 1;
+	    break;
+	}
+
+	query_string = parse_tag_line (line, add_tags, remove_tags);
+	if (query_string == NULL) {
+	    fprintf (stderr, "Error on line %u: no tag to add or remove.\n",
+		     line_number);
+	    ret = 1;
+	} else if (*query_string == '\0') {
+	    fprintf (stderr, "Error on line %u: no search terms.\n",
+		     line_number);
+	    ret = 1;
+	} else {
+	    status = tag_query (notmuch, query_string,
+				add_tags, remove_tags, &changed);
+	    total += changed;
+	    if (status) {
+		fprintf (stderr, "Error on line %u: %s\n",
+			 line_number, notmuch_status_to_string (status));
+		ret = 1;
+	    }
+	}
+
+	talloc_free (add_tags);
+	talloc_free (remove_tags);
+    }
+
+    if (line)
+	free (line);
 
-    static char msg[] = "Stopping...         \n";
-    ignored = write(2, msg, sizeof(msg)-1);
-    interrupted = 1;
+    status = notmuch_database_end_atomic (notmuch);
+    if (status) {
+	fprintf (stderr, "Error committing tag changes: %s\n",
+		 notmuch_status_to_string (status));
+	return 1;
+    }
+
+    if (verbose)
+	printf ("Changed tags of %u message%s.\n",
+		total, total == 1 ? "" : "s");
+
+    return ret;
 }
 
 int
-notmuch_tag_command (void *ctx, unused (int argc), unused (char *argv[]))
+notmuch_tag_command (void *ctx, int argc, char *argv[])
 {
-    int *add_tags, *remove_tags;
+    const char **add_tags, **remove_tags;
     int add_tags_count = 0;
     int remove_tags_count = 0;
-    char *query_string;
+    char *query_string = NULL;
+    const char *input_filename = NULL;
     notmuch_config_t *config;
     notmuch_database_t *notmuch;
-    notmuch_query_t *query;
-    notmuch_messages_t *messages;
-    notmuch_message_t *message;
-    struct sigaction action;
-    int i;
-
-    /* Setup our handler for SIGINT */
-    memset (&action, 0, sizeof (struct sigaction));
-    action.sa_handler = handle_sigint;
-    sigemptyset (&action.sa_mask);
-    action.sa_flags = SA_RESTART;
-    sigaction (SIGINT, &action, NULL);
+    notmuch_status_t status;
+    notmuch_bool_t verbose = FALSE, batch = FALSE;
+    unsigned int changed;
+    FILE *input = stdin;
+    int i, ret;
 
-    add_tags = talloc_size (ctx, argc * sizeof (int));
+    add_tags = talloc_array (ctx, const char *, argc + 1);
     if (add_tags == NULL) {
 	fprintf (stderr, "Out of memory.\n");
 	return 1;
     }
 
-    remove_tags = talloc_size (ctx, argc * sizeof (int));
+    remove_tags = talloc_array (ctx, const char *, argc + 1);
     if (remove_tags == NULL) {
 	fprintf (stderr, "Out of memory.\n");
 	return 1;
     }
 
+    /* Options come first, (and anything else beginning with '-' is a
+     * tag to remove). An initial "--" ends them, so that a tag named
+     * like an option can still be removed. */
     for (i = 0; i < argc; i++) {
+	if (strcmp (argv[i], "--") == 0) {
+	    i++;
+	    break;
+	} else if (strcmp (argv[i], "--verbose") == 0) {
+	    verbose = TRUE;
+	} else if (strcmp (argv[i], "--batch") == 0) {
+	    batch = TRUE;
+	} else if (STRNCMP_LITERAL (argv[i], "--input=") == 0) {
+	    input_filename = argv[i] + sizeof ("--input=") - 1;
+	} else {
+	    break;
+	}
+    }
+
+    if (batch) {
+	if (i < argc) {
+	    fprintf (stderr, "Error: 'notmuch tag --batch' reads its tags and search terms from its input.\n");
+	    return 1;
+	}
+    } else if (input_filename) {
+	fprintf (stderr, "Error: --input is only valid with --batch.\n");
+	return 1;
+    }
+
+    for (; i < argc && ! batch; i++) {
 	if (strcmp (argv[i], "--") == 0) {
 	    i++;
 	    break;
 	}
 	if (argv[i][0] == '+') {
-	    add_tags[add_tags_count++] = i;
+	    add_tags[add_tags_count++] = argv[i] + 1;
 	} else if (argv[i][0] == '-') {
-	    remove_tags[remove_tags_count++] = i;
+	    remove_tags[remove_tags_count++] = argv[i] + 1;
 	} else {
 	    break;
 	}
     }
 
-    if (add_tags_count == 0 && remove_tags_count == 0) {
-	fprintf (stderr, "Error: 'notmuch tag' requires at least one tag to add or remove.\n");
-	return 1;
-    }
+    add_tags[add_tags_count] = NULL;
+    remove_tags[remove_tags_count] = NULL;
 
-    query_string = query_string_from_args (ctx, argc - i, &argv[i]);
+    if (! batch) {
+	if (add_tags_count == 0 && remove_tags_count == 0) {
+	    fprintf (stderr, "Error: 'notmuch tag' requires at least one tag to add or remove.\n");
+	    return 1;
+	}
 
-    if (*query_string == '\0') {
-	fprintf (stderr, "Error: notmuch tag requires at least one search term.\n");
-	return 1;
+	query_string = query_string_from_args (ctx, argc - i, &argv[i]);
+
+	if (*query_string == '\0') {
+	    fprintf (stderr, "Error: notmuch tag requires at least one search term.\n");
+	    return 1;
+	}
+    }
+
+    if (input_filename) {
+	input = fopen (input_filename, "r");
+	if (input == NULL) {
+	    fprintf (stderr, "Error opening %s for reading: %s\n",
+		     input_filename, strerror (errno));
+	    return 1;
+	}
     }
 
     config = notmuch_config_open (ctx, NULL, NULL);
@@ -101,37 +375,27 @@ notmuch_tag_command (void *ctx, unused (int argc), unused (char *argv[]))
     if (notmuch == NULL)
 	return 1;
 
-    query = notmuch_query_create (notmuch, query_string);
-    if (query == NULL) {
-	fprintf (stderr, "Out of memory.\n");
-	return 1;
-    }
-
-    /* tagging is not interested in any special sort order */
-    notmuch_query_set_sort (query, NOTMUCH_SORT_UNSORTED);
-
-    for (messages = notmuch_query_search_messages (query);
-	 notmuch_messages_valid (messages) && !interrupted;
-	 notmuch_messages_move_to_next (messages))
-    {
-	message = notmuch_messages_get (messages);
-
-	notmuch_message_freeze (message);
+    if (batch) {
+	ret = tag_batch (ctx, notmuch, input, verbose);
 
-	for (i = 0; i < remove_tags_count; i++)
-	    notmuch_message_remove_tag (message,
-					argv[remove_tags[i]] + 1);
-
-	for (i = 0; i < add_tags_count; i++)
-	    notmuch_message_add_tag (message, argv[add_tags[i]] + 1);
+	if (input != stdin)
+	    fclose (input);
+    } else {
+	status = tag_query (notmuch, query_string, add_tags, remove_tags,
+			    &changed);
+	if (status) {
+	    fprintf (stderr, "Error changing tags: %s\n",
+		     notmuch_status_to_string (status));
+	}
 
-	notmuch_message_thaw (message);
+	if (verbose)
+	    printf ("Changed tags of %u message%s.\n",
+		    changed, changed == 1 ? "" : "s");
 
-	notmuch_message_destroy (message);
+	ret = status != NOTMUCH_STATUS_SUCCESS;
     }
 
-    notmuch_query_destroy (query);
     notmuch_database_close (notmuch);
 
-    return interrupted;
+    return ret;
 }
@@ -126,7 +126,7 @@ command_t commands[] = {
       "\tInvoking notmuch with no command argument will run setup if\n"
       "\tthe setup command has not previously been completed." },
     { "new", notmuch_new_command,
-      "[--verbose]",
+      "[--verbose] [--jobs=<n>] [--batch-size=<n>] [--watch]",
       "Find and import new messages to the notmuch database.",
       "\tScans all sub-directories of the mail directory, performing\n"
       "\tfull-text indexing on new messages that are found. Each new\n"
@@ -148,9 +148,47 @@ command_t commands[] = {
       "\t\tVerbose operation. Shows paths of message files as\n"
       "\t\tthey are being indexed.\n"
       "\n"
+      "\t--jobs=<n>\n"
+      "\n"
+      "\t\tRead and index new messages with up to <n> threads\n"
+      "\t\tof execution, (the default being the number of\n"
+      "\t\tprocessors, up to 16).\n"
+      "\n"
+      "\t--batch-size=<n>\n"
+      "\n"
+      "\t\tCommit changes to the database after every <n>\n"
+      "\t\tfiles, (1000 by default). An interrupted run\n"
+      "\t\tis resumed from the last commit by the next.\n"
+      "\n"
+      "\t--watch\n"
+      "\n"
+      "\t\tKeep running once up to date, examining the\n"
+      "\t\tdirectories of the mail directory as they change,\n"
+      "\t\tuntil interrupted. (Not supported on all systems.)\n"
+      "\n"
       "\tInvoking notmuch with no command argument will run new if\n"
       "\tthe setup command has previously been completed, but new has\n"
       "\tnot previously been run." },
+    { "insert", notmuch_insert_command,
+      "[--folder=<folder>] [--create-folder] [+<tag>|-<tag> ...]",
+      "Deliver a message from standard input and add it to the database.",
+      "\tWrites the message read from standard input to the new\n"
+      "\tdirectory of a Maildir in the mail directory, (by way of\n"
+      "\tits tmp directory), and adds it to the database with the\n"
+      "\tsame tags as \"notmuch new\" would, changed by the tags\n"
+      "\tgiven, (prefixed by '+' to add or '-' to remove).\n"
+      "\n"
+      "\tSupported options for insert include:\n"
+      "\n"
+      "\t--folder=<folder>\n"
+      "\n"
+      "\t\tDeliver to the Maildir <folder>, relative to the\n"
+      "\t\tmail directory, (rather than to the mail directory\n"
+      "\t\titself).\n"
+      "\n"
+      "\t--create-folder\n"
+      "\n"
+      "\t\tCreate the Maildir if it doesn't already exist." },
     { "search", notmuch_search_command,
       "[options...] <search-terms> [...]",
       "Search for messages matching the given search terms.",
@@ -171,6 +209,21 @@ command_t commands[] = {
       "\t\t(oldest-first) or reverse chronological order\n"
       "\t\t(newest-first), which is the default.\n"
       "\n"
+      "\t--offset=<n>\n"
+      "\n"
+      "\t\tSkip the first <n> threads of the results.\n"
+      "\n"
+      "\t--limit=<n>\n"
+      "\n"
+      "\t\tDisplay no more than <n> threads, (stopping the\n"
+      "\t\tsearch as soon as they have been found).\n"
+      "\n"
+      "\t--jobs=<n>\n"
+      "\n"
+      "\t\tConstruct the threads of the results with up to\n"
+      "\t\t<n> threads of execution, (the default being the\n"
+      "\t\tnumber of processors, up to 16).\n"
+      "\n"
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "show", notmuch_show_command,
@@ -215,13 +268,27 @@ command_t commands[] = {
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "count", notmuch_count_command,
-      "<search-terms> [...]",
-      "Count messages matching the search terms.",
+      "[options...] <search-terms> [...]",
+      "Count messages (or threads) matching the search terms.",
       "\tThe number of matching messages is output to stdout.\n"
       "\n"
       "\tWith no search terms, a count of all messages in the database\n"
       "\twill be displayed.\n"
       "\n"
+      "\tSupported options for count include:\n"
+      "\n"
+      "\t--output=(messages|threads)\n"
+      "\n"
+      "\t\tCount either matching messages (the default) or\n"
+      "\t\tthe distinct threads containing them.\n"
+      "\n"
+      "\t--approximate\n"
+      "\n"
+      "\t\tOutput a fast estimate rather than an exact count\n"
+      "\t\t(exact counts of single terms, such as a tag, are\n"
+      "\t\talways fast). This applies to message counts only,\n"
+      "\t\t(and is an error with --output=threads).\n"
+      "\n"
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "reply", notmuch_reply_command,
@@ -253,7 +320,7 @@ command_t commands[] = {
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "tag", notmuch_tag_command,
-      "+<tag>|-<tag> [...] [--] <search-terms> [...]",
+      "[--verbose] [--] +<tag>|-<tag> [...] [--] <search-terms> [...]",
       "Add/remove tags for all messages matching the search terms.",
       "\tThe search terms are handled exactly as in 'search' so one\n"
       "\tcan use that command first to see what will be modified.\n"
@@ -268,6 +335,20 @@ command_t commands[] = {
       "\tby allowing the user to specify a \"--\" argument to separate\n"
       "\tthe tags from the search terms.\n"
       "\n"
+      "\tOptions are recognized anywhere before the first tag, so a\n"
+      "\ttag to remove named like an option, (such as \"--batch\" to\n"
+      "\tremove the tag \"-batch\"), must follow a \"--\" argument\n"
+      "\tgiven before the tags.\n"
+      "\n"
+      "\tOnly messages not already tagged as requested are changed.\n"
+      "\tWith --verbose, the number of messages changed is printed.\n"
+      "\n"
+      "\tWith \"--batch [--input=<filename>]\", and no other arguments,\n"
+      "\tlines of tags and search terms, (of the same form as the\n"
+      "\targuments above), are read from the given file, or from\n"
+      "\tstdin, and all applied in a single transaction.\n"
+      "\tEmpty lines and lines beginning with '#' are ignored.\n"
+      "\n"
       "\tSee \"notmuch help search-terms\" for details of the search\n"
       "\tterms syntax." },
     { "dump", notmuch_dump_command,
@@ -465,6 +546,14 @@ main (int argc, char *argv[])
 
     local = talloc_new (NULL);
 
+#if ! GLIB_CHECK_VERSION (2, 32, 0)
+    /* GMime protects its shared state with GLib locks, which only
+     * take effect once threads are initialized, (as needed by "notmuch
+     * search", which constructs threads in parallel). */
+    if (! g_thread_supported ())
+	g_thread_init (NULL);
+#endif
+
     g_mime_init (0);
 
     if (argc == 1)